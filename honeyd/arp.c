@@ -86,6 +86,7 @@
 
 #include "honeyd.h"
 #include "template.h"
+#include "network.h"
 #include "router.h"
 #include "interface.h"
 #include "arp.h"
@@ -0,0 +1,747 @@
+/*
+ * Copyright (c) 2002, 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include <err.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <dnet.h>
+
+#undef timeout_pending
+#undef timeout_initialized
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "honeyd.h"
+#include "template.h"
+#include "fdpass.h"
+#include "cmdpool.h"
+
+/*
+ * A request carries the arguments and the environment of the script.
+ * The socket of the connection travels with the request; the socket
+ * for stderr follows in a message of its own.
+ */
+
+struct cmd_request {
+	struct timeval tv;		/* when Honeyd sent the request */
+	int nargs;
+	int nenv;
+	size_t len;
+	char data[CMD_POOL_MAXREQUEST];	/* args, then name and value pairs */
+};
+
+#define CMD_REQUEST_LEN(x)	(offsetof(struct cmd_request, data) + (x)->len)
+#define CMD_POOL_MAXARGS	32
+
+struct cmd_ack {
+	struct timeval tv;		/* from the request to the fork */
+	pid_t pid;			/* -1 if the fork failed */
+};
+
+/*
+ * We want to notice when either side goes away, which datagram sockets
+ * do not tell us.
+ */
+#ifdef SOCK_SEQPACKET
+#define CMD_POOL_SOCKTYPE	SOCK_SEQPACKET
+#else
+#define CMD_POOL_SOCKTYPE	SOCK_DGRAM
+#endif
+
+static SPLAY_HEAD(cmd_pooltree, cmd_pool) cmd_pools =
+    SPLAY_INITIALIZER(&cmd_pools);
+static int cmd_pool_size;		/* workers per pool; 0 disables */
+static struct event *cmd_pool_ev;
+
+static int
+cmd_pool_compare(struct cmd_pool *a, struct cmd_pool *b)
+{
+	int res;
+
+	if (a->port != b->port)
+		return (a->port < b->port ? -1 : 1);
+	if (a->proto != b->proto)
+		return (a->proto < b->proto ? -1 : 1);
+	if (a->uid != b->uid)
+		return (a->uid < b->uid ? -1 : 1);
+	if (a->gid != b->gid)
+		return (a->gid < b->gid ? -1 : 1);
+	if (a->nofiles != b->nofiles)
+		return (a->nofiles < b->nofiles ? -1 : 1);
+	if ((res = strcmp(a->tmplname, b->tmplname)) != 0)
+		return (res);
+	return (strcmp(a->command, b->command));
+}
+
+SPLAY_PROTOTYPE(cmd_pooltree, cmd_pool, node, cmd_pool_compare);
+SPLAY_GENERATE(cmd_pooltree, cmd_pool, node, cmd_pool_compare);
+
+/*
+ * Worker side.  A worker only ever blocks on its control socket; it
+ * does not know about the event loop or the state of Honeyd.
+ */
+
+static void
+cmd_worker_exec(struct cmd_pool *pool, struct cmd_request *req,
+    int fd, int errfd)
+{
+	char *argv[CMD_POOL_MAXARGS + 1];
+	char *p = req->data, *end = req->data + req->len;
+	struct rlimit rl;
+	sigset_t sigmask;
+	int i;
+
+	/* Scripts get the signal handling that they expect */
+	signal(SIGCHLD, SIG_DFL);
+	sigemptyset(&sigmask);
+	sigprocmask(SIG_SETMASK, &sigmask, NULL);
+
+	rl.rlim_cur = rl.rlim_max = pool->nofiles;
+	if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+		err(1, "setrlimit: %d", pool->nofiles);
+
+	if (dup2(fd, fileno(stdout)) == -1)
+		err(1, "%s: dup2", __func__);
+	if (dup2(fd, fileno(stdin)) == -1)
+		err(1, "%s: dup2", __func__);
+	if (dup2(errfd, fileno(stderr)) == -1)
+		err(1, "%s: dup2", __func__);
+	close(fd);
+	close(errfd);
+
+	for (i = 0; i < req->nargs && i < CMD_POOL_MAXARGS; i++) {
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	argv[i] = NULL;
+
+	for (i = 0; i < req->nenv && p < end; i++) {
+		char *name = p;
+		p += strlen(p) + 1;
+		setenv(name, p, 1);
+		p += strlen(p) + 1;
+	}
+
+	if (argv[0] == NULL)
+		errx(1, "%s: no command", __func__);
+	if (execvp(argv[0], argv) == -1)
+		err(1, "%s: execv(%s)", __func__, argv[0]);
+
+	/* NOT REACHED */
+}
+
+static int
+cmd_worker_valid(struct cmd_request *req, size_t len)
+{
+	size_t need;
+	int i, strings;
+
+	if (len < offsetof(struct cmd_request, data) ||
+	    req->len != len - offsetof(struct cmd_request, data) ||
+	    req->nargs < 1 || req->nargs > CMD_POOL_MAXARGS ||
+	    req->nenv < 0 || req->nenv > CMD_POOL_MAXARGS)
+		return (0);
+
+	/* All strings need to be terminated within the request */
+	strings = req->nargs + 2 * req->nenv;
+	for (i = 0, need = 0; i < strings; i++) {
+		char *p = memchr(req->data + need, '\0', req->len - need);
+		if (p == NULL)
+			return (0);
+		need = p - req->data + 1;
+		if (need > req->len)
+			return (0);
+	}
+
+	return (1);
+}
+
+static void
+cmd_worker_main(struct cmd_pool *pool, int fd)
+{
+	static struct cmd_request req;
+	struct cmd_ack ack;
+	struct timeval now;
+	size_t len;
+	ssize_t n;
+	char ch;
+	int conn, errfd;
+
+	for (;;) {
+		/* Honeyd closed our socket; we are done */
+		while ((n = recv(fd, &ch, 1, MSG_PEEK)) == -1 && errno == EINTR)
+			;
+		if (n <= 0)
+			_exit(0);
+
+		len = sizeof(req);
+		conn = receive_fd(fd, &req, &len);
+		errfd = receive_fd(fd, NULL, NULL);
+		if (conn == -1 || errfd == -1 || !cmd_worker_valid(&req, len))
+			errx(1, "%s: bad request", __func__);
+
+		ack.pid = fork();
+		if (ack.pid == 0)
+			cmd_worker_exec(pool, &req, conn, errfd);
+		gettimeofday(&now, NULL);
+		timersub(&now, &req.tv, &ack.tv);
+
+		close(conn);
+		close(errfd);
+
+		if (send(fd, &ack, sizeof(ack), 0) != sizeof(ack))
+			_exit(0);
+	}
+}
+
+/*
+ * A worker is a copy of Honeyd and inherits all of its descriptors:
+ * the sockets of live connections, the capture devices, the UI and the
+ * control sockets of other workers.  Scripts and other workers need to
+ * see the end of file when Honeyd closes its end, so only the control
+ * socket is kept.
+ */
+
+static void
+cmd_worker_closefds(int keep)
+{
+	DIR *dir;
+	struct dirent *dp;
+	int fd, maxfd;
+
+	closelog();
+
+	/* The descriptor limit might be huge; only close open ones */
+	if ((dir = opendir("/proc/self/fd")) != NULL) {
+		while ((dp = readdir(dir)) != NULL) {
+			fd = atoi(dp->d_name);
+			if (fd > STDERR_FILENO && fd != keep &&
+			    fd != dirfd(dir))
+				close(fd);
+		}
+		closedir(dir);
+		return;
+	}
+
+	maxfd = getdtablesize();
+	for (fd = STDERR_FILENO + 1; fd < maxfd; fd++)
+		if (fd != keep)
+			close(fd);
+}
+
+static void
+cmd_worker_start(struct cmd_pool *pool, int fd)
+{
+	sigset_t sigmask;
+
+	cmd_worker_closefds(fd);
+	if (fcntl(fd, F_SETFD, 1) == -1)
+		err(1, "fcntl(F_SETFD)");
+
+	/* The signal handlers belong to the event loop of Honeyd */
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+	signal(SIGUSR2, SIG_DFL);
+
+	/* Nobody waits for the scripts but the kernel */
+	signal(SIGCHLD, SIG_IGN);
+	sigemptyset(&sigmask);
+	sigprocmask(SIG_SETMASK, &sigmask, NULL);
+
+	setpriority(PRIO_PROCESS, 0, 10);
+	cmd_droppriv(pool->uid, pool->gid);
+
+	cmd_worker_main(pool, fd);
+	_exit(0);
+}
+
+/* Honeyd side */
+
+static void
+cmd_worker_free(struct cmd_worker *worker)
+{
+	struct cmd_pool *pool = worker->pool;
+
+	TAILQ_REMOVE(&pool->workers, worker, next);
+	pool->nworkers--;
+
+	event_free(worker->ev);
+	close(worker->fd);
+
+	/* Scripts that the worker started keep running */
+	kill(worker->pid, SIGTERM);
+
+	free(worker);
+}
+
+static void
+cmd_worker_read(evutil_socket_t fd, short what, void *arg)
+{
+	struct cmd_worker *worker = arg;
+	struct cmd_pool *pool = worker->pool;
+	struct cmd_ack ack;
+	uint64_t usec;
+	ssize_t n;
+
+	while ((n = recv(fd, &ack, sizeof(ack), 0)) == sizeof(ack)) {
+		if (worker->queued > 0)
+			worker->queued--;
+		pool->acks++;
+
+		usec = (uint64_t)ack.tv.tv_sec * 1000000 + ack.tv.tv_usec;
+		pool->latency += usec;
+		if (usec > pool->maxlatency)
+			pool->maxlatency = usec;
+
+		if (ack.pid == -1)
+			syslog(LOG_WARNING, "%s: worker %d could not fork \"%s\"",
+			    __func__, worker->pid, pool->command);
+	}
+
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	syslog(LOG_WARNING, "%s: worker %d for \"%s\" exited",
+	    __func__, worker->pid, pool->command);
+	cmd_worker_free(worker);
+}
+
+static struct cmd_worker *
+cmd_worker_spawn(struct cmd_pool *pool)
+{
+	extern int honeyd_nchildren;
+	struct cmd_worker *worker;
+	sigset_t sigmask;
+	int pair[2];
+	pid_t pid;
+
+	if ((worker = calloc(1, sizeof(struct cmd_worker))) == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	if (socketpair(AF_UNIX, CMD_POOL_SOCKTYPE, 0, pair) == -1) {
+		warn("%s: socketpair", __func__);
+		free(worker);
+		return (NULL);
+	}
+
+	/* Block SIGCHLD */
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &sigmask, NULL) == -1)
+		warn("sigprocmask");
+
+	if ((pid = fork()) == 0) {
+		close(pair[0]);
+		cmd_worker_start(pool, pair[1]);
+		/* NOT REACHED */
+	}
+	if (pid != -1)
+		honeyd_nchildren++;
+
+	if (sigprocmask(SIG_UNBLOCK, &sigmask, NULL) == -1)
+		warn("sigprocmask");
+
+	close(pair[1]);
+	if (pid == -1) {
+		warn("%s: fork", __func__);
+		close(pair[0]);
+		free(worker);
+		return (NULL);
+	}
+
+	if (fcntl(pair[0], F_SETFD, 1) == -1)
+		warn("fcntl(F_SETFD)");
+	if (fcntl(pair[0], F_SETFL, O_NONBLOCK) == -1)
+		warn("fcntl(F_SETFL)");
+
+	worker->pool = pool;
+	worker->pid = pid;
+	worker->fd = pair[0];
+	worker->ev = event_new(honeyd_base_ev, worker->fd, EV_READ|EV_PERSIST,
+	    cmd_worker_read, worker);
+	event_add(worker->ev, NULL);
+
+	TAILQ_INSERT_TAIL(&pool->workers, worker, next);
+	pool->nworkers++;
+	pool->spawned++;
+
+	syslog(LOG_DEBUG, "%s: started worker %d for %s %d \"%s\"",
+	    __func__, pid, pool->tmplname, pool->port, pool->command);
+
+	return (worker);
+}
+
+static void
+cmd_pool_free(struct cmd_pool *pool)
+{
+	struct cmd_worker *worker;
+
+	SPLAY_REMOVE(cmd_pooltree, &cmd_pools, pool);
+
+	while ((worker = TAILQ_FIRST(&pool->workers)) != NULL)
+		cmd_worker_free(worker);
+
+	free(pool->tmplname);
+	free(pool->command);
+	free(pool);
+}
+
+static struct cmd_pool *
+cmd_pool_get(struct tuple *hdr, struct template *tmpl, char *command)
+{
+	struct cmd_pool tmp, *pool;
+
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.tmplname = tmpl->name;
+	tmp.command = command;
+	tmp.proto = hdr->type;
+	tmp.port = hdr->dport;
+	cmd_credentials(tmpl, &tmp.uid, &tmp.gid, &tmp.nofiles);
+
+	if ((pool = SPLAY_FIND(cmd_pooltree, &cmd_pools, &tmp)) != NULL)
+		return (pool);
+
+	if ((pool = calloc(1, sizeof(struct cmd_pool))) == NULL)
+		return (NULL);
+	*pool = tmp;
+	if ((pool->tmplname = strdup(tmpl->name)) == NULL ||
+	    (pool->command = strdup(command)) == NULL) {
+		free(pool->tmplname);
+		free(pool);
+		return (NULL);
+	}
+	TAILQ_INIT(&pool->workers);
+
+	SPLAY_INSERT(cmd_pooltree, &cmd_pools, pool);
+
+	return (pool);
+}
+
+static void
+cmd_request_env(const char *name, const char *value, void *arg)
+{
+	struct cmd_request *req = arg;
+	size_t nlen = strlen(name) + 1, vlen = strlen(value) + 1;
+
+	/* A request that does not fit is marked invalid */
+	if (req->nargs == -1 || req->len + nlen + vlen > sizeof(req->data)) {
+		req->nargs = -1;
+		return;
+	}
+
+	memcpy(req->data + req->len, name, nlen);
+	memcpy(req->data + req->len + nlen, value, vlen);
+	req->len += nlen + vlen;
+	req->nenv++;
+}
+
+static int
+cmd_request_make(struct cmd_request *req, struct tuple *hdr,
+    struct template *tmpl, char **argv)
+{
+	size_t len;
+	int nargs;
+
+	memset(req, 0, offsetof(struct cmd_request, data));
+	for (nargs = 0; argv[nargs] != NULL; nargs++) {
+		len = strlen(argv[nargs]) + 1;
+		if (nargs >= CMD_POOL_MAXARGS ||
+		    req->len + len > sizeof(req->data))
+			return (-1);
+		memcpy(req->data + req->len, argv[nargs], len);
+		req->len += len;
+	}
+	if (nargs == 0)
+		return (-1);
+	req->nargs = nargs;
+
+	/* The remote operating system is only known to Honeyd */
+	cmd_environment_list(tmpl, hdr, cmd_request_env, req);
+	if (req->nargs == -1)
+		return (-1);
+	req->nargs = nargs;
+
+	gettimeofday(&req->tv, NULL);
+
+	return (0);
+}
+
+/*
+ * Hands a connection to a worker of the pool for this template, port
+ * and command.  Returns -1 if the caller needs to fork the script
+ * itself, e.g. because the pool is disabled or all workers are busy.
+ */
+
+int
+cmd_pool_fork(struct tuple *hdr, struct command *cmd, struct template *tmpl,
+    char *command, char **argv, void *con)
+{
+	static struct cmd_request req;
+	struct cmd_pool *pool;
+	struct cmd_worker *worker, *best = NULL;
+	int pair[2], perr[2];
+
+	if (cmd_pool_size == 0 || tmpl == NULL || tmpl->name == NULL)
+		return (-1);
+
+	if ((pool = cmd_pool_get(hdr, tmpl, command)) == NULL)
+		return (-1);
+
+	gettimeofday(&pool->tv_used, NULL);
+	pool->requests++;
+
+	/* The least busy worker; start more while the pool is not full */
+	TAILQ_FOREACH(worker, &pool->workers, next) {
+		if (best == NULL || worker->queued < best->queued)
+			best = worker;
+	}
+	if ((best == NULL || best->queued > 0) &&
+	    pool->nworkers < cmd_pool_size) {
+		if ((worker = cmd_worker_spawn(pool)) != NULL)
+			best = worker;
+	}
+	if (best == NULL || best->queued >= CMD_POOL_MAXQUEUE)
+		goto fallback;
+
+	if (cmd_request_make(&req, hdr, tmpl, argv) == -1)
+		goto fallback;
+
+	if (socketpair(AF_UNIX, hdr->type, 0, pair) == -1)
+		goto fallback;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, perr) == -1) {
+		close(pair[0]);
+		close(pair[1]);
+		goto fallback;
+	}
+
+	if (send_fd(best->fd, pair[1], &req, CMD_REQUEST_LEN(&req)) == -1) {
+		if (errno != EAGAIN)
+			cmd_worker_free(best);
+		goto close_fallback;
+	}
+	if (send_fd(best->fd, perr[1], NULL, 0) == -1) {
+		/* The worker would take the next request for this one */
+		cmd_worker_free(best);
+		goto close_fallback;
+	}
+
+	close(pair[1]);
+	close(perr[1]);
+
+	best->queued++;
+	if (best->queued > pool->maxqueued)
+		pool->maxqueued = best->queued;
+
+	cmd->pid = best->pid;
+	cmd_attach(hdr, cmd, pair[0], perr[0], con);
+
+	return (0);
+
+ close_fallback:
+	close(pair[0]);
+	close(pair[1]);
+	close(perr[0]);
+	close(perr[1]);
+ fallback:
+	pool->fallbacks++;
+	return (-1);
+}
+
+static void
+cmd_pool_reap(evutil_socket_t fd, short what, void *arg)
+{
+	struct cmd_pool *pool, *next;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	for (pool = SPLAY_MIN(cmd_pooltree, &cmd_pools); pool != NULL;
+	    pool = next) {
+		next = SPLAY_NEXT(cmd_pooltree, &cmd_pools, pool);
+		if (now.tv_sec - pool->tv_used.tv_sec < CMD_POOL_IDLE)
+			continue;
+
+		syslog(LOG_DEBUG, "%s: %s %d \"%s\" is idle", __func__,
+		    pool->tmplname, pool->port, pool->command);
+		cmd_pool_free(pool);
+	}
+}
+
+void
+cmd_pool_init(int size)
+{
+	struct timeval tv;
+
+	cmd_pool_size = size;
+
+	if (size == 0 || cmd_pool_ev != NULL)
+		return;
+
+	cmd_pool_ev = event_new(honeyd_base_ev, -1, EV_PERSIST,
+	    cmd_pool_reap, NULL);
+	timerclear(&tv);
+	tv.tv_sec = CMD_POOL_IDLE / 5;
+	event_add(cmd_pool_ev, &tv);
+}
+
+void
+cmd_pool_print(struct evbuffer *buf)
+{
+	struct cmd_pool *pool;
+	struct cmd_worker *worker;
+	int npools = 0, queued;
+
+	SPLAY_FOREACH(pool, cmd_pooltree, &cmd_pools)
+		npools++;
+
+	if (cmd_pool_size == 0) {
+		evbuffer_add_printf(buf, "Script workers are disabled\n");
+		return;
+	}
+
+	evbuffer_add_printf(buf, "Script pools: %d with up to %d workers\n",
+	    npools, cmd_pool_size);
+
+	SPLAY_FOREACH(pool, cmd_pooltree, &cmd_pools) {
+		queued = 0;
+		TAILQ_FOREACH(worker, &pool->workers, next)
+			queued += worker->queued;
+
+		evbuffer_add_printf(buf,
+		    "%s %s/%d \"%s\": %d workers, %d queued (max %d)\n",
+		    pool->tmplname,
+		    pool->proto == SOCK_STREAM ? "tcp" : "udp",
+		    pool->port, pool->command,
+		    pool->nworkers, queued, pool->maxqueued);
+		evbuffer_add_printf(buf,
+		    "  %llu requests, %llu forked directly, %llu workers started\n"
+		    "  latency: %llu usec average, %llu usec max\n",
+		    (unsigned long long)pool->requests,
+		    (unsigned long long)pool->fallbacks,
+		    (unsigned long long)pool->spawned,
+		    (unsigned long long)(pool->acks ?
+			pool->latency / pool->acks : 0),
+		    (unsigned long long)pool->maxlatency);
+	}
+}
+
+static void
+cmd_pool_test_run(struct tuple *hdr, struct command *cmd,
+    struct template *tmpl, char *expect)
+{
+	static char *argv[] = { "/bin/sh", "-c", "echo $HONEYD_DST_PORT", NULL };
+	struct pollfd pfd;
+	char buf[64];
+	ssize_t n;
+
+	memset(cmd, 0, sizeof(struct command));
+	if (cmd_pool_fork(hdr, cmd, tmpl, "sh -c port", argv, NULL) == -1)
+		errx(1, "%s: pool did not take the request", __func__);
+
+	pfd.fd = cmd->pfd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 5000) != 1)
+		errx(1, "%s: script did not run", __func__);
+	if ((n = read(cmd->pfd, buf, sizeof(buf) - 1)) <= 0)
+		errx(1, "%s: read", __func__);
+	buf[n] = '\0';
+
+	if (strcmp(buf, expect))
+		errx(1, "%s: expected \"%s\" got \"%s\"", __func__, expect, buf);
+}
+
+void
+cmd_pool_test(void)
+{
+	struct template tmpl;
+	struct command one, two;
+	struct tuple hdr;
+	struct cmd_pool *pool;
+	int size = cmd_pool_size, live[2];
+	char ch;
+
+	cmd_pool_size = 1;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.name = "cmdpooltest";
+	/* As root, the scripts run as the default user */
+	tmpl.uid = getuid();
+	tmpl.gid = getgid();
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = SOCK_STREAM;
+	hdr.dport = 80;
+
+	/* Like the sockets of a connection that is open while forking */
+	if (pipe(live) == -1)
+		err(1, "%s: pipe", __func__);
+	if (fcntl(live[0], F_SETFD, 1) == -1 ||
+	    fcntl(live[1], F_SETFD, 1) == -1 ||
+	    fcntl(live[0], F_SETFL, O_NONBLOCK) == -1)
+		err(1, "%s: fcntl", __func__);
+
+	cmd_pool_test_run(&hdr, &one, &tmpl, "80\n");
+	cmd_pool_test_run(&hdr, &two, &tmpl, "80\n");
+
+	close(live[1]);
+	if (read(live[0], &ch, 1) != 0)
+		errx(1, "%s: worker kept a descriptor of Honeyd", __func__);
+	close(live[0]);
+
+	pool = SPLAY_ROOT(&cmd_pools);
+	if (pool == NULL || pool->spawned != 1 || pool->nworkers != 1 ||
+	    one.pid != two.pid)
+		errx(1, "%s: worker was not reused", __func__);
+
+	cmd_free(&one);
+	cmd_free(&two);
+
+	while ((pool = SPLAY_ROOT(&cmd_pools)) != NULL)
+		cmd_pool_free(pool);
+
+	cmd_pool_size = size;
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2002, 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef _CMDPOOL_H_
+#define _CMDPOOL_H_
+
+/*
+ * Scripts that simulate services are started by long-lived worker
+ * processes instead of forking Honeyd for every connection.  Each
+ * template, port and command gets its own pool of workers.  A worker
+ * has dropped its privileges already; it receives the sockets for a
+ * connection via send_fd() and forks the script outside of the event
+ * loop.  Workers are forked from Honeyd and are no smaller than it;
+ * the pool only moves the fork and privilege dropping off the event
+ * loop.
+ */
+
+#define CMD_POOL_IDLE		300	/* seconds until idle pools go away */
+#define CMD_POOL_MAXQUEUE	16	/* requests waiting per worker */
+#define CMD_POOL_MAXREQUEST	4096	/* arguments and environment */
+
+struct cmd_worker {
+	TAILQ_ENTRY(cmd_worker) next;
+
+	struct cmd_pool *pool;
+	pid_t pid;
+	int fd;				/* requests and acknowledgments */
+	struct event *ev;
+	int queued;			/* requests not acknowledged yet */
+};
+
+struct cmd_pool {
+	SPLAY_ENTRY(cmd_pool) node;
+
+	/* Key */
+	char *tmplname;
+	char *command;			/* before variable expansion */
+	int proto;
+	u_short port;
+	uid_t uid;
+	gid_t gid;
+	int nofiles;
+
+	TAILQ_HEAD(cmd_workerq, cmd_worker) workers;
+	int nworkers;
+
+	struct timeval tv_used;
+
+	/* Statistics */
+	uint64_t requests;
+	uint64_t fallbacks;		/* queues were full; forked directly */
+	uint64_t spawned;
+	uint64_t acks;
+	uint64_t latency;		/* usec from request to fork */
+	uint64_t maxlatency;
+	int maxqueued;
+};
+
+struct tuple;
+struct command;
+struct template;
+struct evbuffer;
+
+void cmd_pool_init(int);
+int cmd_pool_fork(struct tuple *, struct command *, struct template *,
+    char *, char **, void *);
+void cmd_pool_print(struct evbuffer *);
+void cmd_pool_test(void);
+
+#endif /* _CMDPOOL_H_ */
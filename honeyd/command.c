@@ -206,8 +206,14 @@ cmd_proxy_connect(struct tuple *hdr, struct command *cmd, struct addrinfo *ai, v
 	return (0);
 }
 
+/*
+ * Calls cb for every environment variable that a service script gets
+ * for this connection.
+ */
+
 void
-cmd_environment(struct template *tmpl, struct tuple *hdr)
+cmd_environment_list(struct template *tmpl, struct tuple *hdr,
+    void (*cb)(const char *, const char *, void *), void *arg)
 {
 	char line[256];
 	struct addr addr;
@@ -216,7 +222,7 @@ cmd_environment(struct template *tmpl, struct tuple *hdr)
 
 	if (tmpl->person != NULL) {
 		snprintf(line, sizeof(line), "%s", tmpl->person->name);
-		setenv("HONEYD_PERSONALITY", line, 1);
+		(*cb)("HONEYD_PERSONALITY", line, arg);
 	}
 
 	if (hdr == NULL)
@@ -226,22 +232,34 @@ cmd_environment(struct template *tmpl, struct tuple *hdr)
 	ip.ip_src = hdr->ip_src;
 	os_name = honeyd_osfp_name(&ip);
 	if (os_name != NULL) {
-		setenv("HONEYD_REMOTE_OS", os_name, 1);
+		(*cb)("HONEYD_REMOTE_OS", os_name, arg);
 	}
 
 	addr_pack(&addr, ADDR_TYPE_IP, IP_ADDR_BITS, &hdr->ip_src,IP_ADDR_LEN);
 	snprintf(line, sizeof(line), "%s", addr_ntoa(&addr));
-	setenv("HONEYD_IP_SRC", line, 1);
+	(*cb)("HONEYD_IP_SRC", line, arg);
 
 	addr_pack(&addr, ADDR_TYPE_IP, IP_ADDR_BITS, &hdr->ip_dst,IP_ADDR_LEN);
 	snprintf(line, sizeof(line), "%s", addr_ntoa(&addr));
-	setenv("HONEYD_IP_DST", line, 1);
+	(*cb)("HONEYD_IP_DST", line, arg);
 
 	snprintf(line, sizeof(line), "%d", hdr->sport);
-	setenv("HONEYD_SRC_PORT", line, 1);
+	(*cb)("HONEYD_SRC_PORT", line, arg);
 
 	snprintf(line, sizeof(line), "%d", hdr->dport);
-	setenv("HONEYD_DST_PORT", line, 1);
+	(*cb)("HONEYD_DST_PORT", line, arg);
+}
+
+static void
+cmd_setenv(const char *name, const char *value, void *arg)
+{
+	setenv(name, value, 1);
+}
+
+void
+cmd_environment(struct template *tmpl, struct tuple *hdr)
+{
+	cmd_environment_list(tmpl, hdr, cmd_setenv, NULL);
 }
 
 #define SETERROR(x) do { \
@@ -322,26 +340,31 @@ cmd_droppriv(uid_t uid, gid_t gid)
 	errx(1, "%s: terminated", __func__);
 }
 
-int
-cmd_setpriv(struct template *tmpl)
+/* The user, group and file limit that scripts of a template run with */
+
+void
+cmd_credentials(struct template *tmpl, uid_t *puid, gid_t *pgid, int *pnofiles)
 {
 	extern uid_t honeyd_uid;
 	extern gid_t honeyd_gid;
-	uid_t uid = honeyd_uid;
-	gid_t gid = honeyd_gid;
-	int nofiles = 30;
+
+	*puid = tmpl->uid ? tmpl->uid : honeyd_uid;
+	*pgid = tmpl->gid ? tmpl->gid : honeyd_gid;
+	*pnofiles = tmpl->max_nofiles ? tmpl->max_nofiles : 30;
+}
+
+int
+cmd_setpriv(struct template *tmpl)
+{
+	uid_t uid;
+	gid_t gid;
+	int nofiles;
 	struct rlimit rl;
 
 	/* Set our own priority low */
 	setpriority(PRIO_PROCESS, 0, 10);
 
-	if (tmpl->uid)
-		uid = tmpl->uid;
-	if (tmpl->gid)
-		gid = tmpl->gid;
-	if (tmpl->max_nofiles)
-		nofiles = tmpl->max_nofiles;
-
+	cmd_credentials(tmpl, &uid, &gid, &nofiles);
 	cmd_droppriv(uid, gid);
 
 	/* Raising file descriptor limits */
@@ -352,13 +375,46 @@ cmd_setpriv(struct template *tmpl)
 	return (0);
 }
 
+/*
+ * Connects our ends of the sockets of a service script to the
+ * connection; the script may have been started by us or by a worker.
+ */
+
+void
+cmd_attach(struct tuple *hdr, struct command *cmd, int pfd, int perrfd,
+    void *con)
+{
+	struct callback *cb;
+
+	TRACE(pfd, cmd->pfd = pfd);
+	if (fcntl(cmd->pfd, F_SETFD, 1) == -1)
+		warn("fcntl(F_SETFD)");
+	if (fcntl(cmd->pfd, F_SETFL, O_NONBLOCK) == -1)
+		warn("fcntl(F_SETFL)");
+
+	cmd->perrfd = perrfd;
+	if (fcntl(cmd->perrfd, F_SETFD, 1) == -1)
+		warn("fcntl(F_SETFD)");
+	if (fcntl(cmd->perrfd, F_SETFL, O_NONBLOCK) == -1)
+		warn("fcntl(F_SETFL)");
+
+	if (hdr->type == SOCK_STREAM)
+		cb = &cb_tcp;
+	else
+		cb = &cb_udp;
+
+	cmd_ready_fd(cmd, cb, con);
+
+	TRACE(event_get_fd(cmd->pread),  event_add(cmd->pread, NULL));
+	TRACE(event_get_fd(cmd->peread), event_add(cmd->peread, NULL));
+}
+
 int
 cmd_fork(struct tuple *hdr, struct command *cmd, struct template *tmpl,
     char *execcmd, char **argv, void *con)
 {
 	extern int honeyd_nchildren;
 	int pair[2], perr[2];
-	struct callback *cb;
 	sigset_t sigmask;
 
 	if (socketpair(AF_UNIX, hdr->type, 0, pair) == -1)
@@ -409,28 +465,8 @@ cmd_fork(struct tuple *hdr, struct command *cmd, struct template *tmpl,
 	}
 
 	TRACE_RESET(pair[1], close(pair[1]));
-	TRACE(pair[0], cmd->pfd = pair[0]);
-	if (fcntl(cmd->pfd, F_SETFD, 1) == -1)
-		warn("fcntl(F_SETFD)");
-	if (fcntl(cmd->pfd, F_SETFL, O_NONBLOCK) == -1)
-		warn("fcntl(F_SETFL)");
-
 	TRACE_RESET(perr[1], close(perr[1]));
-	cmd->perrfd = perr[0];
-	if (fcntl(cmd->perrfd, F_SETFD, 1) == -1)
-		warn("fcntl(F_SETFD)");
-	if (fcntl(cmd->perrfd, F_SETFL, O_NONBLOCK) == -1)
-		warn("fcntl(F_SETFL)");
-
-	if (hdr->type == SOCK_STREAM)
-		cb = &cb_tcp;
-	else
-		cb = &cb_udp;
-
-	cmd_ready_fd(cmd, cb, con);
-
-	TRACE(event_get_fd(cmd->pread),  event_add(cmd->pread, NULL));
-	TRACE(event_get_fd(cmd->peread), event_add(cmd->peread, NULL));
+	cmd_attach(hdr, cmd, pair[0], perr[0], con);
 
 	honeyd_nchildren++;
 
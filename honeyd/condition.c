@@ -141,6 +141,33 @@ daysec(const struct tm *tm)
 	return (seconds);
 }
 
+/*
+ * Time conditions use a clock that advances once a minute, so that we
+ * do not need to convert the time for every packet and can cache the
+ * decisions of dynamic templates for the rest of the minute.
+ */
+
+static time_t condition_minute = -1;	/* minutes since the epoch */
+static int condition_daysec;		/* second of the day it started */
+
+u_int
+condition_clock(void)
+{
+	struct timeval tv;
+	struct tm now;
+	time_t tmp;
+
+	event_base_gettimeofday_cached(honeyd_base_ev, &tv);
+	if (tv.tv_sec / 60 != condition_minute) {
+		condition_minute = tv.tv_sec / 60;
+		tmp = condition_minute * 60;
+		localtime_r(&tmp, &now);
+		condition_daysec = daysec(&now);
+	}
+
+	return ((u_int)condition_minute);
+}
+
 /*
  * Match the time of access
  */
@@ -149,19 +176,48 @@ int
 condition_match_time(const struct template *tmpl, const struct ip_hdr *ip,
     u_short iplen, void *arg)
 {
-	time_t tmp;
-	struct tm now;
 	int start_sec, now_sec, end_sec;
-	struct timeval tv;
 	struct condition_time *cdt = arg;
 
-	gettimeofday(&tv, NULL);
-
-	tmp = tv.tv_sec; localtime_r(&tmp, &now);
+	condition_clock();
 
 	start_sec = daysec(&cdt->tm_start);
-	now_sec = daysec(&now);
+	now_sec = condition_daysec;
 	end_sec = daysec(&cdt->tm_end);
 	
 	return (start_sec <= now_sec && now_sec <= end_sec);
 }
+
+/* The fingerprints that osfp conditions look at for this packet */
+
+const void *
+condition_osfp(const struct ip_hdr *ip)
+{
+	return (honeyd_osfp_list(ip));
+}
+
+/* Only the fingerprints that we remembered for the source */
+
+const void *
+condition_osfp_remembered(const struct ip_hdr *ip)
+{
+	return (honeyd_osfp_remembered(ip));
+}
+
+/* Reports what the outcome of a condition depends on besides the source */
+
+int
+condition_depends(const struct condition *cond)
+{
+	if (cond->match == NULL ||
+	    cond->match == condition_match_addr ||
+	    cond->match == condition_match_proto ||
+	    cond->match == condition_match_otherwise)
+		return (0);
+	if (cond->match == condition_match_time)
+		return (CONDITION_DEPENDS_TIME);
+	if (cond->match == condition_match_osfp)
+		return (CONDITION_DEPENDS_OSFP);
+
+	return (CONDITION_DEPENDS_OTHER);
+}
@@ -54,6 +54,40 @@ struct condition_time {
 	struct tm tm_end;
 };
 
+/*
+ * Dynamic templates remember which template they picked for a source
+ * address, so that repeated packets do not evaluate the conditions.
+ */
+
+#define CONDITION_CACHE_BITS	10
+#define CONDITION_CACHE_SIZE	(1 << CONDITION_CACHE_BITS)
+
+struct condition_decision {
+	ip_addr_t src;
+	uint8_t proto;
+	uint8_t valid;
+	u_int minute;			/* clock for time conditions */
+	const void *osfp;		/* fingerprints of the source */
+	struct template *tmpl;
+};
+
+struct condition_cache {
+	int depends;			/* what the decisions depend on */
+	uint64_t hits;
+	uint64_t misses;
+
+	struct condition_decision decisions[CONDITION_CACHE_SIZE];
+};
+
+#define CONDITION_DEPENDS_TIME	0x01
+#define CONDITION_DEPENDS_OSFP	0x02
+#define CONDITION_DEPENDS_OTHER	0x04	/* can not be cached */
+
+int condition_depends(const struct condition *);
+u_int condition_clock(void);
+const void *condition_osfp(const struct ip_hdr *);
+const void *condition_osfp_remembered(const struct ip_hdr *);
+
 int condition_match_osfp(const struct template *, const struct ip_hdr *, u_short, void *);
 int condition_match_addr(const struct template *, const struct ip_hdr *, u_short, void *);
 int condition_match_time(const struct template *, const struct ip_hdr *, u_short, void *);
@@ -45,6 +45,7 @@
 
 #include <err.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -62,6 +63,7 @@
 #undef timeout_initialized
 
 #include <event2/event.h>
+#include <event2/tag.h>
 
 #include "honeyd.h"
 #include "personality.h"
@@ -76,6 +78,9 @@
 #include "dhcpclient.h"
 #include "util.h"
 #include "log.h"
+#include "network.h"
+#include "router.h"
+#include "snapshot.h"
 
 /* Tailq that holds all subsystems */
 struct subsystemqueue subsystems;
@@ -83,6 +88,19 @@ struct subsystemqueue subsystems;
 /* Tree that contains all templates */
 struct templtree templates;
 
+/*
+ * Hash table that indexes all templates bound to an IP address, so
+ * that the packet path does not need to convert addresses to strings.
+ */
+LIST_HEAD(templaddrq, template);
+
+static struct templaddrq *templaddr_buckets;
+static u_int templaddr_bits;
+static u_int templaddr_count;
+static struct template *templ_default;	/* cached "default" template */
+
+#define TEMPLADDR_MINBITS	8
+
 /* Counter for addresses in 169.254/16 that we assign for DHCP */
 static uint16_t privip_counter = 1;
 
@@ -112,12 +130,89 @@ SPLAY_PROTOTYPE(porttree, port, node, port_compare);
 
 SPLAY_GENERATE(porttree, port, node, port_compare);
 
+/* Fibonacci hashing - sequentially bound addresses spread evenly */
+#define TEMPLADDR_HASH(x, bits) \
+	((uint32_t)(ntohl(x) * 2654435761U) >> (32 - (bits)))
+
+static void
+templ_addr_resize(u_int bits)
+{
+	struct templaddrq *buckets;
+	struct template *tmpl;
+	u_int i, size = 1 << bits;
+
+	if ((buckets = calloc(size, sizeof(struct templaddrq))) == NULL)
+		err(1, "%s: calloc", __func__);
+	for (i = 0; i < size; i++)
+		LIST_INIT(&buckets[i]);
+
+	for (i = 0; templaddr_buckets != NULL &&
+		 i < (1 << templaddr_bits); i++) {
+		while ((tmpl = LIST_FIRST(&templaddr_buckets[i])) != NULL) {
+			LIST_REMOVE(tmpl, addr_next);
+			LIST_INSERT_HEAD(
+				&buckets[TEMPLADDR_HASH(tmpl->addr, bits)],
+				tmpl, addr_next);
+		}
+	}
+
+	if (templaddr_buckets != NULL)
+		free(templaddr_buckets);
+	templaddr_buckets = buckets;
+	templaddr_bits = bits;
+}
+
+/* Adds a template to the address index if its name is an IP address */
+
+static void
+templ_index_insert(struct template *tmpl)
+{
+	struct templaddrq *head;
+
+	if (strcmp(tmpl->name, "default") == 0) {
+		templ_default = tmpl;
+		return;
+	}
+
+	if (ip_pton(tmpl->name, &tmpl->addr) == -1)
+		return;
+
+	/* We allow only one template per address */
+	if (template_find_addr(tmpl->addr) != NULL)
+		return;
+
+	if (templaddr_count >= (1 << templaddr_bits))
+		templ_addr_resize(templaddr_bits + 1);
+
+	head = &templaddr_buckets[TEMPLADDR_HASH(tmpl->addr, templaddr_bits)];
+	LIST_INSERT_HEAD(head, tmpl, addr_next);
+	tmpl->addr_indexed = 1;
+	templaddr_count++;
+}
+
+static void
+templ_index_remove(struct template *tmpl)
+{
+	if (templ_default == tmpl)
+		templ_default = NULL;
+
+	if (!tmpl->addr_indexed)
+		return;
+
+	LIST_REMOVE(tmpl, addr_next);
+	tmpl->addr_indexed = 0;
+	templaddr_count--;
+}
+
 void
 config_init(void)
 {
 	TAILQ_INIT(&subsystems);
 	SPLAY_INIT(&templates);
 
+	templ_addr_resize(TEMPLADDR_MINBITS);
+	templaddr_count = 0;
+
 	no_spoof.new_src.addr_type = ADDR_TYPE_NONE;	/* default is no source spoofing... */
 	no_spoof.new_dst.addr_type = ADDR_TYPE_NONE;	/* ... and no destination spoofing */
 }
@@ -188,8 +283,8 @@ template_list_glob(struct evbuffer *buffer, const char *pattern)
  * Return the first template that we match.
  */
 
-struct template *
-template_dynamic(const struct template *tmpl, const struct ip_hdr *ip,
+static struct template *
+template_dynamic_match(const struct template *tmpl, const struct ip_hdr *ip,
     u_short iplen)
 {
 	struct template *save = NULL;
@@ -209,6 +304,99 @@ template_dynamic(const struct template *tmpl, const struct ip_hdr *ip,
 	return (save);
 }
 
+static struct condition_cache *
+template_dynamic_cache(struct template *tmpl)
+{
+	struct condition_cache *cache;
+	struct condition *cond;
+
+	if ((cache = calloc(1, sizeof(struct condition_cache))) == NULL)
+		err(1, "%s: calloc", __func__);
+
+	TAILQ_FOREACH(cond, &tmpl->dynamic, next)
+		cache->depends |= condition_depends(cond);
+
+	return (cache);
+}
+
+#define CONDITION_HASH(src, proto) \
+	(((ntohl(src) ^ (proto)) * 2654435761U) >> (32 - CONDITION_CACHE_BITS))
+
+/* Only SYN segments tell us something new about the OS of the source */
+
+static int
+template_dynamic_syn(const struct ip_hdr *ip, u_short iplen)
+{
+	const struct tcp_hdr *tcp;
+
+	if (ip->ip_p != IP_PROTO_TCP ||
+	    (ip->ip_hl << 2) + TCP_HDR_LEN > iplen)
+		return (0);
+	tcp = (const struct tcp_hdr *)((u_char *)ip + (ip->ip_hl << 2));
+
+	return ((tcp->th_flags & (TH_SYN|TH_ACK)) == TH_SYN);
+}
+
+/*
+ * Looks up the decision for the source of this packet.  The conditions
+ * are only evaluated if the source, its fingerprints or the minute
+ * changed since the last packet that mapped to the same slot.  Only
+ * SYN segments are fingerprinted; other packets are compared against
+ * the fingerprints remembered for their source.
+ */
+
+struct template *
+template_dynamic(struct template *tmpl, const struct ip_hdr *ip,
+    u_short iplen)
+{
+	struct condition_cache *cache;
+	struct condition_decision *dec;
+	const void *osfp = NULL;
+	u_int minute = 0;
+
+	if (ip == NULL)
+		return (template_dynamic_match(tmpl, ip, iplen));
+
+	if ((cache = tmpl->dyncache) == NULL)
+		cache = tmpl->dyncache = template_dynamic_cache(tmpl);
+	if (cache->depends & CONDITION_DEPENDS_OTHER)
+		return (template_dynamic_match(tmpl, ip, iplen));
+
+	if (cache->depends & CONDITION_DEPENDS_TIME)
+		minute = condition_clock();
+	if (cache->depends & CONDITION_DEPENDS_OSFP)
+		osfp = template_dynamic_syn(ip, iplen) ?
+		    condition_osfp(ip) : condition_osfp_remembered(ip);
+
+	dec = &cache->decisions[CONDITION_HASH(ip->ip_src, ip->ip_p)];
+	if (dec->valid && dec->src == ip->ip_src && dec->proto == ip->ip_p &&
+	    dec->minute == minute && dec->osfp == osfp) {
+		cache->hits++;
+		return (dec->tmpl);
+	}
+
+	cache->misses++;
+	dec->src = ip->ip_src;
+	dec->proto = ip->ip_p;
+	dec->minute = minute;
+	dec->osfp = osfp;
+	dec->tmpl = template_dynamic_match(tmpl, ip, iplen);
+	dec->valid = 1;
+
+	return (dec->tmpl);
+}
+
+/* Forgets the decisions, as the conditions have changed */
+
+static void
+template_dynamic_flush(struct template *tmpl)
+{
+	if (tmpl->dyncache != NULL) {
+		free(tmpl->dyncache);
+		tmpl->dyncache = NULL;
+	}
+}
+
 struct template *
 template_find_best(const char *addr, const struct ip_hdr *ip, u_short iplen)
 {
@@ -224,6 +412,99 @@ template_find_best(const char *addr, const struct ip_hdr *ip, u_short iplen)
 	return (tmpl);
 }
 
+/* Looks up the template that has been bound to this IP address */
+
+struct template *
+template_find_addr(ip_addr_t addr)
+{
+	struct template *tmpl;
+
+	LIST_FOREACH(tmpl, &templaddr_buckets[TEMPLADDR_HASH(addr,
+		    templaddr_bits)], addr_next) {
+		if (tmpl->addr == addr)
+			return (tmpl);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Same as template_find_best() but keyed by address; this is what
+ * the packet processing path should use.
+ */
+
+struct template *
+template_find_best_addr(ip_addr_t addr, const struct ip_hdr *ip,
+    u_short iplen)
+{
+	struct template *tmpl;
+
+	tmpl = template_find_addr(addr);
+	if (tmpl == NULL)
+		tmpl = templ_default;
+	
+	if (tmpl != NULL && tmpl->flags & TEMPLATE_DYNAMIC)
+		tmpl = template_dynamic(tmpl, ip, iplen);
+
+	return (tmpl);
+}
+
+/* Port sets */
+
+static u_int portset_count;
+static u_int portset_markgen;
+static u_int portset_marshalgen;
+
+static void port_destroy(struct portset *, struct port *);
+
+static struct portset *
+portset_new(void)
+{
+	struct portset *set;
+
+	if ((set = calloc(1, sizeof(struct portset))) == NULL)
+		err(1, "%s: calloc", __func__);
+	SPLAY_INIT(&set->ports);
+	set->refcnt = 1;
+	portset_count++;
+
+	return (set);
+}
+
+static void
+portset_free(struct portset *set)
+{
+	struct port *port;
+
+	if (--set->refcnt > 0)
+		return;
+
+	while ((port = SPLAY_ROOT(&set->ports)) != NULL)
+		port_destroy(set, port);
+	portset_count--;
+	free(set);
+}
+
+/*
+ * Makes sure that the template does not share its ports before they
+ * get changed.  Connection and subsystem state never lives in a shared
+ * set, so only the configured actions need to be copied.
+ */
+static void
+template_ports_own(struct template *tmpl)
+{
+	struct portset *set = tmpl->portset;
+	struct port *port;
+
+	if (set->refcnt == 1)
+		return;
+
+	tmpl->portset = portset_new();
+	SPLAY_FOREACH(port, porttree, &set->ports)
+		port_insert(tmpl, port->proto, port->number, &port->action);
+	portset_free(set);
+}
+
 struct template *
 template_create(const char *name)
 {
@@ -241,12 +522,14 @@ template_create(const char *name)
 	/* UDP ports are closed by default */
 	tmpl->udp.status = PORT_RESET;
 
-	SPLAY_INIT(&tmpl->ports);
+	tmpl->portset = portset_new();
 	SPLAY_INSERT(templtree, &templates, tmpl);
+	templ_index_insert(tmpl);
 
 	/* Configured subsystems */
 	TAILQ_INIT(&tmpl->subsystems);
 	TAILQ_INIT(&tmpl->dynamic);
+	TAILQ_INIT(&tmpl->tcpquiet);
 
 	/* No spoofing, by default */
 	tmpl->spoof = no_spoof;
@@ -285,6 +568,7 @@ template_free_all(int how)
 
 	while ((tmpl = SPLAY_ROOT(&templates)) != NULL) {
 		SPLAY_REMOVE(templtree, &templates, tmpl);
+		templ_index_remove(tmpl);
 		if (how == TEMPLATE_FREE_REGULAR)
 			template_free(tmpl);
 		else if (!(tmpl->flags & TEMPLATE_DYNAMIC_CHILD))
@@ -298,8 +582,10 @@ void
 template_remove(struct template *tmpl)
 {
 	/* Remove ourselves from the searchable index */
-	if (template_find(tmpl->name) == tmpl)
+	if (template_find(tmpl->name) == tmpl) {
 		SPLAY_REMOVE(templtree, &templates, tmpl);
+		templ_index_remove(tmpl);
+	}
 }
 
 /* Insert a template into the system */
@@ -311,19 +597,41 @@ template_insert(struct template *tmpl)
 	if (template_find(tmpl->name) != NULL)
 		return (-1);
 	SPLAY_INSERT(templtree, &templates, tmpl);
+	templ_index_insert(tmpl);
 
 	return (0);
 }
 
+/* Frees the ARP entry that announces the address of this template */
+
+static void
+template_release_arp(struct template *tmpl)
+{
+	struct arp_req *req;
+
+	if (tmpl->ethernet_addr == NULL)
+		return;
+
+	/*
+	 * Templates that are not bound to IP addresses do not have an
+	 * associated arp request object.  After a reload, the entry
+	 * might belong to the template that replaced us.
+	 */
+	req = arp_find(tmpl->ethernet_addr);
+	if (req != NULL && req->owner == tmpl)
+		arp_free(req);
+}
+
 void
 template_deallocate(struct template *tmpl)
 {
 	struct condition *cond;
-	struct port *port;
 
 	/* Remove ourselves from the searchable index */
-	if (template_find(tmpl->name) == tmpl)
+	if (template_find(tmpl->name) == tmpl) {
 		SPLAY_REMOVE(templtree, &templates, tmpl);
+		templ_index_remove(tmpl);
+	}
 
 	/* Free conditions for dynamic templates */
 	for (cond = TAILQ_FIRST(&tmpl->dynamic); cond != NULL;
@@ -335,22 +643,16 @@ template_deallocate(struct template *tmpl)
 			free(cond->match_arg);
 		free(cond);
 	}
+	template_dynamic_flush(tmpl);
 	
-	/* Remove ports from template */
-	while ((port = SPLAY_ROOT(&tmpl->ports)) != NULL)
-		port_free(tmpl, port);
+	/* Remove ports unless other templates still use them */
+	portset_free(tmpl->portset);
 
 	if (tmpl->person != NULL)
 		personality_declone(tmpl->person);
 
 	if (tmpl->ethernet_addr != NULL) {
-		struct arp_req *req = arp_find(tmpl->ethernet_addr);
-		/*
-		 * Templates that are not bound to IP addresses do not
-		 * have an associated arp request object.
-		 */
-		if (req != NULL)
-			arp_free(req);
+		template_release_arp(tmpl);
 		free(tmpl->ethernet_addr);
 	}
 
@@ -372,7 +674,7 @@ port_find(struct template *tmpl, int proto, int number)
 	tmpport.proto = proto;
 	tmpport.number = number;
 	
-	return (SPLAY_FIND(porttree, &tmpl->ports, &tmpport));
+	return (SPLAY_FIND(porttree, &tmpl->portset->ports, &tmpport));
 }
 
 void
@@ -419,6 +721,18 @@ port_encapsulation_free(struct port_encapsulate *tmp)
 
 void
 port_free(struct template *tmpl, struct port *port)
+{
+	/* The port might be in a set that other templates use, too */
+	if (tmpl->portset->refcnt > 1) {
+		template_ports_own(tmpl);
+		port = port_find(tmpl, port->proto, port->number);
+	}
+
+	port_destroy(tmpl->portset, port);
+}
+
+static void
+port_destroy(struct portset *set, struct port *port)
 {
 	struct port_encapsulate *tmp;
 
@@ -431,9 +745,8 @@ port_free(struct template *tmpl, struct port *port)
 		port_encapsulation_free(tmp);
 	}
 
-	SPLAY_REMOVE(porttree, &tmpl->ports, port);
-
-	
+	SPLAY_REMOVE(porttree, &set->ports, port);
+	set->nports--;
 
 	if (port->sub_conport != NULL) {
 		/* Back pointer to connection object.
@@ -462,10 +775,12 @@ port_insert(struct template *tmpl, int proto, int number,
 {
 	struct port *port, tmpport;
 	
+	template_ports_own(tmpl);
+
 	tmpport.proto = proto;
 	tmpport.number = number;
 	
-	if (SPLAY_FIND(porttree, &tmpl->ports, &tmpport) != NULL)
+	if (SPLAY_FIND(porttree, &tmpl->portset->ports, &tmpport) != NULL)
 		return (NULL);
 	
 	if ((port = calloc(1, sizeof(struct port))) == NULL)
@@ -478,7 +793,8 @@ port_insert(struct template *tmpl, int proto, int number,
 	port->number = number;
 	port_action_clone(&port->action, action);
 	    
-	SPLAY_INSERT(porttree, &tmpl->ports, port);
+	SPLAY_INSERT(porttree, &tmpl->portset->ports, port);
+	tmpl->portset->nports++;
 
 	return (port);
 }
@@ -589,10 +905,21 @@ template_clone(const char *newname, const struct template *tmpl,
 	if ((newtmpl = template_create(newname)) == NULL)
 		return (NULL);
 
-	SPLAY_FOREACH(port, porttree, (struct porttree *)&tmpl->ports) {
-		if (port_insert(newtmpl, port->proto, port->number,
-			&port->action) == NULL)
-			return (NULL);
+	/*
+	 * Share the ports until either template changes them.  The
+	 * subsystems of the clone are going to add their own ports.
+	 */
+	if (TAILQ_EMPTY(&tmpl->subsystems)) {
+		portset_free(newtmpl->portset);
+		newtmpl->portset = tmpl->portset;
+		newtmpl->portset->refcnt++;
+	} else {
+		SPLAY_FOREACH(port, porttree,
+		    (struct porttree *)&tmpl->portset->ports) {
+			if (port_insert(newtmpl, port->proto, port->number,
+				&port->action) == NULL)
+				return (NULL);
+		}
 	}
 
 	if (tmpl->person)
@@ -618,7 +945,10 @@ template_clone(const char *newname, const struct template *tmpl,
 			newtmpl->inter = inter;
 
 			/* Register this mac address as our own */
-			template_post_arp(newtmpl, &addr);
+			if (template_staging)
+				newtmpl->deferred |= TEMPLATE_DEFER_ARP;
+			else
+				template_post_arp(newtmpl, &addr);
 		}
 	}
 
@@ -670,6 +1000,12 @@ template_clone(const char *newname, const struct template *tmpl,
 	if (!start)
 		return (newtmpl);
 
+	/* A reload starts them only if the template is new */
+	if (template_staging) {
+		newtmpl->deferred |= TEMPLATE_DEFER_START;
+		return (newtmpl);
+	}
+
 	/* Start background processes */
 	TAILQ_FOREACH(container, &newtmpl->subsystems, next) {
 		template_subsystem_start(newtmpl, container->sub);
@@ -794,7 +1130,9 @@ template_subsystem_free(struct subsystem *sub)
 		template_free(tmpl);
 	}
 
-	cmd_free(&sub->cmd);
+	/* Subsystems of staged templates have never been started */
+	if (sub->cmd.pid != -1)
+		cmd_free(&sub->cmd);
 
 	free(sub->cmdstring);
 	free(sub);
@@ -830,6 +1168,7 @@ template_insert_dynamic(struct template *tmpl, struct template *child,
 	cond->tmpl->flags |= TEMPLATE_DYNAMIC_CHILD;
 
 	TAILQ_INSERT_TAIL(&tmpl->dynamic, cond, next);
+	template_dynamic_flush(tmpl);
 
 	/* Do we need to copy the match arg, too? */
 	if (condition == NULL || condition->match_arg == NULL)
@@ -915,9 +1254,18 @@ template_print(struct evbuffer *buffer, struct template *tmpl)
 	evbuffer_add_printf(buffer, "  TCP drop: in: %d syn: %d\n",
 	    tmpl->drop_inrate, tmpl->drop_synrate);
 	evbuffer_add_printf(buffer, "  refcnt: %d\n", tmpl->refcnt);
-	evbuffer_add_printf(buffer, "  ports:\n");
-
-	SPLAY_FOREACH(port, porttree, &tmpl->ports) {
+	if (tmpl->dyncache != NULL)
+		evbuffer_add_printf(buffer,
+		    "  dynamic decisions: %llu cached, %llu evaluated\n",
+		    (unsigned long long)tmpl->dyncache->hits,
+		    (unsigned long long)tmpl->dyncache->misses);
+	if (tmpl->portset->refcnt > 1)
+		evbuffer_add_printf(buffer, "  ports: shared by %u templates\n",
+		    tmpl->portset->refcnt);
+	else
+		evbuffer_add_printf(buffer, "  ports:\n");
+
+	SPLAY_FOREACH(port, porttree, &tmpl->portset->ports) {
 		char *type;
 		switch (port->action.status) {
 		case PORT_OPEN:
@@ -957,134 +1305,1073 @@ template_print(struct evbuffer *buffer, struct template *tmpl)
 	}
 }
 
-/***************************************************************************
- * Everything is unittest related below this
- ***************************************************************************/
+/* Reports how much memory templates and their ports take up */
+
 void
-template_delay_cb(int fd, short which, void *arg)
+template_print_memory(struct evbuffer *buffer)
 {
-	extern struct pool *pool_pkt;
-	extern struct pool *pool_delay;
-	struct delay *delay = arg;
-	struct ip_hdr *ip = delay->ip;
-	struct template *tmpl = delay->tmpl;
-	u_int iplen = delay->iplen;
+	struct template *tmpl;
+	struct portset *set;
+	u_int gen = ++portset_markgen;
+	u_int ntemplates = 0, nshared = 0;
+	size_t tmplmem = 0, portmem = 0, unshared = 0, size;
 
-	if (ip->ip_ttl &&
-	    !(delay->flags & (DELAY_UNREACH|DELAY_EXTERNAL|DELAY_TUNNEL|DELAY_ETHERNET))) {
-		struct addr addr;
+	SPLAY_FOREACH(tmpl, templtree, &templates) {
+		set = tmpl->portset;
+		size = sizeof(struct portset) + set->nports * sizeof(struct port);
 
-		template_free(tmpl);
+		ntemplates++;
+		tmplmem += sizeof(struct template) + strlen(tmpl->name) + 1;
+		unshared += size;
 
-		addr_pack(&addr, ADDR_TYPE_IP, IP_ADDR_BITS,
-		    &ip->ip_dst, IP_ADDR_LEN);
+		/* Count every set only once */
+		if (set->mark == gen) {
+			nshared++;
+			continue;
+		}
+		set->mark = gen;
+		portmem += size;
+	}
 
-		/* Internal delivery */
-		tmpl = template_find_best(addr_ntoa(&addr), ip, iplen);
-		tmpl = template_ref(tmpl);
+	evbuffer_add_printf(buffer,
+	    "Templates: %u, %u share the ports of another template\n",
+	    ntemplates, nshared);
+	evbuffer_add_printf(buffer, "Port sets: %u\n", portset_count);
+	evbuffer_add_printf(buffer, "Memory: templates %lu KB, ports %lu KB "
+	    "(%lu KB without sharing)\n",
+	    (u_long)(tmplmem / 1024), (u_long)(portmem / 1024),
+	    (u_long)(unshared / 1024));
+}
 
-		/* No Check for fragmentation */
-		honeyd_dispatch(tmpl, ip, iplen);
+/*
+ * Incremental reload: the new configuration is parsed while the running
+ * templates are set aside.  Afterwards, only templates that changed are
+ * replaced, so that unchanged templates keep their connections, running
+ * subsystems, ARP entries and uptime.
+ */
 
-	}
+int template_staging;		/* a reload parses the configuration */
+int template_staging_dhcp;	/* the staged configuration uses DHCP */
 
-	if (delay->flags & DELAY_FREEPKT)
-		pool_free(pool_pkt, ip);
-	template_free(tmpl);
+#define RELOAD_NONE	0
+#define RELOAD_ADD	1	/* only in the new configuration */
+#define RELOAD_REMOVE	2	/* only in the running configuration */
+#define RELOAD_KEEP	3	/* unchanged */
+#define RELOAD_UPDATE	4	/* running template is changed in place */
+#define RELOAD_REPLACE	5	/* new template takes over */
 
-	if (delay->flags & DELAY_NEEDFREE)
-		pool_free(pool_delay, delay);
-}
+/* The running template stays in place */
+#define RELOAD_STAYS(x)	((x) == RELOAD_KEEP || (x) == RELOAD_UPDATE)
 
-void
-template_test_parse_error(char *line, struct evbuffer *evbuf)
+/* Subsystems that the staged configuration created follow the old ones */
+#define RELOAD_STAGED_SUBS(last) \
+	((last) != NULL ? TAILQ_NEXT(last, next) : TAILQ_FIRST(&subsystems))
+
+static int
+action_equal(const struct action *a, const struct action *b)
 {
-	size_t off;
-	char data[128];
+	const struct addrinfo *aia = a->aitop, *aib = b->aitop;
 
-	evbuffer_copyout(evbuf, data, off = evbuffer_get_length(evbuf));
-	data[off - 1] = '\0';
-	errx(1, "parse_line \"%s\" failed: %s", line, data);
+	if (a->status != b->status || a->flags != b->flags ||
+	    a->action_extend != b->action_extend)
+		return (0);
+	if ((a->action == NULL) != (b->action == NULL) ||
+	    (a->action != NULL && strcmp(a->action, b->action)))
+		return (0);
+	if (aia == NULL || aib == NULL)
+		return (aia == aib);
+
+	return (aia->ai_socktype == aib->ai_socktype &&
+	    aia->ai_addrlen == aib->ai_addrlen &&
+	    memcmp(aia->ai_addr, aib->ai_addr, aia->ai_addrlen) == 0);
 }
 
-#define MAKE_CONFIG(x)	do { \
-	char *p = (x); \
-	if (parse_line(evbuf, p) == -1) \
-		template_test_parse_error(p, evbuf); \
-} while (0)
-	
-int
-template_test_add(struct evbuffer *evbuf, struct addr *addr, int count)
+/* Compares the configured ports; subsystems bind their own ports */
+
+static int
+template_ports_equal(struct template *old, struct template *new)
 {
-	char line[128];
-	int i;
+	struct porttree *oldports = &old->portset->ports;
+	struct porttree *newports = &new->portset->ports;
+	struct port *op, *np;
+
+	if (old->portset == new->portset)
+		return (1);
+
+	op = SPLAY_MIN(porttree, oldports);
+	np = SPLAY_MIN(porttree, newports);
+	for (;;) {
+		while (op != NULL && op->sub != NULL)
+			op = SPLAY_NEXT(porttree, oldports, op);
+		if (op == NULL || np == NULL)
+			break;
 
-	for (i = 0; i < count; i++) {
-		evbuffer_drain(evbuf, -1);
-		
-		addr->addr_ip = htonl(ntohl(addr->addr_ip) + 1);
-		snprintf(line, sizeof(line), "bind %s template", addr_ntoa(addr));
-		MAKE_CONFIG(line);
+		if (op->proto != np->proto || op->number != np->number ||
+		    !action_equal(&op->action, &np->action))
+			return (0);
+
+		op = SPLAY_NEXT(porttree, oldports, op);
+		np = SPLAY_NEXT(porttree, newports, np);
 	}
 
-	return (count);
+	return (op == NULL && np == NULL);
 }
 
-void
-template_test_measure(int count)
+static int
+template_subsystems_equal(struct template *old, struct template *new)
 {
-	extern rand_t *honeyd_rand;
-	u_char pkt[1500];
-	struct interface inter;
-	struct pcap_pkthdr pkthdr;
-	struct ip_hdr *ip = (struct ip_hdr *)pkt;
-	struct tcp_hdr *tcp = (struct tcp_hdr *)(ip + 1);
-	struct addr src, dst;
-	uint16_t *snib;
-	struct timeval tv_start, tv_end;
-	double msperpkt;
-	int j;
-	uint16_t iplen = sizeof(*ip) + sizeof(*tcp);
+	struct subsystem_container *oc, *nc;
+	struct template_container *ot, *nt;
+
+	oc = TAILQ_FIRST(&old->subsystems);
+	nc = TAILQ_FIRST(&new->subsystems);
+	for (; oc != NULL && nc != NULL;
+	    oc = TAILQ_NEXT(oc, next), nc = TAILQ_NEXT(nc, next)) {
+		if (strcmp(oc->sub->cmdstring, nc->sub->cmdstring) ||
+		    oc->sub->flags != nc->sub->flags)
+			return (0);
+		if (!(nc->sub->flags & SUBSYSTEM_SHARED))
+			continue;
 
-	memset(&inter, 0, sizeof(struct interface));
-	memset(&pkthdr, 0, sizeof(struct pcap_pkthdr));
-	pkthdr.caplen = sizeof(pkt);
-		    
-	addr_pton("10.0.0.0", &dst);
-	addr_pton("10.1.0.0", &src);
+		/* A shared subsystem needs to be shared the same way */
+		ot = TAILQ_FIRST(&oc->sub->templates);
+		nt = TAILQ_FIRST(&nc->sub->templates);
+		for (; ot != NULL && nt != NULL;
+		    ot = TAILQ_NEXT(ot, next), nt = TAILQ_NEXT(nt, next)) {
+			if (strcmp(ot->tmpl->name, nt->tmpl->name))
+				return (0);
+		}
+		if (ot != NULL || nt != NULL)
+			return (0);
+	}
 
-	snib = (uint16_t *)(&src.addr_data8[2]);
+	return (oc == NULL && nc == NULL);
+}
 
-	gettimeofday(&tv_start, NULL);
-	for (j = 0; j < 80000; j++) {
-		*snib = rand_uint16(honeyd_rand);
-		dst.addr_ip  = htonl(rand_uint32(honeyd_rand) % count);
-		dst.addr_data8[0] = 10;
+/* Decides what to do with a template that both configurations have */
 
-		tcp_pack_hdr(tcp,
-		    rand_uint16(honeyd_rand), 23,
-		    0x100000, 0x00000, TH_SYN, 32768, 0);
-		ip_pack_hdr(pkt, 0, iplen, rand_uint16(honeyd_rand),
-		    0, 64,
-		    IP_PROTO_TCP, src.addr_ip, dst.addr_ip);
-		ip_checksum(pkt, iplen);
+static int
+template_reload_decide(struct template *old, struct template *new)
+{
+	size_t len;
 
-		honeyd_recv_cb((u_char *)&inter, &pkthdr, pkt);
+	if (old->flags != new->flags ||
+	    (new->flags & (TEMPLATE_DYNAMIC|TEMPLATE_DYNAMIC_CHILD)) ||
+	    old->inter != new->inter || old->dhcp_req != NULL ||
+	    !template_subsystems_equal(old, new))
+		return (RELOAD_REPLACE);
+
+	if (old->ethernet_addr == NULL || new->ethernet_addr == NULL) {
+		if (old->ethernet_addr != new->ethernet_addr)
+			return (RELOAD_REPLACE);
+	} else {
+		/* Clones get a random address from the configured vendor */
+		len = new->deferred & TEMPLATE_DEFER_ARP ? 3 : ETH_ADDR_LEN;
+		if (memcmp(old->ethernet_addr->addr_data8,
+			new->ethernet_addr->addr_data8, len))
+			return (RELOAD_REPLACE);
 	}
-	gettimeofday(&tv_end, NULL);
-	timersub(&tv_end, &tv_start, &tv_end);
+
+	/* The uptime and sequence numbers of the running template stay */
+	if (old->person == NULL || new->person == NULL) {
+		if (old->person != new->person)
+			return (RELOAD_UPDATE);
+	} else if (memcmp(old->person, new->person,
+		       sizeof(struct personality)))
+		return (RELOAD_UPDATE);
+
+	if (!action_equal(&old->tcp, &new->tcp) ||
+	    !action_equal(&old->udp, &new->udp) ||
+	    !action_equal(&old->icmp, &new->icmp) ||
+	    !template_ports_equal(old, new) ||
+	    old->drop_inrate != new->drop_inrate ||
+	    old->drop_synrate != new->drop_synrate ||
+	    old->uid != new->uid || old->gid != new->gid ||
+	    old->max_nofiles != new->max_nofiles ||
+	    memcmp(&old->spoof, &new->spoof, sizeof(struct spoof)))
+		return (RELOAD_UPDATE);
+
+	return (RELOAD_KEEP);
+}
+
+static void
+template_reload_replace(struct template *tmpl, struct templtree *running)
+{
+	struct template *other;
+
+	tmpl->reload = RELOAD_REPLACE;
+	if ((other = template_find(tmpl->name)) != NULL)
+		other->reload = RELOAD_REPLACE;
+	if ((other = SPLAY_FIND(templtree, running, tmpl)) != NULL)
+		other->reload = RELOAD_REPLACE;
+}
+
+/*
+ * All templates of a subsystem need to share the same fate.  Returns 1
+ * if a template had to be replaced because of its subsystem.
+ */
+
+static int
+template_reload_subsystem(struct subsystem *sub, struct templtree *running)
+{
+	struct template_container *cont;
+	int stays = 0, goes = 0, changed = 0;
+
+	TAILQ_FOREACH(cont, &sub->templates, next) {
+		if (RELOAD_STAYS(cont->tmpl->reload))
+			stays = 1;
+		else
+			goes = 1;
+	}
+	if (!stays || !goes)
+		return (0);
+
+	TAILQ_FOREACH(cont, &sub->templates, next) {
+		if (RELOAD_STAYS(cont->tmpl->reload)) {
+			template_reload_replace(cont->tmpl, running);
+			changed = 1;
+		}
+	}
+
+	return (changed);
+}
+
+/* Brings the ports of a running template up to date */
+
+static void
+template_reload_ports(struct template *old, struct template *new)
+{
+	struct portset *set;
+	struct port *port, *next, *newport;
+	int busy = 0;
+
+	if (template_ports_equal(old, new))
+		return;
+
+	SPLAY_FOREACH(port, porttree, &old->portset->ports) {
+		if (port->sub != NULL || !TAILQ_EMPTY(&port->pending)) {
+			busy = 1;
+			break;
+		}
+	}
+
+	/* Nobody uses the old ports, so we can take over the new set */
+	if (!busy) {
+		set = old->portset;
+		old->portset = new->portset;
+		new->portset = set;
+		return;
+	}
+
+	template_ports_own(old);
+	for (port = SPLAY_MIN(porttree, &old->portset->ports); port != NULL;
+	    port = next) {
+		next = SPLAY_NEXT(porttree, &old->portset->ports, port);
+		if (port->sub != NULL)
+			continue;
+		newport = port_find(new, port->proto, port->number);
+		if (newport == NULL ||
+		    !action_equal(&port->action, &newport->action))
+			port_free(old, port);
+	}
+
+	SPLAY_FOREACH(port, porttree, &new->portset->ports) {
+		if (port_find(old, port->proto, port->number) == NULL)
+			port_insert(old, port->proto, port->number,
+			    &port->action);
+	}
+}
+
+static void
+template_reload_update(struct template *old, struct template *new)
+{
+	struct personality *person = old->person;
+	struct action action;
+
+	old->person = new->person;
+	new->person = person;
+
+	action = old->tcp; old->tcp = new->tcp; new->tcp = action;
+	action = old->udp; old->udp = new->udp; new->udp = action;
+	action = old->icmp; old->icmp = new->icmp; new->icmp = action;
+
+	template_reload_ports(old, new);
+
+	old->drop_inrate = new->drop_inrate;
+	old->drop_synrate = new->drop_synrate;
+	old->uid = new->uid;
+	old->gid = new->gid;
+	old->max_nofiles = new->max_nofiles;
+	old->spoof = new->spoof;
+}
+
+/* Does the work that template_clone deferred while we were staging */
+
+static void
+template_reload_install(struct template *tmpl)
+{
+	struct subsystem_container *container;
+	struct addr addr;
+
+	SPLAY_INSERT(templtree, &templates, tmpl);
+	templ_index_insert(tmpl);
+
+	if ((tmpl->deferred & TEMPLATE_DEFER_ARP) &&
+	    addr_aton(tmpl->name, &addr) != -1)
+		template_post_arp(tmpl, &addr);
+
+	if (tmpl->deferred & TEMPLATE_DEFER_START) {
+		TAILQ_FOREACH(container, &tmpl->subsystems, next)
+			template_subsystem_start(tmpl, container->sub);
+	}
+
+	tmpl->deferred = 0;
+}
+
+/* Goes back to the running configuration */
+
+static void
+config_reload_abort(struct templtree *running, struct subsystem *lastsub)
+{
+	struct subsystem *sub;
+	struct template *tmpl;
+
+	while ((sub = RELOAD_STAGED_SUBS(lastsub)) != NULL)
+		template_subsystem_free(sub);
+	template_free_all(TEMPLATE_FREE_REGULAR);
+
+	while ((tmpl = SPLAY_ROOT(running)) != NULL) {
+		SPLAY_REMOVE(templtree, running, tmpl);
+		template_insert(tmpl);
+	}
+
+	router_stage_abort();
+}
+
+/*
+ * Reloads the configuration without disturbing the templates that did
+ * not change.  A configuration with errors leaves the running one in
+ * place.
+ */
+
+int
+config_reload(char *config)
+{
+	extern int honeyd_ignore_parse_errors;
+	struct templtree running, staged;
+	struct template *tmpl, *old;
+	struct template_container *cont;
+	struct subsystem *sub, *next, *lastsub;
+	struct timeval tv_start, tv_end;
+	int added = 0, removed = 0, changed = 0, unchanged = 0;
+	int res, routes, again, last;
+	FILE *fp;
+
+	if ((fp = fopen(config, "r")) == NULL) {
+		syslog(LOG_WARNING, "%s: fopen(%s): %m", __func__, config);
+		return (-1);
+	}
+
+	gettimeofday(&tv_start, NULL);
+
+	/* Set the running configuration aside */
+	running = templates;
+	SPLAY_INIT(&templates);
+	SPLAY_FOREACH(tmpl, templtree, &running)
+		templ_index_remove(tmpl);
+	lastsub = TAILQ_LAST(&subsystems, subsystemqueue);
+	router_stage_begin();
+
+	template_staging = 1;
+	template_staging_dhcp = 0;
+	res = parse_configuration(fp, config);
+	template_staging = 0;
+	fclose(fp);
+
+	if (res == -1 && !honeyd_ignore_parse_errors) {
+		config_reload_abort(&running, lastsub);
+		syslog(LOG_WARNING, "%s: errors in %s; keeping the running "
+		    "configuration", __func__, config);
+		return (-1);
+	}
+
+	/* DHCP templates can not be staged, so we start from scratch */
+	if (template_staging_dhcp) {
+		config_reload_abort(&running, lastsub);
+		syslog(LOG_NOTICE, "%s: %s uses DHCP; reloading completely",
+		    __func__, config);
+		template_free_all(TEMPLATE_FREE_REGULAR);
+		router_end();
+		config_read(config);
+		return (0);
+	}
+
+	/* Decide what to do with each template */
+	SPLAY_FOREACH(tmpl, templtree, &templates) {
+		old = SPLAY_FIND(templtree, &running, tmpl);
+		tmpl->reload = old == NULL ?
+		    RELOAD_ADD : template_reload_decide(old, tmpl);
+		if (old != NULL)
+			old->reload = tmpl->reload;
+	}
+	SPLAY_FOREACH(old, templtree, &running) {
+		if (template_find(old->name) == NULL)
+			old->reload = RELOAD_REMOVE;
+	}
+
+	do {
+		again = 0;
+		TAILQ_FOREACH(sub, &subsystems, next)
+			again |= template_reload_subsystem(sub, &running);
+	} while (again);
+
+	routes = router_stage_end();
+
+	/* Staged subsystems of templates that stay are not needed */
+	for (sub = RELOAD_STAGED_SUBS(lastsub); sub != NULL; sub = next) {
+		next = TAILQ_NEXT(sub, next);
+		cont = TAILQ_FIRST(&sub->templates);
+		if (cont != NULL && RELOAD_STAYS(cont->tmpl->reload))
+			template_subsystem_free(sub);
+	}
+
+	/* Running subsystems of templates that go away are stopped */
+	for (sub = lastsub != NULL ? TAILQ_FIRST(&subsystems) : NULL;
+	     sub != NULL; sub = next) {
+		next = TAILQ_NEXT(sub, next);
+		last = sub == lastsub;
+		cont = TAILQ_FIRST(&sub->templates);
+		if (cont == NULL || !RELOAD_STAYS(cont->tmpl->reload)) {
+			if (sub->cmd.pid != -1)
+				kill(sub->cmd.pid, SIGTERM);
+			template_subsystem_free(sub);
+		}
+		if (last)
+			break;
+	}
+
+	/* Free the ARP entries first, as replacements might reuse them */
+	SPLAY_FOREACH(old, templtree, &running) {
+		if (!RELOAD_STAYS(old->reload))
+			template_release_arp(old);
+	}
+
+	staged = templates;
+	SPLAY_INIT(&templates);
+	SPLAY_FOREACH(tmpl, templtree, &staged)
+		templ_index_remove(tmpl);
+
+	while ((tmpl = SPLAY_ROOT(&staged)) != NULL) {
+		SPLAY_REMOVE(templtree, &staged, tmpl);
+		if ((old = SPLAY_FIND(templtree, &running, tmpl)) != NULL)
+			SPLAY_REMOVE(templtree, &running, old);
+
+		switch (tmpl->reload) {
+		case RELOAD_UPDATE:
+			template_reload_update(old, tmpl);
+			changed++;
+			/* FALLTHROUGH */
+		case RELOAD_KEEP:
+			if (tmpl->reload == RELOAD_KEEP)
+				unchanged++;
+			old->reload = RELOAD_NONE;
+			SPLAY_INSERT(templtree, &templates, old);
+			templ_index_insert(old);
+			template_free(tmpl);
+			break;
+		default:
+			tmpl->reload = RELOAD_NONE;
+			template_reload_install(tmpl);
+			if (old != NULL) {
+				old->reload = RELOAD_NONE;
+				template_free(old);
+				changed++;
+			} else
+				added++;
+			break;
+		}
+	}
+
+	/* Live connections keep a reference to the removed templates */
+	while ((old = SPLAY_ROOT(&running)) != NULL) {
+		SPLAY_REMOVE(templtree, &running, old);
+		old->reload = RELOAD_NONE;
+		template_free(old);
+		removed++;
+	}
+
+	gettimeofday(&tv_end, NULL);
+	timersub(&tv_end, &tv_start, &tv_end);
+	syslog(LOG_NOTICE, "reloaded %s in %.1f ms: templates %d added, "
+	    "%d removed, %d changed, %d unchanged; routes %s",
+	    config, tv_end.tv_sec * 1000.0 + tv_end.tv_usec / 1000.0,
+	    added, removed, changed, unchanged,
+	    routes ? "changed" : "unchanged");
+
+	return (0);
+}
+
+/* Compiled configuration */
+
+static int
+action_marshal(struct evbuffer *evbuf, int tag, const struct action *action)
+{
+	struct evbuffer *tmp;
+	struct addrinfo *ai = action->aitop;
+	char addr[NI_MAXHOST];
+	char port[NI_MAXSERV];
+
+	/* Python modules and subsystems are set up by the parser */
+	if (action->status == PORT_PYTHON || action->status == PORT_SUBSYSTEM)
+		return (-1);
+
+	if ((tmp = evbuffer_new()) == NULL)
+		err(1, "%s: evbuffer_new", __func__);
+
+	evtag_marshal_int(tmp, TACT_STATUS, action->status);
+	evtag_marshal_int(tmp, TACT_FLAGS, action->flags);
+	if (action->action != NULL)
+		evtag_marshal_string(tmp, TACT_STRING, action->action);
+	if (ai != NULL) {
+		if (getnameinfo(ai->ai_addr, ai->ai_addrlen,
+			addr, sizeof(addr), port, sizeof(port),
+			NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
+			evbuffer_free(tmp);
+			return (-1);
+		}
+		evtag_marshal_string(tmp, TACT_PROXY_HOST, addr);
+		evtag_marshal_int(tmp, TACT_PROXY_PORT, atoi(port));
+		evtag_marshal_int(tmp, TACT_PROXY_TYPE, ai->ai_socktype);
+	}
+
+	evtag_marshal_buffer(evbuf, tag, tmp);
+	evbuffer_free(tmp);
+
+	return (0);
+}
+
+static int
+action_unmarshal(struct evbuffer *evbuf, struct action *action)
+{
+	uint32_t tag, integer, port = 0, type = 0;
+	char *host = NULL;
+
+	memset(action, 0, sizeof(struct action));
+
+	if (evtag_unmarshal_int(evbuf, TACT_STATUS, &integer) == -1)
+		return (-1);
+	action->status = integer;
+	if (evtag_unmarshal_int(evbuf, TACT_FLAGS, &integer) == -1)
+		return (-1);
+	action->flags = integer;
+
+	while (evtag_peek(evbuf, &tag) != -1) {
+		switch (tag) {
+		case TACT_STRING:
+			if (action->action != NULL ||
+			    evtag_unmarshal_string(evbuf, tag,
+				&action->action) == -1)
+				goto error;
+			break;
+		case TACT_PROXY_HOST:
+			if (host != NULL ||
+			    evtag_unmarshal_string(evbuf, tag, &host) == -1)
+				goto error;
+			break;
+		case TACT_PROXY_PORT:
+			if (evtag_unmarshal_int(evbuf, tag, &port) == -1)
+				goto error;
+			break;
+		case TACT_PROXY_TYPE:
+			if (evtag_unmarshal_int(evbuf, tag, &type) == -1)
+				goto error;
+			break;
+		default:
+			goto error;
+		}
+	}
+
+	/* The address is numeric, so this does not need to resolve names */
+	if (host != NULL) {
+		action->aitop = cmd_proxy_getinfo(host, type, port);
+		if (action->aitop == NULL)
+			goto error;
+		free(host);
+	}
+
+	return (0);
+
+ error:
+	if (host != NULL)
+		free(host);
+	if (action->action != NULL)
+		free(action->action);
+	action->action = NULL;
+	return (-1);
+}
+
+/* Starts a compiled configuration; shared ports are written only once */
+
+void
+template_marshal_start(void)
+{
+	portset_marshalgen = ++portset_markgen;
+}
+
+/*
+ * Adds the template to a compiled configuration.  Returns -1 if the
+ * template uses anything that only the parser can set up: subsystems,
+ * dynamic templates, DHCP or Python modules.
+ */
+int
+template_marshal(struct evbuffer *evbuf, struct template *tmpl)
+{
+	struct portset *set = tmpl->portset;
+	struct evbuffer *tmp, *sub;
+	struct port *port;
+	int res = -1;
+
+	if (!TAILQ_EMPTY(&tmpl->subsystems) || !TAILQ_EMPTY(&tmpl->dynamic) ||
+	    (tmpl->flags & (TEMPLATE_DYNAMIC|TEMPLATE_DYNAMIC_CHILD)) ||
+	    tmpl->dhcp_req != NULL)
+		return (-1);
+
+	if ((tmp = evbuffer_new()) == NULL || (sub = evbuffer_new()) == NULL)
+		err(1, "%s: evbuffer_new", __func__);
+
+	evtag_marshal_string(tmp, TMPL_NAME, tmpl->name);
+	evtag_marshal_int(tmp, TMPL_FLAGS, tmpl->flags);
+	if (tmpl->flags & TEMPLATE_EXTERNAL)
+		evtag_marshal_string(tmp, TMPL_INTERFACE,
+		    tmpl->inter->if_ent.intf_name);
+
+	/* The template has its own copy that might have been annotated */
+	if (tmpl->person != NULL) {
+		evtag_marshal_string(tmp, TMPL_PERSONALITY, tmpl->person->name);
+		evtag_marshal_int(tmp, TMPL_FINSCAN,
+		    tmpl->person->disallow_finscan);
+		evtag_marshal_int(tmp, TMPL_FRAGMENT, tmpl->person->fragp);
+	}
+
+	if (action_marshal(tmp, TMPL_TCP, &tmpl->tcp) == -1 ||
+	    action_marshal(tmp, TMPL_UDP, &tmpl->udp) == -1 ||
+	    action_marshal(tmp, TMPL_ICMP, &tmpl->icmp) == -1)
+		goto out;
+
+	if (set->refcnt > 1 && set->mark == portset_marshalgen) {
+		/* Shared ports are only written for the first template */
+		evtag_marshal_string(tmp, TMPL_PORTS_OF, set->marktmpl->name);
+	} else {
+		set->mark = portset_marshalgen;
+		set->marktmpl = tmpl;
+		SPLAY_FOREACH(port, porttree, &set->ports) {
+			evbuffer_drain(sub, evbuffer_get_length(sub));
+			evtag_marshal_int(sub, TPORT_PROTO, port->proto);
+			evtag_marshal_int(sub, TPORT_NUMBER, port->number);
+			if (action_marshal(sub, TPORT_ACTION,
+				&port->action) == -1)
+				goto out;
+			evtag_marshal_buffer(tmp, TMPL_PORT, sub);
+		}
+	}
+
+	evtag_marshal_int(tmp, TMPL_TIMESTAMP, tmpl->timestamp);
+	evtag_marshal(tmp, TMPL_DRIFT, &tmpl->drift, sizeof(tmpl->drift));
+	evtag_marshal_int(tmp, TMPL_DROP_IN, tmpl->drop_inrate);
+	evtag_marshal_int(tmp, TMPL_DROP_SYN, tmpl->drop_synrate);
+	evtag_marshal_int(tmp, TMPL_UID, tmpl->uid);
+	evtag_marshal_int(tmp, TMPL_GID, tmpl->gid);
+	evtag_marshal_int(tmp, TMPL_MAXFDS, tmpl->max_nofiles);
+	if (tmpl->ethernet_addr != NULL)
+		evtag_marshal(tmp, TMPL_ETHERNET, tmpl->ethernet_addr,
+		    sizeof(struct addr));
+	evtag_marshal(tmp, TMPL_SPOOF_SRC, &tmpl->spoof.new_src,
+	    sizeof(struct addr));
+	evtag_marshal(tmp, TMPL_SPOOF_DST, &tmpl->spoof.new_dst,
+	    sizeof(struct addr));
+
+	evtag_marshal_buffer(evbuf, SNAP_TEMPLATE, tmp);
+	res = 0;
+
+ out:
+	evbuffer_free(sub);
+	evbuffer_free(tmp);
+	return (res);
+}
+
+static int
+template_unmarshal_port(struct template *tmpl, struct evbuffer *evbuf)
+{
+	struct evbuffer *tmp;
+	struct action action, noaction;
+	struct port *port;
+	uint32_t tag, proto, number;
+	int res = -1;
+
+	if (evtag_unmarshal_int(evbuf, TPORT_PROTO, &proto) == -1 ||
+	    evtag_unmarshal_int(evbuf, TPORT_NUMBER, &number) == -1)
+		return (-1);
+
+	if ((tmp = evbuffer_new()) == NULL)
+		err(1, "%s: evbuffer_new", __func__);
+	if (evtag_unmarshal(evbuf, &tag, tmp) == -1 || tag != TPORT_ACTION ||
+	    action_unmarshal(tmp, &action) == -1)
+		goto out;
+
+	/* Hand over the action instead of copying it */
+	memset(&noaction, 0, sizeof(noaction));
+	if ((port = port_insert(tmpl, proto, number, &noaction)) == NULL) {
+		if (action.action != NULL)
+			free(action.action);
+		if (action.aitop != NULL)
+			freeaddrinfo(action.aitop);
+		goto out;
+	}
+	port->action = action;
+	res = 0;
+
+ out:
+	evbuffer_free(tmp);
+	return (res);
+}
+
+/* Creates a template from a compiled configuration */
+int
+template_unmarshal(struct evbuffer *evbuf)
+{
+	extern int need_arp;
+	struct template *tmpl, *other;
+	struct personality *person;
+	struct interface *inter;
+	struct action *action;
+	struct evbuffer *tmp;
+	struct addr addr;
+	uint32_t tag, integer;
+	char *str = NULL;
+	int isipaddr, res = -1;
+
+	if (evtag_unmarshal_string(evbuf, TMPL_NAME, &str) == -1)
+		return (-1);
+	tmpl = template_create(str);
+	isipaddr = addr_aton(str, &addr) != -1;
+	free(str);
+	if (tmpl == NULL)
+		return (-1);
+
+	if ((tmp = evbuffer_new()) == NULL)
+		err(1, "%s: evbuffer_new", __func__);
+
+	while (evtag_peek(evbuf, &tag) != -1) {
+		evbuffer_drain(tmp, evbuffer_get_length(tmp));
+
+		switch (tag) {
+		case TMPL_INTERFACE:
+		case TMPL_PERSONALITY:
+			if (evtag_unmarshal_string(evbuf, tag, &str) == -1)
+				goto out;
+			if (tag == TMPL_INTERFACE) {
+				tmpl->inter = interface_find(str);
+				free(str);
+				if (tmpl->inter == NULL)
+					goto out;
+				break;
+			}
+			person = personality_find(str);
+			free(str);
+			if (person == NULL || tmpl->person != NULL)
+				goto out;
+			tmpl->person = personality_clone(person);
+			break;
+		case TMPL_FINSCAN:
+		case TMPL_FRAGMENT:
+			if (tmpl->person == NULL ||
+			    evtag_unmarshal_int(evbuf, tag, &integer) == -1)
+				goto out;
+			if (tag == TMPL_FINSCAN)
+				tmpl->person->disallow_finscan = integer;
+			else
+				tmpl->person->fragp = integer;
+			break;
+		case TMPL_TCP:
+		case TMPL_UDP:
+		case TMPL_ICMP:
+			action = tag == TMPL_TCP ? &tmpl->tcp :
+			    tag == TMPL_UDP ? &tmpl->udp : &tmpl->icmp;
+			if (evtag_unmarshal(evbuf, &tag, tmp) == -1 ||
+			    action_unmarshal(tmp, action) == -1)
+				goto out;
+			break;
+		case TMPL_PORTS_OF:
+			if (evtag_unmarshal_string(evbuf, tag, &str) == -1)
+				goto out;
+			other = template_find(str);
+			free(str);
+			if (other == NULL || tmpl->portset->nports)
+				goto out;
+			portset_free(tmpl->portset);
+			tmpl->portset = other->portset;
+			tmpl->portset->refcnt++;
+			break;
+		case TMPL_PORT:
+			if (evtag_unmarshal(evbuf, &tag, tmp) == -1 ||
+			    template_unmarshal_port(tmpl, tmp) == -1)
+				goto out;
+			break;
+		case TMPL_DRIFT:
+			if (evtag_unmarshal_fixed(evbuf, tag,
+				&tmpl->drift, sizeof(tmpl->drift)) == -1)
+				goto out;
+			break;
+		case TMPL_ETHERNET:
+			if (tmpl->ethernet_addr != NULL)
+				goto out;
+			if ((tmpl->ethernet_addr = malloc(sizeof(struct addr)))
+			    == NULL)
+				err(1, "%s: malloc", __func__);
+			if (evtag_unmarshal_fixed(evbuf, tag,
+				tmpl->ethernet_addr, sizeof(struct addr)) == -1)
+				goto out;
+			break;
+		case TMPL_SPOOF_SRC:
+			if (evtag_unmarshal_fixed(evbuf, tag,
+				&tmpl->spoof.new_src, sizeof(struct addr)) == -1)
+				goto out;
+			break;
+		case TMPL_SPOOF_DST:
+			if (evtag_unmarshal_fixed(evbuf, tag,
+				&tmpl->spoof.new_dst, sizeof(struct addr)) == -1)
+				goto out;
+			break;
+		default:
+			if (evtag_unmarshal_int(evbuf, tag, &integer) == -1)
+				goto out;
+			switch (tag) {
+			case TMPL_FLAGS:
+				tmpl->flags = integer;
+				break;
+			case TMPL_TIMESTAMP:
+				tmpl->timestamp = integer;
+				break;
+			case TMPL_DROP_IN:
+				tmpl->drop_inrate = integer;
+				break;
+			case TMPL_DROP_SYN:
+				tmpl->drop_synrate = integer;
+				break;
+			case TMPL_UID:
+				if ((tmpl->uid = integer) != 0)
+					honeyd_use_uid(integer);
+				break;
+			case TMPL_GID:
+				if ((tmpl->gid = integer) != 0)
+					honeyd_use_gid(integer);
+				break;
+			case TMPL_MAXFDS:
+				tmpl->max_nofiles = integer;
+				break;
+			default:
+				goto out;
+			}
+			break;
+		}
+	}
+
+	if (tmpl->person != NULL)
+		personality_compile(tmpl->person);
+
+	/* Same as template_clone() but keeps the ethernet address */
+	if (tmpl->ethernet_addr != NULL) {
+		need_arp = 1;
+		if (isipaddr) {
+			if ((inter = interface_find_responsible(&addr)) == NULL)
+				goto out;
+			tmpl->inter = inter;
+			template_post_arp(tmpl, &addr);
+		}
+	}
+
+	res = 0;
+
+ out:
+	evbuffer_free(tmp);
+	if (res == -1)
+		template_free(tmpl);
+	return (res);
+}
+
+/***************************************************************************
+ * Everything is unittest related below this
+ ***************************************************************************/
+void
+template_delay_cb(int fd, short which, void *arg)
+{
+	extern struct pool *pool_pkt;
+	extern struct pool *pool_delay;
+	struct delay *delay = arg;
+	struct ip_hdr *ip = delay->ip;
+	struct template *tmpl = delay->tmpl;
+	u_int iplen = delay->iplen;
+
+	if (ip->ip_ttl &&
+	    !(delay->flags & (DELAY_UNREACH|DELAY_EXTERNAL|DELAY_TUNNEL|DELAY_ETHERNET))) {
+		template_free(tmpl);
+
+		/* Internal delivery */
+		tmpl = template_find_best_addr(ip->ip_dst, ip, iplen);
+		tmpl = template_ref(tmpl);
+
+		/* No Check for fragmentation */
+		honeyd_dispatch(tmpl, ip, iplen);
+
+	}
+
+	if (delay->flags & DELAY_FREEPKT)
+		pool_free(pool_pkt, ip);
+	template_free(tmpl);
+
+	if (delay->flags & DELAY_NEEDFREE)
+		pool_free(pool_delay, delay);
+}
+
+void
+template_test_parse_error(char *line, struct evbuffer *evbuf)
+{
+	size_t off;
+	char data[128];
+
+	evbuffer_copyout(evbuf, data, off = evbuffer_get_length(evbuf));
+	data[off - 1] = '\0';
+	errx(1, "parse_line \"%s\" failed: %s", line, data);
+}
+
+#define MAKE_CONFIG(x)	do { \
+	char *p = (x); \
+	if (parse_line(evbuf, p) == -1) \
+		template_test_parse_error(p, evbuf); \
+} while (0)
+	
+int
+template_test_add(struct evbuffer *evbuf, struct addr *addr, int count)
+{
+	char line[128];
+	int i;
+
+	for (i = 0; i < count; i++) {
+		evbuffer_drain(evbuf, -1);
+		
+		addr->addr_ip = htonl(ntohl(addr->addr_ip) + 1);
+		snprintf(line, sizeof(line), "bind %s template", addr_ntoa(addr));
+		MAKE_CONFIG(line);
+	}
+
+	return (count);
+}
+
+void
+template_test_measure(int count)
+{
+	extern rand_t *honeyd_rand;
+	u_char pkt[1500];
+	struct interface inter;
+	struct pcap_pkthdr pkthdr;
+	struct ip_hdr *ip = (struct ip_hdr *)pkt;
+	struct tcp_hdr *tcp = (struct tcp_hdr *)(ip + 1);
+	struct addr src, dst;
+	uint16_t *snib;
+	struct timeval tv_start, tv_end;
+	double msperpkt;
+	int j;
+	uint16_t iplen = sizeof(*ip) + sizeof(*tcp);
+
+	memset(&inter, 0, sizeof(struct interface));
+	memset(&pkthdr, 0, sizeof(struct pcap_pkthdr));
+	pkthdr.caplen = sizeof(pkt);
+		    
+	addr_pton("10.0.0.0", &dst);
+	addr_pton("10.1.0.0", &src);
+
+	snib = (uint16_t *)(&src.addr_data8[2]);
+
+	gettimeofday(&tv_start, NULL);
+	for (j = 0; j < 80000; j++) {
+		*snib = rand_uint16(honeyd_rand);
+		dst.addr_ip  = htonl(rand_uint32(honeyd_rand) % count);
+		dst.addr_data8[0] = 10;
+
+		tcp_pack_hdr(tcp,
+		    rand_uint16(honeyd_rand), 23,
+		    0x100000, 0x00000, TH_SYN, 32768, 0);
+		ip_pack_hdr(pkt, 0, iplen, rand_uint16(honeyd_rand),
+		    0, 64,
+		    IP_PROTO_TCP, src.addr_ip, dst.addr_ip);
+		ip_checksum(pkt, iplen);
+
+		honeyd_recv_cb((u_char *)&inter, &pkthdr, pkt);
+	}
+	gettimeofday(&tv_end, NULL);
+	timersub(&tv_end, &tv_start, &tv_end);
 	msperpkt = (double)(tv_end.tv_sec * 1000 + tv_end.tv_usec / 1000)
 	    / (double) j;
 	fprintf(stderr, "\t\t%7d templates: %.4f ms per packet\n",
 	    count, msperpkt);
 }
 
+/*
+ * Compares the old string based template lookup against the address
+ * index for the same set of random destinations.
+ */
+
+void
+template_test_lookup(int count)
+{
+	extern rand_t *honeyd_rand;
+	struct template *tmpl;
+	struct timeval tv_start, tv_end;
+	struct addr addr;
+	double msname, msaddr;
+	uint32_t seed;
+	int j;
+
+	addr_pton("10.0.0.0", &addr);
+	seed = rand_uint32(honeyd_rand);
+
+	gettimeofday(&tv_start, NULL);
+	for (j = 0; j < 80000; j++) {
+		addr.addr_ip = htonl(0x0a000000 | ((seed + j * 7919) % count + 1));
+		tmpl = template_find_best(addr_ntoa(&addr), NULL, 0);
+	}
+	gettimeofday(&tv_end, NULL);
+	timersub(&tv_end, &tv_start, &tv_end);
+	msname = (tv_end.tv_sec * 1000.0 + tv_end.tv_usec / 1000.0)
+	    / (double) j;
+
+	gettimeofday(&tv_start, NULL);
+	for (j = 0; j < 80000; j++) {
+		addr.addr_ip = htonl(0x0a000000 | ((seed + j * 7919) % count + 1));
+		tmpl = template_find_best_addr(addr.addr_ip, NULL, 0);
+	}
+	gettimeofday(&tv_end, NULL);
+	timersub(&tv_end, &tv_start, &tv_end);
+	msaddr = (tv_end.tv_sec * 1000.0 + tv_end.tv_usec / 1000.0)
+	    / (double) j;
+
+	/* Both lookups need to agree */
+	if (tmpl != template_find(addr_ntoa(&addr)))
+		errx(1, "%s: address index out of sync for %s",
+		    __func__, addr_ntoa(&addr));
+
+	fprintf(stderr, "\t\t%7d templates: lookup %.6f ms by name, "
+	    "%.6f ms by address\n", count, msname, msaddr);
+}
+
 void
 template_packet_test(void)
 {
 	extern void (*honeyd_delay_callback)(int, short, void *);
+	extern struct conlru tcplru;
 	void (*old)(int, short, void *) = honeyd_delay_callback;
 	struct evbuffer *evbuf = evbuffer_new();
+	struct tuple *hdr;
 	struct addr addr;
 	int i, count;
 
@@ -1099,16 +2386,23 @@ template_packet_test(void)
 
 	count = template_test_add(evbuf, &addr, 1);
 	template_test_measure(count);
+	template_test_lookup(count);
 	for (i = 0; i < 5; i++) {
 		count += template_test_add(evbuf, &addr,
 		    count == 1 ? 999 : 1000);
 		template_test_measure(count);
+		template_test_lookup(count);
 	}
 	for (i = 0; i < 50; i++) {
 		count += template_test_add(evbuf, &addr, 5000);
 		template_test_measure(count);
+		template_test_lookup(count);
 	}
 
+	/* The connections would outlive the test */
+	while ((hdr = TAILQ_FIRST(&tcplru)) != NULL)
+		tcp_free((struct tcp_con *)hdr);
+
 	honeyd_delay_callback = old;
 
 	evbuffer_free(evbuf);
@@ -1116,10 +2410,322 @@ template_packet_test(void)
 	fprintf(stderr, "\t%s: OK\n", __func__);
 }
 
+/* Clones share their ports until either side changes them */
+
+void
+template_share_test(void)
+{
+	struct evbuffer *evbuf = evbuffer_new();
+	struct template *tmpl, *one, *two;
+
+	MAKE_CONFIG("create sharetest");
+	MAKE_CONFIG("add sharetest tcp port 80 open");
+	MAKE_CONFIG("add sharetest udp port 53 open");
+	MAKE_CONFIG("bind 192.168.254.1 sharetest");
+	MAKE_CONFIG("bind 192.168.254.2 sharetest");
+
+	tmpl = template_find("sharetest");
+	one = template_find("192.168.254.1");
+	two = template_find("192.168.254.2");
+	if (one->portset != tmpl->portset || two->portset != tmpl->portset ||
+	    tmpl->portset->refcnt != 3)
+		errx(1, "%s: clones do not share their ports", __func__);
+
+	/* Changing a clone gives it its own ports */
+	MAKE_CONFIG("add 192.168.254.1 tcp port 22 open");
+	if (one->portset == tmpl->portset || one->portset->nports != 3 ||
+	    port_find(one, IP_PROTO_TCP, 80) == NULL ||
+	    port_find(tmpl, IP_PROTO_TCP, 22) != NULL ||
+	    tmpl->portset->refcnt != 2)
+		errx(1, "%s: bad copy on add", __func__);
+
+	/* Changing the template does not affect its clones */
+	MAKE_CONFIG("delete sharetest tcp port 80");
+	if (tmpl->portset == two->portset ||
+	    port_find(tmpl, IP_PROTO_TCP, 80) != NULL ||
+	    port_find(two, IP_PROTO_TCP, 80) == NULL ||
+	    two->portset->refcnt != 1)
+		errx(1, "%s: bad copy on delete", __func__);
+
+	evbuffer_drain(evbuf, -1);
+	template_print_memory(evbuf);
+
+	MAKE_CONFIG("delete 192.168.254.1");
+	MAKE_CONFIG("delete 192.168.254.2");
+	MAKE_CONFIG("delete sharetest");
+
+	evbuffer_free(evbuf);
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
+
+static struct template *
+template_dynamic_test_lookup(ip_addr_t dst, const char *src)
+{
+	struct ip_hdr ip;
+	struct addr addr;
+
+	memset(&ip, 0, sizeof(ip));
+	ip.ip_hl = sizeof(ip) >> 2;
+	ip.ip_p = IP_PROTO_UDP;
+	addr_pton(src, &addr);
+	ip.ip_src = addr.addr_ip;
+
+	return (template_find_best_addr(dst, &ip, sizeof(ip)));
+}
+
+/* The SYN is fingerprinted by the packet hook as if it came in */
+
+static struct template *
+template_dynamic_test_syn(ip_addr_t dst, const char *src)
+{
+	extern void honeyd_osfp_input(struct tuple *, u_char *, u_int, void *);
+	u_char pkt[IP_HDR_LEN + TCP_HDR_LEN];
+	struct ip_hdr *ip = (struct ip_hdr *)pkt;
+	struct addr addr;
+
+	addr_pton(src, &addr);
+	memset(pkt, 0, sizeof(pkt));
+	ip_pack_hdr(pkt, 0, sizeof(pkt), 1, 0, 64, IP_PROTO_TCP,
+	    addr.addr_ip, dst);
+	tcp_pack_hdr(pkt + IP_HDR_LEN, 1024, 80, 1, 0, TH_SYN, 16384, 0);
+
+	honeyd_osfp_input(NULL, pkt, sizeof(pkt), NULL);
+	return (template_find_best_addr(dst, ip, sizeof(pkt)));
+}
+
+static void
+template_dynamic_test(void)
+{
+	struct evbuffer *evbuf = evbuffer_new();
+	struct template *tmpl, *one, *two;
+	struct addr dst;
+	uint64_t hits;
+
+	MAKE_CONFIG("create dyntesta");
+	MAKE_CONFIG("create dyntestb");
+	MAKE_CONFIG("dynamic dyntest");
+	MAKE_CONFIG("add dyntest use dyntesta if source ip = 10.1.0.0/16");
+	MAKE_CONFIG("add dyntest otherwise use dyntestb");
+	MAKE_CONFIG("bind 192.168.252.1 dyntest");
+
+	addr_pton("192.168.252.1", &dst);
+	tmpl = template_find_addr(dst.addr_ip);
+
+	one = template_dynamic_test_lookup(dst.addr_ip, "10.1.2.3");
+	two = template_dynamic_test_lookup(dst.addr_ip, "10.2.0.1");
+	if (one == NULL || two == NULL || strstr(one->name, "dyntesta") == NULL ||
+	    strstr(two->name, "dyntestb") == NULL)
+		errx(1, "%s: wrong templates picked", __func__);
+
+	/* Repeated traffic does not evaluate the conditions */
+	if (template_dynamic_test_lookup(dst.addr_ip, "10.1.2.3") != one ||
+	    template_dynamic_test_lookup(dst.addr_ip, "10.2.0.1") != two ||
+	    tmpl->dyncache->hits != 2 || tmpl->dyncache->misses != 2)
+		errx(1, "%s: decisions were not cached", __func__);
+
+	/* New conditions forget the old decisions */
+	MAKE_CONFIG("add 192.168.252.1 use dyntestb if source ip = 10.1.2.3");
+	if (tmpl->dyncache != NULL ||
+	    template_dynamic_test_lookup(dst.addr_ip, "10.1.2.3") != one)
+		errx(1, "%s: decisions not flushed", __func__);
+
+	/* Only SYN segments are fingerprinted again */
+	MAKE_CONFIG("dynamic dyntestos");
+	MAKE_CONFIG("add dyntestos use dyntesta if source os = \"Windows\"");
+	MAKE_CONFIG("add dyntestos otherwise use dyntestb");
+	MAKE_CONFIG("bind 192.168.252.2 dyntestos");
+
+	addr_pton("192.168.252.2", &dst);
+	tmpl = template_find_addr(dst.addr_ip);
+	two = template_dynamic_test_lookup(dst.addr_ip, "10.4.0.1");
+	if (strstr(two->name, "dyntestb") == NULL ||
+	    template_dynamic_test_lookup(dst.addr_ip, "10.4.0.1") != two ||
+	    tmpl->dyncache->hits != 1 || tmpl->dyncache->misses != 1)
+		errx(1, "%s: fingerprint decisions were not cached", __func__);
+
+	/* The SYN gives the source fingerprints, which its packets remember */
+	template_dynamic_test_syn(dst.addr_ip, "10.4.0.1");
+	template_dynamic_test_lookup(dst.addr_ip, "10.4.0.1");
+	hits = tmpl->dyncache->hits;
+	template_dynamic_test_lookup(dst.addr_ip, "10.4.0.1");
+	if (tmpl->dyncache->hits != hits + 1)
+		errx(1, "%s: remembered fingerprints not cached", __func__);
+
+	/* Fingerprints of other sources do not affect the decision */
+	template_dynamic_test_syn(dst.addr_ip, "10.4.0.2");
+	hits = tmpl->dyncache->hits;
+	if (template_dynamic_test_lookup(dst.addr_ip, "10.4.0.1") != two ||
+	    tmpl->dyncache->hits != hits + 1)
+		errx(1, "%s: decision lost to another source", __func__);
+
+	MAKE_CONFIG("delete 192.168.252.2");
+	MAKE_CONFIG("delete dyntestos");
+	MAKE_CONFIG("delete 192.168.252.1");
+	MAKE_CONFIG("delete dyntest");
+	MAKE_CONFIG("delete dyntestb");
+	MAKE_CONFIG("delete dyntesta");
+
+	evbuffer_free(evbuf);
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
+
+static void
+template_reload_write(const char *filename, const char *config)
+{
+	FILE *fp;
+
+	if ((fp = fopen(filename, "w")) == NULL)
+		err(1, "%s: fopen(%s)", __func__, filename);
+	fprintf(fp, "%s", config);
+	fclose(fp);
+}
+
+/* Sends a UDP packet from the outside to dst */
+
+static void
+template_reload_packet(const char *dst)
+{
+	u_char pkt[IP_HDR_LEN + UDP_HDR_LEN];
+	struct addr src, addr;
+
+	addr_pton("192.0.2.1", &src);
+	addr_pton(dst, &addr);
+	memset(pkt, 0, sizeof(pkt));
+	ip_pack_hdr(pkt, 0, sizeof(pkt), 1, 0, 64, IP_PROTO_UDP,
+	    src.addr_ip, addr.addr_ip);
+	udp_pack_hdr(pkt + IP_HDR_LEN, 1024, 53, UDP_HDR_LEN);
+	ip_checksum(pkt, sizeof(pkt));
+
+	honeyd_input(NULL, (struct ip_hdr *)pkt, sizeof(pkt));
+}
+
+static void
+template_reload_test(void)
+{
+	extern struct pool *pool_delay;
+	char filename[] = "/tmp/honeyd_reload.XXXXXX";
+	struct template *base, *other, *one, *two;
+	struct router *r;
+	struct addr addr;
+	int fd, delays;
+
+	if ((fd = mkstemp(filename)) == -1)
+		err(1, "%s: mkstemp", __func__);
+	close(fd);
+
+	template_free_all(TEMPLATE_FREE_REGULAR);
+	router_end();
+
+	template_reload_write(filename,
+	    "create reloadtest\n"
+	    "add reloadtest tcp port 80 open\n"
+	    "create other\n"
+	    "add other tcp port 22 open\n"
+	    "bind 192.168.253.1 reloadtest\n"
+	    "bind 192.168.253.2 reloadtest\n"
+	    "bind 192.168.253.3 other\n"
+	    "route entry 10.253.0.1 network 10.253.0.0/16\n"
+	    "route 10.253.0.1 link 10.253.0.0/24\n");
+	if (config_reload(filename) == -1)
+		errx(1, "%s: initial reload failed", __func__);
+
+	base = template_find("reloadtest");
+	other = template_find("other");
+	one = template_find("192.168.253.1");
+	two = template_find("192.168.253.2");
+	addr_pton("10.253.0.1", &addr);
+	r = router_find(&addr);
+	if (base == NULL || other == NULL || one == NULL || two == NULL ||
+	    r == NULL)
+		errx(1, "%s: configuration incomplete", __func__);
+
+	/* A live connection holds on to its template */
+	template_ref(two);
+
+	template_reload_write(filename,
+	    "create reloadtest\n"
+	    "add reloadtest tcp port 80 open\n"
+	    "create other\n"
+	    "add other tcp port 22 open\n"
+	    "add other udp port 53 open\n"
+	    "bind 192.168.253.1 reloadtest\n"
+	    "bind 192.168.253.4 other\n"
+	    "route entry 10.253.0.1 network 10.253.0.0/16\n"
+	    "route 10.253.0.1 link 10.253.0.0/24\n");
+	if (config_reload(filename) == -1)
+		errx(1, "%s: reload failed", __func__);
+
+	if (template_find("reloadtest") != base ||
+	    template_find("192.168.253.1") != one)
+		errx(1, "%s: unchanged templates were replaced", __func__);
+	if (template_find("other") != other ||
+	    port_find(other, IP_PROTO_UDP, 53) == NULL)
+		errx(1, "%s: changed template not updated", __func__);
+	if (template_find("192.168.253.2") != NULL ||
+	    template_find("192.168.253.3") != NULL ||
+	    template_find("192.168.253.4") == NULL)
+		errx(1, "%s: bindings not reloaded", __func__);
+	if (router_find(&addr) != r)
+		errx(1, "%s: unchanged routes were replaced", __func__);
+
+	/* The removed template is still around for the connection */
+	if (two->refcnt != 1 || port_find(two, IP_PROTO_TCP, 80) == NULL)
+		errx(1, "%s: removed template freed too early", __func__);
+	template_free(two);
+
+	/* A broken configuration leaves everything in place */
+	template_reload_write(filename,
+	    "create reloadtest\n"
+	    "bind 192.168.253.1 nosuchtemplate\n");
+	if (config_reload(filename) != -1)
+		errx(1, "%s: broken configuration accepted", __func__);
+	if (template_find("reloadtest") != base ||
+	    template_find("192.168.253.1") != one ||
+	    template_find("192.168.253.4") == NULL ||
+	    router_find(&addr) != r)
+		errx(1, "%s: running configuration lost", __func__);
+
+	/* Packets waiting for a link go away with the old routes */
+	template_reload_write(filename,
+	    "create reloadtest\n"
+	    "bind 10.253.1.5 reloadtest\n"
+	    "route entry 10.253.0.1 network 10.253.0.0/16\n"
+	    "route 10.253.0.1 add net 10.253.1.0/24 10.253.1.1 "
+	    "latency 100ms bandwidth 10Kbps\n"
+	    "route 10.253.1.1 link 10.253.1.0/24\n");
+	if (config_reload(filename) == -1)
+		errx(1, "%s: reload with slow link failed", __func__);
+	delays = pool_delay->nalloc;
+	template_reload_packet("10.253.1.5");
+	if (pool_delay->nalloc != delays + 1)
+		errx(1, "%s: packet not queued on the link", __func__);
+
+	template_reload_write(filename,
+	    "create reloadtest\n"
+	    "bind 10.253.1.5 reloadtest\n"
+	    "route entry 10.253.0.1 network 10.253.0.0/16\n"
+	    "route 10.253.0.1 link 10.253.1.0/24\n");
+	if (config_reload(filename) == -1)
+		errx(1, "%s: reload without slow link failed", __func__);
+	if (pool_delay->nalloc != delays)
+		errx(1, "%s: queued packet not freed", __func__);
+
+	template_free_all(TEMPLATE_FREE_REGULAR);
+	router_end();
+	unlink(filename);
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
+
 void
 template_test(void)
 {
 	setlogmask(LOG_UPTO(LOG_NOTICE));
 
+	template_share_test();
+	template_dynamic_test();
 	template_packet_test();
+	template_reload_test();
 }
@@ -79,7 +79,9 @@ send_fd(int socket, int fd, void *base, size_t len)
 	msg.msg_iovlen = 1;
 
 	if ((n = sendmsg(socket, &msg, 0)) == -1) {
-		if (errno == EAGAIN)
+		/* The receiver may be busy or may have gone away */
+		if (errno == EAGAIN || errno == ENOBUFS ||
+		    errno == EPIPE || errno == ECONNRESET)
 			return (-1);
 		err(1, "%s: sendmsg(%d): %s", __func__, fd, strerror(errno));
 	}
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2002, 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include "config.h"
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dnet.h>
+
+#undef timeout_pending
+#undef timeout_initialized
+
+#include <event2/event.h>
+
+#include "honeyd.h"
+#include "flow.h"
+
+#define FLOW_EQUAL(a, b) \
+	((a)->ip_src == (b)->ip_src && (a)->ip_dst == (b)->ip_dst && \
+	 (a)->sport == (b)->sport && (a)->dport == (b)->dport)
+
+/*
+ * Mixes the 4-tuple with the per-table seed, so that an attacker can not
+ * predict which connections collide.
+ */
+static __inline uint32_t
+flow_hash(const struct flowtable *ft, const struct tuple *hdr)
+{
+	uint32_t h = ft->seed;
+
+	h ^= hdr->ip_src;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h ^= hdr->ip_dst;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	h ^= ((uint32_t)hdr->sport << 16) | hdr->dport;
+
+	/* Final avalanche */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return (h);
+}
+
+static void
+flow_place(struct flowslot *slots, uint32_t mask, uint32_t hash,
+    struct tuple *hdr)
+{
+	uint32_t i = hash & mask;
+
+	while (slots[i].hdr != NULL)
+		i = (i + 1) & mask;
+	slots[i].hash = hash;
+	slots[i].hdr = hdr;
+}
+
+static void
+flow_resize(struct flowtable *ft, uint32_t size)
+{
+	struct flowslot *slots, *old = ft->slots;
+	uint32_t i;
+
+	if ((slots = calloc(size, sizeof(struct flowslot))) == NULL)
+		err(1, "%s: calloc", __func__);
+
+	for (i = 0; i < ft->size; i++) {
+		if (old[i].hdr == NULL)
+			continue;
+		flow_place(slots, size - 1, old[i].hash, old[i].hdr);
+	}
+
+	free(old);
+	ft->slots = slots;
+	ft->size = size;
+}
+
+void
+flow_init(struct flowtable *ft, uint32_t seed)
+{
+	memset(ft, 0, sizeof(struct flowtable));
+	ft->seed = seed;
+	flow_resize(ft, FLOW_MINSIZE);
+}
+
+void
+flow_clear(struct flowtable *ft)
+{
+	free(ft->slots);
+	memset(ft, 0, sizeof(struct flowtable));
+}
+
+struct tuple *
+flow_find(struct flowtable *ft, const struct tuple *key)
+{
+	struct flowslot *slot;
+	uint32_t mask = ft->size - 1;
+	uint32_t hash = flow_hash(ft, key);
+	uint32_t i = hash & mask;
+
+	for (slot = &ft->slots[i]; slot->hdr != NULL;
+	    i = (i + 1) & mask, slot = &ft->slots[i]) {
+		if (slot->hash == hash && FLOW_EQUAL(slot->hdr, key))
+			return (slot->hdr);
+	}
+
+	return (NULL);
+}
+
+/*
+ * The caller needs to make sure that the tuple is not in the table yet.
+ * The table is kept at most half full to keep probe sequences short.
+ */
+void
+flow_insert(struct flowtable *ft, struct tuple *hdr)
+{
+	if ((ft->count + 1) * 2 > ft->size)
+		flow_resize(ft, ft->size * 2);
+
+	flow_place(ft->slots, ft->size - 1, flow_hash(ft, hdr), hdr);
+	ft->count++;
+}
+
+/*
+ * Removes a tuple by shifting the following entries of its probe
+ * sequence backwards.  This keeps lookups correct without tombstones.
+ */
+void
+flow_remove(struct flowtable *ft, struct tuple *hdr)
+{
+	struct flowslot *slots = ft->slots;
+	uint32_t mask = ft->size - 1;
+	uint32_t i, j, k;
+
+	for (i = flow_hash(ft, hdr) & mask; slots[i].hdr != hdr;
+	    i = (i + 1) & mask) {
+		if (slots[i].hdr == NULL)
+			errx(1, "%s: %s not in table",
+			    __func__, honeyd_contoa(hdr));
+	}
+
+	for (j = i;;) {
+		j = (j + 1) & mask;
+		if (slots[j].hdr == NULL)
+			break;
+		k = slots[j].hash & mask;
+
+		/* Entries whose home lies cyclically in (i, j] stay put */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+
+		slots[i] = slots[j];
+		i = j;
+	}
+	slots[i].hdr = NULL;
+	ft->count--;
+
+	/* Give memory back after a flood has passed */
+	if (ft->size > FLOW_MINSIZE && ft->count * 8 < ft->size)
+		flow_resize(ft, ft->size / 2);
+}
+
+/* Unittests */
+
+SPLAY_HEAD(flowbench, tuple);
+SPLAY_PROTOTYPE(flowbench, tuple, node, conhdr_compare);
+SPLAY_GENERATE(flowbench, tuple, node, conhdr_compare);
+
+#define FLOW_ELAPSED(start, count) do { \
+	struct timeval tv_end; \
+	gettimeofday(&tv_end, NULL); \
+	timersub(&tv_end, &(start), &tv_end); \
+	elapsed = (tv_end.tv_sec * 1000000.0 + tv_end.tv_usec) / (count); \
+} while (0)
+
+/*
+ * Simulates a SYN flood against a single port, followed by lookups of
+ * established flows, and compares the hash table to a splay tree.
+ */
+static void
+flow_test_bench(int count)
+{
+	extern rand_t *honeyd_rand;
+	struct flowbench root;
+	struct flowtable ft;
+	struct tuple *hdrs, tmp;
+	struct timeval tv_start;
+	double elapsed, splay_insert, splay_find, hash_insert, hash_find;
+	int i, pass;
+
+	if ((hdrs = calloc(count, sizeof(struct tuple))) == NULL)
+		err(1, "%s: calloc", __func__);
+
+	for (i = 0; i < count; i++) {
+		hdrs[i].ip_src = rand_uint32(honeyd_rand);
+		hdrs[i].ip_dst = htonl(0x0a000001);
+		hdrs[i].sport = rand_uint16(honeyd_rand);
+		hdrs[i].dport = 80;
+		hdrs[i].type = SOCK_STREAM;
+	}
+
+	SPLAY_INIT(&root);
+	gettimeofday(&tv_start, NULL);
+	for (i = 0; i < count; i++)
+		SPLAY_INSERT(flowbench, &root, &hdrs[i]);
+	FLOW_ELAPSED(tv_start, count);
+	splay_insert = elapsed;
+
+	gettimeofday(&tv_start, NULL);
+	for (pass = 0; pass < 4; pass++) {
+		for (i = 0; i < count; i++) {
+			tmp = hdrs[(i * 7919) % count];
+			if (SPLAY_FIND(flowbench, &root, &tmp) == NULL)
+				errx(1, "%s: splay lookup failed", __func__);
+		}
+	}
+	FLOW_ELAPSED(tv_start, count * pass);
+	splay_find = elapsed;
+
+	flow_init(&ft, rand_uint32(honeyd_rand));
+	gettimeofday(&tv_start, NULL);
+	for (i = 0; i < count; i++) {
+		/* A colliding random tuple would confuse the removal check */
+		if (flow_find(&ft, &hdrs[i]) != NULL)
+			continue;
+		flow_insert(&ft, &hdrs[i]);
+	}
+	FLOW_ELAPSED(tv_start, count);
+	hash_insert = elapsed;
+
+	gettimeofday(&tv_start, NULL);
+	for (pass = 0; pass < 4; pass++) {
+		for (i = 0; i < count; i++) {
+			tmp = hdrs[(i * 7919) % count];
+			if (flow_find(&ft, &tmp) == NULL)
+				errx(1, "%s: hash lookup failed", __func__);
+		}
+	}
+	FLOW_ELAPSED(tv_start, count * pass);
+	hash_find = elapsed;
+
+	/* Remove every other flow and make sure the rest is still there */
+	for (i = 0; i < count; i += 2) {
+		if (flow_find(&ft, &hdrs[i]) == &hdrs[i])
+			flow_remove(&ft, &hdrs[i]);
+	}
+	for (i = 0; i < count; i++) {
+		struct tuple *hdr = flow_find(&ft, &hdrs[i]);
+		if (i % 2 == 0 && hdr == &hdrs[i])
+			errx(1, "%s: removed flow still present", __func__);
+		if (i % 2 == 1 && hdr == NULL)
+			errx(1, "%s: flow lost after removal", __func__);
+	}
+	for (i = 1; i < count; i += 2) {
+		if (flow_find(&ft, &hdrs[i]) == &hdrs[i])
+			flow_remove(&ft, &hdrs[i]);
+	}
+	if (ft.count != 0 || ft.size != FLOW_MINSIZE)
+		errx(1, "%s: table did not shrink: %u/%u",
+		    __func__, ft.count, ft.size);
+
+	flow_clear(&ft);
+	free(hdrs);
+
+	fprintf(stderr, "\t\t%7d flows: insert %.3f us splay, %.3f us hash; "
+	    "lookup %.3f us splay, %.3f us hash\n", count,
+	    splay_insert, hash_insert, splay_find, hash_find);
+}
+
+void
+flow_test(void)
+{
+	flow_test_bench(1000);
+	flow_test_bench(HONEYD_MAX_CONNECTS);
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
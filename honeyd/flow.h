@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2002, 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef _FLOW_H_
+#define _FLOW_H_
+
+/*
+ * Connection state is kept in an open addressing hash table keyed by
+ * the 4-tuple.  Each slot caches the hash value, so that probing rarely
+ * has to touch the connection itself.
+ */
+
+struct flowslot {
+	uint32_t hash;
+	struct tuple *hdr;	/* NULL if the slot is empty */
+};
+
+struct flowtable {
+	struct flowslot *slots;
+	uint32_t size;		/* always a power of two */
+	uint32_t count;
+	uint32_t seed;
+};
+
+#define FLOW_MINSIZE	256
+
+void flow_init(struct flowtable *, uint32_t);
+void flow_clear(struct flowtable *);
+struct tuple *flow_find(struct flowtable *, const struct tuple *);
+void flow_insert(struct flowtable *, struct tuple *);
+void flow_remove(struct flowtable *, struct tuple *);
+
+void flow_test(void);
+
+#endif /* _FLOW_H_ */
@@ -46,6 +46,7 @@
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/tree.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/queue.h>
 
@@ -77,13 +78,18 @@
 #include "subsystem.h"
 #include "personality.h"
 #include "xprobe_assoc.h"
+#include "perscache.h"
+#include "snapshot.h"
 #include "ipfrag.h"
 #include "router.h"
 #include "network.h"
+#include "flow.h"
 #include "tcp.h"
 #include "udp.h"
 #include "hooks.h"
 #include "pool.h"
+#include "sendq.h"
+#include "cmdpool.h"
 #include "plugins_config.h"
 #include "plugins.h"
 #include "interface.h"
@@ -118,18 +124,22 @@ static void honeyd_init(void);
 static int honeyd_webserver_enabled(void);
 #endif
 static void honeyd_exit(int);
+static void honeyd_workers_stop(void);
 static void honeyd_ether_cb(struct arp_req *, int, void *);
-static void honeyd_deliver_ethernet(struct interface *, struct addr *, struct addr *, struct addr *, struct ip_hdr *, u_int);
-static struct ip_hdr *honeyd_delay_own_memory(struct delay *, struct ip_hdr *, u_int);
+static struct ip_hdr *honeyd_pkt_copy(struct ip_hdr *, u_int, enum pktcopy);
+static void honeyd_deliver_ethernet(struct interface *, struct addr *, struct addr *, struct addr *, struct ip_hdr *, u_int, int);
 static inline void honeyd_send_normally(struct ip_hdr *ip, u_int);
 static void honeyd_delay_cb(evutil_socket_t, short, void *);
-static void honeyd_delay_packet(struct template *, struct ip_hdr *, u_int, const struct addr *, const struct addr *, int, int, struct spoof);
-static void connection_insert(struct tree *, struct conlru *, struct tuple *);
-static void connection_remove(struct tree *, struct conlru *, struct tuple *);
+static void honeyd_delay_packet(struct template *, struct ip_hdr *, u_int, const struct addr *, const struct addr *, int, int, struct spoof, struct pktctx *);
+static struct delayq *honeyd_delayq_new(void);
+static struct template *honeyd_ctx_src(struct pktctx *, struct ip_hdr *, u_int);
+static struct template *honeyd_ctx_dst(struct pktctx *, struct ip_hdr *, u_int);
+static void connection_insert(struct flowtable *, struct conlru *, struct tuple *);
+static void connection_remove(struct flowtable *, struct conlru *, struct tuple *);
 static void connection_update(struct conlru *, struct tuple *);
-static void tcp_retrans_timeout(evutil_socket_t, short, void *);
-static void honeyd_tcp_timeout(evutil_socket_t, short, void *);
-static void honeyd_udp_timeout(evutil_socket_t, short, void *);
+static void tcp_retrans_timeout(void *);
+static void honeyd_tcp_timeout(void *);
+static void honeyd_udp_timeout(void *);
 static int honeyd_block(struct template *, int, int);
 static void honeyd_varexpand(struct tcp_con *, char *, u_int);
 static struct action *honeyd_port(struct template *, int, u_short);
@@ -142,7 +152,7 @@ static void tcp_recv_cb(struct template *, u_char *, u_short);
 static void udp_recv_cb(struct template *, u_char *, u_short);
 static void icmp_recv_cb(struct template *, u_char *, u_short);
 static inline int honeyd_router_drop(struct link_drop *, struct timeval *);
-static enum forward honeyd_route_packet(struct ip_hdr *, u_int, struct addr *, struct addr *, int *);
+static enum forward honeyd_route_packet(struct ip_hdr *, u_int, struct addr *, struct addr *, int *, struct pktctx *);
 static void honeyd_sigchld(evutil_socket_t, short, void *);
 static void honeyd_signal(evutil_socket_t, short, void *);
 static void honeyd_sighup(evutil_socket_t, short, void *);
@@ -150,9 +160,10 @@ static void honeyd_sigusr(evutil_socket_t, short, void *);
 static void unittest(void);
 int main(int argc, char *[]); /* NOT STATIC */
 
-struct tree tcpcons;
+struct flowtable tcpcons;
 struct conlru tcplru;
-struct tree udpcons;
+struct tcpquietq tcpquiet;
+struct flowtable udpcons;
 struct conlru udplru;
 
 struct spoof no_spoof;	/* spoof settings for default packet processing */
@@ -170,8 +181,8 @@ struct stats_network stats_network = {
 	0	/* output bytes */
 };
 
-SPLAY_PROTOTYPE(tree, tuple, node, conhdr_compare);
-SPLAY_GENERATE(tree, tuple, node, conhdr_compare);
+struct stats_copy stats_copy;
+struct stats_admit stats_admit;
 
 /* The global event_base used by all events for the honeypot */
 struct event_base	*honeyd_base_ev;
@@ -185,9 +196,20 @@ static FILE		*honeyd_logfp;
 static ip_t		*honeyd_ip;
 struct pool		*pool_pkt;
 struct pool		*pool_delay;
+static struct delayq	*honeyd_delayq;		/* not waiting for a link */
+struct pool		*pool_tcp;
+struct pool		*pool_tcpbuf;
+struct pool		*pool_udp;
+struct pool		*pool_conbuffer;
+struct pool		*pool_tcpsource;
 rand_t			*honeyd_rand;
+static int		 honeyd_setrand;	/* for regression tests */
 int			 honeyd_sig;
 int			 honeyd_nconnects;
+int			 honeyd_nhalfopen;	/* waiting for our SYN-ACK */
+int			 honeyd_syncookies = -1;
+int			 honeyd_max_source_connections;
+int			 honeyd_max_template_connections;
 int			 honeyd_nchildren;
 int			 honeyd_ttl = HONEYD_DFL_TTL;
 struct tcp_con		 honeyd_tmp;
@@ -203,16 +225,29 @@ int			 honeyd_disable_webserver = 0;
 int			 honeyd_disable_update = 0;
 int			 honeyd_ignore_parse_errors = 0;
 int			 honeyd_verify_config = 0;
+static int		 honeyd_compile_config = 0;
 int			 honeyd_webserver_fix_permissions = 0;
 char			*honeyd_webserver_address = "127.0.0.1";
 int			 honeyd_webserver_port = 80;
 char			*honeyd_webserver_root = PATH_HONEYDDATA \
 						"/webserver/htdocs";
 char			*honeyd_rrdtool_path = PATH_RRDTOOL;
+size_t			 honeyd_pool_maxmem = HONEYD_POOL_MAXMEM;
+size_t			 honeyd_udp_maxmem = HONEYD_UDP_MAXMEM;
+int			 honeyd_send_batch = SENDQ_MAXBATCH;
+int			 honeyd_nworkers = 1;
+int			 honeyd_worker;		/* 0 in the first process */
+static pid_t		 honeyd_worker_pids[HONEYD_MAX_WORKERS];
+int			 honeyd_send_latency = 0;	/* usec */
+int			 honeyd_script_workers = 0;
 
 /* can be used by unittests to do bad stuff */
 void (*honeyd_delay_callback)(evutil_socket_t, short, void *) = honeyd_delay_cb;
 
+/* Template lookups performed and avoided by the packet context */
+static uint64_t		 honeyd_ctx_lookups;
+static uint64_t		 honeyd_ctx_saved;
+
 static char		*logfile = NULL;	/* Log file names */
 static char		*servicelog = NULL;
 
@@ -225,6 +260,19 @@ static struct option honeyd_long_opts[] = {
 	{"webserver-port", required_argument, NULL, 'W'},
 	{"webserver-root", required_argument, NULL, 'X'},
 	{"rrdtool-path", required_argument, NULL, 'Y'},
+	{"pool-memory", required_argument, NULL, 'M'},
+	{"udp-memory", required_argument, NULL, 'U'},
+	{"capture-ring", required_argument, NULL, 'B'},
+	{"send-batch", required_argument, NULL, 'Q'},
+	{"send-latency", required_argument, NULL, 'L'},
+	{"workers", required_argument, NULL, 'w'},
+	{"script-workers", required_argument, NULL, 'K'},
+	{"syn-cookies", required_argument, NULL, 'C'},
+	{"max-source-connections", required_argument, NULL, 'N'},
+	{"max-template-connections", required_argument, NULL, 'O'},
+	{"fingerprint-cache", required_argument, NULL, 'F'},
+	{"config-snapshot", required_argument, NULL, 'S'},
+	{"compile-config", 0, &honeyd_compile_config, 1},
 	{"disable-webserver", 0, &honeyd_disable_webserver, 1},
 	{"disable-update", 0, &honeyd_disable_update, 1},
 	{"verify-config", 0, &honeyd_verify_config, 1},
@@ -257,6 +305,19 @@ usage(void)
 	    "  --webserver-root=path  Root of document tree.\n"
 	    "  --fix-webserver-permissions Change ownership and permissions.\n"
 	    "  --rrdtool-path=path    Path to rrdtool.\n"
+	    "  --pool-memory=MB       Memory each pool keeps after bursts.\n"
+	    "  --udp-memory=MB        Memory for datagrams waiting for scripts.\n"
+	    "  --capture-ring=MB      Capture into a ring of MB megabytes.\n"
+	    "  --send-batch=count     Packets sent with one system call.\n"
+	    "  --send-latency=usec    Longest time a packet waits to be sent.\n"
+	    "  --workers=count        Process packets in count processes.\n"
+	    "  --script-workers=count Start scripts from count workers per port.\n"
+	    "  --syn-cookies=count    SYN cookies above count half-open connections.\n"
+	    "  --max-source-connections=count TCP connections per source address.\n"
+	    "  --max-template-connections=count TCP connections per template.\n"
+	    "  --fingerprint-cache=file Cache parsed fingerprints in file.\n"
+	    "  --config-snapshot=file Start from a compiled configuration.\n"
+	    "  --compile-config       Write the configuration snapshot then exit.\n"
 	    "  --disable-webserver    Disables internal webserver\n"
 	    "  --disable-update       Disables checking for security fixes.\n"
 	    "  --verify-config        Verify configuration file then exit.\n"
@@ -325,9 +386,9 @@ honeyd_setudp(struct udp_con *con, struct ip_hdr *ip, struct udp_hdr *udp,
 }
 
 struct tuple *
-tuple_find(struct tree *root, struct tuple *key)
+tuple_find(struct flowtable *ft, struct tuple *key)
 {
-	return SPLAY_FIND(tree, root, key);
+	return flow_find(ft, key);
 }
 
 /* extern */
@@ -471,9 +532,10 @@ honeyd_init(void)
 	}
 
 	/* Initalize ongoing connection state */
-	SPLAY_INIT(&tcpcons);
+	flow_init(&tcpcons, rand_uint32(honeyd_rand));
 	TAILQ_INIT(&tcplru);
-	SPLAY_INIT(&udpcons);
+	TAILQ_INIT(&tcpquiet);
+	flow_init(&udpcons, rand_uint32(honeyd_rand));
 	TAILQ_INIT(&udplru);
 
 	memset(&honeyd_tmp, 0, sizeof(honeyd_tmp));
@@ -521,6 +583,12 @@ honeyd_exit(int status)
 	honeyd_logend(honeyd_logfp);
 	honeyd_logend(honeyd_servicefp);
 
+	sendq_flush();
+
+	/* The first worker takes all other workers down with it */
+	if (honeyd_worker == 0)
+		honeyd_workers_stop();
+
 	template_free_all(TEMPLATE_FREE_DEALLOCATE);
 
 	interface_close_all();
@@ -528,7 +596,8 @@ honeyd_exit(int status)
 	rand_close(honeyd_rand);
 	ip_close(honeyd_ip);
 	closelog();
-	unlink(PIDFILE);
+	if (honeyd_worker == 0)
+		unlink(PIDFILE);
 
 #ifdef HAVE_PYTHON
 	if (honeyd_is_webserver_enabled())
@@ -540,11 +609,10 @@ honeyd_exit(int status)
 
 /* Encapsulate a packet into Ethernet */
 static void
-honeyd_ether_cb(struct arp_req *req, int success, void *arg)
+honeyd_ether_send(struct arp_req *req, struct ip_hdr *ip)
 {
 	u_char pkt[HONEYD_MTU + 40]; /* XXX - Enough? */
 	struct interface *inter = req->inter;
-	struct ip_hdr *ip = arg;
 	u_int len, iplen = ntohs(ip->ip_len);
 
 	eth_pack_hdr(pkt,
@@ -556,27 +624,38 @@ honeyd_ether_cb(struct arp_req *req, int success, void *arg)
 	if (sizeof(pkt) < len) {
 		syslog(LOG_WARNING, "%s: IP packet is larger than buffer: %d",
 		    __func__, len);
-		goto out;
+		return;
 	}
 
 	memcpy(pkt + ETH_HDR_LEN, ip, iplen);
+	if (sendq_eth(inter, pkt, len) == 0)
+		return;
+
 	if (eth_send(inter->if_eth, pkt, len) != len) {
 		syslog(LOG_ERR, "%s: couldn't send packet size %d: %m",
 		    __func__, len);
 	} else {
 		count_increment(stats_network.output_bytes, iplen);
 	}
+}
 
- out:
+/* Called when the ARP request for a queued packet has been answered */
+static void
+honeyd_ether_cb(struct arp_req *req, int success, void *arg)
+{
+	struct ip_hdr *ip = arg;
+
+	honeyd_ether_send(req, ip);
 	pool_free(pool_pkt, ip);
 }
 
 /*
  * Delivers an IP packet to a specific interface.
- * Generates ARP request if necessary.
+ * Generates ARP request if necessary.  The packet is only copied if it
+ * has to wait for the ARP reply and the caller does not own the memory.
  */
 static void
-honeyd_deliver_ethernet(struct interface *inter, struct addr *src_pa, struct addr *src_ha, struct addr *dst_pa, struct ip_hdr *ip, u_int iplen)
+honeyd_deliver_ethernet(struct interface *inter, struct addr *src_pa, struct addr *src_ha, struct addr *dst_pa, struct ip_hdr *ip, u_int iplen, int owned)
 {
 	struct arp_req *req;
 
@@ -584,7 +663,10 @@ honeyd_deliver_ethernet(struct interface *inter, struct addr *src_pa, struct add
 
 	/* Ethernet delivery if possible */
 	if ((req = arp_find(dst_pa)) == NULL) {
+		if (!owned)
+			ip = honeyd_pkt_copy(ip, iplen, PKTCOPY_ARP);
 		arp_request(inter, src_pa, src_ha, dst_pa, honeyd_ether_cb,ip);
+		return;
 	} else if (req->cnt == -1) {
 		/*
 		 * The source MAC of the original requestor does not help
@@ -592,40 +674,83 @@ honeyd_deliver_ethernet(struct interface *inter, struct addr *src_pa, struct add
 		 * honeypot without causing any harm.
 		 */
 		req->src_ha = *src_ha;
-		honeyd_ether_cb(req, 1, ip);
-	} else {
-		/* 
-		 * Fall through in case that this packet needs
-		 * to be dropped.
-		 */
-		pool_free(pool_pkt, ip);
+		honeyd_ether_send(req, ip);
 	}
+
+	/* 
+	 * Fall through in case that this packet has been sent
+	 * or needs to be dropped.
+	 */
+	if (owned)
+		pool_free(pool_pkt, ip);
 }
 
 /*
- * Makes sure that we end up owning the memory referenced by
- * the delay descriptor.  We either tell to not free the
- * memory or just make our own copy.
+ * Copies a packet that needs to outlive the buffer it was received in.
  */
 static struct ip_hdr *
-honeyd_delay_own_memory(struct delay *delay, struct ip_hdr *ip, u_int iplen)
+honeyd_pkt_copy(struct ip_hdr *ip, u_int iplen, enum pktcopy type)
 {
-	/* If we are not supposed to free the buffer then we do not own it */
-	if (!(delay->flags & DELAY_FREEPKT)) {
-		void *tmp = pool_alloc(pool_pkt);
+	void *tmp;
 
-		memcpy(tmp, ip, iplen);
-		ip = tmp;
-	} else {
-		/* 
-		 * We are handling the memory ourselves: if we
-		 * delegate the memory to the ARP handler, it will get
-		 * freed later.
-		 */
-		delay->flags &= ~DELAY_FREEPKT;
+	if (iplen <= pool_pkt->size)
+		tmp = pool_alloc(pool_pkt);
+	else
+		tmp = pool_alloc_size(pool_pkt, iplen);
+
+	memcpy(tmp, ip, iplen);
+	honeyd_count_copy(type, iplen);
+
+	return (tmp);
+}
+
+void
+honeyd_print_packet_stats(struct evbuffer *buf)
+{
+	static const char *names[PKTCOPY_MAX] = {
+		"delay", "arp", "fragment"
+	};
+	int i;
+
+	evbuffer_add_printf(buf, "%-10s %12s %14s\n",
+	    "packets", "count", "bytes");
+	evbuffer_add_printf(buf, "%-10s %12llu %14s\n", "in place",
+	    (unsigned long long)stats_copy.inplace, "-");
+	for (i = 0; i < PKTCOPY_MAX; i++) {
+		evbuffer_add_printf(buf, "%-10s %12llu %14llu\n", names[i],
+		    (unsigned long long)stats_copy.copies[i],
+		    (unsigned long long)stats_copy.copybytes[i]);
 	}
-		
-	return (ip);
+}
+
+void
+honeyd_print_lookup_stats(struct evbuffer *buf)
+{
+	evbuffer_add_printf(buf, "%-20s %12llu\n", "template lookups",
+	    (unsigned long long)honeyd_ctx_lookups);
+	evbuffer_add_printf(buf, "%-20s %12llu\n", "lookups saved",
+	    (unsigned long long)honeyd_ctx_saved);
+}
+
+void
+honeyd_print_connection_stats(struct evbuffer *buf)
+{
+	evbuffer_add_printf(buf, "connections %d, half-open %d\n",
+	    honeyd_nconnects, honeyd_nhalfopen);
+	evbuffer_add_printf(buf, "%-20s %12llu\n", "cookies sent",
+	    (unsigned long long)stats_admit.cookies_sent);
+	evbuffer_add_printf(buf, "%-20s %12llu\n", "cookies accepted",
+	    (unsigned long long)stats_admit.cookies_accepted);
+	evbuffer_add_printf(buf, "%-20s %12llu\n", "cookies rejected",
+	    (unsigned long long)stats_admit.cookies_rejected);
+	evbuffer_add_printf(buf, "%-20s %12llu\n", "refused by source",
+	    (unsigned long long)stats_admit.refused_source);
+	evbuffer_add_printf(buf, "%-20s %12llu\n", "refused by template",
+	    (unsigned long long)stats_admit.refused_template);
+	evbuffer_add_printf(buf, "%-20s %12llu\n", "evicted without data",
+	    (unsigned long long)stats_admit.evicted_quiet);
+	evbuffer_add_printf(buf, "%-20s %12llu\n", "evicted oldest",
+	    (unsigned long long)stats_admit.evicted_oldest);
 }
 
 /*
@@ -651,6 +776,10 @@ honeyd_send_normally(struct ip_hdr *ip, u_int iplen)
 {
 	ip_checksum(ip, iplen);
 
+	/* The output queue sends the packet with the rest of the batch */
+	if (sendq_ip(ip, iplen) == 0)
+		return;
+
 	if (ip_send(honeyd_ip, ip, iplen) != iplen) {
 		int level = LOG_ERR;
 		if (errno == EHOSTDOWN || errno == EHOSTUNREACH)
@@ -695,12 +824,13 @@ honeyd_delay_cb(evutil_socket_t fd, short which, void *arg)
 			addr_pack(&src, ADDR_TYPE_IP, IP_ADDR_BITS,
 			    &ip->ip_src, IP_ADDR_LEN);
 
-			ip = honeyd_delay_own_memory(delay, ip, iplen);
-
 			/* This function computes the IP checksum for us */
 			honeyd_deliver_ethernet(tmpl->inter,
 			    &src, tmpl->ethernet_addr,
-			    &dst, ip, iplen);
+			    &dst, ip, iplen, delay->flags & DELAY_FREEPKT);
+
+			/* Ethernet delivery takes care of the memory */
+			delay->flags &= ~DELAY_FREEPKT;
 		} else {
 			honeyd_send_normally(ip, iplen);
 		}
@@ -730,28 +860,24 @@ honeyd_delay_cb(evutil_socket_t fd, short which, void *arg)
 			errx(1, "%s: bad configuration", __func__);
 
 		/* 
-		 * If we are routing for an external sender, then we
-		 * might have to copy the packet into an allocated
-		 * buffer.
+		 * If we are routing for an external sender, then the
+		 * packet is only copied if it needs to wait for ARP.
+		 * This function computes the IP checksum for us.
 		 */
-		
-		ip = honeyd_delay_own_memory(delay, ip, iplen);
-
-		/* This function computes the IP checksum for us */
 		honeyd_deliver_ethernet(inter,
 		    &router->addr, &inter->if_ent.intf_link_addr,
-		    &addr, ip, iplen);
+		    &addr, ip, iplen, delay->flags & DELAY_FREEPKT);
+		delay->flags &= ~DELAY_FREEPKT;
 	} else {
-		struct addr addr;
 		uint16_t ipoff;
 
 		template_free(tmpl);
 
-		addr_pack(&addr, ADDR_TYPE_IP, IP_ADDR_BITS,
-		    &ip->ip_dst, IP_ADDR_LEN);
-
 		/* Internal delivery */
-		tmpl = template_find_best(addr_ntoa(&addr), ip, iplen);
+		if (delay->ctx != NULL)
+			tmpl = honeyd_ctx_dst(delay->ctx, ip, iplen);
+		else
+			tmpl = template_find_best_addr(ip->ip_dst, ip, iplen);
 		tmpl = template_ref(tmpl);
 
 		/* Check for fragmentation */
@@ -774,15 +900,144 @@ honeyd_delay_cb(evutil_socket_t fd, short which, void *arg)
 		pool_free(pool_delay, delay);
 }
 
+static void
+honeyd_delayq_schedule(struct delayq *queue, struct timeval *now)
+{
+	struct delay *delay;
+	struct timeval tv;
+
+	if ((delay = TAILQ_FIRST(&queue->packets)) == NULL)
+		return;
+
+	if (timercmp(&delay->tv_due, now, >))
+		timersub(&delay->tv_due, now, &tv);
+	else
+		timerclear(&tv);
+	evtimer_add(queue->ev, &tv);
+}
+
+/* Delivers all packets of a queue that are due */
+static void
+honeyd_delayq_cb(evutil_socket_t fd, short which, void *arg)
+{
+	struct delayq *queue = arg;
+	struct delay *delay;
+	struct timeval now;
+
+	event_base_gettimeofday_cached(honeyd_base_ev, &now);
+
+	while ((delay = TAILQ_FIRST(&queue->packets)) != NULL &&
+	    !timercmp(&delay->tv_due, &now, >)) {
+		TAILQ_REMOVE(&queue->packets, delay, next);
+		(*honeyd_delay_callback)(-1, EV_TIMEOUT, delay);
+	}
+
+	honeyd_delayq_schedule(queue, &now);
+}
+
+static struct delayq *
+honeyd_delayq_new(void)
+{
+	struct delayq *queue;
+
+	if ((queue = calloc(1, sizeof(struct delayq))) == NULL)
+		err(1, "%s: calloc", __func__);
+	TAILQ_INIT(&queue->packets);
+
+	queue->ev = evtimer_new(honeyd_base_ev, honeyd_delayq_cb, queue);
+	if (queue->ev == NULL)
+		errx(1, "%s: evtimer_new", __func__);
+
+	return (queue);
+}
+
+/* Drops the packets that are still waiting and frees the queue */
+void
+honeyd_delayq_free(struct delayq *queue)
+{
+	struct delay *delay;
+
+	while ((delay = TAILQ_FIRST(&queue->packets)) != NULL) {
+		TAILQ_REMOVE(&queue->packets, delay, next);
+		if (delay->flags & DELAY_FREEPKT)
+			pool_free(pool_pkt, delay->ip);
+		template_free(delay->tmpl);
+		if (delay->flags & DELAY_NEEDFREE)
+			pool_free(pool_delay, delay);
+	}
+
+	event_free(queue->ev);
+	free(queue);
+}
+
+static void
+honeyd_delayq_insert(struct delayq *queue, struct delay *delay, int ms)
+{
+	struct delay *after;
+	struct timeval now, tv;
+
+	event_base_gettimeofday_cached(honeyd_base_ev, &now);
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	timeradd(&now, &tv, &delay->tv_due);
+
+	for (after = TAILQ_LAST(&queue->packets, delayqueue);
+	    after != NULL && timercmp(&after->tv_due, &delay->tv_due, >);
+	    after = TAILQ_PREV(after, delayqueue, next))
+		;
+
+	if (after != NULL) {
+		TAILQ_INSERT_AFTER(&queue->packets, after, delay, next);
+	} else {
+		/* The packet is due first; the timer needs to move */
+		TAILQ_INSERT_HEAD(&queue->packets, delay, next);
+		honeyd_delayq_schedule(queue, &now);
+	}
+}
+
+/*
+ * Return the template for the source or destination address of a packet.
+ * The result is remembered in the packet context, so that subsequent
+ * stages of the delivery pipeline do not have to repeat the lookup.
+ */
+static struct template *
+honeyd_ctx_src(struct pktctx *ctx, struct ip_hdr *ip, u_int iplen)
+{
+	if (ctx->flags & PKTCTX_SRC) {
+		honeyd_ctx_saved++;
+		return (ctx->src);
+	}
+
+	honeyd_ctx_lookups++;
+	ctx->src = template_find_best_addr(ip->ip_src, ip, iplen);
+	ctx->flags |= PKTCTX_SRC;
+	return (ctx->src);
+}
+
+static struct template *
+honeyd_ctx_dst(struct pktctx *ctx, struct ip_hdr *ip, u_int iplen)
+{
+	if (ctx->flags & PKTCTX_DST) {
+		honeyd_ctx_saved++;
+		return (ctx->dst);
+	}
+
+	honeyd_ctx_lookups++;
+	ctx->dst = template_find_best_addr(ip->ip_dst, ip, iplen);
+	ctx->flags |= PKTCTX_DST;
+	return (ctx->dst);
+}
+
 /*
  * Delays a packet for a specified amount of ms to simulate routing delay.
  * Host is used for the router that might generate a XCEED message.
+ * The packet context is only used for immediate delivery; a delayed
+ * packet might see a different configuration and is looked up again.
  */
 static void
-honeyd_delay_packet(struct template *tmpl, struct ip_hdr *ip, u_int iplen, const struct addr *src, const struct addr *dst, int ms, int flags, struct spoof spoof)
+honeyd_delay_packet(struct template *tmpl, struct ip_hdr *ip, u_int iplen, const struct addr *src, const struct addr *dst, int ms, int flags, struct spoof spoof, struct pktctx *ctx)
 {
 	struct delay *delay, tmp_delay;
-	struct timeval tv;
 
 	if (ms) {
 		delay = pool_alloc(pool_delay);
@@ -793,21 +1048,16 @@ honeyd_delay_packet(struct template *tmpl, struct ip_hdr *ip, u_int iplen, const
 		 * need to allocate it here.
 		 */
 		if ((flags & DELAY_FREEPKT) == 0) {
-			void *tmp;
-
-			if (iplen < HONEYD_MTU)
-				tmp = pool_alloc(pool_pkt);
-			else
-				tmp = pool_alloc_size(pool_pkt, iplen);
-
-			memcpy(tmp, ip, iplen);
-			ip = tmp;
-
+			ip = honeyd_pkt_copy(ip, iplen, PKTCOPY_DELAY);
 			flags |= DELAY_FREEPKT;
 		}
 	} else {
 		memset(&tmp_delay, 0, sizeof(tmp_delay));
 		delay = &tmp_delay;
+
+		/* Processed straight out of the buffer it arrived in */
+		if ((flags & DELAY_FREEPKT) == 0)
+			stats_copy.inplace++;
 	}
  	delay->ip = ip;
 	delay->iplen = iplen;
@@ -819,13 +1069,11 @@ honeyd_delay_packet(struct template *tmpl, struct ip_hdr *ip, u_int iplen, const
 	delay->tmpl = template_ref(tmpl);
 	delay->flags = flags;
 	delay->spoof = spoof;
+	delay->ctx = ms ? NULL : ctx;
 
 	if (ms) {
-		delay->timeout = evtimer_new(honeyd_base_ev, honeyd_delay_callback, delay);
-		timerclear(&tv);
-		tv.tv_sec = ms / 1000;
-		tv.tv_usec = (ms % 1000) * 1000;
-		evtimer_add(delay->timeout, &tv);
+		honeyd_delayq_insert(ctx != NULL && ctx->queue != NULL ?
+		    ctx->queue : honeyd_delayq, delay, ms);
 	} else
 		honeyd_delay_callback(-1, EV_TIMEOUT, delay);
 }
@@ -841,6 +1089,7 @@ honeyd_ip_send(u_char *pkt, u_int iplen, struct spoof spoof)
 {
 	struct template *tmpl = NULL;
 	struct ip_hdr *ip = (struct ip_hdr *)pkt;
+	struct pktctx ctx;
 	enum forward res = FW_EXTERNAL;
 	int delay = 0, flags = 0;
 	struct addr addr, src;
@@ -858,13 +1107,15 @@ print_spoof("honeyd_ip_send", spoof);
 	addr_pack(&addr, ADDR_TYPE_IP, IP_ADDR_BITS, &ip->ip_dst, IP_ADDR_LEN);
 	addr_pack(&src, ADDR_TYPE_IP, IP_ADDR_BITS, &ip->ip_src, IP_ADDR_LEN);
 
+	memset(&ctx, 0, sizeof(ctx));
+
 	/* Find the template for the external address */
-	tmpl = template_find_best(addr_ntoa(&addr), ip, iplen);
+	tmpl = honeyd_ctx_dst(&ctx, ip, iplen);
 	if (tmpl != NULL && tmpl->flags & TEMPLATE_EXTERNAL)
 		flags |= DELAY_ETHERNET;
 
 	/* But all sending decisions are really based on the source template */
-	tmpl = template_find_best(addr_ntoa(&src), ip, iplen);
+	tmpl = honeyd_ctx_src(&ctx, ip, iplen);
 
 	if (router_used) {
 		extern struct network *reverse;
@@ -884,10 +1135,13 @@ print_spoof("honeyd_ip_send", spoof);
 		if (addr_cmp(&src, &router->addr) == 0)
 			ip->ip_ttl++; /* XXX - Ugly hack */
 
-		if (spoof.new_src.addr_type != ADDR_TYPE_NONE)
+		if (spoof.new_src.addr_type != ADDR_TYPE_NONE) {
 			ip->ip_src = spoof.new_src.addr_ip;
+			/* Dynamic templates might depend on the source */
+			ctx.flags = 0;
+		}
 		res = honeyd_route_packet(ip, iplen, &router->addr, &addr,
-		    &delay);
+		    &delay, &ctx);
 		if (res == FW_DROP)
 			goto drop;
 	}
@@ -897,13 +1151,16 @@ print_spoof("honeyd_ip_send", spoof);
 	if (res == FW_EXTERNAL)
 		flags |= DELAY_EXTERNAL;
 	
-	if (spoof.new_src.addr_type != ADDR_TYPE_NONE)
+	if (spoof.new_src.addr_type != ADDR_TYPE_NONE) {
 		ip->ip_src = spoof.new_src.addr_ip;
+		ctx.flags = 0;
+	}
 	if (spoof.new_dst.addr_type != ADDR_TYPE_NONE)
 		ip->ip_dst = spoof.new_dst.addr_ip;
 
 	/* Delay the packet if necessary, otherwise deliver it directly */
-	honeyd_delay_packet(tmpl, ip, iplen, NULL, NULL, delay, flags, spoof);
+	honeyd_delay_packet(tmpl, ip, iplen, NULL, NULL, delay, flags, spoof,
+	    &ctx);
 	return;
 
  drop:
@@ -912,22 +1169,25 @@ print_spoof("honeyd_ip_send", spoof);
 }
 
 static void
-connection_insert(struct tree *tree, struct conlru *head, struct tuple *hdr)
+connection_insert(struct flowtable *ft, struct conlru *head, struct tuple *hdr)
 {
-	SPLAY_INSERT(tree, tree, hdr);
+	flow_insert(ft, hdr);
 	TAILQ_INSERT_HEAD(head, hdr, next);
 }
 
 static void
-connection_remove(struct tree *tree, struct conlru *head, struct tuple *hdr)
+connection_remove(struct flowtable *ft, struct conlru *head, struct tuple *hdr)
 {
-	SPLAY_REMOVE(tree, tree, hdr);
+	flow_remove(ft, hdr);
 	TAILQ_REMOVE(head, hdr, next);
 
-	evtimer_del(hdr->timeout);
+	timer_del(&hdr->timeout);
 }
 
-/* Called when a connection received data and has not been idle */
+/*
+ * Called when a connection received data and has not been idle.  Pushing
+ * the idle timeout out only records the new expiration in the wheel.
+ */
 
 static void
 connection_update(struct conlru *head, struct tuple *hdr)
@@ -935,7 +1195,150 @@ connection_update(struct conlru *head, struct tuple *hdr)
 	TAILQ_REMOVE(head, hdr, next);
 	TAILQ_INSERT_HEAD(head, hdr, next);
 
-	generic_timeout(hdr->timeout, HONEYD_IDLE_TIMEOUT);
+	timer_add(&hdr->timeout, HONEYD_IDLE_TIMEOUT * 1000);
+}
+
+/*
+ * Incoming connections per source address, only tracked with
+ * --max-source-connections.
+ */
+
+struct tcp_source {
+	SPLAY_ENTRY(tcp_source) node;
+
+	ip_addr_t addr;
+	int nconnects;
+	struct tcpquietq quiet;		/* of them, never received data */
+};
+
+static int
+tcp_source_compare(struct tcp_source *a, struct tcp_source *b)
+{
+	if (a->addr < b->addr)
+		return (-1);
+	if (a->addr > b->addr)
+		return (1);
+	return (0);
+}
+
+static SPLAY_HEAD(tcpsourcetree, tcp_source) tcpsources =
+    SPLAY_INITIALIZER(&tcpsources);
+SPLAY_PROTOTYPE(tcpsourcetree, tcp_source, node, tcp_source_compare);
+SPLAY_GENERATE(tcpsourcetree, tcp_source, node, tcp_source_compare);
+
+static struct tcp_source *
+tcp_source_find(ip_addr_t addr)
+{
+	struct tcp_source tmp;
+
+	tmp.addr = addr;
+	return (SPLAY_FIND(tcpsourcetree, &tcpsources, &tmp));
+}
+
+/* Counts an incoming connection against its source and template */
+
+static void
+tcp_account(struct tcp_con *con)
+{
+	struct tcp_source *source;
+
+	con->flags |= TCP_COUNTED;
+	if (con->tmpl != NULL) {
+		con->tmpl->nconnects++;
+		if (con->flags & TCP_QUIET)
+			TAILQ_INSERT_HEAD(&con->tmpl->tcpquiet, con, tmplquiet);
+	}
+
+	if (!honeyd_max_source_connections)
+		return;
+
+	if ((source = tcp_source_find(con->con_ipsrc)) == NULL) {
+		source = pool_alloc(pool_tcpsource);
+		source->addr = con->con_ipsrc;
+		source->nconnects = 0;
+		TAILQ_INIT(&source->quiet);
+		SPLAY_INSERT(tcpsourcetree, &tcpsources, source);
+	}
+	source->nconnects++;
+	if (con->flags & TCP_QUIET)
+		TAILQ_INSERT_HEAD(&source->quiet, con, srcquiet);
+	con->source = source;
+}
+
+/* The connection received data, so it is no longer evicted first */
+
+static void
+tcp_unquiet(struct tcp_con *con)
+{
+	TAILQ_REMOVE(&tcpquiet, con, quiet);
+	if (con->flags & TCP_COUNTED) {
+		if (con->tmpl != NULL)
+			TAILQ_REMOVE(&con->tmpl->tcpquiet, con, tmplquiet);
+		if (con->source != NULL)
+			TAILQ_REMOVE(&con->source->quiet, con, srcquiet);
+	}
+	con->flags &= ~TCP_QUIET;
+}
+
+static void
+tcp_unaccount(struct tcp_con *con)
+{
+	struct tcp_source *source = con->source;
+
+	con->flags &= ~TCP_COUNTED;
+	if (con->tmpl != NULL)
+		con->tmpl->nconnects--;
+
+	if (source != NULL && --source->nconnects == 0) {
+		SPLAY_REMOVE(tcpsourcetree, &tcpsources, source);
+		pool_free(pool_tcpsource, source);
+	}
+	con->source = NULL;
+}
+
+/*
+ * Decides if a source may open another connection to a template.  A
+ * source or template at its quota gives up its oldest connection that
+ * never received any data, so that scanners churn through their own
+ * connections.  Only if there is none, the new connection is refused.
+ */
+
+static int
+tcp_admit(struct template *tmpl, ip_addr_t src)
+{
+	struct tcp_source *source = NULL;
+	struct tcp_con *con;
+	int oversource, overtmpl;
+
+	if (honeyd_max_source_connections)
+		source = tcp_source_find(src);
+	oversource = source != NULL &&
+	    source->nconnects >= honeyd_max_source_connections;
+	overtmpl = tmpl != NULL && honeyd_max_template_connections &&
+	    tmpl->nconnects >= honeyd_max_template_connections;
+	if (!oversource && !overtmpl)
+		return (0);
+
+	if (oversource) {
+		/* At most as many as the source may have */
+		for (con = TAILQ_LAST(&source->quiet, tcpquietq);
+		    con != NULL && overtmpl && con->tmpl != tmpl;
+		    con = TAILQ_PREV(con, tcpquietq, srcquiet))
+			;
+	} else
+		con = TAILQ_LAST(&tmpl->tcpquiet, tcpquietq);
+
+	if (con != NULL) {
+		stats_admit.evicted_quiet++;
+		tcp_free(con);
+		return (0);
+	}
+
+	if (oversource)
+		stats_admit.refused_source++;
+	else
+		stats_admit.refused_template++;
+	return (-1);
 }
 
 struct tcp_con *
@@ -946,23 +1349,31 @@ tcp_new(struct ip_hdr *ip, struct tcp_hdr *tcp, int local)
 	if (honeyd_nconnects >= HONEYD_MAX_CONNECTS) {
 		/* 
 		 * We seem to be in an overload situation - remove the
-		 * oldest connection available.
+		 * oldest connection that never received any data.  Only
+		 * if every connection carried data, remove the oldest one.
 		 */
-		con = (struct tcp_con *)TAILQ_LAST(&tcplru, conlru);
+		if ((con = TAILQ_LAST(&tcpquiet, tcpquietq)) != NULL) {
+			stats_admit.evicted_quiet++;
+		} else {
+			con = (struct tcp_con *)TAILQ_LAST(&tcplru, conlru);
+			stats_admit.evicted_oldest++;
+		}
 		tcp_free(con);
 	}
 
-	if ((con = calloc(1, sizeof(struct tcp_con))) == NULL) {
-		syslog(LOG_WARNING, "calloc: %m");
-		return (NULL);
-	}
+	con = pool_alloc(pool_tcp);
+	memset(con, 0, sizeof(struct tcp_con));
+	con->smss = TCP_DEFAULT_MSS;
+	con->rto = TCP_RTO_INIT;
 
 	honeyd_nconnects++;
 	honeyd_settcp(con, ip, tcp, local);
-	con->conhdr.timeout  = evtimer_new(honeyd_base_ev, honeyd_tcp_timeout, con);
-	con->retrans_timeout = evtimer_new(honeyd_base_ev, tcp_retrans_timeout, con);
+	timer_set(&con->conhdr.timeout, honeyd_tcp_timeout, con);
+	timer_set(&con->retrans_timeout, tcp_retrans_timeout, con);
 
 	connection_insert(&tcpcons, &tcplru, &con->conhdr);
+	TAILQ_INSERT_HEAD(&tcpquiet, con, quiet);
+	con->flags |= TCP_QUIET;
 
 	honeyd_log_flownew(honeyd_logfp, IP_PROTO_TCP, &con->conhdr);
 	return (con);
@@ -981,40 +1392,43 @@ tcp_free(struct tcp_con *con)
 		port_free(port->subtmpl, port);
 
 	connection_remove(&tcpcons, &tcplru, &con->conhdr);
+	if (con->flags & TCP_QUIET)
+		tcp_unquiet(con);
+	if (con->flags & TCP_HALFOPEN)
+		honeyd_nhalfopen--;
+	if (con->flags & TCP_COUNTED)
+		tcp_unaccount(con);
 
 	hooks_dispatch(IP_PROTO_TCP, HD_INCOMING_STREAM, &con->conhdr,
 	    NULL, 0);
 	honeyd_log_flowend(honeyd_logfp, IP_PROTO_TCP, &con->conhdr);
 
-	evtimer_del(con->retrans_timeout);
+	timer_del(&con->retrans_timeout);
 
 	if (con->cmd_pfd > 0)
 		cmd_free(&con->cmd);
-	if (con->payload != NULL)
-		free(con->payload);
-	if (con->readbuf != NULL)
-		free(con->readbuf);
+	tcp_ring_release(&con->payload, &con->phead);
+	tcp_ring_release(&con->readbuf, &con->rhead);
 	if (con->tmpl != NULL)
 		template_free(con->tmpl);
 
 	honeyd_nconnects--;
-	free(con);
+	pool_free(pool_tcp, con);
 }
 
 static void
-tcp_retrans_timeout(evutil_socket_t fd, short event, void *arg)
+tcp_retrans_timeout(void *arg)
 {
 	struct tcp_con *con = arg;
 
-	/* Restart transmitting from the last acknowledged segment */
-	con->poff = 0;
+	/* Karn's algorithm: retransmitted segments are not timed */
+	con->flags &= ~TCP_TIMING;
 
-	con->retrans_time *= 2;
-	/* Upper bound on the retransmit time */
-	if (con->retrans_time >= 60) {
+	if (++con->rexmits > TCP_MAX_RETRANS) {
 		tcp_free(con);
 		return;
 	}
+	con->rto = MIN(con->rto * 2, TCP_RTO_MAX);
 
 	switch (con->state) {
 	case TCP_STATE_SYN_SENT:
@@ -1022,7 +1436,7 @@ tcp_retrans_timeout(evutil_socket_t fd, short event, void *arg)
 		tcp_send(con, TH_SYN, NULL, 0);
 		con->snd_una++;
 		
-		generic_timeout(con->retrans_timeout, con->retrans_time);
+		timer_add(&con->retrans_timeout, con->rto);
 		break;
 
 	case TCP_STATE_SYN_RECEIVED:
@@ -1030,10 +1444,24 @@ tcp_retrans_timeout(evutil_socket_t fd, short event, void *arg)
 		tcp_send(con, TH_SYN|TH_ACK, NULL, 0);
 		con->snd_una++;
 		
-		generic_timeout(con->retrans_timeout, con->retrans_time);
+		timer_add(&con->retrans_timeout, con->rto);
 		break;
 
 	default:
+		/*
+		 * A timeout means that the network is congested.  Shrink
+		 * the window to one segment and restart transmitting from
+		 * the last acknowledged segment.
+		 */
+		if (con->rexmits == 1)
+			con->ssthresh = MAX(con->poff / 2, 2 * con->smss);
+		con->cwnd = con->smss;
+		con->recover = con->snd_max;
+		con->flags &= ~TCP_RECOVERY;
+		con->nsacks = 0;
+		con->dupacks = 0;
+		con->poff = 0;
+
 		/* Will reschedule retransmit timeout if needed */
 		tcp_senddata(con, TH_ACK);
 		break;
@@ -1045,16 +1473,14 @@ udp_new(struct ip_hdr *ip, struct udp_hdr *udp, int local)
 {
 	struct udp_con *con;
 
-	if ((con = calloc(1, sizeof(struct udp_con))) == NULL) {
-			syslog(LOG_WARNING, "calloc: %m");
-			return (NULL);
-	}
+	con = pool_alloc(pool_udp);
+	memset(con, 0, sizeof(struct udp_con));
 
 	honeyd_setudp(con, ip, udp, local);
 
 	connection_insert(&udpcons, &udplru, &con->conhdr);
 
-	con->conhdr.timeout = evtimer_new(honeyd_base_ev, honeyd_udp_timeout, con);
+	timer_set(&con->conhdr.timeout, honeyd_udp_timeout, con);
 
 	honeyd_log_flownew(honeyd_logfp, IP_PROTO_UDP, &con->conhdr);
 
@@ -1064,7 +1490,6 @@ udp_new(struct ip_hdr *ip, struct udp_hdr *udp, int local)
 void
 udp_free(struct udp_con *con)
 {
-	struct conbuffer *buf;
 	struct port *port = con->port;
 	struct port_encapsulate *pending = con->conhdr.pending;
 
@@ -1080,22 +1505,19 @@ udp_free(struct udp_con *con)
 	    NULL, 0);
 	honeyd_log_flowend(honeyd_logfp, IP_PROTO_UDP, &con->conhdr);
 
-	while ((buf = TAILQ_FIRST(&con->incoming)) != NULL) {
-		TAILQ_REMOVE(&con->incoming, buf, next);
-		free(buf->buf);
-		free(buf);
-	}
+	while (TAILQ_FIRST(&con->incoming) != NULL)
+		udp_free_readbuf(con);
 
 	if (con->cmd_pfd > 0)
 		cmd_free(&con->cmd);
 	if (con->tmpl != NULL)
 		template_free(con->tmpl);
 
-	free(con);
+	pool_free(pool_udp, con);
 }
 
 static void
-honeyd_tcp_timeout(evutil_socket_t fd, short event, void *arg)
+honeyd_tcp_timeout(void *arg)
 {
 	struct tcp_con *con = arg;
 
@@ -1106,7 +1528,7 @@ honeyd_tcp_timeout(evutil_socket_t fd, short event, void *arg)
 }
 
 static void
-honeyd_udp_timeout(evutil_socket_t fd, short event, void *arg)
+honeyd_udp_timeout(void *arg)
 {
 	struct udp_con *con = arg;
 
@@ -1233,41 +1655,23 @@ proxy_connect(struct tuple *hdr, struct command *cmd, struct addrinfo *ai, char
 void
 tcp_connectfail(struct tcp_con *con)
 {
-	if (con->payload) {
-		free(con->payload);
-		con->payload = NULL;
-	}
-	if (con->readbuf) {
-		free(con->readbuf);
-		con->readbuf = NULL;
-	}
+	tcp_ring_release(&con->payload, &con->phead);
+	tcp_ring_release(&con->readbuf, &con->rhead);
+	con->plen = con->poff = con->rlen = 0;
 }
 
-/* Sets up buffers for a fully connected TCP connection */
+/*
+ * Sets up buffers for a fully connected TCP connection.  The rings come
+ * from pool_tcpbuf once there is data to hold.
+ */
 
 int
 tcp_setupconnect(struct tcp_con *con)
 {
-	struct tuple *hdr = &con->conhdr;
-
-	/* Allocate buffers */
-	if ((con->payload = malloc(TCP_DEFAULT_SIZE)) == NULL) {
-		syslog(LOG_WARNING, "malloc %s: %m", honeyd_contoa(hdr));
-		goto err;
-	}
-	if ((con->readbuf = malloc(TCP_DEFAULT_SIZE)) == NULL) {
-		syslog(LOG_WARNING, "malloc %s: %m", honeyd_contoa(hdr));
-		goto err;
-	}
-	con->psize = TCP_DEFAULT_SIZE;
-	con->rsize = TCP_DEFAULT_SIZE;
+	con->phead = con->plen = con->poff = 0;
+	con->rhead = con->rlen = 0;
 
 	return (0);
-
- err:
-	tcp_connectfail(con);
-
-	return (-1);
 }
 
 static void
@@ -1356,7 +1760,9 @@ generic_connect(struct template *tmpl, struct tuple *hdr, struct command *cmd, v
 
 	argv[i] = NULL;
 
-	if (cmd_fork(hdr, cmd, tmpl, argv[0], argv, con) == -1) {
+	/* Workers start the script if we have any for this port */
+	if (cmd_pool_fork(hdr, cmd, tmpl, action->action, argv, con) == -1 &&
+	    cmd_fork(hdr, cmd, tmpl, argv[0], argv, con) == -1) {
 		syslog(LOG_WARNING, "malloc %s: %m", honeyd_contoa(hdr));
 		goto err;
 	}
@@ -1375,18 +1781,59 @@ generic_connect(struct template *tmpl, struct tuple *hdr, struct command *cmd, v
 	    honeyd_contoa(hdr));
 }
 
-int
-tcp_send(struct tcp_con *con, uint8_t flags, u_char *payload, u_int len)
+static uint32_t
+tcp_msec(void)
 {
-	u_char *pkt;
+	struct timeval tv;
+
+	event_base_gettimeofday_cached(honeyd_base_ev, &tv);
+	return (tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+/*
+ * Our SYN segments decide whether the window of the peer is scaled and
+ * whether it may acknowledge selectively.  Both are only used if the
+ * options that we sent, which come from the personality, included them.
+ */
+
+static void
+tcp_syn_options(struct tcp_con *con, uint8_t flags,
+    const struct persopts *options)
+{
+	if (options != NULL && options->wscale)
+		con->flags |= TCP_WSCALE;
+	if (options != NULL && options->sackok &&
+	    (flags & TH_ACK) && con->sawsackok)
+		con->flags |= TCP_SACKOK;
+
+	/* The handshake gives the first round trip time measurement */
+	if (!con->rexmits && !(con->flags & TCP_TIMING)) {
+		con->rtt_seq = con->snd_una + 1;
+		con->rtt_start = tcp_msec();
+		con->flags |= TCP_TIMING;
+	}
+}
+
+/* Sends a segment whose payload is gathered from iovcnt pieces */
+
+static int
+tcp_sendv(struct tcp_con *con, uint8_t flags, struct iovec *iov, int iovcnt)
+{
+	u_char *pkt, *p;
+	u_int len = 0;
+	int i;
 	struct tcp_hdr *tcp;
 	u_int iplen;
 	int window = 16000;
 	int dontfragment = 0;
-	char *options;
+	const struct persopts *options;
 	uint16_t id = rand_uint16(honeyd_rand);
 	struct spoof spoof;
 	struct template *tmpl = con->tmpl;
+	uint32_t irs = con->rcv_next - 1;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
 
 	if (con->window)
 		window = con->window;
@@ -1405,7 +1852,12 @@ tcp_send(struct tcp_con *con, uint8_t flags, u_char *payload, u_int len)
 			options = NULL;
 			window = con->window;
 		} else if (flags & TH_SYN) {
-			options = "m";
+			/* Without a fingerprint to match, SACK is up to us */
+			if ((tmpl == NULL || tmpl->person == NULL) &&
+			    (flags & TH_ACK) && con->sawsackok)
+				options = &persopts_mss_sack;
+			else
+				options = &persopts_mss;
 		}
 	}
 
@@ -1446,6 +1898,15 @@ tcp_send(struct tcp_con *con, uint8_t flags, u_char *payload, u_int len)
 	if (options != NULL)
 		tcp_personality_options(con, tcp, options);
 
+	if (flags & TH_SYN)
+		tcp_syn_options(con, flags, options);
+
+	/* The cookie replaces the sequence number from the personality */
+	if (con->flags & TCP_COOKIE) {
+		con->snd_una = tcp_syncookie_make(con, irs);
+		tcp->th_seq = htonl(con->snd_una);
+	}
+
 	iplen = IP_HDR_LEN + (tcp->th_off << 2) + len;
 
 	if (tmpl != NULL)
@@ -1458,7 +1919,11 @@ tcp_send(struct tcp_con *con, uint8_t flags, u_char *payload, u_int len)
 	    dontfragment ? IP_DF : 0, honeyd_ttl,
 	    IP_PROTO_TCP, con->con_ipdst, con->con_ipsrc);
 
-	memcpy(pkt + IP_HDR_LEN + (tcp->th_off << 2), payload, len);
+	p = pkt + IP_HDR_LEN + (tcp->th_off << 2);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
 
 	hooks_dispatch(IP_PROTO_TCP, HD_OUTGOING, &con->conhdr,
 	    pkt, iplen);
@@ -1468,16 +1933,34 @@ tcp_send(struct tcp_con *con, uint8_t flags, u_char *payload, u_int len)
 	return (len);
 }
 
+int
+tcp_send(struct tcp_con *con, uint8_t flags, u_char *payload, u_int len)
+{
+	struct iovec iov;
+
+	iov.iov_base = payload;
+	iov.iov_len = len;
+	return (tcp_sendv(con, flags, &iov, len ? 1 : 0));
+}
+
 void
 tcp_senddata(struct tcp_con *con, uint8_t flags)
 {
-	int space, sent;
+	struct iovec iov[2];
+	uint32_t wnd, snd_nxt;
+	int space, sent, iovcnt;
 	int needretrans = 0;
 
 	do {
-		space = TCP_MAX_INFLIGHT - TCP_BYTESINFLIGHT(con);
-		if (space > TCP_MAX_SEND)
-			space = TCP_MAX_SEND;
+		/* Bounded by the congestion window and the peer's window */
+		wnd = MIN(con->cwnd, con->snd_wnd);
+		space = wnd > TCP_BYTESINFLIGHT(con) ?
+		    wnd - TCP_BYTESINFLIGHT(con) : 0;
+		/* Probe a closed window with a single byte */
+		if (con->snd_wnd == 0 && TCP_BYTESINFLIGHT(con) == 0)
+			space = 1;
+		if (space > con->smss)
+			space = con->smss;
 		if (con->plen - con->poff < space)
 			space = con->plen - con->poff;
 
@@ -1499,31 +1982,229 @@ tcp_senddata(struct tcp_con *con, uint8_t flags)
 			break;
 
 		con->snd_una += con->poff;
-		sent = tcp_send(con, flags, con->payload + con->poff, space);
+		/* The segment is copied straight out of the ring */
+		iovcnt = tcp_ring_slice(con->payload, con->phead + con->poff,
+		    space, iov);
+		sent = tcp_sendv(con, flags, iov, iovcnt);
 		con->snd_una -= con->poff;
 		con->poff += sent;
 
-		/* Statistics */
-		con->conhdr.sent += space;
+		/* Only new data is timed; resent data is ambiguous */
+		snd_nxt = con->snd_una + con->poff;
+		if (TCP_SEQ_GT(snd_nxt, con->snd_max)) {
+			if (!(con->flags & TCP_TIMING) &&
+			    TCP_SEQ_GEQ(snd_nxt - sent, con->snd_max)) {
+				con->rtt_seq = snd_nxt;
+				con->rtt_start = tcp_msec();
+				con->flags |= TCP_TIMING;
+			}
+			con->snd_max = snd_nxt;
+		}
+
+		/* Statistics */
+		con->conhdr.sent += space;
+
+		if (flags & TH_ACK)
+			con->last_acked = con->rcv_next;
+
+		if (con->flags & TCP_TARPIT)
+			break;
+
+	} while (sent);
+
+	/* 
+	 * We need to retransmit if we still have outstanding data or
+	 * our FIN did not get acked.
+	 */
+	needretrans = con->poff || (con->sentfin && !con->finacked);
+
+	if (needretrans && !timer_pending(&con->retrans_timeout))
+		timer_add(&con->retrans_timeout, con->rto);
+}
+
+/*
+ * Retransmits at most one segment from the hole between start and end
+ * without changing where new data is sent from.
+ */
+
+static void
+tcp_retransmit(struct tcp_con *con, uint32_t start, uint32_t end)
+{
+	struct iovec iov[2];
+	u_int off = start - con->snd_una, len = end - start;
+	int iovcnt;
+
+	if (off >= con->plen)
+		return;
+	if (len > con->smss)
+		len = con->smss;
+	if (len > con->plen - off)
+		len = con->plen - off;
+
+	iovcnt = tcp_ring_slice(con->payload, con->phead + off, len, iov);
+	con->snd_una += off;
+	tcp_sendv(con, TH_ACK, iov, iovcnt);
+	con->snd_una -= off;
+	con->last_acked = con->rcv_next;
+
+	if (TCP_SEQ_LT(con->rexmt, start + len))
+		con->rexmt = start + len;
+
+	/* Karn's algorithm: an ambiguous acknowledgment is no sample */
+	if (TCP_SEQ_LT(start, con->rtt_seq))
+		con->flags &= ~TCP_TIMING;
+
+	if (!timer_pending(&con->retrans_timeout))
+		timer_add(&con->retrans_timeout, con->rto);
+}
+
+/* The window of the peer; windows on SYN segments are never scaled */
+
+static uint32_t
+tcp_peer_window(struct tcp_con *con, struct tcp_hdr *tcp)
+{
+	uint32_t wnd = ntohs(tcp->th_win);
+
+	if (!(tcp->th_flags & TH_SYN) && (con->flags & TCP_WSCALE) &&
+	    con->sawwscale)
+		wnd <<= con->snd_wscale;
+	return (wnd);
+}
+
+/*
+ * Prepares congestion control once the handshake is done, as described
+ * in RFC 5681.  The handshake gives us the first round trip time.
+ */
+
+static void
+tcp_established(struct tcp_con *con, struct tcp_hdr *tcp)
+{
+	u_int smss = con->smss;
+
+	if ((con->flags & TCP_TIMING) &&
+	    TCP_SEQ_GEQ(ntohl(tcp->th_ack), con->rtt_seq))
+		tcp_rtt_update(con, tcp_msec() - con->rtt_start);
+	con->flags &= ~TCP_TIMING;
+
+	if (con->flags & TCP_HALFOPEN) {
+		con->flags &= ~TCP_HALFOPEN;
+		honeyd_nhalfopen--;
+	}
+
+	/* A lost SYN means that we should start out more carefully */
+	if (con->rexmits && !con->srtt)
+		con->rto = TCP_RTO_SYNLOSS;
+	con->rexmits = 0;
+
+	con->cwnd = MIN(4 * smss, MAX(2 * smss, 4380));
+	con->ssthresh = (uint32_t)-1;
+	con->snd_wnd = tcp_peer_window(con, tcp);
+	con->snd_max = con->snd_una;
+	con->recover = con->rexmt = con->snd_una - 1;
+}
+
+/*
+ * Duplicate acknowledgments signal that a segment was lost.  The third
+ * one triggers a fast retransmit and recovery, RFC 6582.  With SACK, we
+ * know which segments are missing and retransmit one for every further
+ * duplicate.
+ */
+
+static void
+tcp_dupack(struct tcp_con *con)
+{
+	uint32_t start, end;
+
+	if (con->flags & TCP_RECOVERY) {
+		/* Another segment has left the network */
+		con->cwnd += con->smss;
+		if ((con->flags & TCP_SACKOK) &&
+		    tcp_sack_hole(con, con->rexmt, &start, &end))
+			tcp_retransmit(con, start, end);
+		return;
+	}
+
+	/* After a timeout, old duplicates do not start another recovery */
+	if (++con->dupacks != 3 || !TCP_SEQ_GT(con->snd_una, con->recover))
+		return;
+
+	con->ssthresh = MAX(TCP_BYTESINFLIGHT(con) / 2, 2 * con->smss);
+	con->recover = con->snd_max;
+	con->flags |= TCP_RECOVERY;
+
+	if (!(con->flags & TCP_SACKOK) ||
+	    !tcp_sack_hole(con, con->snd_una, &start, &end)) {
+		start = con->snd_una;
+		end = start + con->smss;
+	}
+	tcp_retransmit(con, start, end);
+
+	con->cwnd = con->ssthresh + 3 * con->smss;
+}
+
+/*
+ * Processes the acknowledgment of a segment after its data has been
+ * drained from the payload and snd_una moved forward by acked bytes.
+ */
 
-		if (flags & TH_ACK)
-			con->last_acked = con->rcv_next;
+static void
+tcp_ack(struct tcp_con *con, struct tcp_hdr *tcp, u_int acked, u_int dlen)
+{
+	uint32_t wnd = tcp_peer_window(con, tcp), start, end;
+	u_int smss = con->smss;
+
+	if (TCP_SEQ_GT(con->snd_una, con->snd_max))
+		con->snd_max = con->snd_una;	/* our FIN */
+	tcp_sack_trim(con);
+
+	if (!acked) {
+		/* Only segments that carry no news are duplicates */
+		if (TCP_BYTESINFLIGHT(con) && !dlen && wnd == con->snd_wnd)
+			tcp_dupack(con);
+		con->snd_wnd = wnd;
+		return;
+	}
 
-		if (con->flags & TCP_TARPIT)
-			break;
+	con->snd_wnd = wnd;
+	con->dupacks = 0;
+	con->rexmits = 0;
+	if (TCP_SEQ_LT(con->rexmt, con->snd_una))
+		con->rexmt = con->snd_una;
 
-	} while (sent && !con->dupacks);
+	if ((con->flags & TCP_TIMING) &&
+	    TCP_SEQ_GEQ(con->snd_una, con->rtt_seq)) {
+		tcp_rtt_update(con, tcp_msec() - con->rtt_start);
+		con->flags &= ~TCP_TIMING;
+	}
 
-	/* 
-	 * We need to retransmit if we still have outstanding data or
-	 * our FIN did not get acked.
-	 */
-	needretrans = con->poff || (con->sentfin && !con->finacked);
+	/* New data has been acknowledged; restart the timer */
+	timer_del(&con->retrans_timeout);
+
+	if (con->flags & TCP_RECOVERY) {
+		if (TCP_SEQ_GEQ(con->snd_una, con->recover)) {
+			/* Everything lost before recovery has arrived */
+			con->cwnd = MIN(con->ssthresh,
+			    MAX(TCP_BYTESINFLIGHT(con), smss) + smss);
+			con->flags &= ~TCP_RECOVERY;
+			return;
+		}
 
-	if (needretrans && !evtimer_pending(con->retrans_timeout, NULL)) {
-		if (!con->retrans_time)
-			con->retrans_time = 1;
-		generic_timeout(con->retrans_timeout, con->retrans_time);
+		/* A partial acknowledgment points to the next hole */
+		if (!(con->flags & TCP_SACKOK)) {
+			tcp_retransmit(con, con->snd_una,
+			    con->snd_una + smss);
+		} else if (tcp_sack_hole(con, con->rexmt, &start, &end))
+			tcp_retransmit(con, start, end);
+
+		con->cwnd -= MIN(con->cwnd - smss, acked);
+		if (acked >= smss)
+			con->cwnd += smss;
+	} else if (con->cwnd < con->ssthresh) {
+		/* Slow start */
+		con->cwnd += MIN(acked, smss);
+	} else {
+		/* Congestion avoidance */
+		con->cwnd += MAX(1, smss * smss / con->cwnd);
 	}
 }
 
@@ -1791,6 +2472,9 @@ static void
 tcp_do_options(struct tcp_con *con, struct tcp_hdr *tcp, int isonsyn)
 {
 	u_char *p, *end;
+	uint32_t sack[2];
+	uint16_t mss;
+	int i, issyn = tcp->th_flags & TH_SYN;
 
 	p = (u_char *)(tcp + 1);
 	end = (u_char *)tcp + (tcp->th_off << 2);
@@ -1810,13 +2494,34 @@ tcp_do_options(struct tcp_con *con, struct tcp_hdr *tcp, int isonsyn)
 		memcpy(&opt, tmp, tmp->opt_len);
 		switch (opt.opt_type) {
 		case TCP_OPT_MSS:
+			mss = ntohs(opt.opt_data.mss);
 			if (!isonsyn) {
-				con->mss = ntohs(opt.opt_data.mss);
+				con->mss = mss;
 			}
+			/* The size of the segments that we send */
+			if (issyn && mss)
+				con->smss = MIN(mss, TCP_MAX_SEGMENT);
 			break;
 		case TCP_OPT_WSCALE:
-			if (!isonsyn) {
+			/* Only valid during the handshake, RFC 7323 */
+			if (issyn) {
 				con->sawwscale = 1;
+				con->snd_wscale = MIN(opt.opt_data.wscale, 14);
+			}
+			break;
+		case TCP_OPT_SACKOK:
+			if (issyn)
+				con->sawsackok = 1;
+			break;
+		case TCP_OPT_SACK:
+			if (issyn || !(con->flags & TCP_SACKOK))
+				break;
+			for (i = 0; i + TCP_OPT_LEN + sizeof(sack) <= opt.opt_len;
+			    i += sizeof(sack)) {
+				memcpy(sack, opt.opt_data.data8 + i,
+				    sizeof(sack));
+				tcp_sack_update(con,
+				    ntohl(sack[0]), ntohl(sack[1]));
 			}
 			break;
 		case TCP_OPT_TIMESTAMP:
@@ -1833,17 +2538,6 @@ tcp_do_options(struct tcp_con *con, struct tcp_hdr *tcp, int isonsyn)
 	}
 }
 
-/* extern */
-void
-generic_timeout(struct event *ev, int seconds)
-{
-	struct timeval tv;
-
-	timerclear(&tv);
-	tv.tv_sec = seconds;
-	evtimer_add(ev, &tv);
-}
-
 /* Checks that the sequence number is where we expect it to be */
 #define TCP_CHECK_SEQ_OR_ACK	do { \
 		int has_ack = tcp->th_flags & TH_ACK; \
@@ -1878,6 +2572,8 @@ generic_timeout(struct event *ev, int seconds)
 		dlen -= doff; \
 \
 		con->conhdr.received += dlen; \
+		if (dlen && (con->flags & TCP_QUIET)) \
+			tcp_unquiet(con); \
 \
 		if (con->plen || con->cmd_pfd > 0) { \
 			int ackinc = 0; \
@@ -1893,7 +2589,7 @@ generic_timeout(struct event *ev, int seconds)
 			} \
 			tcp_drain_payload(con, acked); \
 			acked += ackinc; \
-			if (con->cmd_pfd == -1 && con->plen <= TCP_MAX_SEND) \
+			if (con->cmd_pfd == -1 && con->plen <= con->smss) \
 				con->sentfin = 1; \
 		} else if (con->cmd_pfd == -1) { \
 			tcp_add_readbuf(con, data + doff, dlen); \
@@ -1904,19 +2600,89 @@ generic_timeout(struct event *ev, int seconds)
 				con->finacked = 1; \
 			} \
 		} \
-		if (acked == 0 && con->poff) { \
-			con->dupacks++; \
-			if (con->dupacks >= 3) { \
-				con->dupacks = 3; \
-				con->poff = 0; \
-			} \
-		} else if (acked) { \
-			con->retrans_time = 0; \
-			evtimer_del(con->retrans_timeout); \
-			con->dupacks=0; \
-		} \
+		tcp_do_options(con, tcp, 0); \
+		con->snd_una += acked; \
+		tcp_ack(con, tcp, acked, dlen); \
 } while (0)
 
+/*
+ * Answers a SYN with a SYN cookie instead of creating a connection.  The
+ * negotiated options are encoded in the initial sequence number.
+ */
+
+static void
+tcp_syncookie_send(struct template *tmpl, struct ip_hdr *ip,
+    struct tcp_hdr *tcp, struct action *action)
+{
+	struct tcp_con con;
+
+	memset(&con, 0, sizeof(con));
+	honeyd_settcp(&con, ip, tcp, 0);
+	con.smss = TCP_DEFAULT_MSS;
+	con.flags |= TCP_COOKIE;
+	if (action != NULL && (action->flags & PORT_TARPIT))
+		con.flags |= TCP_TARPIT;
+
+	tcp_do_options(&con, tcp, 1);
+
+	con.tmpl = tmpl;
+	con.rcv_next = ntohl(tcp->th_seq) + 1;
+	con.state = TCP_STATE_LISTEN;
+	tcp_send(&con, TH_SYN|TH_ACK, NULL, 0);
+
+	stats_admit.cookies_sent++;
+}
+
+/*
+ * Creates the connection for an acknowledgment that carries a valid SYN
+ * cookie.  The connection then continues as if it had been waiting in
+ * SYN_RECEIVED all along.
+ */
+
+static struct tcp_con *
+tcp_syncookie_accept(struct template *tmpl, struct ip_hdr *ip,
+    struct tcp_hdr *tcp, struct action *action)
+{
+	struct tcp_con tmp, *con;
+	uint32_t th_seq = ntohl(tcp->th_seq), th_ack = ntohl(tcp->th_ack);
+
+	memset(&tmp, 0, sizeof(tmp));
+	honeyd_settcp(&tmp, ip, tcp, 0);
+	if (tcp_syncookie_check(&tmp, th_seq - 1, th_ack - 1) == -1) {
+		stats_admit.cookies_rejected++;
+		return (NULL);
+	}
+
+	if (tcp_admit(tmpl, ip->ip_src) == -1)
+		return (NULL);
+	if ((con = tcp_new(ip, tcp, 0)) == NULL)
+		return (NULL);
+
+	syslog(LOG_DEBUG, "Connection request with SYN cookie: tcp %s",
+	    honeyd_contoa(&con->conhdr));
+
+	/* Restore what the cookie remembered about the SYN */
+	con->smss = tmp.smss;
+	con->sawwscale = tmp.sawwscale;
+	con->snd_wscale = tmp.snd_wscale;
+	con->sawsackok = tmp.sawsackok;
+	con->flags |= tmp.flags & (TCP_WSCALE|TCP_SACKOK);
+	if (action != NULL && (action->flags & PORT_TARPIT))
+		con->flags |= TCP_TARPIT;
+
+	con->tmpl = template_ref(tmpl);
+	tcp_account(con);
+	con->window = tcp_personality_synwindow(tmpl);
+	con->rcv_next = th_seq;
+	con->snd_una = th_ack;
+	con->state = TCP_STATE_SYN_RECEIVED;
+
+	timer_add(&con->conhdr.timeout, HONEYD_SYN_WAIT * 1000);
+
+	stats_admit.cookies_accepted++;
+	return (con);
+}
+
 static void
 tcp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 {
@@ -1944,7 +2710,7 @@ tcp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 	 * that we can look at potential flags like local origination.
 	 */
 	honeyd_settcp(&honeyd_tmp, ip, tcp, 0);
-	con = (struct tcp_con *)SPLAY_FIND(tree, &tcpcons, &honeyd_tmp.conhdr);
+	con = (struct tcp_con *)flow_find(&tcpcons, &honeyd_tmp.conhdr);
 
 	hooks_dispatch(ip->ip_p, HD_INCOMING, 
 	    con != NULL ? &con->conhdr : &honeyd_tmp.conhdr, pkt, pktlen);
@@ -1964,6 +2730,12 @@ tcp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 
 	tiflags = tcp->th_flags;
 
+	/* The acknowledgment of a SYN cookie creates the connection */
+	if (con == NULL && honeyd_syncookies != -1 &&
+	    honeyd_tmp.state == TCP_STATE_LISTEN &&
+	    (tiflags & (TH_SYN|TH_RST|TH_ACK)) == TH_ACK)
+		con = tcp_syncookie_accept(tmpl, ip, tcp, action);
+
 	if (con == NULL) {
 		if (honeyd_tmp.state != TCP_STATE_LISTEN)
 			goto kill;
@@ -2012,6 +2784,17 @@ tcp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 				goto justlog;
 		}
 
+		/* Do not keep any state while we are flooded with SYNs */
+		if (honeyd_syncookies != -1 &&
+		    honeyd_nhalfopen >= honeyd_syncookies &&
+		    tcp_personality_cookies(tmpl)) {
+			tcp_syncookie_send(tmpl, ip, tcp, action);
+			return;
+		}
+
+		if (tcp_admit(tmpl, ip->ip_src) == -1)
+			goto justlog;
+
 		/* Out of memory is dealt with by killing the connection */
 		if ((con = tcp_new(ip, tcp, 0)) == NULL) {
 			goto kill;
@@ -2025,6 +2808,7 @@ tcp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 		tcp_do_options(con, tcp, 1);
 
 		con->tmpl = template_ref(tmpl);
+		tcp_account(con);
 		con->rcv_next = ntohl(tcp->th_seq) + 1;
 		con->snd_una = 0;
 
@@ -2033,12 +2817,12 @@ tcp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 
 		con->snd_una++;
 		con->state = TCP_STATE_SYN_RECEIVED;
+		con->flags |= TCP_HALFOPEN;
+		honeyd_nhalfopen++;
 
-		generic_timeout(con->conhdr.timeout, HONEYD_SYN_WAIT);
+		timer_add(&con->conhdr.timeout, HONEYD_SYN_WAIT * 1000);
 
-		/* Get initial value from personality */
-		con->retrans_time = 3;
-		generic_timeout(con->retrans_timeout, con->retrans_time);
+		timer_add(&con->retrans_timeout, con->rto);
 
 		return;
 	}
@@ -2078,10 +2862,15 @@ tcp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 			goto dropwithreset;
 
 		tcp_do_options(con, tcp, 0);
+		if (!con->sawsackok)
+			con->flags &= ~TCP_SACKOK;
 
 		con->rcv_next = th_seq + 1;
 		tcp_send(con, TH_ACK, NULL, 0);
 
+		timer_del(&con->retrans_timeout);
+		tcp_established(con, tcp);
+
 		con->state = TCP_STATE_ESTABLISHED;
 		generic_connect(tmpl, &con->conhdr, &con->cmd, con);
 		break;
@@ -2110,8 +2899,8 @@ tcp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 		tcp_do_options(con, tcp, 0);
 
 		/* Clear retransmit timeout */
-		con->retrans_time = 0;
-		evtimer_del(con->retrans_timeout);
+		timer_del(&con->retrans_timeout);
+		tcp_established(con, tcp);
 
 		connection_update(&tcplru, &con->conhdr);
 
@@ -2123,8 +2912,6 @@ tcp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 		TCP_CHECK_SEQ_OR_ACK;
 
 		TCP_RECV_SEND_DATA;
-			
-		tcp_do_options(con, tcp, 0);
 
 		connection_update(&tcplru, &con->conhdr);
 
@@ -2153,7 +2940,6 @@ tcp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 		}
 
 		con->rcv_next += dlen;
-		con->snd_una += acked;
 		if (con->sentfin) {
 			tcp_sendfin(con);
 		} else
@@ -2165,13 +2951,10 @@ tcp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 
 		TCP_RECV_SEND_DATA;
 
-		tcp_do_options(con, tcp, 0);
-
 		connection_update(&tcplru, &con->conhdr);
 
 		if (dlen)
 			goto dropwithreset;
-		con->snd_una += acked;
 		tcp_senddata(con, TH_ACK);
 		if (con->sentfin)
 			con->state = TCP_STATE_CLOSING;
@@ -2183,11 +2966,8 @@ tcp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 
 		TCP_RECV_SEND_DATA;
 
-		tcp_do_options(con, tcp, 0);
-
 		connection_update(&tcplru, &con->conhdr);
 
-		con->snd_una += acked;
 		if (con->finacked)
 			goto closed;
 		tcp_senddata(con, TH_ACK);
@@ -2197,19 +2977,16 @@ tcp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 		TCP_CHECK_SEQ_OR_ACK;
 
 		TCP_RECV_SEND_DATA;
-			
-		tcp_do_options(con, tcp, 0);
 
 		if (tiflags & TH_FIN && !(con->flags & TCP_TARPIT)) {
 			con->state = TCP_STATE_CLOSING;
-			generic_timeout(con->conhdr.timeout, HONEYD_CLOSE_WAIT);
+			timer_add(&con->conhdr.timeout, HONEYD_CLOSE_WAIT * 1000);
 			dlen++;
 		} else {
 			connection_update(&tcplru, &con->conhdr);
 		}
 
 		con->rcv_next += dlen;
-		con->snd_una += acked;
 		tcp_senddata(con, TH_ACK);
 		break;
 	}
@@ -2339,7 +3116,7 @@ udp_send(struct udp_con *con, u_char *payload, u_int len)
 
 	honeyd_ip_send(pkt, iplen, spoof);
 
-	generic_timeout(con->conhdr.timeout, HONEYD_UDP_WAIT);
+	timer_add(&con->conhdr.timeout, HONEYD_UDP_WAIT * 1000);
 
 	return (len);
 }
@@ -2369,7 +3146,7 @@ udp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 	 * that we can look at potential flags like local origination.
 	 */
 	honeyd_setudp(&honeyd_udp, ip, udp, 0);
-	con = (struct udp_con *)SPLAY_FIND(tree, &udpcons, &honeyd_udp.conhdr);
+	con = (struct udp_con *)flow_find(&udpcons, &honeyd_udp.conhdr);
 
 	hooks_dispatch(ip->ip_p, HD_INCOMING,
 	    con != NULL ? &con->conhdr : &honeyd_udp.conhdr, pkt, pktlen);
@@ -2413,7 +3190,7 @@ udp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 	}
 
 	/* Keep this state active */
-	generic_timeout(con->conhdr.timeout, HONEYD_UDP_WAIT);
+	timer_add(&con->conhdr.timeout, HONEYD_UDP_WAIT * 1000);
 	con->softerrors = 0;
 
 	/* Statistics */
@@ -2570,8 +3347,7 @@ icmp_recv_cb(struct template *tmpl, u_char *pkt, u_short pktlen)
 		honeyd_setudp(&honeyd_udp, &tmpip, &tmpudp, 0);
 
 		/* Find matching state */
-		con = (struct udp_con *)SPLAY_FIND(tree, &udpcons,
-		    &honeyd_udp.conhdr);
+		con = (struct udp_con *)flow_find(&udpcons, &honeyd_udp.conhdr);
 		if (con == NULL)
 			break;
 
@@ -2699,6 +3475,47 @@ honeyd_router_drop(struct link_drop *drop, struct timeval *tv)
 		return (0);
 }
 
+/*
+ * Queues the packet on a bandwidth limited link and adds the time that
+ * it has to wait.  The time comes from the event loop, which is precise
+ * enough for simulated links.  Returns -1 if the queue drops the packet.
+ */
+static int
+honeyd_link_queue(struct link_entry *link, u_int iplen, int *pdelay)
+{
+	int ms = iplen * link->bandwidth / link->divider;
+	struct timeval now, tv;
+
+	event_base_gettimeofday_cached(honeyd_base_ev, &now);
+
+	if (timercmp(&now, &link->tv_busy, <)) {
+		/* Router is busy for a while */
+		timersub(&link->tv_busy, &now, &tv);
+
+		/* Opportunity to drop based on queue length */
+		if (honeyd_router_drop(&link->red, &tv))
+			return (-1);
+
+		*pdelay += tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	} else {
+		/* Router is busy now */
+		link->tv_busy = now;
+	}
+
+	/* Construct router delay time */
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+
+	timeradd(&link->tv_busy, &tv, &link->tv_busy);
+
+	*pdelay += ms;
+
+	if (link->queue == NULL)
+		link->queue = honeyd_delayq_new();
+
+	return (0);
+}
+
 /* 
  * Follow a packet through the routing table; starting with router gw.
  * Return:
@@ -2708,15 +3525,44 @@ honeyd_router_drop(struct link_drop *drop, struct timeval *tv)
  */
 
 static enum forward
-honeyd_route_packet(struct ip_hdr *ip, u_int iplen, struct addr *gw, struct addr *addr, int *pdelay)
+honeyd_route_packet(struct ip_hdr *ip, u_int iplen, struct addr *gw, struct addr *addr, int *pdelay, struct pktctx *ctx)
 {
 	struct router *r, *lastrouter = NULL;
 	struct router_entry *rte = NULL;
 	struct link_entry *link = NULL;
+	struct route_result *res;
 	struct template *tmpl;
 	struct addr host;
 	double packetloss = 1;
 	int delay = 0, external = 0;
+	int i;
+
+	/*
+	 * Cached routes are only used if the TTL does not run out on the
+	 * way; otherwise we need to know where exactly that happens.
+	 */
+	res = router_cache_lookup(gw, addr);
+	if (res != NULL && ip->ip_ttl > res->hops) {
+		ip->ip_ttl -= res->hops;
+		if (res->noroute) {
+			syslog(LOG_DEBUG, "No route to %s", addr_ntoa(addr));
+			return (FW_DROP);
+		}
+
+		for (i = 0; i < res->nlinks; i++) {
+			link = res->links[i];
+			if (honeyd_link_queue(link, iplen, &delay) == -1)
+				return (FW_DROP);
+			ctx->queue = link->queue;
+		}
+
+		delay += res->latency;
+		packetloss = res->survive;
+		external = res->external;
+		host = res->host;
+		rte = res->rte;
+		goto routed;
+	}
 
 	host = *gw;
 	r = router_find(&host);
@@ -2750,31 +3596,9 @@ honeyd_route_packet(struct ip_hdr *ip, u_int iplen, struct addr *gw, struct addr
 			delay += 3;
 
 		if (link->bandwidth) {
-			int ms = iplen * link->bandwidth / link->divider;
-			struct timeval now, tv;
-			gettimeofday(&now, NULL);
-
-			if (timercmp(&now, &link->tv_busy, <)) {
-				/* Router is busy for a while */
-				timersub(&link->tv_busy, &now, &tv);
-
-				/* Opportunity to drop based on queue length */
-				if (honeyd_router_drop(&link->red, &tv))
-					return (FW_DROP);
-
-				delay += tv.tv_sec * 1000 + tv.tv_usec / 1000;
-			} else {
-				/* Router is busy now */
-				link->tv_busy = now;
-			}
-
-			/* Construct router delay time */
-			tv.tv_sec = ms / 1000;
-			tv.tv_usec = (ms % 1000) * 1000;
-
-			timeradd(&link->tv_busy, &tv, &link->tv_busy);
-
-			delay += ms;
+			if (honeyd_link_queue(link, iplen, &delay) == -1)
+				return (FW_DROP);
+			ctx->queue = link->queue;
 		}
 		if (link->packetloss)
 			packetloss *= 1 - ((double)link->packetloss / 10000.0);
@@ -2784,6 +3608,7 @@ honeyd_route_packet(struct ip_hdr *ip, u_int iplen, struct addr *gw, struct addr
 		host = r->addr;
 	}
 
+ routed:
 	/* Calculate the packet loss rate */
 	packetloss = (1 - packetloss) * 10000;
 	if (rand_uint16(honeyd_rand) % 10000 < packetloss)
@@ -2801,8 +3626,9 @@ honeyd_route_packet(struct ip_hdr *ip, u_int iplen, struct addr *gw, struct addr
 		 * We need to use the template of the host that will
 		 * send the ICMP error message.
 		 */
-		tmpl = template_find_best(addr_ntoa(&host), ip, iplen);
-		honeyd_delay_packet(tmpl, ip, iplen, &host, NULL, delay, 0, spoof);
+		tmpl = template_find_best_addr(host.addr_ip, ip, iplen);
+		honeyd_delay_packet(tmpl, ip, iplen, &host, NULL, delay, 0, spoof,
+		    NULL);
 		return (FW_DROP);
 	}
 
@@ -2815,9 +3641,9 @@ honeyd_route_packet(struct ip_hdr *ip, u_int iplen, struct addr *gw, struct addr
 		 * We need to use the template of the host that will
 		 * send the ICMP error message.
 		 */
-		tmpl = template_find_best(addr_ntoa(&host), ip, iplen);
+		tmpl = template_find_best_addr(host.addr_ip, ip, iplen);
 		honeyd_delay_packet(tmpl, ip, iplen, &host, NULL, delay,
-		    DELAY_UNREACH, no_spoof);
+		    DELAY_UNREACH, no_spoof, NULL);
 		return (FW_DROP);
 	}
 
@@ -2825,7 +3651,7 @@ honeyd_route_packet(struct ip_hdr *ip, u_int iplen, struct addr *gw, struct addr
 	if (rte != NULL && rte->type == ROUTE_TUNNEL) {
 		honeyd_delay_packet(NULL, ip, iplen,
 		    &rte->tunnel_src, &rte->tunnel_dst,
-		    delay, DELAY_TUNNEL, no_spoof);
+		    delay, DELAY_TUNNEL, no_spoof, NULL);
 		return (FW_DROP);
 	}
 
@@ -2833,7 +3659,7 @@ honeyd_route_packet(struct ip_hdr *ip, u_int iplen, struct addr *gw, struct addr
 		struct template *tmpl;
 
 		/* Check if a template specific drop rate applies */
-		tmpl = template_find_best(addr_ntoa(addr), ip, iplen);
+		tmpl = honeyd_ctx_dst(ctx, ip, iplen);
 		if (tmpl != NULL && tmpl->drop_inrate) {
 			uint16_t value;
 			value = rand_uint16(honeyd_rand) % (100*100);
@@ -2857,14 +3683,17 @@ honeyd_input(const struct interface *inter, struct ip_hdr *ip, u_short iplen)
 	struct router *gw;
 	struct addr gw_addr;
 	struct router_entry *rte;
+	struct pktctx ctx;
 	enum forward res = FW_INTERNAL;
 	int delay = 0, flags = 0;
 	struct addr src, addr;
 
+	memset(&ctx, 0, sizeof(ctx));
+
 	addr_pack(&addr, ADDR_TYPE_IP, IP_ADDR_BITS, &ip->ip_dst, IP_ADDR_LEN);
 	if (!router_used) {
 		/* Check if a template specific drop rate applies */
-		tmpl = template_find_best(addr_ntoa(&addr), ip, iplen);
+		tmpl = honeyd_ctx_dst(&ctx, ip, iplen);
 		if (tmpl != NULL && tmpl->drop_inrate) {
 			uint16_t value;
 			value = rand_uint16(honeyd_rand) % (100*100);
@@ -2873,7 +3702,8 @@ honeyd_input(const struct interface *inter, struct ip_hdr *ip, u_short iplen)
 		}
 		if (tmpl != NULL && tmpl->flags & TEMPLATE_EXTERNAL)
 			flags |= DELAY_ETHERNET;
-		honeyd_delay_packet(NULL, ip, iplen, NULL, NULL, delay, flags, no_spoof);
+		honeyd_delay_packet(NULL, ip, iplen, NULL, NULL, delay, flags,
+		    no_spoof, &ctx);
 		return;
 	}
 
@@ -2921,11 +3751,11 @@ honeyd_input(const struct interface *inter, struct ip_hdr *ip, u_short iplen)
 		gw_addr = gw->addr;
 	else {
 		/* Pick the first one on the list */
-		gw = entry_routers->data;
+		gw = network_first(entry_routers);
 		gw_addr = gw->addr;
 	}
 
-	res = honeyd_route_packet(ip, iplen, &gw_addr, &addr, &delay);
+	res = honeyd_route_packet(ip, iplen, &gw_addr, &addr, &delay, &ctx);
 	if (res == FW_DROP)
 		return;
 
@@ -2948,13 +3778,14 @@ honeyd_input(const struct interface *inter, struct ip_hdr *ip, u_short iplen)
 		} else
 			flags |= DELAY_EXTERNAL;
 	} else
-		tmpl = template_find_best(addr_ntoa(&addr), ip, iplen);
+		tmpl = honeyd_ctx_dst(&ctx, ip, iplen);
 
 	if (tmpl != NULL && tmpl->flags & TEMPLATE_EXTERNAL)
 		flags |= DELAY_ETHERNET;
 
 	/* Delay the packet if necessary, otherwise deliver it directly */
-	honeyd_delay_packet(NULL, ip, iplen, NULL, NULL, delay, flags, no_spoof);
+	honeyd_delay_packet(NULL, ip, iplen, NULL, NULL, delay, flags, no_spoof,
+	    &ctx);
 }
 
 void
@@ -3030,6 +3861,106 @@ honeyd_recv_cb(u_char *ag, const struct pcap_pkthdr *pkthdr, const u_char *pkt)
 	honeyd_input(inter, ip, iplen);
 }
 
+/*
+ * Worker processes are forked after the configuration has been read.
+ * They share the templates, personalities and routing topology
+ * copy-on-write, but each has its own event base, connection and
+ * fragment tables and pools.  The kernel distributes packets by flow
+ * across the capture rings of all workers.  The first worker keeps
+ * the user interface, the webserver and rrdtool.
+ */
+static void
+honeyd_worker_init(int worker)
+{
+	extern int interface_ringsize;
+
+	honeyd_worker = worker;
+	if (event_reinit(honeyd_base_ev) == -1)
+		errx(1, "%s: event_reinit", __func__);
+
+	interface_worker_init(worker);
+
+	/*
+	 * Workers must not repeat each other's IP IDs, sequence numbers
+	 * and loss decisions.  The SYN cookie secret stays shared.
+	 */
+	if (honeyd_setrand) {
+		int seed[2] = { honeyd_setrand, worker };
+		rand_set(honeyd_rand, seed, sizeof(seed));
+	} else {
+		rand_close(honeyd_rand);
+		if ((honeyd_rand = rand_open()) == NULL)
+			err(1, "%s: rand_open", __func__);
+	}
+
+	ui_close();
+#ifdef HAVE_PYTHON
+	if (honeyd_is_webserver_enabled())
+		pyextend_webserver_exit();
+#endif
+	honeyd_disable_webserver = 1;
+	honeyd_disable_update = 1;
+	honeyd_rrdtool_path = NULL;
+
+	syslog(LOG_INFO, "worker %d capturing from %d MB rings",
+	    worker, interface_ringsize);
+}
+
+static void
+honeyd_workers_start(void)
+{
+	pid_t pid;
+	int i;
+
+	for (i = 1; i < honeyd_nworkers; i++) {
+		if ((pid = fork()) == -1)
+			err(1, "%s: fork", __func__);
+		if (pid == 0) {
+			honeyd_worker_init(i);
+			return;
+		}
+		honeyd_worker_pids[i] = pid;
+	}
+
+	syslog(LOG_NOTICE, "started %d additional worker processes",
+	    honeyd_nworkers - 1);
+}
+
+/* Passes a signal from the first worker on to all others */
+
+static void
+honeyd_workers_signal(int sig)
+{
+	int i;
+
+	for (i = 1; i < honeyd_nworkers; i++) {
+		if (honeyd_worker_pids[i] != 0)
+			kill(honeyd_worker_pids[i], sig);
+	}
+}
+
+static void
+honeyd_workers_stop(void)
+{
+	honeyd_workers_signal(SIGTERM);
+}
+
+static int
+honeyd_worker_exited(pid_t pid)
+{
+	int i;
+
+	for (i = 1; i < honeyd_nworkers; i++) {
+		if (honeyd_worker_pids[i] != pid)
+			continue;
+		syslog(LOG_ERR, "worker %d (pid %d) exited", i, pid);
+		honeyd_worker_pids[i] = 0;
+		return (1);
+	}
+
+	return (0);
+}
+
 static void
 honeyd_sigchld(evutil_socket_t fd, short what, void *arg)
 {
@@ -3038,6 +3969,8 @@ honeyd_sigchld(evutil_socket_t fd, short what, void *arg)
 		/* Ignore the rrdtool driver for children accounting */
 		if (honeyd_rrd_drv != NULL && honeyd_rrd_drv->pid == pid)
 			continue;
+		if (honeyd_worker_exited(pid))
+			continue;
 		honeyd_nchildren--;
 	}
 }
@@ -3046,6 +3979,15 @@ static void
 honeyd_signal(evutil_socket_t fd, short what, void *arg)
 {
 	syslog(LOG_NOTICE, "exiting on signal %d", fd);
+	syslog(LOG_NOTICE, "template lookups: %llu performed, %llu saved",
+	    (unsigned long long)honeyd_ctx_lookups,
+	    (unsigned long long)honeyd_ctx_saved);
+	syslog(LOG_NOTICE, "packets: %llu in place, copied %llu for delay, "
+	    "%llu for arp, %llu for fragments",
+	    (unsigned long long)stats_copy.inplace,
+	    (unsigned long long)stats_copy.copies[PKTCOPY_DELAY],
+	    (unsigned long long)stats_copy.copies[PKTCOPY_ARP],
+	    (unsigned long long)stats_copy.copies[PKTCOPY_FRAGMENT]);
 	honeyd_exit(0);
 }
 
@@ -3054,10 +3996,13 @@ honeyd_sighup(evutil_socket_t fd, short what, void *arg)
 {
 	syslog(LOG_NOTICE, "rereading configuration on signal %d", fd);
 
-	template_free_all(TEMPLATE_FREE_REGULAR);
-	router_end();
+	/* Templates that did not change keep their connections */
 	if (config.config != NULL)
-		config_read(config.config);
+		config_reload(config.config);
+
+	/* Every worker needs to see the same configuration */
+	if (honeyd_worker == 0)
+		honeyd_workers_signal(SIGHUP);
 }
 
 static void
@@ -3072,6 +4017,9 @@ honeyd_sigusr(evutil_socket_t fd, short what, void *arg)
 		honeyd_logfp = honeyd_logstart(logfile);
 	if (servicelog != NULL)
 		honeyd_servicefp = honeyd_logstart(servicelog);
+
+	if (honeyd_worker == 0)
+		honeyd_workers_signal(SIGUSR1);
 }
 
 struct _unittest {
@@ -3086,7 +4034,20 @@ struct _unittest {
 	{ "ethernet", ethernet_test },
 	{ "interface", interface_test },
 	{ "network", network_test },
+	{ "router", router_test },
+	{ "flow", flow_test },
+	{ "ipfrag", ip_fragment_test },
+	{ "timer", timer_test },
+	{ "pool", pool_test },
 	{ "template", template_test },
+	{ "personality", personality_test },
+	{ "perscache", perscache_test },
+	{ "snapshot", snapshot_test },
+	{ "cmdpool", cmd_pool_test },
+	{ "tcp", tcp_test },
+	{ "tcpbench", tcp_bench },
+	{ "tcpflood", tcp_flood_test },
+	{ "udp", udp_test },
 	{ NULL, NULL}
 };
 
@@ -3104,10 +4065,28 @@ unittest(void)
 	exit(0);
 }
 
+/* Parses a positive number of megabytes; returns 0 if it is not one */
+
+static size_t
+honeyd_parse_mbytes(const char *str)
+{
+	char *end;
+	long mbytes;
+
+	errno = 0;
+	mbytes = strtol(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || mbytes <= 0 ||
+	    (unsigned long)mbytes > (size_t)-1 / (1024 * 1024))
+		return (0);
+
+	return ((size_t)mbytes * 1024 * 1024);
+}
+
 int
 main(int argc, char *argv[])
 {
 	extern int interface_dopoll;
+	extern int interface_ringsize;
 	/* signal handling */
 	struct event 	*sigterm_ev,
 			*sigint_ev,
@@ -3121,8 +4100,9 @@ main(int argc, char *argv[])
 	char *stats_username = NULL;
 	char *stats_password = NULL;
 	int want_unittest = 0;
-	int setrand = 0;
 	int i, c, orig_argc, ninterfaces = 0;
+	char *persfiles[PERSCACHE_NSOURCES];
+	char *snapfiles[PERSCACHE_NSOURCES + 1];
 	FILE *fp;
 
 	fprintf(stderr, "Honeyd V%s Copyright (c) 2002-2007 Niels Provos\n",
@@ -3138,6 +4118,97 @@ main(int argc, char *argv[])
 			honeyd_rrdtool_path = optarg;
 			break;
 
+		case 'M':
+			honeyd_pool_maxmem = honeyd_parse_mbytes(optarg);
+			if (honeyd_pool_maxmem == 0) {
+				fprintf(stderr, "Bad pool memory: %s\n",
+				    optarg);
+				usage();
+			}
+			break;
+
+		case 'U':
+			honeyd_udp_maxmem = honeyd_parse_mbytes(optarg);
+			if (honeyd_udp_maxmem == 0) {
+				fprintf(stderr, "Bad UDP memory: %s\n",
+				    optarg);
+				usage();
+			}
+			break;
+
+		case 'B':
+			interface_ringsize = atoi(optarg);
+			if (interface_ringsize <= 0) {
+				fprintf(stderr, "Bad capture ring size: %s\n",
+				    optarg);
+				usage();
+			}
+			break;
+
+		case 'Q':
+			honeyd_send_batch = atoi(optarg);
+			if (honeyd_send_batch <= 0) {
+				fprintf(stderr, "Bad send batch size: %s\n",
+				    optarg);
+				usage();
+			}
+			break;
+
+		case 'L':
+			honeyd_send_latency = atoi(optarg);
+			if (honeyd_send_latency < 0) {
+				fprintf(stderr, "Bad send latency: %s\n",
+				    optarg);
+				usage();
+			}
+			break;
+
+		case 'w':
+			honeyd_nworkers = atoi(optarg);
+			if (honeyd_nworkers <= 0 ||
+			    honeyd_nworkers > HONEYD_MAX_WORKERS) {
+				fprintf(stderr, "Bad number of workers: %s\n",
+				    optarg);
+				usage();
+			}
+			break;
+
+		case 'K':
+			honeyd_script_workers = atoi(optarg);
+			if (honeyd_script_workers < 0) {
+				fprintf(stderr, "Bad number of script workers: "
+				    "%s\n", optarg);
+				usage();
+			}
+			break;
+
+		case 'C':
+			honeyd_syncookies = atoi(optarg);
+			if (honeyd_syncookies < 0) {
+				fprintf(stderr, "Bad number of half-open "
+				    "connections: %s\n", optarg);
+				usage();
+			}
+			break;
+
+		case 'N':
+			honeyd_max_source_connections = atoi(optarg);
+			if (honeyd_max_source_connections < 0) {
+				fprintf(stderr, "Bad number of connections "
+				    "per source: %s\n", optarg);
+				usage();
+			}
+			break;
+
+		case 'O':
+			honeyd_max_template_connections = atoi(optarg);
+			if (honeyd_max_template_connections < 0) {
+				fprintf(stderr, "Bad number of connections "
+				    "per template: %s\n", optarg);
+				usage();
+			}
+			break;
+
 		case 'A':
 			honeyd_webserver_address = optarg;
 			break;
@@ -3158,7 +4229,7 @@ main(int argc, char *argv[])
 			break;
 		case 'R':
 			/* For regression testing */
-			setrand = atoi(optarg);
+			honeyd_setrand = atoi(optarg);
 			break;
 		case 'c': {
 			char line[1024], *p = line;
@@ -3243,6 +4314,12 @@ main(int argc, char *argv[])
 		case 'p':
 			config.pers = optarg;
 			break;
+		case 'F':
+			config.perscache = optarg;
+			break;
+		case 'S':
+			config.snapshot = optarg;
+			break;
 		case '0':
 			config.osfp = optarg;
 			break;
@@ -3271,6 +4348,15 @@ main(int argc, char *argv[])
 		printf("%s\n", PATH_HONEYDDATA);
 		exit(0);
 	}
+	if (honeyd_compile_config) {
+		if (config.config == NULL || config.snapshot == NULL) {
+			fprintf(stderr, "--compile-config requires -f and "
+			    "--config-snapshot\n");
+			usage();
+		}
+		/* Compiling must not open any interfaces */
+		honeyd_verify_config = 1;
+	}
 
 	argc -= optind;
 	argv += optind;
@@ -3278,8 +4364,9 @@ main(int argc, char *argv[])
 	if ((honeyd_rand = rand_open()) == NULL)
 		err(1, "rand_open");
 	/* We need reproduceable random numbers for regression testing */
-	if (setrand)
-		rand_set(honeyd_rand, &setrand, sizeof(setrand));
+	if (honeyd_setrand)
+		rand_set(honeyd_rand, &honeyd_setrand, sizeof(honeyd_setrand));
+	tcp_syncookie_init();
 
 
 	/* disables event methods that don't work for bpf */
@@ -3291,11 +4378,35 @@ main(int argc, char *argv[])
 	/* Three priorities - UI connections always get a better priority */
 	event_base_priority_init(honeyd_base_ev, 3);
 
+	/*
+	 * All connection and cache timeouts are driven by one timer,
+	 * which is no more urgent than the packets.
+	 */
+	timer_init(1);
+
 	syslog_init(orig_argc, orig_argv);
 
 	/* Initalize pool allocator */
-	pool_pkt = pool_init(HONEYD_MTU);
-	pool_delay = pool_init(sizeof(struct delay));
+	pool_pkt = pool_init("packet", HONEYD_MTU,
+	    honeyd_pool_maxmem, POOL_TRIM_HIGHWATER);
+	pool_delay = pool_init("delay", sizeof(struct delay),
+	    honeyd_pool_maxmem, POOL_TRIM_HIGHWATER);
+	honeyd_delayq = honeyd_delayq_new();
+	pool_tcp = pool_init("tcp", sizeof(struct tcp_con),
+	    honeyd_pool_maxmem, POOL_TRIM_HIGHWATER);
+	pool_tcpbuf = pool_init("tcpbuf", TCP_MAX_SIZE,
+	    honeyd_pool_maxmem, POOL_TRIM_HIGHWATER);
+	pool_udp = pool_init("udp", sizeof(struct udp_con),
+	    honeyd_pool_maxmem, POOL_TRIM_HIGHWATER);
+	pool_conbuffer = pool_init("conbuffer",
+	    sizeof(struct conbuffer) + CONBUFFER_INLINE,
+	    honeyd_pool_maxmem, POOL_TRIM_HIGHWATER);
+	pool_tcpsource = pool_init("tcpsource", sizeof(struct tcp_source),
+	    honeyd_pool_maxmem, POOL_TRIM_HIGHWATER);
+
+	/* Give memory back once a connection flood has passed */
+	pool_set_highwater(pool_tcp, 1024);
+	pool_set_highwater(pool_udp, 1024);
 
 	/* Initialize honeyd's callback hooks */
 	hooks_init();
@@ -3317,26 +4428,41 @@ main(int argc, char *argv[])
 	xprobe_personality_init();
 	associations_init();
 
-	/* Xprobe2 fingerprints */
-	if ((fp = fopen(config.xprobe, "r")) == NULL)
-		err(1, "fopen(%s)", config.xprobe);
-	if (xprobe_personality_parse(fp) == -1)
-		errx(1, "parsing xprobe personality file failed");
-	fclose(fp);
-	
-	/* Association between xprobe and nmap fingerprints */
-	if ((fp = fopen(config.assoc, "r")) == NULL)
-		err(1, "fopen(%s)", config.assoc);
-	if (parse_associations(fp) == -1)
-		errx(1, "parsing associations file failed");
-	fclose(fp);
-
-	/* Nmap fingerprints */
-	if ((fp = fopen(config.pers, "r")) == NULL)
-		err(1, "fopen(%s)", config.pers);
-	if (personality_parse(fp) == -1)
-		errx(1, "parsing personality file failed");
-	fclose(fp);
+	/* The cache is only used if none of the fingerprint files changed */
+	persfiles[PERSCACHE_PERS] = config.pers;
+	persfiles[PERSCACHE_XPROBE] = config.xprobe;
+	persfiles[PERSCACHE_ASSOC] = config.assoc;
+	if (config.perscache != NULL &&
+	    perscache_load(config.perscache, persfiles) != -1) {
+		syslog(LOG_INFO, "loaded %d fingerprints from %s",
+		    npersons, config.perscache);
+	} else {
+		/* Xprobe2 fingerprints */
+		if ((fp = fopen(config.xprobe, "r")) == NULL)
+			err(1, "fopen(%s)", config.xprobe);
+		if (xprobe_personality_parse(fp) == -1)
+			errx(1, "parsing xprobe personality file failed");
+		fclose(fp);
+
+		/* Association between xprobe and nmap fingerprints */
+		if ((fp = fopen(config.assoc, "r")) == NULL)
+			err(1, "fopen(%s)", config.assoc);
+		if (parse_associations(fp) == -1)
+			errx(1, "parsing associations file failed");
+		fclose(fp);
+
+		/* Nmap fingerprints */
+		if ((fp = fopen(config.pers, "r")) == NULL)
+			err(1, "fopen(%s)", config.pers);
+		if (personality_parse(fp) == -1)
+			errx(1, "parsing personality file failed");
+		fclose(fp);
+
+		if (config.perscache != NULL &&
+		    perscache_save(config.perscache, persfiles) == -1)
+			syslog(LOG_WARNING, "could not write fingerprint "
+			    "cache %s", config.perscache);
+	}
 
 
 	/* PF OS fingerprints */
@@ -3358,6 +4484,11 @@ main(int argc, char *argv[])
 			err(1, "ip_open");
 	}
 
+	if (!honeyd_verify_config) {
+		sendq_init(honeyd_send_batch, honeyd_send_latency);
+		cmd_pool_init(honeyd_script_workers);
+	}
+
 	if (honeyd_verify_config) {
 		extern int interface_verify_config;
 		
@@ -3365,6 +4496,15 @@ main(int argc, char *argv[])
 		interface_verify_config = 1;
 	}
 
+	if (honeyd_nworkers > 1) {
+		extern int interface_ringsize, interface_nworkers;
+
+		/* Only capture rings can be shared between processes */
+		if (!interface_ringsize)
+			errx(1, "--workers requires --capture-ring");
+		interface_nworkers = honeyd_nworkers;
+	}
+
 	/* Initialize the specified interfaces */
 	if (ninterfaces == 0)
 		interface_init(NULL, argc, argc ? argv : NULL);
@@ -3389,13 +4529,37 @@ main(int argc, char *argv[])
 	ethernetcode_init();
 
 	/* Read main configuration file */
-	if (config.config != NULL)
-		config_read(config.config);
+	snapfiles[0] = config.config;
+	memcpy(&snapfiles[1], persfiles, sizeof(persfiles));
+	if (config.config != NULL) {
+		if (config.snapshot != NULL && !honeyd_compile_config &&
+		    snapshot_load(config.snapshot, snapfiles,
+			PERSCACHE_NSOURCES + 1) != -1)
+			syslog(LOG_INFO, "loaded configuration from %s",
+			    config.snapshot);
+		else
+			config_read(config.config);
+	}
+
+	if (honeyd_compile_config) {
+		if (snapshot_save(config.snapshot, snapfiles,
+			PERSCACHE_NSOURCES + 1) == -1)
+			errx(1, "compiling configuration failed");
+		errx(0, "wrote configuration snapshot %s", config.snapshot);
+	}
 
 	/* Just verify the configuration - exit with success */
 	if (honeyd_verify_config)
 		errx(0, "parsing configuration file successful");
 
+	if (honeyd_nworkers > 1) {
+		extern struct subsystemqueue subsystems;
+
+		/* A subsystem would see the connections of only one worker */
+		if (!TAILQ_EMPTY(&subsystems))
+			errx(1, "subsystems can not be used with --workers");
+	}
+
 	/* Attach the UI interface */
 	ui_init();
 	
@@ -3435,6 +4599,10 @@ main(int argc, char *argv[])
 	
 	chmod(PIDFILE, 0644);
 
+	/* Fork the other workers while we can still open capture rings */
+	if (honeyd_nworkers > 1)
+		honeyd_workers_start();
+
 	/* Drop privileges if we do not need them */
 	if (honeyd_needsroot <= 0) {
 		cmd_droppriv(honeyd_uid, honeyd_gid);
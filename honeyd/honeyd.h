@@ -32,14 +32,28 @@
 #ifndef _HONEYD_H_
 #define _HONEYD_H_
 
+#include "timer.h"
+
 #define PIDFILE			"/var/run/honeyd.pid"
 
-#define TCP_DEFAULT_SIZE	512
-#define TCP_MAX_SIZE		4096
-#define TCP_MAX_SEND		512
+#define TCP_MAX_SIZE		16384	/* ring buffers; a power of two */
+#define TCP_DEFAULT_MSS		536	/* if the peer did not announce one */
+#define TCP_MAX_SACKS		8	/* blocks remembered from the peer */
+#define TCP_MAX_RETRANS		5	/* timeouts before giving up */
+
+/* Retransmission timeouts in msec, see RFC 6298 */
+#define TCP_RTO_INIT		1000
+#define TCP_RTO_SYNLOSS		3000	/* if the handshake was retransmitted */
+#define TCP_RTO_MIN		1000
+#define TCP_RTO_MAX		60000
 
 #define HONEYD_MTU		1500
 #define HONEYD_MAX_INTERFACES	8
+#define HONEYD_MAX_WORKERS	64	/* processes sharing the capture */
+
+/* Memory each pool keeps allocated after a burst, see --pool-memory */
+#define HONEYD_POOL_MAXMEM	(8 * 1024 * 1024)
+#define HONEYD_UDP_MAXMEM	(4 * 1024 * 1024) /* datagrams for scripts */
 
 #define HONEYD_MAX_CONNECTS	32000
 
@@ -60,6 +74,8 @@ struct config {
 	char *xprobe;
 	char *assoc;
 	char *osfp;
+	char *perscache; /* Binary cache of the three above */
+	char *snapshot;	 /* Compiled configuration */
 };
 
 struct count;
@@ -68,6 +84,44 @@ struct stats_network {
 	struct count *output_bytes;
 };
 
+/*
+ * Received packets are processed directly out of the capture buffer.
+ * They are only copied when they have to outlive the receive callback;
+ * these counters keep track of how often that happens and why.
+ */
+enum pktcopy {
+	PKTCOPY_DELAY = 0,	/* held back to simulate routing latency */
+	PKTCOPY_ARP,		/* waiting for ARP resolution */
+	PKTCOPY_FRAGMENT,	/* kept for reassembly */
+	PKTCOPY_MAX
+};
+
+struct stats_copy {
+	uint64_t inplace;	/* packets delivered without a copy */
+	uint64_t copies[PKTCOPY_MAX];
+	uint64_t copybytes[PKTCOPY_MAX];
+};
+
+extern struct stats_copy stats_copy;
+
+/* Admission of incoming TCP connections */
+struct stats_admit {
+	uint64_t cookies_sent;
+	uint64_t cookies_accepted;
+	uint64_t cookies_rejected;	/* acknowledged no valid cookie */
+	uint64_t refused_source;	/* --max-source-connections */
+	uint64_t refused_template;	/* --max-template-connections */
+	uint64_t evicted_quiet;		/* never received any data */
+	uint64_t evicted_oldest;
+};
+
+extern struct stats_admit stats_admit;
+
+#define honeyd_count_copy(type, len) do { \
+	stats_copy.copies[type]++; \
+	stats_copy.copybytes[type] += (len); \
+} while (0)
+
 struct spoof {
 	struct addr new_src;	/* where the reply should appear to come from */
 	struct addr new_dst;	/* where the reply should go */
@@ -75,8 +129,25 @@ struct spoof {
 
 extern struct spoof no_spoof;
 
+/*
+ * Templates resolved for a single packet.  The context travels with the
+ * packet from the input path to internal delivery so that each address
+ * is looked up only once, including dynamic template resolution.
+ */
+struct pktctx {
+	struct template *src;
+	struct template *dst;
+	int flags;
+
+	struct delayq *queue;	/* last bandwidth limited link */
+};
+
+#define PKTCTX_SRC	0x0001	/* src template has been resolved */
+#define PKTCTX_DST	0x0002	/* dst template has been resolved */
+
 struct delay {
-	struct event *timeout;
+	TAILQ_ENTRY(delay) next;
+	struct timeval tv_due;
 
 	struct addr src;
 	struct addr dst;
@@ -87,6 +158,21 @@ struct delay {
 
 	struct spoof spoof;
 	int flags;
+
+	struct pktctx *ctx;	/* only set for immediate delivery */
+};
+
+/*
+ * Delayed packets wait in a queue that is sorted by the time they are
+ * due and drained by a single timer.  Each bandwidth limited link has
+ * its own queue, all other delayed packets share one.  Packets mostly
+ * arrive in order, so inserting them from the tail is cheap.
+ */
+TAILQ_HEAD(delayqueue, delay);
+
+struct delayq {
+	struct delayqueue packets;
+	struct event *ev;
 };
 
 #define DELAY_NEEDFREE	0x0001
@@ -159,7 +245,7 @@ struct tuple {
 	uint32_t received;
 	uint32_t sent;
 
-	struct event *timeout;
+	struct timer timeout;
 
 	int local;	/* locally initiated */
 
@@ -169,6 +255,7 @@ struct tuple {
 
 SPLAY_HEAD(tree, tuple);
 TAILQ_HEAD(conlru, tuple);
+TAILQ_HEAD(tcpquietq, tcp_con);
 
 struct command {
 	pid_t pid;
@@ -208,6 +295,8 @@ struct port_encapsulate {
 
 /* State about TCP connections */
 
+struct tcp_source;
+
 struct tcp_con {
 	/* Has to be the first member of the structure */
 	struct tuple conhdr;
@@ -216,6 +305,12 @@ struct tcp_con {
 #define con_sport conhdr.sport
 #define con_dport conhdr.dport
 
+	/* Connections that never received any data are evicted first */
+	TAILQ_ENTRY(tcp_con) quiet;
+	TAILQ_ENTRY(tcp_con) srcquiet;	/* of the same source */
+	TAILQ_ENTRY(tcp_con) tmplquiet;	/* of the same template */
+	struct tcp_source *source;	/* for --max-source-connections */
+
 	uint8_t dupacks;
 	uint32_t snd_una;
 
@@ -229,13 +324,14 @@ struct tcp_con {
 #define cmd_pfd	cmd.pfd
 #define cmd_perrfd cmd.perrfd
 
+	/* Rings of TCP_MAX_SIZE bytes, only allocated while they hold data */
 	u_char *payload;
-	u_int psize;
+	u_int phead;		/* first unacknowledged byte */
 	u_int plen;		/* date in buffer */
 	u_int poff;		/* current send offset */
 
 	u_char *readbuf;
-	u_int rsize;
+	u_int rhead;
 	u_int rlen;
 
 	uint8_t state;
@@ -243,25 +339,63 @@ struct tcp_con {
 		finacked:1,
 		sawwscale:1,
 		sawtimestamp:1,
-		unused:4;
+		sawsackok:1,
+		unused:3;
 
 	u_short	mss;
 	u_short window;
 	uint32_t echotimestamp;
 
-	u_short retrans_time;
-
-	struct event *retrans_timeout;
+	/* Retransmission timer after RFC 6298; all times are in msec */
+	u_int srtt;
+	u_int rttvar;
+	u_int rto;
+	uint32_t rtt_seq;		/* acknowledging this ends the sample */
+	uint32_t rtt_start;
+	uint8_t rexmits;		/* consecutive timeouts */
+
+	struct timer retrans_timeout;
+
+	/* Congestion control after RFC 5681 and RFC 6582 */
+	uint32_t snd_max;		/* highest sequence number sent */
+	uint32_t snd_wnd;		/* window of the peer, scaled */
+	uint32_t cwnd;
+	uint32_t ssthresh;
+	uint32_t recover;		/* snd_max when recovery started */
+	uint32_t rexmt;			/* holes retransmitted up to here */
+	u_short smss;			/* from the MSS option of the peer */
+	uint8_t snd_wscale;		/* window shift of the peer */
+
+	/* Data the peer acknowledged selectively, sorted, RFC 2018 */
+	struct tcp_sack {
+		uint32_t start;
+		uint32_t end;
+	} sacks[TCP_MAX_SACKS];
+	int nsacks;
 
 	struct port *port;		/* used if bound to sub system */
 
-	uint16_t flags;			/* Currently used for tarpitting */
+	uint16_t flags;
 };
 
 #define TCP_TARPIT	0x01
-
-#define MAX_UDP_BUFFERS	10
-
+#define TCP_TIMING	0x02	/* rtt_seq is being timed */
+#define TCP_RECOVERY	0x04	/* fast recovery until recover is acked */
+#define TCP_SACKOK	0x08	/* both sides permitted SACK */
+#define TCP_WSCALE	0x10	/* our SYN carried a window scale option */
+#define TCP_QUIET	0x20	/* on the queue of quiet connections */
+#define TCP_HALFOPEN	0x40	/* waiting for the ACK of our SYN-ACK */
+#define TCP_COUNTED	0x80	/* counts against the connection quotas */
+#define TCP_COOKIE	0x100	/* our SYN-ACK carries a SYN cookie */
+
+/* Segments leave room for a full set of options */
+#define TCP_MAX_SEGMENT	(HONEYD_MTU - IP_HDR_LEN - TCP_HDR_LEN - TCP_OPT_LEN_MAX)
+
+#define MAX_UDP_BUFFERS	32
+#define MAX_UDP_QUEUED	(64 * 1024)	/* bytes waiting per flow */
+#define CONBUFFER_INLINE 512		/* datagrams that fit a pool object */
+
+/* A datagram waiting for a script; the data follows the header */
 struct conbuffer {
 	TAILQ_ENTRY(conbuffer) next;
 
@@ -279,6 +413,7 @@ struct udp_con {
 
 	TAILQ_HEAD(bufferq, conbuffer) incoming;
 	int nincoming;
+	size_t queued;		/* bytes in incoming */
 
 	int softerrors;		/* ICMP unreachables for this state */
 
@@ -324,7 +459,6 @@ struct icmp_msg_inforeply { /* Our definition */
 };
 
 #define TCP_BYTESINFLIGHT(x)	(x)->poff
-#define TCP_MAX_INFLIGHT	4096
 
 /* other forward reference structures */
 struct addrinfo;
@@ -341,10 +475,16 @@ extern struct event_base *honeyd_base_ev; /* the event base from libevent2 for e
 
 /* Iterate over all active connections */
 int tuple_iterate(struct conlru *, int (*f)(struct tuple *, void *), void *);
-struct tuple *tuple_find(struct tree *, struct tuple *);
+struct flowtable;
+struct tuple *tuple_find(struct flowtable *, struct tuple *);
 
 void honeyd_ip_send(u_char *, u_int, struct spoof spoof);
 void honeyd_dispatch(struct template *, struct ip_hdr *, u_short);
+void honeyd_delayq_free(struct delayq *);
+struct evbuffer;
+void honeyd_print_packet_stats(struct evbuffer *);
+void honeyd_print_lookup_stats(struct evbuffer *);
+void honeyd_print_connection_stats(struct evbuffer *);
 char *honeyd_contoa(const struct tuple *);
 
 void honeyd_input(const struct interface *, struct ip_hdr *, u_short);
@@ -353,6 +493,10 @@ struct action *honeyd_protocol(struct template *, int);
 
 /* Command prototypes for services */
 void cmd_droppriv(uid_t, gid_t);
+void cmd_credentials(struct template *, uid_t *, gid_t *, int *);
+void cmd_environment_list(struct template *, struct tuple *,
+    void (*)(const char *, const char *, void *), void *);
+void cmd_attach(struct tuple *, struct command *, int, int, void *);
 
 void cmd_ready_fd(struct command *, struct callback *, void *);
 void cmd_trigger_read(struct command *, int);
@@ -390,6 +534,7 @@ int  udp_send(struct udp_con *con, u_char *payload, u_int len);
 
 void config_init(void);
 void config_read(char *);
+int config_reload(char *);
 
 struct port *port_insert(struct template *, int, int, struct action *);
 struct port *port_random(struct template *, int, struct action *, int, int);
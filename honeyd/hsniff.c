@@ -665,6 +665,7 @@ main(int argc, char *argv[])
 	interface_prevent_init();
 
 	honeyd_base_ev = event_base_new();
+	timer_init(0);
 
 	syslog_init(orig_argc, orig_argv);
 
@@ -43,11 +43,23 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#include <sys/socket.h>
+#include <net/if.h>
 
 #ifdef HAVE_NET_BPF_H
 #include <net/bpf.h>
 #endif
 
+#ifdef HAVE_LINUX_IF_PACKET_H
+#include <sys/mman.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#ifdef TPACKET3_HDRLEN		/* TPACKET_V3 is an enum */
+#define HAVE_INTERFACE_RING
+#endif
+#endif
+
 #include <err.h>
 #include <errno.h>
 #include <stdio.h>
@@ -72,11 +84,51 @@ int pcap_dloff(pcap_t *);
 static char *interface_expandips(int, char **, int);
 static void interface_recv(int, short, void *);
 static void interface_poll_recv(int, short, void *);
+static void interface_schedule(struct interface *, int);
 
 int interface_verify_config = 0;
 int interface_dopoll;
+int interface_ringsize;		/* capture ring in MB, 0 uses libpcap */
+int interface_nworkers = 1;	/* processes sharing each capture ring */
+int interface_worker;		/* index of this process */
 char *interface_filter = NULL;
 
+#ifdef HAVE_INTERFACE_RING
+/*
+ * On Linux, packets can be captured from a memory-mapped TPACKET_V3
+ * ring instead of going through libpcap.  The kernel fills whole blocks
+ * of packets, so that a single readiness event delivers a batch of
+ * packets without any system calls or copies.
+ */
+#define RING_BLOCKSIZE	(1 << 17)
+#define RING_FRAMESIZE	2048
+#define RING_TIMEOUT	30	/* ms until a partial block is retired */
+
+struct interface_ring {
+	int fd;
+	u_char *map;
+	size_t maplen;
+
+	u_int nblocks;
+	u_int cur;		/* next block to look at */
+
+	int promisc;
+	int fanout;		/* group shared by all workers, or 0 */
+
+	/* With several workers, ARP bypasses the fanout */
+	int arpfd;
+	struct event *arpev;
+
+	uint64_t packets;
+	uint64_t blocks;
+};
+
+static int interface_ring_open(struct interface *, int, int);
+static void interface_ring_recv(struct interface *);
+static void interface_ring_close(struct interface *);
+static void interface_ring_free(struct interface *);
+#endif
+
 static TAILQ_HEAD(ifq, interface) interfaces;
 static intf_t *intf;
 static pcap_handler if_recv_cb = NULL;
@@ -133,6 +185,8 @@ interface_new(char *dev)
 		errx(1, "%s: bad interface configuration: %s is not IP",
 		    __func__, dev);
 
+	inter->if_index = if_nametoindex(inter->if_ent.intf_name);
+
 	return (inter);
 }
 
@@ -200,20 +254,18 @@ struct interface *
 interface_find_responsible(struct addr *addr)
 {
 	struct interface *inter;
-	struct network net, ifnet;
-
-	net.net = *addr;
+	struct addr ifnet;
 
 	TAILQ_FOREACH(inter, &interfaces, next) {
 		/* 
 		 * Restore the original address so that the network
 		 * comparison gets the correct network bits.
 		 */
-		ifnet.net = inter->if_ent.intf_addr;
-		ifnet.net.addr_bits = inter->if_addrbits;
-		addr_net(&ifnet.net, &ifnet.net);
-		ifnet.net.addr_bits = inter->if_addrbits;
-		if (network_compare(&ifnet, &net) == NET_CONTAINS)
+		ifnet = inter->if_ent.intf_addr;
+		ifnet.addr_bits = inter->if_addrbits;
+		addr_net(&ifnet, &ifnet);
+		ifnet.addr_bits = inter->if_addrbits;
+		if (network_compare(&ifnet, addr) == NET_CONTAINS)
 			return (inter);
 	}
 
@@ -227,7 +279,12 @@ interface_close(struct interface *inter)
 
 	if (inter->if_eth != NULL)
 		eth_close(inter->if_eth);
-	pcap_close(inter->if_pcap);
+#ifdef HAVE_INTERFACE_RING
+	if (inter->if_ring != NULL)
+		interface_ring_close(inter);
+#endif
+	if (inter->if_pcap != NULL)
+		pcap_close(inter->if_pcap);
 
 	free(inter);
 }
@@ -334,6 +391,18 @@ interface_init(char *dev, int naddresses, char **addresses)
 	if (interface_verify_config)
 		return;
 
+#ifdef HAVE_INTERFACE_RING
+	if (interface_ringsize &&
+	    inter->if_ent.intf_link_addr.addr_type == ADDR_TYPE_ETH) {
+		pcap_fd = interface_ring_open(inter, promisc, 0);
+		interface_schedule(inter, pcap_fd);
+		return;
+	}
+#endif
+	if (interface_ringsize)
+		syslog(LOG_WARNING, "%s: capture ring not supported, using pcap",
+		    inter->if_ent.intf_name);
+
 	time = interface_dopoll ? 10 : 30;
 	if ((inter->if_pcap = pcap_open_live(inter->if_ent.intf_name,
 		 inter->if_ent.intf_mtu + 40, promisc, time, ebuf)) == NULL)
@@ -365,8 +434,15 @@ interface_init(char *dev, int naddresses, char **addresses)
 	}
 #endif
 
+	interface_schedule(inter, pcap_fd);
+}
+
+/* Arranges for packets to be read from the descriptor */
+static void
+interface_schedule(struct interface *inter, int fd)
+{
 	if (!interface_dopoll) {
-		inter->if_recvev = event_new(honeyd_base_ev, pcap_fd, EV_READ, interface_recv, inter);
+		inter->if_recvev = event_new(honeyd_base_ev, fd, EV_READ, interface_recv, inter);
 		event_add(inter->if_recvev, NULL);
 	} else {
 		struct timeval tv = HONEYD_POLL_INTERVAL;
@@ -491,6 +567,13 @@ interface_recv(int fd, short type, void *arg)
 	if (!interface_dopoll)
 		event_add(inter->if_recvev, NULL);
 
+#ifdef HAVE_INTERFACE_RING
+	if (inter->if_ring != NULL) {
+		interface_ring_recv(inter);
+		return;
+	}
+#endif
+
 	if (pcap_dispatch(inter->if_pcap, -1, if_recv_cb, (u_char *)inter) < 0)
 		syslog(LOG_ERR, "pcap_dispatch: %s",
 		    pcap_geterr(inter->if_pcap));
@@ -507,6 +590,284 @@ interface_poll_recv(int fd, short type, void *arg)
 	interface_recv(fd, type, arg);
 }
 
+#ifdef HAVE_INTERFACE_RING
+/* Compiles the filter for ethernet and attaches it to the socket */
+static void
+interface_ring_filter(struct interface *inter, int fd, const char *fmt)
+{
+	char filter[sizeof(inter->if_filter) + 32];
+	struct bpf_program fcode;
+	struct sock_fprog fprog;
+	pcap_t *pd;
+
+	snprintf(filter, sizeof(filter), fmt, inter->if_filter);
+
+	if ((pd = pcap_open_dead(DLT_EN10MB,
+		 inter->if_ent.intf_mtu + 40)) == NULL)
+		errx(1, "%s: pcap_open_dead", __func__);
+	if (pcap_compile(pd, &fcode, filter, 1, 0) < 0)
+		errx(1, "bad pcap filter: %s", pcap_geterr(pd));
+	fprog.len = fcode.bf_len;
+	fprog.filter = (struct sock_filter *)fcode.bf_insns;
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+		&fprog, sizeof(fprog)) == -1)
+		err(1, "%s: SO_ATTACH_FILTER", __func__);
+	pcap_freecode(&fcode);
+	pcap_close(pd);
+}
+
+/* Reads the ARP packets that this worker receives outside of the ring */
+static void
+interface_arp_recv(int fd, short type, void *arg)
+{
+	struct interface *inter = arg;
+	struct pcap_pkthdr pkthdr;
+	u_char pkt[2048];
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		if ((n = recv(fd, pkt, sizeof(pkt), MSG_DONTWAIT)) <= 0)
+			break;
+
+		event_base_gettimeofday_cached(honeyd_base_ev, &pkthdr.ts);
+		pkthdr.caplen = pkthdr.len = n;
+		(*if_recv_cb)((u_char *)inter, &pkthdr, pkt);
+	}
+}
+
+/*
+ * The kernel hashes IP packets by their addresses and ports across all
+ * workers, but ARP does not carry a flow.  So each worker sees all ARP
+ * replies to learn the addresses it asked for, and only the first one
+ * answers requests.
+ */
+static void
+interface_arp_open(struct interface *inter, struct interface_ring *ring)
+{
+	struct sockaddr_ll sll;
+
+	if ((ring->arpfd = socket(AF_PACKET, SOCK_RAW,
+		 htons(ETH_P_ARP))) == -1)
+		err(1, "%s: socket", __func__);
+
+	interface_ring_filter(inter, ring->arpfd, interface_worker == 0 ?
+	    "(%s) and arp" : "(%s) and arp and arp[6:2] = 2");
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ARP);
+	sll.sll_ifindex = inter->if_index;
+	if (bind(ring->arpfd, (struct sockaddr *)&sll, sizeof(sll)) == -1)
+		err(1, "%s: bind", __func__);
+
+	ring->arpev = event_new(honeyd_base_ev, ring->arpfd,
+	    EV_READ | EV_PERSIST, interface_arp_recv, inter);
+	event_add(ring->arpev, NULL);
+}
+
+/*
+ * Opens an AF_PACKET socket with a TPACKET_V3 receive ring.  The
+ * filter is still compiled by libpcap and attached to the socket.
+ * If several workers share the interface, the socket joins the fanout
+ * group.  Returns the file descriptor to wait on.
+ */
+static int
+interface_ring_open(struct interface *inter, int promisc, int fanout)
+{
+	struct interface_ring *ring;
+	struct tpacket_req3 req;
+	struct sockaddr_ll sll;
+	struct packet_mreq mreq;
+	int version = TPACKET_V3;
+	int ifindex = inter->if_index;
+
+	if ((ring = calloc(1, sizeof(struct interface_ring))) == NULL)
+		err(1, "%s: calloc", __func__);
+	ring->promisc = promisc;
+	ring->arpfd = -1;
+
+	if (ifindex == 0)
+		errx(1, "%s: no index for %s", __func__,
+		    inter->if_ent.intf_name);
+
+	if ((ring->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) == -1)
+		err(1, "%s: socket", __func__);
+
+	interface_ring_filter(inter, ring->fd,
+	    interface_nworkers > 1 ? "(%s) and not arp" : "%s");
+
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION,
+		&version, sizeof(version)) == -1)
+		err(1, "%s: TPACKET_V3 is not supported", __func__);
+
+	ring->nblocks = interface_ringsize * (1024 * 1024 / RING_BLOCKSIZE);
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = RING_BLOCKSIZE;
+	req.tp_block_nr = ring->nblocks;
+	req.tp_frame_size = RING_FRAMESIZE;
+	req.tp_frame_nr = (RING_BLOCKSIZE / RING_FRAMESIZE) * ring->nblocks;
+	req.tp_retire_blk_tov = RING_TIMEOUT;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING,
+		&req, sizeof(req)) == -1)
+		err(1, "%s: PACKET_RX_RING", __func__);
+
+	ring->maplen = (size_t)req.tp_block_size * req.tp_block_nr;
+	ring->map = mmap(NULL, ring->maplen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_LOCKED, ring->fd, 0);
+	if (ring->map == MAP_FAILED)
+		err(1, "%s: mmap", __func__);
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(ring->fd, (struct sockaddr *)&sll, sizeof(sll)) == -1)
+		err(1, "%s: bind", __func__);
+
+	if (promisc) {
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.mr_ifindex = ifindex;
+		mreq.mr_type = PACKET_MR_PROMISC;
+		if (setsockopt(ring->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+			&mreq, sizeof(mreq)) == -1)
+			err(1, "%s: PACKET_MR_PROMISC", __func__);
+	}
+
+	if (interface_nworkers > 1) {
+		int arg;
+
+		/* Packets of the same flow always go to the same worker */
+		if (!fanout)
+			fanout = ((getpid() << 4) ^ ifindex) & 0xffff;
+		ring->fanout = fanout;
+		arg = fanout | ((PACKET_FANOUT_HASH |
+			PACKET_FANOUT_FLAG_DEFRAG) << 16);
+		if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT,
+			&arg, sizeof(arg)) == -1)
+			err(1, "%s: PACKET_FANOUT", __func__);
+
+		interface_arp_open(inter, ring);
+	}
+
+	inter->if_ring = ring;
+	inter->if_dloff = ETH_HDR_LEN;
+
+	syslog(LOG_INFO, "listening %son %s with a %d MB ring: %s",
+	    promisc ? "promiscuously " : "",
+	    inter->if_ent.intf_name, interface_ringsize, inter->if_filter);
+
+	return (ring->fd);
+}
+
+/* Hands all packets of the blocks that the kernel has filled to honeyd */
+static void
+interface_ring_recv(struct interface *inter)
+{
+	struct interface_ring *ring = inter->if_ring;
+	struct tpacket_block_desc *block;
+	struct tpacket3_hdr *hdr;
+	struct pcap_pkthdr pkthdr;
+	uint32_t i, npkts;
+
+	for (;;) {
+		block = (struct tpacket_block_desc *)
+		    (ring->map + (size_t)ring->cur * RING_BLOCKSIZE);
+		if (!(block->hdr.bh1.block_status & TP_STATUS_USER))
+			break;
+
+		npkts = block->hdr.bh1.num_pkts;
+		hdr = (struct tpacket3_hdr *)
+		    ((u_char *)block + block->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < npkts; i++) {
+			pkthdr.ts.tv_sec = hdr->tp_sec;
+			pkthdr.ts.tv_usec = hdr->tp_nsec / 1000;
+			pkthdr.caplen = hdr->tp_snaplen;
+			pkthdr.len = hdr->tp_len;
+
+			(*if_recv_cb)((u_char *)inter, &pkthdr,
+			    (u_char *)hdr + hdr->tp_mac);
+
+			hdr = (struct tpacket3_hdr *)
+			    ((u_char *)hdr + hdr->tp_next_offset);
+		}
+
+		ring->packets += npkts;
+		ring->blocks++;
+
+		/* Give the block back to the kernel */
+		block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		ring->cur = (ring->cur + 1) % ring->nblocks;
+	}
+}
+
+static void
+interface_ring_free(struct interface *inter)
+{
+	struct interface_ring *ring = inter->if_ring;
+
+	if (ring->arpev != NULL)
+		event_free(ring->arpev);
+	if (ring->arpfd != -1)
+		close(ring->arpfd);
+	munmap(ring->map, ring->maplen);
+	close(ring->fd);
+	free(ring);
+	inter->if_ring = NULL;
+}
+
+static void
+interface_ring_close(struct interface *inter)
+{
+	struct interface_ring *ring = inter->if_ring;
+	struct tpacket_stats_v3 stats;
+	socklen_t len = sizeof(stats);
+
+	if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS,
+		&stats, &len) == 0)
+		syslog(LOG_INFO, "%s: %llu packets in %llu blocks, %u dropped",
+		    inter->if_ent.intf_name,
+		    (unsigned long long)ring->packets,
+		    (unsigned long long)ring->blocks, stats.tp_drops);
+
+	interface_ring_free(inter);
+}
+#endif /* HAVE_INTERFACE_RING */
+
+/*
+ * Called in a newly forked worker process.  The capture rings that
+ * were inherited from the first worker are replaced with rings of our
+ * own that join the same fanout groups.
+ */
+void
+interface_worker_init(int worker)
+{
+#ifdef HAVE_INTERFACE_RING
+	struct interface *inter;
+	struct interface_ring *ring;
+	int fd, promisc, fanout;
+
+	interface_worker = worker;
+
+	TAILQ_FOREACH(inter, &interfaces, next) {
+		if ((ring = inter->if_ring) == NULL)
+			continue;
+
+		promisc = ring->promisc;
+		fanout = ring->fanout;
+
+		event_free(inter->if_recvev);
+		interface_ring_free(inter);
+
+		fd = interface_ring_open(inter, promisc, fanout);
+		interface_schedule(inter, fd);
+	}
+#else
+	errx(1, "%s: worker processes are not supported", __func__);
+#endif
+}
+
 /* Unittests */
 static void
 interface_test_insert_and_find(void)
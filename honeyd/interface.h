@@ -39,8 +39,10 @@ struct interface {
 	int if_addrbits;
 	struct event *if_recvev;
 	pcap_t *if_pcap;
+	struct interface_ring *if_ring;	/* memory-mapped capture */
 	eth_t *if_eth;
 	int if_dloff;
+	int if_index;			/* kernel interface index */
 
 	char if_filter[1024];
 	struct intf_entry if_ent;
@@ -62,6 +64,8 @@ int interface_count(void);
 void interface_close(struct interface *);
 void interface_close_all(void);
 
+void interface_worker_init(int);
+
 void interface_test(void);
 
 #endif /* _INTERFACE_ */
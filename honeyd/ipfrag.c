@@ -65,30 +65,18 @@
 #include "pool.h"
 
 extern struct pool *pool_pkt;
+extern rand_t *honeyd_rand;
 
-static u_char buf[IP_LEN_MAX];  /* for complete packet */
+static struct pool *pool_fragment;
+static struct pool *pool_fragbuf;
 
-SPLAY_HEAD(fragtree, fragment) fragments;
+/* The last reassembled packet; valid until the next one is complete */
+static u_char *fragdone;
 
-#define DIFF(a,b) do { \
-	if ((a) < (b)) return -1; \
-	if ((a) > (b)) return 1; \
-} while (0)
+#define IPFRAG_INFINITY		(IP_LEN_MAX + 1)
 
-int
-fragcompare(struct fragment *a, struct fragment *b)
-{
-	DIFF(a->ip_src, b->ip_src);
-	DIFF(a->ip_dst, b->ip_dst);
-	DIFF(a->ip_id, b->ip_id);
-	DIFF(a->ip_proto, b->ip_proto);
-
-	return (0);
-}
-
-SPLAY_PROTOTYPE(fragtree, fragment, node, fragcompare);
-
-SPLAY_GENERATE(fragtree, fragment, node, fragcompare);
+static LIST_HEAD(fraghash, fragment) fragtable[IPFRAG_HASHSIZE];
+static uint32_t fragseed;
 
 TAILQ_HEAD(fragqueue, fragment) fraglru;
 
@@ -98,24 +86,52 @@ int nfragmem;
 void
 ip_fragment_init(void)
 {
-	SPLAY_INIT(&fragments);
+	int i;
+
+	for (i = 0; i < IPFRAG_HASHSIZE; i++)
+		LIST_INIT(&fragtable[i]);
 	TAILQ_INIT(&fraglru);
 
+	/* Keep attackers from aiming at a single hash bucket */
+	fragseed = rand_uint32(honeyd_rand);
+
+	pool_fragment = pool_init("fragment", sizeof(struct fragment),
+	    0, POOL_TRIM_HIGHWATER);
+	pool_fragbuf = pool_init("fragbuf", IPFRAG_MINSIZE,
+	    IPFRAG_MAX_MEM, POOL_TRIM_HIGHWATER);
+
 	nfragments = 0;
 	nfragmem = 0;
 }
 
+static __inline struct fraghash *
+ip_fragment_bucket(ip_addr_t src, ip_addr_t dst, u_short id, u_char proto)
+{
+	uint32_t h = fragseed;
+
+	h ^= src;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h ^= dst;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	h ^= ((uint32_t)id << 8) | proto;
+	h *= 0x85ebca6b;
+	h ^= h >> 16;
+
+	return (&fragtable[h & (IPFRAG_HASHSIZE - 1)]);
+}
+
 struct fragment *
 ip_fragment_find(ip_addr_t src, ip_addr_t dst, u_short id, u_char proto)
 {
-	struct fragment tmp, *frag;
-
-	tmp.ip_src = src;
-	tmp.ip_dst = dst;
-	tmp.ip_id = id;
-	tmp.ip_proto = proto;
+	struct fragment *frag;
 
-	frag = SPLAY_FIND(fragtree, &fragments, &tmp);
+	LIST_FOREACH(frag, ip_fragment_bucket(src, dst, id, proto), hash) {
+		if (frag->ip_src == src && frag->ip_dst == dst &&
+		    frag->ip_id == id && frag->ip_proto == proto)
+			break;
+	}
 
 	if (frag != NULL) {
 		TAILQ_REMOVE(&fraglru, frag, next);
@@ -125,38 +141,24 @@ ip_fragment_find(ip_addr_t src, ip_addr_t dst, u_short id, u_char proto)
 	return (frag);
 }
 
-/* Free a fragment by removing it from all lists, etc... */
-void
-ip_fragent_free(struct fragent *ent)
-{
-	nfragmem -= ent->size;
-
-	free(ent->data);
-	free(ent);
-}
-
 void
 ip_fragment_free(struct fragment *tmp)
 {
-	struct fragent *ent;
+	timer_del(&tmp->timeout);
 
-	evtimer_del(tmp->timeout);
-
-	SPLAY_REMOVE(fragtree, &fragments, tmp);
+	LIST_REMOVE(tmp, hash);
 	TAILQ_REMOVE(&fraglru, tmp, next);
 	nfragments--;
 
-	for (ent = TAILQ_FIRST(&tmp->fraglist); ent;
-	    ent = TAILQ_FIRST(&tmp->fraglist)) {
-		TAILQ_REMOVE(&tmp->fraglist, ent, next);
-
-		ip_fragent_free(ent);
+	if (tmp->data != NULL) {
+		nfragmem -= tmp->size;
+		pool_free(pool_fragbuf, tmp->data);
 	}
-	free(tmp);
+	pool_free(pool_fragment, tmp);
 }
 
 void
-ip_fragment_timeout(int fd, short which, void *arg)
+ip_fragment_timeout(void *arg)
 {
 	struct fragment *tmp = arg;
 	struct addr src;
@@ -169,14 +171,22 @@ ip_fragment_timeout(int fd, short which, void *arg)
 	ip_fragment_free(tmp);
 }
 
-void
-ip_fragment_reclaim(int count)
+/*
+ * Frees the least recently used datagrams until size more bytes fit
+ * into the memory budget.  The datagram that needs the memory is never
+ * freed; it is the most recently used one.
+ */
+static void
+ip_fragment_reclaim(struct fragment *keep, u_int size)
 {
 	struct fragment *tmp;
-	for (tmp = TAILQ_LAST(&fraglru, fragqueue); tmp && count;
-	    tmp = TAILQ_LAST(&fraglru, fragqueue)) {
+
+	while (nfragmem + size > IPFRAG_MAX_MEM ||
+	    nfragments > IPFRAG_MAX_FRAGS) {
+		tmp = TAILQ_LAST(&fraglru, fragqueue);
+		if (tmp == NULL || tmp == keep)
+			break;
 		ip_fragment_free(tmp);
-		count--;
 	}
 }
 
@@ -184,23 +194,12 @@ struct fragment *
 ip_fragment_new(ip_addr_t src, ip_addr_t dst, u_short id, u_char proto,
     enum fragpolicy pl)
 {
-	struct fragment *tmp = NULL;
-	struct timeval tv = { IPFRAG_TIMEOUT, 0};
-	int reclaim = 0;
-
-	if (nfragmem > IPFRAG_MAX_MEM || nfragments > IPFRAG_MAX_FRAGS)
-		ip_fragment_reclaim(nfragments/10);
-
-	while (tmp == NULL && reclaim < 2) {
-		tmp = calloc(1, sizeof(struct fragment));
-		if (tmp == NULL) {
-			reclaim++;
-			ip_fragment_reclaim(nfragments/10);
-		}
-	}
+	struct fragment *tmp;
+
+	ip_fragment_reclaim(NULL, IPFRAG_MINSIZE);
 
-	if (tmp == NULL)
-		return (NULL);
+	tmp = pool_alloc(pool_fragment);
+	memset(tmp, 0, sizeof(struct fragment));
 
 	tmp->ip_src = src;
 	tmp->ip_dst = dst;
@@ -208,132 +207,129 @@ ip_fragment_new(ip_addr_t src, ip_addr_t dst, u_short id, u_char proto,
 	tmp->ip_proto = proto;
 	tmp->fragp = pl;
 
-	TAILQ_INIT(&tmp->fraglist);
-	tmp->timeout = evtimer_new(honeyd_base_ev, ip_fragment_timeout, tmp);
-	evtimer_add(tmp->timeout, &tv);
+	/* Everything is missing */
+	tmp->holes[0].first = 0;
+	tmp->holes[0].last = IPFRAG_INFINITY;
+	tmp->nholes = 1;
+
+	timer_set(&tmp->timeout, ip_fragment_timeout, tmp);
+	timer_add(&tmp->timeout, IPFRAG_TIMEOUT * 1000);
 
-	SPLAY_INSERT(fragtree, &fragments, tmp);
+	LIST_INSERT_HEAD(ip_fragment_bucket(src, dst, id, proto), tmp, hash);
 	TAILQ_INSERT_HEAD(&fraglru, tmp, next);
 	nfragments++;
 
 	return (tmp);
 }
 
-int
-ip_fragment_insert(struct fragment *fragq, struct fragent *ent, short mf)
+/* Makes sure that the reassembly buffer holds at least len bytes */
+static void
+ip_fragment_grow(struct fragment *fragq, u_int len)
 {
-	struct fragent *prev, *after;
-	struct ip_hdr *ip;
 	u_char *data;
-	u_short overlap;
-	u_short max;
-	u_short off;
-	u_short len;
+	u_int size;
 
-	off = ent->off;
-	len = ent->len;
-	max = off + len;
+	if (len <= fragq->size)
+		return;
 
-	if (fragq->maxlen < max)
-		fragq->maxlen = max;
-	if (!mf)
-		fragq->hadlastpacket = 1;
+	for (size = IPFRAG_MINSIZE; size < len; size <<= 1)
+		;
 
-	prev = NULL;
-	for (after = TAILQ_FIRST(&fragq->fraglist); after;
-	    after = TAILQ_NEXT(after, next)) {
-		if (off < after->off)
-			break;
-		prev = after;
-	}
+	ip_fragment_reclaim(fragq, size - fragq->size);
 
-	if (prev && prev->off + prev->len > off) {
-		overlap = prev->off + prev->len - off;
+	data = pool_alloc_size(pool_fragbuf, size);
+	if (fragq->data != NULL) {
+		memcpy(data, fragq->data, fragq->size);
+		nfragmem -= fragq->size;
+		pool_free(pool_fragbuf, fragq->data);
+	}
 
-		if (overlap >= len) {
-			if (fragq->fragp == FRAG_NEW) {
-				u_char *odata = prev->data + off - prev->off;
-				memcpy(odata, ent->data, len);
-			}
-			goto free_fragment;
-		}
+	fragq->data = data;
+	fragq->size = size;
+	nfragmem += size;
+}
 
-		if (fragq->fragp == FRAG_OLD) {
-			u_char *odata = prev->data + prev->len - overlap;
-			memcpy(ent->data, odata, overlap);
-		}
-		prev->len -= overlap;
-	}
+/*
+ * Copies the fragment into the reassembly buffer and updates the holes.
+ * With FRAG_NEW, new data overwrites what has been received before;
+ * with FRAG_OLD, only missing bytes are filled in.
+ *
+ * Returns 1 if the datagram is complete, 0 if it is not and -1 if the
+ * datagram has too many holes.
+ */
+int
+ip_fragment_insert(struct fragment *fragq, u_char *dat, u_int off, u_int len,
+    short mf)
+{
+	struct fraghole *hole, holes[IPFRAG_MAX_HOLES + 2];
+	u_int end = off + len;
+	u_int first, last;
+	int i, nholes = 0;
+
+	if (fragq->hadlastpacket) {
+		/* Ignore data after the end of the datagram */
+		if (end > fragq->maxlen)
+			end = fragq->maxlen;
+		if (off >= end)
+			return (0);
+		len = end - off;
+	} else if (!mf) {
+		fragq->hadlastpacket = 1;
+		fragq->maxlen = end;
+	} else if (fragq->maxlen < end)
+		fragq->maxlen = end;
 
-	if (after && off + len > after->off) {
-		overlap = off + len - after->off;
-
-		if (overlap >= after->len) {
-			if (fragq->fragp == FRAG_OLD) {
-				u_char *ndata = ent->data + after->off - off;
-				memcpy(ndata, after->data, after->len);
-			}
-			
-			/* Drop the old fragment */
-			TAILQ_REMOVE(&fragq->fraglist, after, next);
-			ip_fragent_free(after);
-		} else {
-			/* Trim the overlap */
-			if (fragq->fragp == FRAG_NEW) {
-				u_char *ndata = ent->data + len - overlap;
-				memcpy(after->data, ndata, overlap);
-			}
-			len -= overlap;
-			ent->len = len;
-		}
-	}
+	ip_fragment_grow(fragq, end);
 
-	if (prev)
-		TAILQ_INSERT_AFTER(&fragq->fraglist, prev, ent, next);
-	else
-		TAILQ_INSERT_HEAD(&fragq->fraglist, ent, next);
+	if (fragq->fragp == FRAG_NEW)
+		memcpy(fragq->data + off, dat, len);
 
-	/* Waiting for more data */
-	if (!fragq->hadlastpacket)
-		return (0);
+	for (i = 0; i < fragq->nholes; i++) {
+		hole = &fragq->holes[i];
 
-	off = 0;
-	TAILQ_FOREACH(ent, &fragq->fraglist, next) {
-		if (ent->off != off)
+		/* Nothing is missing after the last fragment */
+		if (fragq->hadlastpacket && hole->first >= fragq->maxlen)
 			break;
-		off = ent->off + ent->len;
-	}
 
-	if (ent)
-		return (0);
-
-	/* Completely assembled */
+		if (hole->last <= off || hole->first >= end) {
+			holes[nholes++] = *hole;
+			continue;
+		}
 
-	data = buf;
-	ip = (struct ip_hdr *)data;
-	for(ent = TAILQ_FIRST(&fragq->fraglist); ent;
-	    ent = TAILQ_FIRST(&fragq->fraglist)) {
-		TAILQ_REMOVE(&fragq->fraglist, ent, next);
+		first = hole->first > off ? hole->first : off;
+		last = hole->last < end ? hole->last : end;
+		if (fragq->fragp == FRAG_OLD)
+			memcpy(fragq->data + first, dat + first - off,
+			    last - first);
 
-		memcpy(data, ent->data, ent->len);
-		data += ent->len;
-		ip_fragent_free(ent);
+		/* The fragment splits the hole into at most two */
+		if (hole->first < off) {
+			holes[nholes].first = hole->first;
+			holes[nholes++].last = off;
+		}
+		if (hole->last > end &&
+		    (!fragq->hadlastpacket || end < fragq->maxlen)) {
+			holes[nholes].first = end;
+			holes[nholes++].last = hole->last;
+			if (fragq->hadlastpacket &&
+			    holes[nholes - 1].last > fragq->maxlen)
+				holes[nholes - 1].last = fragq->maxlen;
+		}
 	}
 
-	ip->ip_len = htons(fragq->maxlen);
-	ip->ip_off = 0;
+	/* Any fragment may split a hole, not only the last one */
+	if (nholes > IPFRAG_MAX_HOLES)
+		return (-1);
 
-	ip_fragment_free(fragq);
-
-	return (1);
+	memcpy(fragq->holes, holes, nholes * sizeof(struct fraghole));
+	fragq->nholes = nholes;
 
- free_fragment:
-	ip_fragent_free(ent);
-	return (0);
+	return (fragq->hadlastpacket && !nholes);
 }
 
 /*
- * Reassembles fragmented IP packets.
+ * Reassembles fragmented IP packets.  The reassembled packet stays valid
+ * until the next packet has been reassembled.
  *
  * Return:
  *  0 - successfully reassembled
@@ -347,12 +343,12 @@ ip_fragment(struct template *tmpl, struct ip_hdr *ip, u_short len,
 	struct addr src;
 	struct personality *person = NULL;
 	struct fragment *fragq;
-	struct fragent *ent;
 	u_char *dat;
 	short mf;
 	u_short off;
 	u_short hlen;
 	enum fragpolicy fragp = FRAG_OLD;
+	int res;
 	
 	addr_pack(&src, ADDR_TYPE_IP, IP_ADDR_BITS, &ip->ip_src, IP_ADDR_LEN);
 
@@ -393,33 +389,34 @@ ip_fragment(struct template *tmpl, struct ip_hdr *ip, u_short len,
 			goto drop;
 	}
 
-	if ((ent = calloc(1, sizeof(struct fragent))) == NULL)
-		goto freeall;
-
-	ent->off = off;
-	ent->len = len;
-	ent->size = len;
-	if ((ent->data = malloc(len)) == NULL) {
-		free(ent);
-		goto freeall;
-	}
-	memcpy(ent->data, dat, len);
-	nfragmem += len;
+	honeyd_count_copy(PKTCOPY_FRAGMENT, len);
 
 	syslog(LOG_DEBUG,  "Received fragment from %s, id %d: %d@%d",
 	    addr_ntoa(&src), ntohs(ip->ip_id), len, off);
 
-	if (ip_fragment_insert(fragq, ent, mf)) {
-		ip = (struct ip_hdr *)buf;
-		len = ntohs(ip->ip_len);
+	if ((res = ip_fragment_insert(fragq, dat, off, len, mf)) == -1)
+		goto freeall;
+	if (res == 0)
+		return (-1);
 
-		*pip = ip;
-		*piplen = len;
+	/* Completely assembled; hand over the buffer */
+	if (fragdone != NULL)
+		pool_free(pool_fragbuf, fragdone);
+	fragdone = fragq->data;
+	nfragmem -= fragq->size;
+	fragq->data = NULL;
 
-		/* Successfully reassembled */
-		return (0);
-	}
-	return (-1);
+	ip = (struct ip_hdr *)fragdone;
+	ip->ip_len = htons(fragq->maxlen);
+	ip->ip_off = 0;
+
+	*pip = ip;
+	*piplen = fragq->maxlen;
+
+	ip_fragment_free(fragq);
+
+	/* Successfully reassembled */
+	return (0);
 
  freeall:
 	syslog(LOG_DEBUG,  "%s fragment from %s, id %d: %d@%d",
@@ -474,3 +471,116 @@ ip_send_fragments(u_int mtu, struct ip_hdr *ip, u_int iplen, struct spoof spoof)
 		offset += size;
 	}
 }
+
+/* Unittests */
+
+static u_char fragtest_pkt[IP_LEN_MAX];
+
+/* Sends len bytes of the test datagram payload starting at off */
+static int
+ip_fragment_test_send(struct template *tmpl, u_short id, u_int off,
+    u_int len, int mf, struct ip_hdr **pip, u_short *piplen)
+{
+	u_char frag[IP_HDR_LEN + 2048];
+	struct ip_hdr *ip = (struct ip_hdr *)frag;
+
+	memcpy(frag, fragtest_pkt, IP_HDR_LEN);
+	memcpy(frag + IP_HDR_LEN, fragtest_pkt + IP_HDR_LEN + off, len);
+	ip->ip_id = htons(id);
+	ip->ip_len = htons(IP_HDR_LEN + len);
+	ip->ip_off = htons((off >> 3) | (mf ? IP_MF : 0));
+
+	return (ip_fragment(tmpl, ip, IP_HDR_LEN + len, pip, piplen));
+}
+
+static void
+ip_fragment_test_policy(enum fragpolicy fragp, u_char expect)
+{
+	struct personality person;
+	struct template tmpl;
+	struct ip_hdr *ip;
+	u_short iplen;
+	u_char *p;
+
+	memset(&person, 0, sizeof(person));
+	memset(&tmpl, 0, sizeof(tmpl));
+	person.fragp = fragp;
+	tmpl.person = &person;
+
+	/* The second fragment overlaps the first in bytes 8 to 15 */
+	memset(fragtest_pkt + IP_HDR_LEN, 'a', 16);
+	if (ip_fragment_test_send(&tmpl, 2, 0, 16, 1, &ip, &iplen) != -1)
+		errx(1, "%s: reassembled early", __func__);
+	memset(fragtest_pkt + IP_HDR_LEN, 'b', 24);
+	if (ip_fragment_test_send(&tmpl, 2, 8, 16, 0, &ip, &iplen) != 0)
+		errx(1, "%s: not reassembled", __func__);
+
+	p = (u_char *)ip + IP_HDR_LEN;
+	if (iplen != IP_HDR_LEN + 24 || p[0] != 'a' || p[23] != 'b' ||
+	    p[8] != expect || p[15] != expect)
+		errx(1, "%s: bad overlap for policy %d", __func__, fragp);
+}
+
+void
+ip_fragment_test(void)
+{
+	struct ip_hdr *ip = (struct ip_hdr *)fragtest_pkt, *nip;
+	u_short niplen;
+	int i;
+
+	ip_fragment_init();
+
+	memset(fragtest_pkt, 0, sizeof(fragtest_pkt));
+	ip->ip_hl = IP_HDR_LEN >> 2;
+	ip->ip_v = 4;
+	ip->ip_p = IP_PROTO_UDP;
+	ip->ip_src = htonl(0x0a000001);
+	ip->ip_dst = htonl(0x0a000002);
+	for (i = 0; i < 4000; i++)
+		fragtest_pkt[IP_HDR_LEN + i] = i;
+
+	/* Out of order */
+	if (ip_fragment_test_send(NULL, 1, 2960, 1040, 0, &nip, &niplen) != -1 ||
+	    ip_fragment_test_send(NULL, 1, 1480, 1480, 1, &nip, &niplen) != -1 ||
+	    ip_fragment_test_send(NULL, 1, 0, 1480, 1, &nip, &niplen) != 0)
+		errx(1, "%s: reassembly failed", __func__);
+	if (niplen != IP_HDR_LEN + 4000 ||
+	    memcmp((u_char *)nip + IP_HDR_LEN, fragtest_pkt + IP_HDR_LEN, 4000))
+		errx(1, "%s: bad reassembled data", __func__);
+	if (nfragments != 0 || nfragmem != 0)
+		errx(1, "%s: datagram not freed", __func__);
+
+	ip_fragment_test_policy(FRAG_OLD, 'a');
+	ip_fragment_test_policy(FRAG_NEW, 'b');
+
+	/* Too many holes drop the datagram */
+	for (i = 0; i <= IPFRAG_MAX_HOLES; i++)
+		ip_fragment_test_send(NULL, 3, i * 16, 8, 1, &nip, &niplen);
+	if (nfragments != 0)
+		errx(1, "%s: datagram with %d holes kept", __func__, i);
+
+	/* Also if the hole that is split is not the last one */
+	for (i = 1; i < IPFRAG_MAX_HOLES; i++)
+		ip_fragment_test_send(NULL, 4, i * 32, 8, 1, &nip, &niplen);
+	if (nfragments != 1 || ip_fragment_find(ip->ip_src, ip->ip_dst,
+		htons(4), ip->ip_p)->nholes != IPFRAG_MAX_HOLES)
+		errx(1, "%s: datagram with %d holes dropped", __func__, i);
+	ip_fragment_test_send(NULL, 4, 8, 8, 1, &nip, &niplen);
+	if (nfragments != 0)
+		errx(1, "%s: datagram with %d holes kept", __func__, i + 1);
+
+	/* Old datagrams make room for new ones */
+	for (i = 0; i < 2 * IPFRAG_MAX_MEM / IP_LEN_MAX; i++)
+		ip_fragment_test_send(NULL, 100 + i, 60000, 8, 1, &nip, &niplen);
+	if (nfragmem > IPFRAG_MAX_MEM || nfragments >= i)
+		errx(1, "%s: memory budget exceeded: %d bytes in %d datagrams",
+		    __func__, nfragmem, nfragments);
+	if (ip_fragment_find(ip->ip_src, ip->ip_dst, htons(100 + i - 1),
+		ip->ip_p) == NULL)
+		errx(1, "%s: newest datagram was evicted", __func__);
+
+	while (!TAILQ_EMPTY(&fraglru))
+		ip_fragment_free(TAILQ_FIRST(&fraglru));
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
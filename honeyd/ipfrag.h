@@ -32,20 +32,23 @@
 #ifndef _IPFRAG_H_
 #define _IPFRAG_H_
 
-struct fragent {
-	TAILQ_ENTRY(fragent) next;
-	u_short off;
-	u_short len;
-	u_short size;
-	u_char *data;
+#define IPFRAG_MAX_HOLES	32	/* more and the datagram is dropped */
+
+/*
+ * A datagram is reassembled in place in a single buffer that grows with
+ * the highest offset seen.  The bytes that are still missing are kept in
+ * a list of hole descriptors as described in RFC 815.
+ */
+struct fraghole {
+	u_int first;		/* first missing byte */
+	u_int last;		/* one past the last missing byte */
 };
 
 struct fragment {
-	SPLAY_ENTRY(fragment) node;
+	LIST_ENTRY(fragment) hash;
 	TAILQ_ENTRY(fragment) next;
 
-	TAILQ_HEAD(fragq, fragent) fraglist;
-	struct event *timeout;
+	struct timer timeout;
 
 	enum fragpolicy fragp;
 
@@ -54,17 +57,27 @@ struct fragment {
 	u_short ip_id;		/* Network order */
 	u_char ip_proto;
 
-	u_short maxlen;		
+	u_char *data;		/* reassembly buffer */
+	u_int size;		/* allocated size of the buffer */
+
+	u_int maxlen;
 	u_short hadlastpacket;
+
+	int nholes;		/* sorted by offset */
+	struct fraghole holes[IPFRAG_MAX_HOLES];
 };
 
 #define IPFRAG_TIMEOUT		30
 
 #define IPFRAG_MAX_MEM		(25*1024*1024)
 #define IPFRAG_MAX_FRAGS	(10000)
+#define IPFRAG_HASHSIZE		16384	/* power of two */
+#define IPFRAG_MINSIZE		2048	/* initial reassembly buffer */
 
 void ip_fragment_init(void);
 int ip_fragment(struct template *, struct ip_hdr *, u_short,
     struct ip_hdr **, u_short *);
 void ip_send_fragments(u_int, struct ip_hdr *, u_int, struct spoof);
+
+void ip_fragment_test(void);
 #endif
@@ -37,6 +37,7 @@
 
 #include <sys/queue.h>
 #include <sys/tree.h>
+#include <sys/time.h>
 
 #include <pcap.h>
 
@@ -56,25 +57,48 @@
 
 #include "network.h"
 
+#ifdef __GNUC__
+#define network_popcount(x)	__builtin_popcountll(x)
+#else
+static __inline int
+network_popcount(uint64_t x)
+{
+	int count;
+
+	for (count = 0; x; count++)
+		x &= x - 1;
+	return (count);
+}
+#endif
+
+/* Number of slots up to and including slot v that are set */
+#define NETWORK_RANK(vec, v) \
+	network_popcount((vec) & ((2ULL << (v)) - 1))
+
+/* The six bits of the key at offset off, padded with zeros at the end */
+#define NETWORK_SLOT(key, off) \
+	((uint32_t)(((uint64_t)(key) << (off)) >> (32 - NETWORK_STRIDE)) & \
+	    ((1 << NETWORK_STRIDE) - 1))
+
 /*
  *  compare 2 v4 ranges
  */
 
 enum net_order
-network_compare(struct network *a, struct network *b)
+network_compare(struct addr *a, struct addr *b)
 {
 	struct addr addr_a, addr_b;
 	struct addr addr_aend, addr_bend;
 
 	/* Set up the addresses; still IPv4 dependent */
-	addr_a = a->net;
+	addr_a = *a;
 	addr_a.addr_bits = IP_ADDR_BITS;
-	addr_b = b->net;
+	addr_b = *b;
 	addr_b.addr_bits = IP_ADDR_BITS;
 
-	addr_bcast(&a->net, &addr_aend);
+	addr_bcast(a, &addr_aend);
 	addr_aend.addr_bits = IP_ADDR_BITS;
-	addr_bcast(&b->net, &addr_bend);
+	addr_bcast(b, &addr_bend);
 	addr_bend.addr_bits = IP_ADDR_BITS;
 
 	if (addr_cmp(&addr_aend, &addr_b) < 0)
@@ -83,47 +107,438 @@ network_compare(struct network *a, struct network *b)
 		return (NET_FOLLOWS);
 	if (addr_cmp(&addr_a, &addr_b) <= 0 && 
 	    addr_cmp(&addr_aend, &addr_bend) >= 0){
-		if (addr_cmp(&a->net, &b->net) == 0)
+		if (addr_cmp(a, b) == 0)
 			return (NET_EQUALS);
 		return (NET_CONTAINS);
 	}
 	return (NET_CONTAINED);
 }
 
+/*
+ * Add a route to the structure.  Adding an existing network replaces
+ * its data.
+ */
+void
+network_add(struct network **root, struct addr *addr, void *data)
+{
+	struct network *net;
+	struct network_node **pnode;
+	uint32_t key = ntohl(addr->addr_ip);
+	int bit;
+
+	if ((net = *root) == NULL) {
+		if ((net = calloc(1, sizeof(struct network))) == NULL)
+			err(1, "%s: calloc", __func__);
+		*root = net;
+	}
+
+	pnode = &net->trie;
+	for (bit = 0; ; bit++) {
+		if (*pnode == NULL) {
+			*pnode = calloc(1, sizeof(struct network_node));
+			if (*pnode == NULL)
+				err(1, "%s: calloc", __func__);
+		}
+		if (bit == addr->addr_bits)
+			break;
+		pnode = &(*pnode)->child[(key >> (31 - bit)) & 1];
+	}
+
+	if ((*pnode)->data == NULL)
+		net->nprefixes++;
+	(*pnode)->data = data;
+	net->dirty = 1;
+}
+
+static uint32_t
+network_newnodes(struct network *net, uint32_t count)
+{
+	uint32_t base = net->nnodes;
+
+	if (net->nnodes + count > net->maxnodes) {
+		struct network_ptnode *nodes;
+		uint32_t size = net->maxnodes ? net->maxnodes : 64;
+
+		while (size < net->nnodes + count)
+			size *= 2;
+		nodes = realloc(net->nodes, size * sizeof(*nodes));
+		if (nodes == NULL)
+			err(1, "%s: realloc", __func__);
+		net->nodes = nodes;
+		net->maxnodes = size;
+	}
+	net->nnodes += count;
+
+	return (base);
+}
+
+static void
+network_newleaf(struct network *net, void *data)
+{
+	if (net->nleaves == net->maxleaves) {
+		void **leaves;
+		uint32_t size = net->maxleaves ? net->maxleaves * 2 : 64;
+
+		leaves = realloc(net->leaves, size * sizeof(*leaves));
+		if (leaves == NULL)
+			err(1, "%s: realloc", __func__);
+		net->leaves = leaves;
+		net->maxleaves = size;
+	}
+	net->leaves[net->nleaves++] = data;
+}
+
+/*
+ * Fills in the compiled node idx for the part of the binary trie below
+ * node at the given depth.  Prefixes that end within the stride are
+ * expanded into all the slots that they cover.
+ */
+static void
+network_build(struct network *net, uint32_t idx, struct network_node *node,
+    int depth, void *data)
+{
+	struct network_node *child[1 << NETWORK_STRIDE];
+	void *value[1 << NETWORK_STRIDE], *last = NULL;
+	uint64_t vector = 0, leafvec = 0;
+	uint32_t base0, base1;
+	int stride = 32 - depth < NETWORK_STRIDE ? 32 - depth : NETWORK_STRIDE;
+	int v, bit, nchildren = 0, nleaves = 0;
+
+	for (v = 0; v < (1 << NETWORK_STRIDE); v++) {
+		struct network_node *tmp = node;
+		void *best = data;
+
+		for (bit = 0; bit < stride && tmp != NULL; bit++) {
+			tmp = tmp->child[(v >> (NETWORK_STRIDE - 1 - bit)) & 1];
+			if (tmp != NULL && tmp->data != NULL)
+				best = tmp->data;
+		}
+
+		value[v] = best;
+		child[v] = NULL;
+		if (tmp != NULL && depth + stride < 32 &&
+		    (tmp->child[0] != NULL || tmp->child[1] != NULL)) {
+			child[v] = tmp;
+			vector |= 1ULL << v;
+			nchildren++;
+			continue;
+		}
+
+		if (!nleaves++ || best != last) {
+			leafvec |= 1ULL << v;
+			last = best;
+		}
+	}
+
+	base0 = net->nleaves;
+	for (v = 0; v < (1 << NETWORK_STRIDE); v++) {
+		if (leafvec & (1ULL << v))
+			network_newleaf(net, value[v]);
+	}
+
+	base1 = network_newnodes(net, nchildren);
+
+	net->nodes[idx].vector = vector;
+	net->nodes[idx].leafvec = leafvec;
+	net->nodes[idx].base0 = base0;
+	net->nodes[idx].base1 = base1;
+
+	for (v = 0; v < (1 << NETWORK_STRIDE); v++) {
+		if (child[v] == NULL)
+			continue;
+		network_build(net, base1++, child[v],
+		    depth + NETWORK_STRIDE, value[v]);
+	}
+}
+
+static void
+network_compile(struct network *net)
+{
+	net->nnodes = net->nleaves = 0;
+	network_newnodes(net, 1);
+	network_build(net, 0, net->trie, 0,
+	    net->trie != NULL ? net->trie->data : NULL);
+	net->dirty = 0;
+}
+
+/*
+ * Returns the data of the longest network that contains addr.
+ */
+void *
+network_lookup(struct network *net, struct addr *addr)
+{
+	struct network_ptnode *node;
+	uint32_t key, v;
+	int off = 0;
+
+	if (net == NULL)
+		return (NULL);
+	if (net->dirty)
+		network_compile(net);
+
+	key = ntohl(addr->addr_ip);
+	node = &net->nodes[0];
+	v = NETWORK_SLOT(key, 0);
+	while (node->vector & (1ULL << v)) {
+		node = &net->nodes[node->base1 + NETWORK_RANK(node->vector, v) - 1];
+		off += NETWORK_STRIDE;
+		v = NETWORK_SLOT(key, off);
+	}
+
+	return (net->leaves[node->base0 + NETWORK_RANK(node->leafvec, v) - 1]);
+}
+
+/*
+ * Returns the data of the first network in address order, where a
+ * network comes before the networks that it contains.
+ */
+void *
+network_first(struct network *net)
+{
+	struct network_node *queue[33], *node;
+	int depth = 0;
+
+	if (net == NULL || net->trie == NULL)
+		return (NULL);
+
+	/* Depth first; the queue holds the right children left to visit */
+	node = net->trie;
+	for (;;) {
+		if (node->data != NULL)
+			return (node->data);
+		if (node->child[1] != NULL)
+			queue[depth++] = node->child[1];
+		if (node->child[0] != NULL)
+			node = node->child[0];
+		else if (depth)
+			node = queue[--depth];
+		else
+			return (NULL);
+	}
+}
+
+static void
+network_walknode(struct network_node *node, void (*cb)(void *, void *),
+    void *arg)
+{
+	if (node->data != NULL)
+		(*cb)(node->data, arg);
+	if (node->child[0] != NULL)
+		network_walknode(node->child[0], cb, arg);
+	if (node->child[1] != NULL)
+		network_walknode(node->child[1], cb, arg);
+}
+
+/* Calls the callback for the data of every network in address order */
+void
+network_walk(struct network *net, void (*cb)(void *, void *), void *arg)
+{
+	if (net == NULL || net->trie == NULL)
+		return;
+
+	network_walknode(net->trie, cb, arg);
+}
+
+static void
+network_freenode(struct network_node *node, int needfree)
+{
+	if (node->child[0] != NULL)
+		network_freenode(node->child[0], needfree);
+	if (node->child[1] != NULL)
+		network_freenode(node->child[1], needfree);
+	if (needfree && node->data != NULL)
+		free(node->data);
+	free(node);
+}
+
+void
+network_cleanup(struct network *net, int needfree)
+{
+	if (net->trie != NULL)
+		network_freenode(net->trie, needfree);
+	free(net->nodes);
+	free(net->leaves);
+	free(net);
+}
+
 /* Unittests */
 
 static void
 network_test_compare(void)
 {
 	struct addr one, two;
-	struct network net_one, net_two;
 
 	addr_pton("1.0.0.0/24", &one);
 	addr_pton("2.0.0.0/24", &two);
-	net_one.net = one;
-	net_two.net = two;
 
-	if (network_compare(&net_one, &net_two) != NET_PRECEEDS)
+	if (network_compare(&one, &two) != NET_PRECEEDS)
 		errx(1, "network_compare");
-	if (network_compare(&net_two, &net_one) != NET_FOLLOWS)
+	if (network_compare(&two, &one) != NET_FOLLOWS)
 		errx(1, "network_compare");
-	if (network_compare(&net_two, &net_two) != NET_EQUALS)
+	if (network_compare(&two, &two) != NET_EQUALS)
 		errx(1, "network_compare");
 
 	addr_pton("2.1.0.0/24", &one);
 	addr_pton("2.0.0.0/8", &two);
-	net_one.net = one;
-	net_two.net = two;
-	if (network_compare(&net_one, &net_two) != NET_CONTAINED)
+	if (network_compare(&one, &two) != NET_CONTAINED)
 		errx(1, "network_compare: !contained");
-	if (network_compare(&net_two, &net_one) != NET_CONTAINS)
+	if (network_compare(&two, &one) != NET_CONTAINS)
 		errx(1, "network_compare: !contains");
 
 	fprintf(stderr, "\t%s: OK\n", __func__);
 }
 
+static void
+network_test_lookup(void)
+{
+	struct network *net = NULL;
+	struct addr addr;
+	char *nets[] = {
+		"0.0.0.0/0", "10.0.0.0/8", "10.1.0.0/16", "10.1.2.0/24",
+		"10.1.2.128/25", "10.1.2.129/32", "10.1.3.0/30", NULL
+	};
+	struct {
+		char *addr;
+		int net;
+	} tests[] = {
+		{ "192.168.1.1", 0 }, { "10.2.0.1", 1 }, { "10.1.255.1", 2 },
+		{ "10.1.2.1", 3 }, { "10.1.2.130", 4 }, { "10.1.2.129", 5 },
+		{ "10.1.3.3", 6 }, { "10.1.3.4", 2 }, { NULL, 0 }
+	};
+	int i;
+
+	if (network_lookup(net, &addr) != NULL)
+		errx(1, "%s: lookup in empty table", __func__);
+
+	/* Insert the longest networks first */
+	for (i = 6; i >= 0; i--) {
+		addr_pton(nets[i], &addr);
+		addr.addr_bits = atoi(strchr(nets[i], '/') + 1); /* libdnet bug */
+		network_add(&net, &addr, nets[i]);
+	}
+
+	for (i = 0; tests[i].addr != NULL; i++) {
+		addr_pton(tests[i].addr, &addr);
+		if (network_lookup(net, &addr) != nets[tests[i].net])
+			errx(1, "%s: %s did not match %s", __func__,
+			    tests[i].addr, nets[tests[i].net]);
+	}
+
+	network_cleanup(net, 0);
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
+
+/* Walks the uncompiled trie one bit at a time */
+static void *
+network_test_trie(struct network *net, uint32_t key)
+{
+	struct network_node *node = net->trie;
+	void *data = NULL;
+	int bit = 0;
+
+	while (node != NULL) {
+		if (node->data != NULL)
+			data = node->data;
+		if (bit == 32)
+			break;
+		node = node->child[(key >> (31 - bit++)) & 1];
+	}
+
+	return (data);
+}
+
+#define NETWORK_ELAPSED(start, count) do { \
+	struct timeval tv_end; \
+	gettimeofday(&tv_end, NULL); \
+	timersub(&tv_end, &(start), &tv_end); \
+	elapsed = (tv_end.tv_sec * 1000000.0 + tv_end.tv_usec) / (count); \
+} while (0)
+
+/*
+ * Inserts random prefixes and compares the compiled trie against walking
+ * the binary trie bit by bit.
+ */
+static void
+network_test_bench(int count)
+{
+	struct network *net = NULL;
+	struct timeval tv_start;
+	struct addr addr;
+	uint32_t *keys, key;
+	double elapsed, trie_find, poptrie_find, compile;
+	int i, lookups = count * 10;
+	int trie_found = 0, poptrie_found = 0;
+	rand_t *rand;
+
+	if ((rand = rand_open()) == NULL)
+		err(1, "%s: rand_open", __func__);
+	if ((keys = calloc(lookups, sizeof(uint32_t))) == NULL)
+		err(1, "%s: calloc", __func__);
+
+	addr_pton("0.0.0.0", &addr);
+	for (i = 0; i < count; i++) {
+		/* Most routes are between /16 and /24 */
+		addr.addr_bits = 8 + rand_uint32(rand) % 25;
+		if (i % 4)
+			addr.addr_bits = 16 + rand_uint32(rand) % 9;
+		key = rand_uint32(rand);
+		key &= 0xffffffffU << (32 - addr.addr_bits);
+		addr.addr_ip = htonl(key);
+		network_add(&net, &addr, (void *)(long)(i + 1));
+	}
+
+	for (i = 0; i < lookups; i++)
+		keys[i] = rand_uint32(rand);
+
+	gettimeofday(&tv_start, NULL);
+	network_compile(net);
+	NETWORK_ELAPSED(tv_start, 1);
+	compile = elapsed / 1000;
+
+	gettimeofday(&tv_start, NULL);
+	for (i = 0; i < lookups; i++) {
+		if (network_test_trie(net, keys[i]) != NULL)
+			trie_found++;
+	}
+	NETWORK_ELAPSED(tv_start, lookups);
+	trie_find = elapsed;
+
+	gettimeofday(&tv_start, NULL);
+	for (i = 0; i < lookups; i++) {
+		addr.addr_ip = htonl(keys[i]);
+		if (network_lookup(net, &addr) != NULL)
+			poptrie_found++;
+	}
+	NETWORK_ELAPSED(tv_start, lookups);
+	poptrie_find = elapsed;
+
+	if (trie_found != poptrie_found)
+		errx(1, "%s: %d matches in trie, %d in poptrie",
+		    __func__, trie_found, poptrie_found);
+
+	for (i = 0; i < lookups; i++) {
+		addr.addr_ip = htonl(keys[i]);
+		if (network_lookup(net, &addr) != network_test_trie(net, keys[i]))
+			errx(1, "%s: lookup mismatch for %s",
+			    __func__, addr_ntoa(&addr));
+	}
+
+	fprintf(stderr, "\t\t%7d prefixes: compile %.1f ms, %u nodes, "
+	    "%u leaves; lookup %.3f us trie, %.3f us poptrie\n",
+	    net->nprefixes, compile, net->nnodes, net->nleaves,
+	    trie_find, poptrie_find);
+
+	network_cleanup(net, 0);
+	free(keys);
+	rand_close(rand);
+}
+
 void
 network_test(void)
 {
 	network_test_compare();
+	network_test_lookup();
+	network_test_bench(1000);
+	network_test_bench(100000);
 }
@@ -32,17 +32,40 @@
 #ifndef _NETWORK_H_
 #define _NETWORK_H_
 
-struct network {
-	struct network *left;
-	struct network *mid;
-	struct network *right;
+/*
+ * Longest prefix match on IPv4 networks.  Prefixes are kept in a binary
+ * trie that gets compiled into a multibit trie with a stride of six bits
+ * on the first lookup after a change.  Each node of the compiled trie
+ * stores which of its 64 slots lead to children and where the leaf value
+ * changes in two bitmaps; a population count turns a slot into an index
+ * into the contiguous child and leaf arrays (poptrie).
+ */
 
-	uint16_t	depth;
-	struct addr	net;
+#define NETWORK_STRIDE	6
 
+struct network_node {
+	struct network_node *child[2];
 	void	*data;
 };
 
+struct network_ptnode {
+	uint64_t vector;	/* slots that have a child node */
+	uint64_t leafvec;	/* slots where a new leaf value starts */
+	uint32_t base0;		/* first leaf */
+	uint32_t base1;		/* first child node */
+};
+
+struct network {
+	struct network_node *trie;
+	int	nprefixes;
+	int	dirty;
+
+	struct network_ptnode *nodes;
+	uint32_t nnodes, maxnodes;
+	void	**leaves;
+	uint32_t nleaves, maxleaves;
+};
+
 enum net_order
 {
 	NET_PRECEEDS,
@@ -52,7 +75,13 @@ enum net_order
 	NET_CONTAINED
 };
 
-enum net_order network_compare(struct network *a, struct network *b);
+enum net_order network_compare(struct addr *a, struct addr *b);
+
+void network_add(struct network **, struct addr *, void *);
+void *network_lookup(struct network *, struct addr *);
+void *network_first(struct network *);
+void network_walk(struct network *, void (*)(void *, void *), void *);
+void network_cleanup(struct network *, int);
 
 void network_test(void);
 
@@ -125,7 +125,7 @@ honeyd_osfp_hash(const struct ip_hdr *ip)
 }
 
 void
-honeyd_osfp_timeout(int fd, short what, void *arg)
+honeyd_osfp_timeout(void *arg)
 {
 	struct osfp *entry = arg;
 	struct osfptree *root;
@@ -145,7 +145,6 @@ honeyd_osfp_timeout(int fd, short what, void *arg)
 static void
 honeyd_osfp_cache_insert(const struct ip_hdr *ip, struct pf_osfp_enlist *list)
 {
-	struct timeval tv;
 	struct osfptree *root;
 	struct osfp *entry;
 
@@ -157,23 +156,20 @@ honeyd_osfp_cache_insert(const struct ip_hdr *ip, struct pf_osfp_enlist *list)
 		}
 
 		entry->src = ip->ip_src;
-		entry->timeout = evtimer_new(honeyd_base_ev, honeyd_osfp_timeout, entry);
+		timer_set(&entry->timeout, honeyd_osfp_timeout, entry);
 		root = honeyd_osfp_hash(ip);
 
 		SPLAY_INSERT(osfptree, root, entry);
 	}
 
 	entry->list = list;
-	
-	timerclear(&tv);
-	tv.tv_sec = OSFP_TIMEOUT;
-	evtimer_add(entry->timeout, &tv);
+
+	timer_add(&entry->timeout, OSFP_TIMEOUT * 1000);
 }
 
 static struct osfp *
 honeyd_osfp_cache(const struct ip_hdr *ip)
 {
-	struct timeval tv;
 	struct osfptree *root;
 	struct osfp tmp, *entry;
 
@@ -188,29 +184,46 @@ honeyd_osfp_cache(const struct ip_hdr *ip)
 	assert(entry->src == ip->ip_src);
 
 	/* Update timeout */
-	timerclear(&tv);
-	tv.tv_sec = OSFP_TIMEOUT;
-	evtimer_add(entry->timeout, &tv);
+	timer_add(&entry->timeout, OSFP_TIMEOUT * 1000);
 
 	return (entry);
 }
 
-int
-honeyd_osfp_match(const struct ip_hdr *ip, pf_osfp_t fp)
+/*
+ * Returns the fingerprints of this packet if it is a SYN; otherwise,
+ * the ones we remembered for its source.
+ */
+
+struct pf_osfp_enlist *
+honeyd_osfp_list(const struct ip_hdr *ip)
 {
-	struct pf_osfp_enlist *list;
+	struct pf_osfp_enlist *list = NULL;
 	const struct tcp_hdr *tcp;
 
 	tcp = (const struct tcp_hdr *)((u_char *)ip + (ip->ip_hl << 2));
 
-	list = pf_osfp_fingerprint_hdr(ip, tcp);
-	if (list == NULL) {
-		struct osfp *entry = honeyd_osfp_cache(ip);
-		if (entry != NULL)
-			list = entry->list;
-	}
+	if (ip->ip_p == IP_PROTO_TCP)
+		list = pf_osfp_fingerprint_hdr(ip, tcp);
+	if (list == NULL)
+		list = honeyd_osfp_remembered(ip);
 
-	return (pf_osfp_match(list, fp));
+	return (list);
+}
+
+/* Returns the fingerprints from the last SYN of the source */
+
+struct pf_osfp_enlist *
+honeyd_osfp_remembered(const struct ip_hdr *ip)
+{
+	struct osfp *entry = honeyd_osfp_cache(ip);
+
+	return (entry != NULL ? entry->list : NULL);
+}
+
+int
+honeyd_osfp_match(const struct ip_hdr *ip, pf_osfp_t fp)
+{
+	return (pf_osfp_match(honeyd_osfp_list(ip), fp));
 }
 
 void
@@ -39,7 +39,7 @@
 
 struct osfp {
 	SPLAY_ENTRY(osfp) node;
-	struct event *timeout;
+	struct timer timeout;
 
 	ip_addr_t	src;
 
@@ -48,6 +48,8 @@ struct osfp {
 
 int honeyd_osfp_init(const char *);
 int honeyd_osfp_match(const struct ip_hdr *, pf_osfp_t);
+struct pf_osfp_enlist *honeyd_osfp_list(const struct ip_hdr *);
+struct pf_osfp_enlist *honeyd_osfp_remembered(const struct ip_hdr *);
 char *honeyd_osfp_name(struct ip_hdr *);
 
 #endif
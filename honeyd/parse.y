@@ -494,6 +494,7 @@ annotate	: ANNOTATE personality finscan
 		if ($2 == NULL)
 			break;
 		$2->disallow_finscan = !$3;
+		personality_compile($2);
 	}
 		| ANNOTATE personality fragment
 	{
@@ -1095,6 +1096,12 @@ dhcp_template(struct template *tmpl, char *interface, char *mac_addr)
 		return;
 	}
 
+	/* A reload needs to start over for DHCP templates */
+	if (template_staging) {
+		template_staging_dhcp = 1;
+		return;
+	}
+
 	/* Find the right interface */
 	if ((inter = interface_find(interface)) == NULL) {
 		yyerror("Interface \"%s\" does not exist.", interface);
@@ -0,0 +1,464 @@
+/*
+ * Copyright (c) 2002, 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include "config.h"
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <dnet.h>
+
+#undef timeout_pending
+#undef timeout_initialized
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "honeyd.h"
+#include "personality.h"
+#include "xprobe_assoc.h"
+#include "perscache.h"
+
+/*
+ * The file starts with the header, followed by the personality,
+ * xprobe and association records and the string table.  Records are
+ * the structures themselves; pointers to strings are replaced by their
+ * offset into the string table plus one, other pointers are cleared.
+ * The cache is only valid for the same build, which the structure
+ * sizes check for.
+ */
+
+#define PERSCACHE_MAGIC		0x48445043	/* HDPC */
+#define PERSCACHE_VERSION	1
+
+struct perscache_source {
+	uint64_t size;
+	int64_t mtime;
+	uint64_t ino;
+};
+
+struct perscache_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t perssize;
+	uint32_t xpsize;
+	struct perscache_source src[PERSCACHE_NSOURCES];
+	uint32_t npersons;
+	uint32_t nxprobes;
+	uint32_t nassocs;
+	uint32_t strsize;
+};
+
+struct perscache_assoc {
+	uint32_t nmap_name;
+	uint32_t os_id;
+};
+
+#define PERSCACHE_STRREF(p)	((uint32_t)(uintptr_t)(p))
+
+static int
+perscache_source(struct perscache_source *src, const char *path)
+{
+	struct stat sb;
+
+	if (stat(path, &sb) == -1)
+		return (-1);
+
+	memset(src, 0, sizeof(struct perscache_source));
+	src->size = sb.st_size;
+	src->mtime = sb.st_mtime;
+	src->ino = sb.st_ino;
+
+	return (0);
+}
+
+static uint32_t
+perscache_string(struct evbuffer *strs, const char *str)
+{
+	uint32_t off = evbuffer_get_length(strs);
+
+	if (str == NULL)
+		return (0);
+
+	evbuffer_add(strs, str, strlen(str) + 1);
+	return (off + 1);
+}
+
+/* Returns NULL for a reference outside of the string table */
+static const char *
+perscache_resolve(const char *strings, uint32_t strsize, uint32_t ref)
+{
+	if (ref == 0 || ref > strsize)
+		return (NULL);
+	return (strings + ref - 1);
+}
+
+/*
+ * Writes the fingerprints that are currently loaded.  The cache is
+ * written to a temporary file first, so that a concurrent load never
+ * sees a partial file.
+ */
+int
+perscache_save(const char *path, char * const *sources)
+{
+	struct perscache_hdr hdr;
+	struct evbuffer *recs = NULL, *strs = NULL;
+	char tmppath[MAXPATHLEN];
+	FILE *fout = NULL;
+	int i, j, res = -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = PERSCACHE_MAGIC;
+	hdr.version = PERSCACHE_VERSION;
+	hdr.perssize = sizeof(struct personality);
+	hdr.xpsize = sizeof(struct xp_fingerprint);
+	for (i = 0; i < PERSCACHE_NSOURCES; i++) {
+		if (perscache_source(&hdr.src[i], sources[i]) == -1) {
+			warn("%s: stat(%s)", __func__, sources[i]);
+			return (-1);
+		}
+	}
+
+	if ((recs = evbuffer_new()) == NULL || (strs = evbuffer_new()) == NULL)
+		err(1, "%s: evbuffer_new", __func__);
+
+	for (i = 0; i < npersons; i++) {
+		struct personality pers = *perslist[i];
+
+		memset(&pers.next, 0, sizeof(pers.next));
+		pers.name = (char *)(uintptr_t)perscache_string(strs, pers.name);
+		for (j = 0; j < sizeof(pers.tests)/sizeof(pers.tests[0]); j++) {
+			struct personate *test = &pers.tests[j];
+			test->options = (char *)(uintptr_t)
+			    perscache_string(strs, test->options);
+		}
+		pers.xp_fprint = NULL;
+		pers.testmap = NULL;
+		evbuffer_add(recs, &pers, sizeof(pers));
+	}
+
+	for (i = 0; i < nxp_fprints; i++) {
+		struct xp_fingerprint xp = *xp_fprintlist[i];
+
+		memset(&xp.next, 0, sizeof(xp.next));
+		xp.os_id = (char *)(uintptr_t)perscache_string(strs, xp.os_id);
+		evbuffer_add(recs, &xp, sizeof(xp));
+	}
+
+	for (i = 0; i < nassocs; i++) {
+		struct perscache_assoc assoc;
+
+		assoc.nmap_name = perscache_string(strs,
+		    assoclist[i]->nmap_name);
+		assoc.os_id = perscache_string(strs,
+		    assoclist[i]->xp_fprint->os_id);
+		evbuffer_add(recs, &assoc, sizeof(assoc));
+	}
+
+	hdr.npersons = npersons;
+	hdr.nxprobes = nxp_fprints;
+	hdr.nassocs = nassocs;
+	hdr.strsize = evbuffer_get_length(strs);
+
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	if ((fout = fopen(tmppath, "w")) == NULL) {
+		warn("%s: fopen(%s)", __func__, tmppath);
+		goto out;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fout) != 1 ||
+	    fwrite(evbuffer_pullup(recs, -1), evbuffer_get_length(recs),
+		1, fout) != 1 ||
+	    fwrite(evbuffer_pullup(strs, -1), hdr.strsize, 1, fout) != 1) {
+		warn("%s: fwrite(%s)", __func__, tmppath);
+		fclose(fout);
+		unlink(tmppath);
+		goto out;
+	}
+
+	if (fclose(fout) == EOF || rename(tmppath, path) == -1) {
+		warn("%s: %s", __func__, path);
+		unlink(tmppath);
+		goto out;
+	}
+
+	res = 0;
+ out:
+	evbuffer_free(recs);
+	evbuffer_free(strs);
+	return (res);
+}
+
+/*
+ * Checks that the cache belongs to the current source files and that
+ * every string reference is valid, before anything gets loaded.
+ */
+static int
+perscache_verify(const struct perscache_hdr *hdr, size_t len,
+    char * const *sources)
+{
+	struct perscache_source src;
+	const u_char *recs = (const u_char *)(hdr + 1);
+	const char *strings;
+	size_t off;
+	int i, j;
+
+	if (len < sizeof(*hdr) ||
+	    hdr->magic != PERSCACHE_MAGIC ||
+	    hdr->version != PERSCACHE_VERSION ||
+	    hdr->perssize != sizeof(struct personality) ||
+	    hdr->xpsize != sizeof(struct xp_fingerprint))
+		return (-1);
+
+	for (i = 0; i < PERSCACHE_NSOURCES; i++) {
+		if (perscache_source(&src, sources[i]) == -1 ||
+		    memcmp(&src, &hdr->src[i], sizeof(src)))
+			return (-1);
+	}
+
+	off = (size_t)hdr->npersons * sizeof(struct personality) +
+	    (size_t)hdr->nxprobes * sizeof(struct xp_fingerprint) +
+	    (size_t)hdr->nassocs * sizeof(struct perscache_assoc);
+	if (len != sizeof(*hdr) + off + hdr->strsize)
+		return (-1);
+	strings = (const char *)recs + off;
+	if (hdr->strsize && strings[hdr->strsize - 1] != '\0')
+		return (-1);
+
+	for (i = 0; i < hdr->npersons; i++) {
+		struct personality pers;
+
+		memcpy(&pers, recs, sizeof(pers));
+		recs += sizeof(pers);
+		if (perscache_resolve(strings, hdr->strsize,
+			PERSCACHE_STRREF(pers.name)) == NULL)
+			return (-1);
+		for (j = 0; j < sizeof(pers.tests)/sizeof(pers.tests[0]); j++) {
+			uint32_t ref = PERSCACHE_STRREF(pers.tests[j].options);
+			if (ref && perscache_resolve(strings, hdr->strsize,
+				ref) == NULL)
+				return (-1);
+		}
+	}
+
+	for (i = 0; i < hdr->nxprobes; i++) {
+		struct xp_fingerprint xp;
+
+		memcpy(&xp, recs, sizeof(xp));
+		recs += sizeof(xp);
+		if (perscache_resolve(strings, hdr->strsize,
+			PERSCACHE_STRREF(xp.os_id)) == NULL)
+			return (-1);
+	}
+
+	for (i = 0; i < hdr->nassocs; i++) {
+		struct perscache_assoc assoc;
+
+		memcpy(&assoc, recs, sizeof(assoc));
+		recs += sizeof(assoc);
+		if (perscache_resolve(strings, hdr->strsize,
+			assoc.nmap_name) == NULL ||
+		    perscache_resolve(strings, hdr->strsize,
+			assoc.os_id) == NULL)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Loads the fingerprints from the cache if it is still current.  The
+ * interned strings point into the mapping, so it is never unmapped
+ * after a successful load.
+ */
+int
+perscache_load(const char *path, char * const *sources)
+{
+	const struct perscache_hdr *hdr;
+	const u_char *recs;
+	const char *strings;
+	struct stat sb;
+	void *map;
+	int fd, i, j;
+
+	if ((fd = open(path, O_RDONLY, 0)) == -1)
+		return (-1);
+	if (fstat(fd, &sb) == -1 || sb.st_size < sizeof(*hdr)) {
+		close(fd);
+		return (-1);
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("%s: mmap(%s)", __func__, path);
+		return (-1);
+	}
+
+	hdr = map;
+	if (perscache_verify(hdr, sb.st_size, sources) == -1) {
+		munmap(map, sb.st_size);
+		return (-1);
+	}
+
+	recs = (const u_char *)(hdr + 1);
+	strings = (const char *)recs +
+	    (size_t)hdr->npersons * sizeof(struct personality) +
+	    (size_t)hdr->nxprobes * sizeof(struct xp_fingerprint) +
+	    (size_t)hdr->nassocs * sizeof(struct perscache_assoc);
+#define RESOLVE(ref) \
+	personality_intern(perscache_resolve(strings, hdr->strsize, ref), 0)
+
+	/* The xprobe fingerprints and associations come before personalities */
+	recs += (size_t)hdr->npersons * sizeof(struct personality);
+	for (i = 0; i < hdr->nxprobes; i++) {
+		struct xp_fingerprint *xp;
+
+		if ((xp = malloc(sizeof(struct xp_fingerprint))) == NULL)
+			err(1, "%s: malloc", __func__);
+		memcpy(xp, recs, sizeof(struct xp_fingerprint));
+		recs += sizeof(struct xp_fingerprint);
+
+		xp->os_id = RESOLVE(PERSCACHE_STRREF(xp->os_id));
+		xprobe_personality_insert(xp);
+	}
+
+	for (i = 0; i < hdr->nassocs; i++) {
+		struct perscache_assoc assoc;
+		struct xp_fingerprint *xp;
+
+		memcpy(&assoc, recs, sizeof(assoc));
+		recs += sizeof(assoc);
+
+		xp = xprobe_personality_find(RESOLVE(assoc.os_id));
+		if (xp != NULL)
+			association_insert(RESOLVE(assoc.nmap_name), xp);
+	}
+
+	recs = (const u_char *)(hdr + 1);
+	for (i = 0; i < hdr->npersons; i++) {
+		struct personality *pers;
+
+		if ((pers = malloc(sizeof(struct personality))) == NULL)
+			err(1, "%s: malloc", __func__);
+		memcpy(pers, recs, sizeof(struct personality));
+		recs += sizeof(struct personality);
+
+		pers->name = RESOLVE(PERSCACHE_STRREF(pers->name));
+		for (j = 0; j < sizeof(pers->tests)/sizeof(pers->tests[0]); j++) {
+			struct personate *test = &pers->tests[j];
+			uint32_t ref = PERSCACHE_STRREF(test->options);
+			test->options = ref ? RESOLVE(ref) : NULL;
+		}
+		pers->xp_fprint = NULL;
+		personality_compile(pers);
+		personality_insert(pers);
+	}
+#undef RESOLVE
+
+	return (0);
+}
+
+/* Unittests */
+
+void
+perscache_test(void)
+{
+	char cache[] = "/tmp/honeyd_perscache.XXXXXX";
+	char source[] = "/tmp/honeyd_perssource.XXXXXX";
+	char *sources[PERSCACHE_NSOURCES];
+	struct personality **old, *pers, tmp;
+	struct timeval tv_start, tv_end;
+	int fd, i, n = npersons;
+
+	if ((fd = mkstemp(cache)) == -1)
+		err(1, "%s: mkstemp", __func__);
+	close(fd);
+	if ((fd = mkstemp(source)) == -1)
+		err(1, "%s: mkstemp", __func__);
+	for (i = 0; i < PERSCACHE_NSOURCES; i++)
+		sources[i] = source;
+
+	if (perscache_save(cache, sources) == -1)
+		errx(1, "%s: could not write cache", __func__);
+
+	if ((old = calloc(n, sizeof(struct personality *))) == NULL)
+		err(1, "%s: calloc", __func__);
+	memcpy(old, perslist, n * sizeof(struct personality *));
+
+	personality_clear();
+	associations_init();
+
+	gettimeofday(&tv_start, NULL);
+	if (perscache_load(cache, sources) == -1)
+		errx(1, "%s: could not load cache", __func__);
+	gettimeofday(&tv_end, NULL);
+	timersub(&tv_end, &tv_start, &tv_end);
+
+	if (npersons != n)
+		errx(1, "%s: loaded %d personalities instead of %d",
+		    __func__, npersons, n);
+
+	for (i = 0; i < n; i++) {
+		/* Interned strings are shared with the original */
+		if ((pers = personality_find(old[i]->name)) == NULL ||
+		    pers->name != old[i]->name)
+			errx(1, "%s: lost \"%s\"", __func__, old[i]->name);
+		if ((pers->xp_fprint == NULL) != (old[i]->xp_fprint == NULL) ||
+		    (pers->xp_fprint != NULL &&
+			pers->xp_fprint->os_id != old[i]->xp_fprint->os_id))
+			errx(1, "%s: bad xprobe association for \"%s\"",
+			    __func__, pers->name);
+
+		tmp = *pers;
+		tmp.next = old[i]->next;
+		tmp.xp_fprint = old[i]->xp_fprint;
+		if (memcmp(&tmp, old[i], sizeof(tmp)))
+			errx(1, "%s: \"%s\" differs", __func__, pers->name);
+	}
+
+	/* A changed source file invalidates the cache */
+	if (write(fd, "#\n", 2) != 2)
+		err(1, "%s: write", __func__);
+	close(fd);
+	if (perscache_load(cache, sources) != -1 || npersons != n)
+		errx(1, "%s: loaded stale cache", __func__);
+
+	unlink(cache);
+	unlink(source);
+	free(old);
+
+	fprintf(stderr, "\t%s: loaded %d fingerprints in %.3f ms\n", __func__,
+	    n, tv_end.tv_sec * 1000.0 + tv_end.tv_usec / 1000.0);
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
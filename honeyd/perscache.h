@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2002, 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef _PERSCACHE_H_
+#define _PERSCACHE_H_
+
+/*
+ * Binary snapshot of the parsed nmap, xprobe and association databases.
+ * It is mapped at startup instead of parsing the text files, as long as
+ * none of them has changed since the snapshot was written.
+ */
+
+enum {
+	PERSCACHE_PERS = 0, PERSCACHE_XPROBE, PERSCACHE_ASSOC,
+	PERSCACHE_NSOURCES
+};
+
+int perscache_load(const char *, char * const *);
+int perscache_save(const char *, char * const *);
+
+void perscache_test(void);
+
+#endif /* _PERSCACHE_H_ */
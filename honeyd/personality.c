@@ -65,18 +65,39 @@
 #include "template.h"
 #include "debug.h"
 
-/* ET - Moved SPLAY_HEAD to personality.h so xprobe_assoc.c could use it. */
+struct personality **perslist;
 int npersons;
+static int perslistsize;
+static LIST_HEAD(pershash, personality) perstable[PERS_HASHSIZE];
+
+struct xp_fingerprint **xp_fprintlist;
+int nxp_fprints;
+static int xp_fprintlistsize;
+static LIST_HEAD(xphash, xp_fingerprint) xptable[XP_HASHSIZE];
+
+/* Interned strings, open addressing like the flow table */
+struct internslot {
+	uint32_t hash;
+	char *str;
+};
+
+static struct internslot *interntable;
+static uint32_t internsize, interncount;
 
 /* ET - global from honeyd.c */
 struct personate person_drop = {};
 static struct event *personality_time_ev;
 static struct timeval tv_periodic;
 
-SPLAY_GENERATE(perstree, personality, node, perscompare);
+static uint8_t personality_testmaps[4][PERS_TESTMAP_SIZE];
+
+/* Default TCP options is timestamp, noop, noop */
+static struct persopts persopts_default;
+struct persopts persopts_mss;
+struct persopts persopts_mss_sack;	/* without a personality */
 
-/* ET - For the Xprobe fingerprint tree */
-SPLAY_GENERATE(xp_fprint_tree, xp_fingerprint, node, xp_fprint_compare);
+static void personality_testmap_init(void);
+static void tcp_personality_compile_options(struct persopts *, const char *);
 
 static void
 personality_time_evcb(evutil_socket_t fd, short what, void *arg)
@@ -90,46 +111,197 @@ personality_time_evcb(evutil_socket_t fd, short what, void *arg)
 	evtimer_add(personality_time_ev, &tv);
 }
 
+/* FNV-1a over the name */
+uint32_t
+personality_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	for (; *name; name++) {
+		h ^= (u_char)*name;
+		h *= 16777619;
+	}
+
+	return (h);
+}
+
+static void
+personality_intern_resize(uint32_t size)
+{
+	struct internslot *slots;
+	uint32_t i, j;
+
+	if ((slots = calloc(size, sizeof(struct internslot))) == NULL)
+		err(1, "%s: calloc", __func__);
+
+	for (i = 0; i < internsize; i++) {
+		if (interntable[i].str == NULL)
+			continue;
+		for (j = interntable[i].hash & (size - 1); slots[j].str != NULL;
+		    j = (j + 1) & (size - 1))
+			;
+		slots[j] = interntable[i];
+	}
+
+	free(interntable);
+	interntable = slots;
+	internsize = size;
+}
+
+/*
+ * Returns the one copy of a string.  Strings that are not copied, for
+ * example those in the load cache, need to stay around forever.
+ */
+char *
+personality_intern(const char *str, int copy)
+{
+	uint32_t hash = personality_hash(str);
+	uint32_t i;
+
+	if ((interncount + 1) * 2 > internsize)
+		personality_intern_resize(internsize ? internsize * 2 : 1024);
+
+	for (i = hash & (internsize - 1); interntable[i].str != NULL;
+	    i = (i + 1) & (internsize - 1)) {
+		if (interntable[i].hash == hash &&
+		    strcmp(interntable[i].str, str) == 0)
+			return (interntable[i].str);
+	}
+
+	interntable[i].hash = hash;
+	if (!copy)
+		interntable[i].str = (char *)str;
+	else if ((interntable[i].str = strdup(str)) == NULL)
+		err(1, "%s: strdup", __func__);
+	interncount++;
+
+	return (interntable[i].str);
+}
+
 void
 xprobe_personality_init(void)
 {
-  SPLAY_INIT(&xp_fprints);
+	int i;
+
+	for (i = 0; i < XP_HASHSIZE; i++)
+		LIST_INIT(&xptable[i]);
+	nxp_fprints = 0;
+}
+
+void
+xprobe_personality_insert(struct xp_fingerprint *xp)
+{
+	struct xphash *head;
+
+	xp->os_id = personality_intern(xp->os_id, 1);
+	head = &xptable[personality_hash(xp->os_id) & (XP_HASHSIZE - 1)];
+	LIST_INSERT_HEAD(head, xp, next);
+
+	if (nxp_fprints >= xp_fprintlistsize) {
+		struct xp_fingerprint **list;
+		int size = xp_fprintlistsize ? xp_fprintlistsize * 2 : 64;
+
+		if ((list = realloc(xp_fprintlist, size * sizeof(*list))) == NULL)
+			err(1, "%s: realloc", __func__);
+		xp_fprintlist = list;
+		xp_fprintlistsize = size;
+	}
+	xp_fprintlist[nxp_fprints++] = xp;
+}
+
+struct xp_fingerprint *
+xprobe_personality_find(const char *name)
+{
+	struct xp_fingerprint *xp;
+
+	LIST_FOREACH(xp, &xptable[personality_hash(name) & (XP_HASHSIZE - 1)],
+	    next) {
+		if (strcmp(xp->os_id, name) == 0)
+			return (xp);
+	}
+
+	return (NULL);
 }
 
 void
 personality_init(void)
 {
+	int i;
+
+	for (i = 0; i < PERS_HASHSIZE; i++)
+		LIST_INIT(&perstable[i]);
 	npersons = 0;
-	SPLAY_INIT(&personalities);
+
+	personality_testmap_init();
+	tcp_personality_compile_options(&persopts_default, "tnn");
+	tcp_personality_compile_options(&persopts_mss, "m");
+	tcp_personality_compile_options(&persopts_mss_sack, "mnns");
 
 	/* Start a timer that keeps track of the current system time */
 	personality_time_ev = evtimer_new(honeyd_base_ev, personality_time_evcb, NULL);
 	personality_time_evcb(-1, EV_TIMEOUT, NULL);
 }
 
+/*
+ * Forgets about all nmap and xprobe fingerprints without freeing them;
+ * templates may still refer to them.
+ */
+void
+personality_clear(void)
+{
+	int i;
+
+	for (i = 0; i < PERS_HASHSIZE; i++)
+		LIST_INIT(&perstable[i]);
+	npersons = 0;
+
+	xprobe_personality_init();
+}
+
+/* The caller needs to make sure that the name is not taken yet */
+void
+personality_insert(struct personality *pers)
+{
+	struct pershash *head;
+
+	pers->name = personality_intern(pers->name, 1);
+	head = &perstable[personality_hash(pers->name) & (PERS_HASHSIZE - 1)];
+	LIST_INSERT_HEAD(head, pers, next);
+
+	if (npersons >= perslistsize) {
+		struct personality **list;
+		int size = perslistsize ? perslistsize * 2 : 1024;
+
+		if ((list = realloc(perslist, size * sizeof(*list))) == NULL)
+			err(1, "%s: realloc", __func__);
+		perslist = list;
+		perslistsize = size;
+	}
+	pers->index = npersons;
+	perslist[npersons++] = pers;
+
+	/* Find and add the Xprobe fingerprint, if it exists */
+	correlate_nmap_with_xprobe(pers);
+}
+
 struct personality *
 personality_new(const char *name)
 {
-	struct personality *pers, tmp;
+	struct personality *pers;
 
-	tmp.name = (char *)name;
-	if (SPLAY_FIND(perstree, &personalities, &tmp))
+	if (personality_find(name) != NULL)
 		return (NULL);
 
 	if ((pers = calloc(1, sizeof(struct personality))) == NULL)
 		err(1, "%s: calloc", __FUNCTION__);
 
-	if ((pers->name = strdup(name)) == NULL)
-		err(1, "%s: stdup", __FUNCTION__);
+	pers->name = (char *)name;
 
 	/* Initialize defaults */
 	pers->tstamphz = -1;
+	personality_compile(pers);
 
-	npersons++;
-	SPLAY_INSERT(perstree, &personalities, pers);
-
-	/* Find and add the Xprobe fingerprint, if it exists */
-	correlate_nmap_with_xprobe(pers);
+	personality_insert(pers);
 
 	return (pers);
 }
@@ -157,12 +329,16 @@ personality_declone(struct personality *pers)
 	free(pers);
 }
 
+/* The name stays interned */
 void
 personality_free(struct personality *pers)
 {
-	SPLAY_REMOVE(perstree, &personalities, pers);
+	struct personality *last = perslist[--npersons];
+
+	LIST_REMOVE(pers, next);
+	last->index = pers->index;
+	perslist[last->index] = last;
 
-	free(pers->name);
 	free(pers);
 }
 
@@ -170,27 +346,25 @@ struct personality *
 personality_random(void)
 {
 	extern rand_t *honeyd_rand;
-	struct personality *pers;
-	int i;
 
 	if (!npersons)
 		return (NULL);
 
-	i = rand_uint32(honeyd_rand) % npersons;
-	pers = SPLAY_MIN(perstree, &personalities);
-	while (i--) {
-		pers = SPLAY_NEXT(perstree, &personalities, pers);
-	}
-
-	return (pers);
+	return (perslist[rand_uint32(honeyd_rand) % npersons]);
 }
 
 struct personality *
 personality_find(const char *name)
 {
-	struct personality tmp;
-	tmp.name = (char *)name;
-	return (SPLAY_FIND(perstree, &personalities, &tmp));
+	struct personality *pers;
+
+	LIST_FOREACH(pers,
+	    &perstable[personality_hash(name) & (PERS_HASHSIZE - 1)], next) {
+		if (strcmp(pers->name, name) == 0)
+			return (pers);
+	}
+
+	return (NULL);
 }
 
 /* Not much here, set up ip id accordingly */
@@ -310,6 +484,102 @@ tcp_personality_test(const struct tcp_con *con, struct personality *person,
 	return (NULL);
 }
 
+/*
+ * Runs tcp_personality_test for every possible segment, so that the
+ * test can be found with a table lookup later.
+ */
+static void
+personality_testmap_init(void)
+{
+	static const int states[] = {
+		TCP_STATE_LISTEN, TCP_STATE_SYN_RECEIVED,
+		TCP_STATE_CLOSED, TCP_STATE_ESTABLISHED
+	};
+	struct personality person;
+	struct personate *test;
+	struct tcp_con con;
+	int map, sig;
+
+	for (map = 0; map < 4; map++) {
+		memset(&person, 0, sizeof(person));
+		if (map & PERS_MAP_SYNACK) {
+			person.tests[0].flags = TH_SYN|TH_ACK;
+			person.tests[0].forceack = ACK_KEEP;
+		}
+		person.disallow_finscan = (map & PERS_MAP_NOFINSCAN) != 0;
+
+		for (sig = 0; sig < PERS_TESTMAP_SIZE; sig++) {
+			memset(&con, 0, sizeof(con));
+			con.rcv_flags = sig & 0x7f;
+			con.state = states[(sig >> PERS_SIG_STATE) & 3];
+
+			test = tcp_personality_test(&con, &person,
+			    sig & PERS_SIG_RST ? TH_RST : 0);
+			if (test == NULL)
+				personality_testmaps[map][sig] = PERS_TEST_NONE;
+			else if (test == &person_drop)
+				personality_testmaps[map][sig] = PERS_TEST_DROP;
+			else
+				personality_testmaps[map][sig] =
+				    test - person.tests;
+		}
+	}
+}
+
+static __inline struct personate *
+tcp_personality_lookup(const struct tcp_con *con, struct personality *person,
+    uint8_t sndflags)
+{
+	int sig = con->rcv_flags & (TH_FIN|TH_SYN|TH_RST|TH_PUSH|TH_ACK|
+	    TH_URG|TH_ECE);
+	uint8_t test;
+
+	switch (con->state) {
+	case TCP_STATE_LISTEN:
+		break;
+	case TCP_STATE_SYN_RECEIVED:
+		sig |= 1 << PERS_SIG_STATE;
+		break;
+	case TCP_STATE_CLOSED:
+		sig |= 2 << PERS_SIG_STATE;
+		break;
+	default:
+		sig |= 3 << PERS_SIG_STATE;
+		break;
+	}
+	if (sndflags & TH_RST)
+		sig |= PERS_SIG_RST;
+
+	if ((test = person->testmap[sig]) == PERS_TEST_NONE)
+		return (NULL);
+	if (test == PERS_TEST_DROP)
+		return (&person_drop);
+	return (&person->tests[test]);
+}
+
+/*
+ * Precomputes everything that tcp_personality needs for each segment.
+ * Needs to be called again whenever a personality is changed.
+ */
+void
+personality_compile(struct personality *person)
+{
+	struct personate *test = &person->tests[0];
+	int i, map = 0;
+
+	if (test->flags == (TH_SYN|TH_ACK) && test->forceack == ACK_KEEP)
+		map |= PERS_MAP_SYNACK;
+	if (person->disallow_finscan)
+		map |= PERS_MAP_NOFINSCAN;
+	person->testmap = personality_testmaps[map];
+
+	for (i = 0; i < 7; i++) {
+		test = &person->tests[i];
+		tcp_personality_compile_options(&test->opts,
+		    test->options != NULL ? test->options : "");
+	}
+}
+
 void
 tcp_personality_seqinit(struct personality *person)
 {
@@ -537,9 +807,6 @@ tcp_personality_seq(struct template *tmpl, struct personality *person)
 	}
 }
 
-/* Default TCP options is timestamp, noop, noop */
-static char *default_opts = "tnn";
-
 int
 tcp_personality_match(struct tcp_con *con, int flags)
 {
@@ -553,12 +820,45 @@ tcp_personality_match(struct tcp_con *con, int flags)
 	if (person == NULL)
 		return (0);
 
-	return (tcp_personality_test(con, person, flags) != NULL);
+	return (tcp_personality_lookup(con, person, flags) != NULL);
+}
+
+/*
+ * SYN cookies take the place of our initial sequence numbers, which is
+ * only possible if the personality does not make them predictable.
+ */
+
+int
+tcp_personality_cookies(const struct template *tmpl)
+{
+	return (tmpl == NULL || tmpl->person == NULL ||
+	    tmpl->person->seqt == SEQ_RANDOM);
+}
+
+/*
+ * Returns the window of our SYN-ACK for a plain SYN, or 0 if the
+ * personality leaves it at the default.  Connections created from a
+ * SYN cookie did not keep it.
+ */
+
+int
+tcp_personality_synwindow(const struct template *tmpl)
+{
+	struct personality *person;
+	uint8_t test;
+
+	if (tmpl == NULL || (person = tmpl->person) == NULL)
+		return (0);
+
+	test = person->testmap[TH_SYN];
+	if (test == PERS_TEST_NONE || test == PERS_TEST_DROP)
+		return (0);
+	return (person->tests[test].window);
 }
 
 int
 tcp_personality(struct tcp_con *con, uint8_t *pflags, int *pwindow, int *pdf,
-    uint16_t *pid, char **poptions)
+    uint16_t *pid, const struct persopts **poptions)
 {
 	struct template *tmpl = con->tmpl;
 	struct personality *person;
@@ -577,7 +877,7 @@ tcp_personality(struct tcp_con *con, uint8_t *pflags, int *pwindow, int *pdf,
 	if (person == NULL)
 		return (-1);
 
-	if ((pers = tcp_personality_test(con, person, flags)) == NULL) {
+	if ((pers = tcp_personality_lookup(con, person, flags)) == NULL) {
 		/* Not a test case - but we still want to pretend */
 		ip_personality(tmpl, pid);
 
@@ -587,15 +887,15 @@ tcp_personality(struct tcp_con *con, uint8_t *pflags, int *pwindow, int *pdf,
 
 		/* If we support timestamps, always set them */
 		if (person->tstamphz >= 0 && poptions != NULL)
-			*poptions = default_opts;
+			*poptions = &persopts_default;
 		return (-1);
 	}
 
 	*pwindow = pers->window;
 	*pflags = pers->flags;
 	*pdf = pers->df;
-	if (poptions != NULL)
-		*poptions = pers->options;
+	if (poptions != NULL && pers->options != NULL)
+		*poptions = &pers->opts;
 
 	switch (pers->forceack) {
 	case ACK_ZERO:
@@ -616,83 +916,126 @@ tcp_personality(struct tcp_con *con, uint8_t *pflags, int *pwindow, int *pdf,
 	return (0);
 }
 
-#define SET(y, x, w, l) do { \
-	(x)->opt_type = w; \
-	(x)->opt_len = l; \
-	memcpy(y, x, l); \
-} while (0)
-
 /* 
  * Given a character string that describe TCP options, create the
  * corresponding packet data.
  */
 
-void
-tcp_personality_options(struct tcp_con *con, struct tcp_hdr *tcp,
-    char *options)
+static void
+tcp_personality_compile_options(struct persopts *opts, const char *options)
 {
-	extern rand_t *honeyd_rand;
-	u_char *p = (u_char *)tcp + TCP_HDR_LEN;
-	struct template *tmpl = con->tmpl;
 	struct tcp_opt opt;
-	int optlen = 0, simple = 0;
-	uint32_t timestamp;
-	short mss = 1460;
-	char *o;
-	
+	int optlen = 0, simple = 0, echo;
+	const char *o;
+
+	memset(opts, 0, sizeof(struct persopts));
+
 	for (o = options; *o; o++) {
-		opt.opt_len = 0;
+		echo = 0;
+		memset(&opt, 0, sizeof(opt));
 		switch(*o) {
 		case 'm':
 			if (o[1] == 'e') {
 				o++;
-				if (con->mss)
-					mss = con->mss;
+				echo = 1;
 			}
-			if (con->flags & TCP_TARPIT)
-				mss = 64;
-			opt.opt_data.mss = htons(mss);
-			SET(p, &opt, TCP_OPT_MSS, 4);
+			opt.opt_type = TCP_OPT_MSS;
+			opt.opt_len = 4;
+			opt.opt_data.mss = htons(1460);
 			break;
 		case 'w':
-			opt.opt_data.wscale = 0;
-			SET(p, &opt, TCP_OPT_WSCALE, 3);
+			opt.opt_type = TCP_OPT_WSCALE;
+			opt.opt_len = 3;
 			break;
 		case 't':
-			if (tmpl != NULL) {
-				struct timeval tv;
-				tcp_personality_time(tmpl, &tv);
-				timestamp = htonl(tmpl->timestamp);
-			} else {
-				timestamp = rand_uint32(honeyd_rand);
-			}
-			opt.opt_data.timestamp[0] = timestamp;
-			opt.opt_data.timestamp[1] = 0;
-			if (con->sawtimestamp)
-				opt.opt_data.timestamp[1] = con->echotimestamp;
-			SET(p, &opt, TCP_OPT_TIMESTAMP, 2 + 4 + 4);
+			opt.opt_type = TCP_OPT_TIMESTAMP;
+			opt.opt_len = 2 + 4 + 4;
 			break;
 		case 'n':
 			simple++;
-			SET(p, &opt, TCP_OPT_NOP, 1);
+			opt.opt_type = TCP_OPT_NOP;
+			opt.opt_len = 1;
+			break;
+		case 's':
+			opt.opt_type = TCP_OPT_SACKOK;
+			opt.opt_len = 2;
 			break;
 		case 'l':
-			SET(p, &opt, TCP_OPT_EOL, 2);
+			opt.opt_type = TCP_OPT_EOL;
+			opt.opt_len = 2;
 			break;
 		default:
-			opt.opt_len = 0;
-			break;
+			continue;
 		}
+
+		if (optlen + opt.opt_len > PERSOPTS_MAXLEN)
+			break;
+
+		if (opt.opt_type == TCP_OPT_MSS ||
+		    opt.opt_type == TCP_OPT_TIMESTAMP) {
+			opts->patch[opts->npatch].off = optlen;
+			opts->patch[opts->npatch++].echo = echo;
+		} else if (opt.opt_type == TCP_OPT_WSCALE)
+			opts->wscale = 1;
+		else if (opt.opt_type == TCP_OPT_SACKOK)
+			opts->sackok = 1;
+		memcpy(opts->data + optlen, &opt, opt.opt_len);
 		optlen += opt.opt_len;
-		p += opt.opt_len;
 	}
 
 	/* Check if we have only unreasonable options */
 	if (simple == optlen)
-		optlen = 0;
+		optlen = opts->npatch = 0;
+
+	opts->len = (optlen + 3) & ~3;
+}
+
+void
+tcp_personality_options(struct tcp_con *con, struct tcp_hdr *tcp,
+    const struct persopts *opts)
+{
+	extern rand_t *honeyd_rand;
+	u_char *p = (u_char *)tcp + TCP_HDR_LEN, *opt;
+	struct template *tmpl = con->tmpl;
+	uint32_t timestamp[2];
+	uint16_t mss;
+	int i, havetimestamp = 0;
+
+	if (!opts->len)
+		return;
+
+	memcpy(p, opts->data, opts->len);
+
+	for (i = 0; i < opts->npatch; i++) {
+		opt = p + opts->patch[i].off;
+		if (opt[0] == TCP_OPT_MSS) {
+			mss = 1460;
+			if (opts->patch[i].echo && con->mss)
+				mss = con->mss;
+			if (con->flags & TCP_TARPIT)
+				mss = 64;
+			mss = htons(mss);
+			memcpy(opt + 2, &mss, sizeof(mss));
+			continue;
+		}
+
+		if (!havetimestamp) {
+			if (tmpl != NULL) {
+				struct timeval tv;
+				tcp_personality_time(tmpl, &tv);
+				timestamp[0] = htonl(tmpl->timestamp);
+			} else {
+				timestamp[0] = rand_uint32(honeyd_rand);
+			}
+			timestamp[1] = 0;
+			if (con->sawtimestamp)
+				timestamp[1] = con->echotimestamp;
+			havetimestamp = 1;
+		}
+		memcpy(opt + 2, timestamp, sizeof(timestamp));
+	}
 
-	if (optlen)
-		tcp->th_off += (optlen + 3) / 4;
+	tcp->th_off += opts->len / 4;
 }
 
 /* JVR - added '+1' in default case below for situations where IP checksum does not
@@ -1160,8 +1503,7 @@ parse_tl(struct personality *pers, int off, char *line)
 			if (strlen(p2)) {
 				for (p3 = p2; *p3; p3++)
 					*p3 = tolower(*p3);
-				if ((test->options = strdup(p2)) == NULL)
-					err(1, "%s: strdup", __FUNCTION__);
+				test->options = personality_intern(p2, 1);
 			}
 		} else
 		      return (-1);
@@ -1320,7 +1662,7 @@ int
 personality_parse(FILE *fin)
 {
 	char bl[1024], line[1024], *p, *p2;
-	int errors = 0, lineno = 0, ignore = 0;
+	int errors = 0, lineno = 0, ignore = 0, i;
 	struct personality *pers = NULL;
 
 	while ((p = fgets(line, sizeof(line), fin)) != NULL) {
@@ -1371,6 +1713,9 @@ personality_parse(FILE *fin)
 		}
 	}
 
+	for (i = 0; i < npersons; i++)
+		personality_compile(perslist[i]);
+
 	return (errors ? -1 : 0);
 }
 
@@ -1497,7 +1842,7 @@ set_xp_struct(struct xp_fingerprint *pers, char *line)
 		osname_len = strcspn (p, "\0");
 		if (osname_len <= 0)
 			return (0);
-		pers->os_id = strdup(p);
+		pers->os_id = personality_intern(p, 1);
 	} else {
 		/* Copy other icmp values into structure:
 		 * Assumes the the format is: 'icmp_... = val'
@@ -1695,11 +2040,13 @@ print_xprobe_struct(struct xp_fingerprint *pers)
 void
 print_perstree(void)
 {
-	struct personality * pers;
-	int i = 0;
-	SPLAY_FOREACH(pers, perstree, &personalities) {
+	struct personality *pers;
+	int i, n = 0;
+
+	for (i = 0; i < npersons; i++) {
+		pers = perslist[i];
 		if (pers->xp_fprint != NULL)
-			printf("\tXP %d: %s\n", ++i, pers->xp_fprint->os_id);
+			printf("\tXP %d: %s\n", ++n, pers->xp_fprint->os_id);
 	}
 }
 
@@ -1724,12 +2071,106 @@ xprobe_personality_parse(FILE *fp)
 	while (!feof (fp)) {
 		/* Get a single fingerprint */
 		new_print = get_fprint (fp); 
-		if (new_print != NULL) {
-			/* print_xprobe_struct (new_print); */
-			SPLAY_INSERT(xp_fprint_tree, &xp_fprints, new_print);
-			new_print = NULL;
+		if (new_print == NULL)
+			continue;
+		/* print_xprobe_struct (new_print); */
+
+		/* The first fingerprint of a name wins */
+		if (xprobe_personality_find(new_print->os_id) != NULL) {
+			free(new_print);
+			continue;
 		}
+		xprobe_personality_insert(new_print);
 	}
 
 	return (0);
 }
+
+/* Unittests */
+
+static void
+personality_test_options(const char *options, const u_char *expect,
+    int len)
+{
+	struct persopts opts;
+
+	tcp_personality_compile_options(&opts, options);
+	if (opts.len != ((len + 3) & ~3) ||
+	    (len && memcmp(opts.data, expect, len)))
+		errx(1, "%s: bad options for \"%s\"", __func__, options);
+}
+
+void
+personality_test(void)
+{
+	static const u_char mnns[] = {
+		TCP_OPT_MSS, 4, 0x05, 0xb4, TCP_OPT_NOP, TCP_OPT_NOP,
+		TCP_OPT_SACKOK, 2
+	};
+	static const u_char mnwnnt[] = {
+		TCP_OPT_MSS, 4, 0x05, 0xb4, TCP_OPT_NOP, TCP_OPT_WSCALE, 3, 0,
+		TCP_OPT_NOP, TCP_OPT_NOP, TCP_OPT_TIMESTAMP, 10,
+		0, 0, 0, 0, 0, 0, 0, 0
+	};
+	struct personality person;
+	struct tcp_con con;
+	struct tcp_hdr *tcp;
+	u_char pkt[TCP_HDR_LEN + PERSOPTS_MAXLEN];
+	int map, sig, state;
+
+	/* The tables have to agree with the tests they were built from */
+	for (map = 0; map < 4; map++) {
+		memset(&person, 0, sizeof(person));
+		person.tests[0].flags = map & 1 ? TH_SYN|TH_ACK : TH_SYN;
+		person.disallow_finscan = map >> 1;
+		personality_compile(&person);
+
+		for (sig = 0; sig < 0x100; sig++) {
+			for (state = 0; state <= TCP_STATE_TIME_WAIT; state++) {
+				memset(&con, 0, sizeof(con));
+				con.rcv_flags = sig;
+				con.state = state;
+				if (tcp_personality_lookup(&con, &person,
+					TH_RST) !=
+				    tcp_personality_test(&con, &person,
+					TH_RST) ||
+				    tcp_personality_lookup(&con, &person, 0) !=
+				    tcp_personality_test(&con, &person, 0))
+					errx(1, "%s: tables disagree for flags "
+					    "%#x in state %d", __func__,
+					    sig, state);
+			}
+		}
+	}
+
+	personality_test_options("mnwnnt", mnwnnt, sizeof(mnwnnt));
+	personality_test_options("nnn", NULL, 0);
+	personality_test_options("me", mnwnnt, 4);
+	personality_test_options("mnns", mnns, sizeof(mnns));
+
+	/* SACK is only permitted if the personality includes it */
+	memset(&person, 0, sizeof(person));
+	tcp_personality_compile_options(&person.tests[0].opts, "mnwnntl");
+	tcp_personality_compile_options(&person.tests[1].opts, "mnns");
+	if (person.tests[0].opts.sackok || !person.tests[1].opts.sackok)
+		errx(1, "%s: bad SACK permitted options", __func__);
+
+	/* Only MSS and timestamp are filled in at send time */
+	memset(&con, 0, sizeof(con));
+	memset(pkt, 0xff, sizeof(pkt));
+	tcp = (struct tcp_hdr *)pkt;
+	tcp->th_off = 5;
+	con.mss = 536;
+	con.sawtimestamp = 1;
+	con.echotimestamp = htonl(0x01020304);
+	memset(&person, 0, sizeof(person));
+	tcp_personality_compile_options(&person.tests[0].opts, "menwt");
+	tcp_personality_options(&con, tcp, &person.tests[0].opts);
+	if (tcp->th_off != 5 + 5 ||
+	    pkt[TCP_HDR_LEN + 2] != 0x02 || pkt[TCP_HDR_LEN + 3] != 0x18 ||
+	    memcmp(pkt + TCP_HDR_LEN + 14, &con.echotimestamp, 4) ||
+	    pkt[TCP_HDR_LEN + 18] != 0 || pkt[TCP_HDR_LEN + 19] != 0)
+		errx(1, "%s: bad options on segment", __func__);
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
@@ -34,14 +34,50 @@
 
 enum ackchange { ACK_KEEP = 0, ACK_ZERO, ACK_DECREMENT };
 
+#define PERSOPTS_MAXLEN	40	/* all that fits into a TCP header */
+
+/*
+ * TCP options of a response, serialized when the personality is
+ * loaded.  Only the MSS and timestamp values are filled in when the
+ * segment is sent.
+ */
+struct persopts {
+	u_char len;		/* padded to a multiple of four */
+	u_char npatch;
+	u_char wscale;		/* includes a window scale option */
+	u_char sackok;		/* includes a SACK permitted option */
+	struct {
+		u_char off;	/* of an MSS or timestamp option */
+		u_char echo;	/* MSS echoes the one of the peer */
+	} patch[PERSOPTS_MAXLEN / 4];
+	u_char data[PERSOPTS_MAXLEN];
+};
+
 struct personate {
 	int window;
 	u_char flags;
 	u_char df;
 	char *options;
+	struct persopts opts;	/* compiled from options */
 	enum ackchange forceack;
 };
 
+/*
+ * The response test for an incoming segment is looked up by its flags,
+ * the connection state and whether we are sending a reset.  The result
+ * only depends on two properties of a personality, so that all
+ * personalities share four tables.
+ */
+#define PERS_SIG_STATE		7	/* listen, syn received, closed, other */
+#define PERS_SIG_RST		0x200
+#define PERS_TESTMAP_SIZE	0x400
+
+#define PERS_MAP_SYNACK		0x01	/* T1 can answer a normal SYN */
+#define PERS_MAP_NOFINSCAN	0x02
+
+#define PERS_TEST_DROP		7	/* silently drop the segment */
+#define PERS_TEST_NONE		0xff
+
 enum rval { RVAL_OKAY = 0, RVAL_ZERO, RVAL_BAD };
 
 struct persudp {
@@ -104,8 +140,8 @@ struct xp_fp_ttlvals {
 };
 
 struct xp_fingerprint {
-	SPLAY_ENTRY(xp_fingerprint) node;
-	char                 *os_id;   //OS name
+	LIST_ENTRY(xp_fingerprint) next;	/* hash bucket */
+	char                 *os_id;   //OS name, interned
 	struct xp_fp_flags   flags;    //everything else
 	struct xp_fp_ttlvals ttl_vals; //ttl values
 };
@@ -123,8 +159,9 @@ enum fragpolicy {FRAG_OLD = 0, FRAG_DROP, FRAG_NEW};
 #define SEQ_RI_MAX		0xD7CAB8
 
 struct personality {
-	SPLAY_ENTRY(personality) node;
-	char *name;
+	LIST_ENTRY(personality) next;	/* hash bucket */
+	char *name;		/* interned */
+	int index;		/* in perslist */
 
 	struct personate tests[7];
 	struct persudp udptest;
@@ -154,21 +191,47 @@ struct personality {
 
 	uint8_t disallow_finscan:1,
 		reserved:7;
+
+	const uint8_t *testmap;	/* set by personality_compile */
 };
 
+/*
+ * Fingerprint names are interned, so that they can be shared with the
+ * load cache and compared by pointer.
+ */
+#define PERS_HASHSIZE	2048	/* must be a power of two */
+#define XP_HASHSIZE	256
+
+extern struct personality **perslist;
+extern int npersons;
+extern struct xp_fingerprint **xp_fprintlist;
+extern int nxp_fprints;
+
+uint32_t personality_hash(const char *);
+char *personality_intern(const char *, int);
+
 void personality_init(void);
+void personality_clear(void);
 int personality_parse(FILE *);
+void personality_insert(struct personality *);
 struct personality *personality_find(const char *);
 struct personality *personality_clone(const struct personality *);
 void personality_declone(struct personality *pers);
 struct personality *personality_random(void);
 void personality_free(struct personality *);
+void personality_compile(struct personality *);
 
 void ip_personality(struct template *, uint16_t *);
 int tcp_personality(struct tcp_con *, uint8_t *, int *, int *,
-    uint16_t *, char **);
-void tcp_personality_options(struct tcp_con *, struct tcp_hdr *, char *);
+    uint16_t *, const struct persopts **);
+void tcp_personality_options(struct tcp_con *, struct tcp_hdr *,
+    const struct persopts *);
+
+extern struct persopts persopts_mss;
+extern struct persopts persopts_mss_sack;
 int tcp_personality_match(struct tcp_con *, int);
+int tcp_personality_cookies(const struct template *);
+int tcp_personality_synwindow(const struct template *);
 
 int icmp_error_personality(struct template *, struct addr *,
     struct ip_hdr *ip, uint8_t *, uint8_t *, int *, uint8_t *);
@@ -176,23 +239,10 @@ int icmp_error_personality(struct template *, struct addr *,
 /* ET - This functions loads the Xprobe fingerprints */
 int xprobe_personality_parse(FILE *fp);
 void xprobe_personality_init(void);
+void xprobe_personality_insert(struct xp_fingerprint *);
+struct xp_fingerprint *xprobe_personality_find(const char *);
 void print_perstree(void);
 
-/* Splay stuff here so other modules can use it */
-SPLAY_HEAD(perstree, personality) personalities;
-static int
-perscompare(struct personality *a, struct personality *b)
-{
-  return (strcmp(a->name, b->name));
-}
-SPLAY_PROTOTYPE(perstree, personality, node, perscompare);
-
-SPLAY_HEAD(xp_fprint_tree, xp_fingerprint) xp_fprints;
-static int 
-xp_fprint_compare(struct xp_fingerprint *a, struct xp_fingerprint *b)
-{
-  return (strcmp(a->os_id, b->os_id));
-}
-SPLAY_PROTOTYPE(xp_fprint_tree, xp_fingerprint, node, xp_fprint_compare);
+void personality_test(void);
 
 #endif
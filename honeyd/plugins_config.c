@@ -145,3 +145,14 @@ plugins_config_find_item(const char *plugin, const char *option,
 	return (NULL);
 }
 
+/* Calls the callback for each item in the order they were added */
+void
+plugins_config_foreach(void (*cb)(const char *, const char *,
+    const struct honeyd_plugin_cfg *, void *), void *arg)
+{
+	struct honeyd_plugin_cfgitem *item;
+
+	for (item = TAILQ_LAST(&cfg_items, honeyd_plugin_cfg_lh); item != NULL;
+	    item = TAILQ_PREV(item, honeyd_plugin_cfg_lh, next))
+		(*cb)(item->plugin, item->option, &item->cfg, arg);
+}
@@ -88,4 +88,7 @@ void  plugins_config_item_add(const char *plugin, const char *option,
 const struct honeyd_plugin_cfg  *plugins_config_find_item(const char *plugin,
     const char *option, enum honeyd_plugin_cfgtype type);
 
+void  plugins_config_foreach(void (*cb)(const char *, const char *,
+    const struct honeyd_plugin_cfg *, void *), void *arg);
+
 #endif
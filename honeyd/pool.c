@@ -41,61 +41,330 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <event2/buffer.h>
 
 #include "pool.h"
 
+static TAILQ_HEAD(poolhead, pool) pools = TAILQ_HEAD_INITIALIZER(pools);
+
+/*
+ * Creates a pool for objects of the given size.  The pool keeps at most
+ * maxresident bytes allocated once objects are freed again; allocations
+ * beyond that still succeed but are counted as memory pressure.
+ */
 struct pool*
-pool_init(size_t size)
+pool_init(const char *name, size_t size, size_t maxresident,
+    enum pool_trim trim)
 {
 	struct pool *pool;
-
-	if (POOL_PAGE_SIZE / (sizeof(struct pool_entry) + size) < 1)
-		errx(1, "%s: object size too large for pool", __func__);
+	size_t objsize, header;
+	int i;
 
 	if ((pool = calloc(1, sizeof(struct pool))) == NULL)
 		err(1, "%s: calloc", __func__);
 
-	SLIST_INIT(&pool->entries);
+	TAILQ_INIT(&pool->pages);
+	for (i = 0; i < POOL_NCLASSES; i++)
+		SLIST_INIT(&pool->classes[i].entries);
+
+	pool->name = name;
 	pool->size = size;
 
+	/* Make the slab large enough to amortize its header */
+	objsize = roundup(sizeof(struct pool_entry) + size, POOL_ALIGN);
+	header = roundup(sizeof(struct pool_page), POOL_ALIGN);
+	pool->slabsize = POOL_PAGE_SIZE;
+	while ((pool->slabsize - header) / objsize < POOL_MINOBJS)
+		pool->slabsize *= 2;
+	pool->perslab = (pool->slabsize - header) / objsize;
+
+	pool->maxresident = maxresident;
+	pool->trim = trim;
+	pool->highwater = 4 * pool->perslab;
+
+	TAILQ_INSERT_TAIL(&pools, pool, next);
+
 	return (pool);
 }
 
+/*
+ * With POOL_TRIM_HIGHWATER, slabs that become completely unused are
+ * returned to the system once there are more than highwater free objects.
+ */
+void
+pool_set_highwater(struct pool *pool, int highwater)
+{
+	pool->highwater = highwater;
+}
+
+static void
+pool_account(struct pool *pool, ssize_t size)
+{
+	pool->resident += size;
+	if (pool->resident > pool->peakresident)
+		pool->peakresident = pool->resident;
+}
+
+/* Gives back all cached buffers and unused slabs */
+static void
+pool_reclaim(struct pool *pool)
+{
+	struct pool_page *page, *next;
+	struct pool_entry *entry;
+	struct pool_class *pc;
+	int i;
+
+	for (i = 0; i < POOL_NCLASSES; i++) {
+		pc = &pool->classes[i];
+		while ((entry = SLIST_FIRST(&pc->entries)) != NULL) {
+			SLIST_REMOVE_HEAD(&pc->entries, next);
+			pool_account(pool,
+			    -(ssize_t)(entry->size + sizeof(struct pool_entry)));
+			free(entry);
+		}
+		pc->nfree = 0;
+	}
+
+	for (page = TAILQ_FIRST(&pool->pages); page != NULL; page = next) {
+		next = TAILQ_NEXT(page, next);
+		if (page->nfree != pool->perslab)
+			continue;
+
+		TAILQ_REMOVE(&pool->pages, page, next);
+		pool->nfree -= pool->perslab;
+		pool->nslabs--;
+		pool->ntrimmed++;
+		pool_account(pool, -(ssize_t)pool->slabsize);
+		free(page);
+	}
+}
+
+/* Called before the pool allocates more memory from the system */
+static void
+pool_grow(struct pool *pool, size_t size)
+{
+	if (!pool->maxresident || pool->resident + size <= pool->maxresident)
+		return;
+
+	pool_reclaim(pool);
+	if (pool->resident + size > pool->maxresident)
+		pool->npressure++;
+}
+
+static struct pool_page *
+pool_slab_new(struct pool *pool)
+{
+	struct pool_page *page;
+	struct pool_entry *entry;
+	size_t objsize;
+	u_char *p;
+	int i;
+
+	pool_grow(pool, pool->slabsize);
+	if ((page = malloc(pool->slabsize)) == NULL)
+		err(1, "%s: malloc", __func__);
+	pool_account(pool, pool->slabsize);
+
+	SLIST_INIT(&page->entries);
+	page->nfree = pool->perslab;
+
+	objsize = roundup(sizeof(struct pool_entry) + pool->size, POOL_ALIGN);
+	p = (u_char *)page + roundup(sizeof(struct pool_page), POOL_ALIGN);
+	for (i = 0; i < pool->perslab; i++, p += objsize) {
+		entry = (struct pool_entry *)p;
+		entry->page = page;
+		entry->data = p + sizeof(struct pool_entry);
+		entry->size = pool->size;
+
+		SLIST_INSERT_HEAD(&page->entries, entry, next);
+	}
+
+	TAILQ_INSERT_HEAD(&pool->pages, page, next);
+	pool->nslabs++;
+	pool->nfree += pool->perslab;
+
+	return (page);
+}
+
+static int
+pool_class(size_t size)
+{
+	int class = POOL_MINCLASS;
+
+	while (class <= POOL_MAXCLASS && ((size_t)1 << class) < size)
+		class++;
+
+	return (class <= POOL_MAXCLASS ? class - POOL_MINCLASS : -1);
+}
+
+/*
+ * Called with a size of zero when the pool has no free objects left.
+ * Otherwise, returns a buffer of at least size bytes from the size
+ * classes of the pool.
+ */
 void *
 pool_alloc_size(struct pool *pool, size_t size)
 {
-	struct pool_entry *entry = NULL;
-
-	if (size) {
-		entry = malloc(size + sizeof(struct pool_entry));
-		if (entry == NULL)
-			err(1, "%s: malloc", __func__);
-		
-		entry->data = (void *)entry + sizeof(struct pool_entry);;
-		entry->size = size;
-		pool->nalloc++;
-	} else {
-		void *p = malloc(POOL_PAGE_SIZE);
-		int i, max;
-
-		if (p == NULL)
-			err(1, "%s: malloc", __func__);
-
-		size = pool->size;
-		max = POOL_PAGE_SIZE / (sizeof(struct pool_entry) + size);
-		pool->nalloc += max;
-		for (i = 0; i < max; i++) {
-			entry = p;
-			entry->data = (void *)entry+ sizeof(struct pool_entry);
-			entry->size = size;
-
-			/* We want to use the last one as return */
-			if (i < max - 1) {
-				SLIST_INSERT_HEAD(&pool->entries, entry, next);
-				p += sizeof(struct pool_entry) + size;
-			}
+	struct pool_class *pc;
+	struct pool_entry *entry;
+	int class;
+
+	if (!size) {
+		pool_slab_new(pool);
+		return (pool_alloc(pool));
+	}
+
+	pool->nlarge++;
+
+	if ((class = pool_class(size)) != -1) {
+		pc = &pool->classes[class];
+		if ((entry = SLIST_FIRST(&pc->entries)) != NULL) {
+			SLIST_REMOVE_HEAD(&pc->entries, next);
+			pc->nfree--;
+			return (entry->data);
 		}
+		size = (size_t)1 << (class + POOL_MINCLASS);
 	}
 
+	pool_grow(pool, size + sizeof(struct pool_entry));
+	entry = malloc(size + sizeof(struct pool_entry));
+	if (entry == NULL)
+		err(1, "%s: malloc", __func__);
+	pool_account(pool, size + sizeof(struct pool_entry));
+
+	entry->page = NULL;
+	entry->data = (void *)entry + sizeof(struct pool_entry);
+	entry->size = size;
+
 	return (entry->data);
 }
+
+void
+pool_free_slow(struct pool *pool, struct pool_entry *entry)
+{
+	struct pool_page *page = entry->page;
+	struct pool_class *pc;
+	int class;
+
+	if (page != NULL) {
+		/* The slab has no objects in use anymore */
+		TAILQ_REMOVE(&pool->pages, page, next);
+		pool->nfree -= pool->perslab - 1;
+		pool->nalloc--;
+		pool->nslabs--;
+		pool->ntrimmed++;
+		pool_account(pool, -(ssize_t)pool->slabsize);
+
+		free(page);
+		return;
+	}
+
+	pool->nlarge--;
+
+	class = pool_class(entry->size);
+	if (class != -1 && pool->trim != POOL_TRIM_ALWAYS &&
+	    (!pool->maxresident || pool->resident <= pool->maxresident) &&
+	    entry->size == (size_t)1 << (class + POOL_MINCLASS)) {
+		pc = &pool->classes[class];
+		if (pc->nfree < POOL_CLASSKEEP) {
+			SLIST_INSERT_HEAD(&pc->entries, entry, next);
+			pc->nfree++;
+			return;
+		}
+	}
+
+	pool_account(pool, -(ssize_t)(entry->size + sizeof(struct pool_entry)));
+	free(entry);
+}
+
+void
+pool_print(struct evbuffer *buffer)
+{
+	struct pool *pool;
+	int i, ncached;
+
+	evbuffer_add_printf(buffer,
+	    "%-10s %5s %7s %7s %7s %6s %7s %7s %6s %8s %8s %8s %8s\n",
+	    "pool", "size", "in use", "free", "peak", "slabs", "trimmed",
+	    "buffers", "cached", "res KB", "peak KB", "max KB", "pressure");
+
+	TAILQ_FOREACH(pool, &pools, next) {
+		ncached = 0;
+		for (i = 0; i < POOL_NCLASSES; i++)
+			ncached += pool->classes[i].nfree;
+
+		evbuffer_add_printf(buffer,
+		    "%-10s %5u %7d %7d %7d %6d %7d %7d %6d %8u %8u %8u %8d\n",
+		    pool->name, (u_int)pool->size, pool->nalloc, pool->nfree,
+		    pool->npeak, pool->nslabs, pool->ntrimmed, pool->nlarge,
+		    ncached, (u_int)(pool->resident / 1024),
+		    (u_int)(pool->peakresident / 1024),
+		    (u_int)(pool->maxresident / 1024), pool->npressure);
+	}
+}
+
+/* Unittests */
+
+void
+pool_test(void)
+{
+	struct pool *pool;
+	void *objs[200], *buf;
+	int i;
+
+	pool = pool_init("test", 100, 0, POOL_TRIM_HIGHWATER);
+	pool_set_highwater(pool, pool->perslab);
+
+	for (i = 0; i < 200; i++)
+		objs[i] = pool_alloc(pool);
+	if (pool->nalloc != 200 ||
+	    pool->nslabs != (200 + pool->perslab - 1) / pool->perslab)
+		errx(1, "%s: bad allocation counts: %d in %d slabs",
+		    __func__, pool->nalloc, pool->nslabs);
+
+	for (i = 0; i < 200; i++) {
+		memset(objs[i], i, pool->size);
+		pool_free(pool, objs[i]);
+	}
+	if (pool->nalloc != 0 || pool->npeak != 200)
+		errx(1, "%s: %d objects still in use, peak %d",
+		    __func__, pool->nalloc, pool->npeak);
+
+	/* Unused slabs above the high-water mark are gone */
+	if (pool->nfree > 2 * pool->perslab || !pool->ntrimmed)
+		errx(1, "%s: pool was not trimmed: %d free",
+		    __func__, pool->nfree);
+
+	/* Variable sized buffers are cached by size class */
+	buf = pool_alloc_size(pool, 3000);
+	pool_free(pool, buf);
+	if (pool_alloc_size(pool, 2049) != buf)
+		errx(1, "%s: size class did not cache buffer", __func__);
+	pool_free(pool, buf);
+
+	buf = pool_alloc_size(pool, 100000);
+	pool_free(pool, buf);
+	if (pool->nlarge != 0)
+		errx(1, "%s: %d buffers in use", __func__, pool->nlarge);
+
+	/* Bursts above the resident limit are given back afterwards */
+	pool = pool_init("test-max", 100, 4 * POOL_PAGE_SIZE,
+	    POOL_TRIM_NEVER);
+	for (i = 0; i < 200; i++)
+		objs[i] = pool_alloc(pool);
+	if (!pool->npressure || pool->peakresident <= pool->maxresident)
+		errx(1, "%s: no memory pressure recorded", __func__);
+	for (i = 0; i < 200; i++)
+		pool_free(pool, objs[i]);
+	if (pool->resident > pool->maxresident)
+		errx(1, "%s: %u bytes resident above limit", __func__,
+		    (u_int)pool->resident);
+	buf = pool_alloc_size(pool, 30000);
+	pool_free(pool, buf);
+	if (pool->resident > pool->maxresident)
+		errx(1, "%s: buffer cached above limit", __func__);
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
@@ -34,36 +34,124 @@
 #define _POOL_
 
 #define POOL_PAGE_SIZE	4096
+#define POOL_MINOBJS	8	/* objects per slab at least */
+#define POOL_ALIGN	16
+
+/* Variable sized buffers are cached by power of two size classes */
+#define POOL_MINCLASS	6	/* 64 bytes */
+#define POOL_MAXCLASS	16	/* 64 KB */
+#define POOL_NCLASSES	(POOL_MAXCLASS - POOL_MINCLASS + 1)
+#define POOL_CLASSKEEP	32	/* free buffers kept per size class */
+
+/* What to do with slabs that have no objects in use */
+enum pool_trim {
+	POOL_TRIM_NEVER,	/* keep them around */
+	POOL_TRIM_HIGHWATER,	/* free them above the high-water mark */
+	POOL_TRIM_ALWAYS	/* free them right away */
+};
+
+struct pool_page;
 
 struct pool_entry {
 	SLIST_ENTRY(pool_entry) next;
+	struct pool_page *page;	/* NULL for variable sized buffers */
 	void *data;
 	size_t size;
 };
 
+SLIST_HEAD(poolq, pool_entry);
+
+/*
+ * A slab is a contiguous allocation of slabsize bytes that starts with
+ * this header and is followed by the objects.
+ */
+struct pool_page {
+	TAILQ_ENTRY(pool_page) next;
+	struct poolq entries;	/* free objects in this slab */
+	int nfree;
+};
+
+struct pool_class {
+	struct poolq entries;
+	int nfree;
+};
+
 struct pool {
-	SLIST_HEAD(poolq, pool_entry) entries;
-	size_t size;
-	int nalloc;
+	TAILQ_ENTRY(pool) next;
+	TAILQ_HEAD(pageq, pool_page) pages;	/* slabs with free objects */
+
+	const char *name;
+	size_t size;		/* object size */
+	size_t slabsize;
+	int perslab;
+
+	enum pool_trim trim;
+	int highwater;		/* free objects kept before trimming */
+	size_t maxresident;	/* memory kept allocated, 0 is unlimited */
+
+	/* Statistics */
+	int nslabs;
+	int nalloc;		/* objects in use */
+	int nfree;		/* free objects in slabs */
+	int npeak;		/* objects in use at most */
+	int ntrimmed;		/* slabs returned to the system */
+	int nlarge;		/* variable sized buffers in use */
+	int npressure;		/* allocations above maxresident */
+	size_t resident;	/* slabs and buffers allocated */
+	size_t peakresident;
+
+	struct pool_class classes[POOL_NCLASSES];
 };
 
-struct pool *pool_init(size_t);
+struct evbuffer;
+
+struct pool *pool_init(const char *, size_t, size_t, enum pool_trim);
+void pool_set_highwater(struct pool *, int);
 void *pool_alloc_size(struct pool *, size_t);
+void pool_free_slow(struct pool *, struct pool_entry *);
+void pool_print(struct evbuffer *);
+
+void pool_test(void);
 
 /* 
  * The pool interface cached allocation of fixed sized objects,
  * but it can also be used to allocate larger buffers if necessary.
  */
 
+/* Checks if a slab that just became unused should be given back */
+static __inline int
+pool_want_trim(struct pool *pool)
+{
+	if (pool->maxresident && pool->resident > pool->maxresident)
+		return (1);
+
+	switch (pool->trim) {
+	case POOL_TRIM_ALWAYS:
+		return (1);
+	case POOL_TRIM_HIGHWATER:
+		return (pool->nfree >= pool->highwater);
+	default:
+		return (0);
+	}
+}
+
 static __inline void *
 pool_alloc(struct pool *pool)
 {
+	struct pool_page *page;
 	struct pool_entry *entry;
 
-	if ((entry = SLIST_FIRST(&pool->entries)) == NULL)
+	if ((page = TAILQ_FIRST(&pool->pages)) == NULL)
 		return (pool_alloc_size(pool, 0));
 
-	SLIST_REMOVE_HEAD(&pool->entries, next);
+	entry = SLIST_FIRST(&page->entries);
+	SLIST_REMOVE_HEAD(&page->entries, next);
+	if (--page->nfree == 0)
+		TAILQ_REMOVE(&pool->pages, page, next);
+
+	pool->nfree--;
+	if (++pool->nalloc > pool->npeak)
+		pool->npeak = pool->nalloc;
 	return (entry->data);
 }
 
@@ -71,17 +159,25 @@ static __inline void
 pool_free(struct pool *pool, void *addr)
 {
 	struct pool_entry *entry = addr - sizeof(struct pool_entry);
+	struct pool_page *page = entry->page;
 
 	if (entry->data != addr)
 		errx(1, "%s: bad address: %p != %p", __func__,
 		    addr, entry->data);
 
-	if (entry->size == pool->size)
-		SLIST_INSERT_HEAD(&pool->entries, entry, next);
-	else {
-		free(entry);
-		pool->nalloc--;
+	/* Either a variable sized buffer or a slab that gets trimmed */
+	if (page == NULL ||
+	    (page->nfree == pool->perslab - 1 && pool_want_trim(pool))) {
+		pool_free_slow(pool, entry);
+		return;
 	}
+
+	SLIST_INSERT_HEAD(&page->entries, entry, next);
+	if (page->nfree++ == 0)
+		TAILQ_INSERT_HEAD(&pool->pages, page, next);
+
+	pool->nfree++;
+	pool->nalloc--;
 }
 
 #endif /* _POOL_ */
@@ -486,8 +486,8 @@ pyextend_delete_template(PyObject *self, PyObject *args)
 static PyObject*
 pyextend_delete_connection(PyObject *self, PyObject *args)
 {
-	extern struct tree tcpcons;
-	extern struct tree udpcons;
+	extern struct flowtable tcpcons;
+	extern struct flowtable udpcons;
 	struct tuple tmp, *hdr;
 	char *protocol;
 	char *asrc, *adst, *asport, *adport;
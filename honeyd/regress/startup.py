@@ -0,0 +1,77 @@
+#!/usr/bin/env python
+#
+# Copyright (c) 2004 Niels Provos <provos@citi.umich.edu>
+# All rights reserved.
+#
+# Measures how long it takes to load a large configuration, once by
+# parsing it and once from a compiled snapshot.
+#
+import os
+import sys
+import re
+import time
+
+honeyd = ('../honeyd --disable-webserver --disable-update -R 1 '
+          '-p ../nmap.prints -x ../xprobe2.conf -a ../nmap.assoc -0 ../pf.os '
+          '-f config.startup')
+
+def get_ipaddr(count):
+    octet1 = count % 250
+    octet2 = count / 250
+
+    return "10.%d.%d.%d" % (octet2 / 250 + 1, octet2 % 250, octet1 + 1)
+
+def make_configuration(filename, fingerprints, number):
+    output = open(filename, "w")
+    input = open(fingerprints, "r")
+
+    print >>output, """create template
+set template default tcp action reset
+add template tcp port 23 open
+add template tcp port 80 "sh scripts/web.sh"
+add template udp port 53 open
+route entry 10.0.0.1 network 10.0.0.0/8
+route 10.0.0.1 link 10.0.0.0/8
+"""
+    prints = []
+    r = re.compile('\s*$')
+    m = re.compile("^Fingerprint ([^#]*)$")
+    for line in input:
+        res = m.match(r.sub("", line))
+        if res:
+            prints.append(res.group(1))
+
+    for count in range(0, number):
+        ipaddr = get_ipaddr(count)
+        print >>output, 'bind %s template' % ipaddr
+        print >>output, 'set %s personality "%s"' % (
+            ipaddr, prints[count % len(prints)])
+
+    output.close()
+    input.close()
+
+def run(args):
+    start = time.time()
+    res = os.system('%s %s >/dev/null 2>&1' % (honeyd, args))
+    end = time.time()
+
+    if res != 0:
+        print >>sys.stderr, 'honeyd %s failed' % args
+        sys.exit(1)
+
+    return end - start
+
+# Main
+
+number = 20000
+make_configuration("config.startup", "../nmap.prints", number)
+
+parsed = run('--verify-config')
+run('--compile-config --config-snapshot=config.snapshot')
+loaded = run('--verify-config --config-snapshot=config.snapshot')
+
+print "Startup with %d templates: parsed %.2fs, snapshot %.2fs" % (
+    number, parsed, loaded)
+
+os.unlink("config.startup")
+os.unlink("config.snapshot")
@@ -53,15 +53,26 @@
 #undef timeout_initialized
 
 #include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/tag.h>
 
+#include "honeyd.h"
 #include "network.h"
 #include "router.h"
-#include "pool.h"
 #include "interface.h"
+#include "snapshot.h"
 
 /* Structure for routers */
 static SPLAY_HEAD(routetree, router) routers;
 
+/* Changes whenever the routing topology changes */
+u_int router_generation = 1;
+
+static struct route_result *route_cache;
+static uint64_t route_cache_hits;
+static uint64_t route_cache_misses;
+static uint64_t route_cache_uncached;
+
 int
 routercompare(struct router *a, struct router *b)
 {
@@ -105,226 +116,6 @@ int router_used = 0;
 struct network *entry_routers = NULL;
 struct network *reverse = NULL;
 
-/* Internal */
-
-static struct pool *pool_network;
-
-/* Network trinary tree code by Bill Cheswick; stylified and munged by NP */
-
-static void network_addnode(struct network **, struct network *,
-    struct network **);
-
-static void
-network_copydata(struct network *dst, struct network *src)
-{
-	memmove(&dst->data, &src->data, sizeof(dst->data));
-}
-
-/*
- *  walk down a tree adding nodes back in
- */
-static void
-network_walkadd(struct network **root, struct network *net,
-    struct network **netqueue)
-{
-	struct network *left, *right;
-
-	left = net->left;
-	right = net->right;
-	net->left = NULL;
-	net->right = NULL;
-
-	network_addnode(root, net, netqueue);
-	if (left != NULL)
-		network_walkadd(root, left, netqueue);
-	if (right != NULL)
-		network_walkadd(root, right, netqueue);
-}
-
-/*
- *  calculate depth
- */
-static void
-network_calcd(struct network *net)
-{
-	struct network *tmp;
-	int depth;
-
-	if (net == NULL)
-		return;
-
-	depth = 0;
-	if ((tmp = net->left) != NULL)
-		depth = tmp->depth;
-
-	tmp = net->right;
-	if (tmp != NULL && tmp->depth > depth)
-		depth = tmp->depth;
-
-	tmp = net->mid;
-	if (tmp != NULL && tmp->depth > depth)
-		depth = tmp->depth;
-
-	net->depth = depth + 1;
-}
-
-/*
- *  balance the tree at the current node
- */
-static void
-network_balancetree(struct network **cur)
-{
-	struct network *net, *left, *right;
-	int dl, dr;
-
-	/*
-	 * if left and right are too out of balance, rotate tree node
-	 */
-	net = *cur;
-	dl = dr = 0;
-	if ((left = net->left) != NULL)
-		dl = left->depth;
-	if ((right = net->right)!= NULL)
-		dr = right->depth;
-
-	if (dl > dr + 1) {
-		/* Rotate left */
-		net->left = left->right;
-		left->right = net;
-		*cur = left;
-
-		network_calcd(net);
-		network_calcd(left);
-	} else if (dr > dl + 1) {
-		/* Rotate right */
-		net->right = right->left;
-		right->left = net;
-		*cur = right;
-
-		network_calcd(net);
-		network_calcd(right);
-	} else
-		network_calcd(net);
-}
-
-/*
- *  add a new node to the tree
- */
-static void
-network_addnode(struct network **root, struct network *new,
-    struct network **netqueue)
-{
-	struct network *net, *left;
-
-	if ((net = *root) == NULL) {
-		*root = new;
-		new->depth = 1;
-		return;
-	}
-
-	switch(network_compare(new, net)){
-	case NET_PRECEEDS:
-		network_addnode(&net->left, new, netqueue);
-		break;
-
-	case NET_FOLLOWS:
-		network_addnode(&net->right, new, netqueue);
-		break;
-
-	case NET_CONTAINS:
-		/*
-		 *  if new node is superset of tree node, replace tree
-		 *  node and queue tree node to be merged into root.
-		 */
-		*root = new;
-		new->depth = 1;
-		left = pool_alloc(pool_network);
-		memset(left, 0, sizeof(struct network));
-		left->mid = *netqueue;
-		*netqueue = left;
-		left->left = net;
-		break;
-
-	case NET_EQUALS:
-		network_copydata(net, new);
-		pool_free(pool_network, new);
-		break;
-
-	case NET_CONTAINED:
-		network_addnode(&net->mid, new, netqueue);
-		break;
-	}
-	
-	network_balancetree(root);
-}
-
-/*
- * Add a route to the structure.  a and mask must be in host byte order.
- */
-void
-network_add(struct network **root, struct addr *addr, void *data)
-{
-	struct network *netqueue = NULL;
-	struct network *p;
-
-	p = pool_alloc(pool_network);
-	memset(p, 0, sizeof(struct network));
-	p->net = *addr;
-	p->data = data;
-	network_addnode(root, p, &netqueue);
-
-	while ((p = netqueue) != NULL) {
-		netqueue = p->mid;
-		network_walkadd(root, p->left, &netqueue);
-		pool_free(pool_network, p);
-	}
-}
-
-/*
- * Find address la. Must be in host byte order.
- */
-void *
-network_lookup(struct network *root, struct addr *addr)
-{
-	struct network *net, *last;
-
-	last = NULL;
-	for (net = root; net != NULL; ) {
-		struct addr tmp;
-		
-		tmp = net->net;
-		tmp.addr_bits = IP_ADDR_BITS;
-		if (addr_cmp(addr, &tmp) >= 0) {
-			addr_bcast(&net->net, &tmp);
-			tmp.addr_bits = IP_ADDR_BITS;
-			if (addr_cmp(addr, &tmp) <= 0) {
-				last = net;
-				net = net->mid;
-			} else {
-				net = net->right;
-			}
-		} else {
-			net = net->left;
-		}
-	}
-
-	return (last != NULL ? last->data : NULL);
-}
-
-void
-network_cleanup(struct network *net, int needfree)
-{
-	if (net->mid != NULL)
-		network_cleanup(net->mid, needfree);
-	if (net->left != NULL)
-		network_cleanup(net->left, needfree);
-	if (net->right != NULL)
-		network_cleanup(net->right, needfree);
-	if (needfree && net->data != NULL)
-		free(net->data);
-	pool_free(pool_network, net);
-}
-
 /* Functions to deal with Honeyd virtual routers */
 
 void
@@ -333,7 +124,9 @@ router_init(void)
 	SPLAY_INIT(&routers);
 	SPLAY_INIT(&tunnels);
 
-	pool_network = pool_init(sizeof(struct network));
+	route_cache = calloc(ROUTE_CACHE_SIZE, sizeof(struct route_result));
+	if (route_cache == NULL)
+		err(1, "%s: calloc", __func__);
 }
 
 struct router *
@@ -356,6 +149,8 @@ router_new(struct addr *addr)
 	if ((new = calloc(1, sizeof(struct router))) == NULL)
 		err(1, "%s: calloc", __FUNCTION__);
 
+	router_generation++;
+
 	new->routes = NULL;
 	new->addr = *addr;
 
@@ -373,6 +168,7 @@ router_end(void)
 {
 	struct router *router;
 	struct router_entry *tunnel;
+	struct link_entry *link;
 
 	/* 
 	 * Clean up configured tunnels:
@@ -386,6 +182,12 @@ router_end(void)
 
 		if (router->routes != NULL)
 			network_cleanup(router->routes, 1);
+		while ((link = SPLAY_ROOT(&router->links)) != NULL) {
+			SPLAY_REMOVE(linktree, &router->links, link);
+			if (link->queue != NULL)
+				honeyd_delayq_free(link->queue);
+			free(link);
+		}
 		free(router);
 	}
 
@@ -393,8 +195,110 @@ router_end(void)
 		network_cleanup(reverse, 0);
 	if (entry_routers != NULL)
 		network_cleanup(entry_routers, 0);
+	reverse = entry_routers = NULL;
 
 	router_used = 0;
+	router_generation++;
+}
+
+/*
+ * While a new configuration is parsed, the running topology is set
+ * aside, so that packets keep getting routed until the reload has
+ * finished.
+ */
+
+static struct {
+	struct routetree routers;
+	struct tunneltree tunnels;
+	struct network *entry_routers;
+	struct network *reverse;
+	int used;
+} router_staged;
+
+static void
+router_swap(void)
+{
+	struct routetree tmprouters = routers;
+	struct tunneltree tmptunnels = tunnels;
+	struct network *tmpentry = entry_routers, *tmpreverse = reverse;
+	int tmpused = router_used;
+
+	routers = router_staged.routers;
+	tunnels = router_staged.tunnels;
+	entry_routers = router_staged.entry_routers;
+	reverse = router_staged.reverse;
+	router_used = router_staged.used;
+
+	router_staged.routers = tmprouters;
+	router_staged.tunnels = tmptunnels;
+	router_staged.entry_routers = tmpentry;
+	router_staged.reverse = tmpreverse;
+	router_staged.used = tmpused;
+}
+
+void
+router_stage_begin(void)
+{
+	SPLAY_INIT(&router_staged.routers);
+	SPLAY_INIT(&router_staged.tunnels);
+	router_staged.entry_routers = router_staged.reverse = NULL;
+	router_staged.used = 0;
+
+	router_swap();
+}
+
+/*
+ * Installs the staged topology unless it is the same as the running
+ * one.  Returns 1 if the routes changed.
+ */
+
+int
+router_stage_end(void)
+{
+	struct evbuffer *staged, *running;
+	u_int generation = router_generation;
+	size_t len;
+	int changed;
+
+	if ((staged = evbuffer_new()) == NULL ||
+	    (running = evbuffer_new()) == NULL)
+		err(1, "%s: evbuffer_new", __func__);
+
+	router_marshal(staged);
+	router_swap();
+	router_marshal(running);
+
+	len = evbuffer_get_length(staged);
+	changed = len != evbuffer_get_length(running) || (len != 0 &&
+	    memcmp(evbuffer_pullup(staged, -1), evbuffer_pullup(running, -1),
+		len) != 0);
+	evbuffer_free(staged);
+	evbuffer_free(running);
+
+	if (changed) {
+		router_end();
+		router_swap();
+	} else {
+		/* The route cache still refers to the running routers */
+		router_swap();
+		router_end();
+		router_swap();
+		router_generation = generation;
+	}
+
+	return (changed);
+}
+
+/* Throws away the staged topology and keeps the running one */
+
+void
+router_stage_abort(void)
+{
+	u_int generation = router_generation;
+
+	router_end();
+	router_swap();
+	router_generation = generation;
 }
 
 /*
@@ -484,6 +388,7 @@ router_add_link(struct router *r, struct addr *addr)
 	rte = router_entry_new(addr, r, NULL, ROUTE_LINK);
 	
 	network_add(&r->routes, addr, rte);
+	router_generation++;
 
 	/* Add this router in the reverse lookup */
 	network_add(&reverse, addr, r);
@@ -499,6 +404,7 @@ router_add_unreach(struct router *r, struct addr *addr)
 	rte = router_entry_new(addr, r, NULL, ROUTE_UNREACH);
 	
 	network_add(&r->routes, addr, rte);
+	router_generation++;
 
 	return (0);
 }
@@ -546,6 +452,7 @@ router_add_net(struct router *r, struct addr *net, struct router *gw,
 	}
 	
 	network_add(&r->routes, net, rte);
+	router_generation++;
 
 	return (0);
 }
@@ -568,6 +475,7 @@ router_add_tunnel(struct router *r, struct addr *net,
 	rte->tunnel_dst = *tunnel_dst;
 	
 	network_add(&r->routes, net, rte);
+	router_generation++;
 
 	SPLAY_INSERT(tunneltree, &tunnels, rte);
 
@@ -584,3 +492,362 @@ router_find_tunnel(struct addr *src, struct addr *dst)
 
 	return (SPLAY_FIND(tunneltree, &tunnels, &tmp));
 }
+
+/*
+ * Walks the routing topology from the entry router to the destination
+ * and records everything about the route that is the same for every
+ * packet.  Returns -1 if the route can not be cached.
+ */
+static int
+router_compile(struct route_result *res, struct addr *gw, struct addr *dst)
+{
+	struct router *r, *lastrouter = NULL;
+	struct router_entry *rte = NULL;
+	struct link_entry *link;
+	struct addr host;
+
+	memset(res, 0, sizeof(struct route_result));
+	res->gw = gw->addr_ip;
+	res->dst = dst->addr_ip;
+	res->survive = 1;
+
+	host = *gw;
+	if ((r = router_find(&host)) == NULL)
+		return (-1);
+
+	while (addr_cmp(&host, dst) != 0) {
+		/* Routing loops only end when the TTL runs out */
+		if (++res->hops > IP_TTL_MAX)
+			return (-1);
+
+		if ((rte = network_lookup(r->routes, dst)) == NULL) {
+			if (r->flags & ROUTER_ISENTRY) {
+				res->external = 1;
+				break;
+			}
+			res->noroute = 1;
+			break;
+		}
+
+		if (rte->gw != NULL && lastrouter == rte->gw) {
+			res->noroute = 1;
+			break;
+		}
+
+		if (rte->type == ROUTE_TUNNEL ||
+		    rte->type == ROUTE_LINK || rte->type == ROUTE_UNREACH)
+			break;
+
+		link = rte->link;
+		res->latency += link->latency ? link->latency : 3;
+		if (link->bandwidth) {
+			if (res->nlinks == ROUTE_MAXLINKS)
+				return (-1);
+			res->links[res->nlinks++] = link;
+		}
+		if (link->packetloss)
+			res->survive *= 1 - ((double)link->packetloss / 10000.0);
+
+		lastrouter = r;
+		r = rte->gw;
+		host = r->addr;
+	}
+
+	res->host = host;
+	res->rte = rte;
+	res->generation = router_generation;
+
+	return (0);
+}
+
+/*
+ * Returns the static part of the route from an entry router to a
+ * destination, or NULL if the route needs to be walked for each packet.
+ */
+struct route_result *
+router_cache_lookup(struct addr *gw, struct addr *dst)
+{
+	struct route_result *res;
+	uint32_t h;
+
+	h = gw->addr_ip * 0x9e3779b1;
+	h ^= dst->addr_ip;
+	h *= 0x85ebca6b;
+	h ^= h >> 16;
+	res = &route_cache[h & (ROUTE_CACHE_SIZE - 1)];
+
+	if (res->generation == router_generation &&
+	    res->gw == gw->addr_ip && res->dst == dst->addr_ip) {
+		route_cache_hits++;
+		return (res);
+	}
+
+	route_cache_misses++;
+	if (router_compile(res, gw, dst) == -1) {
+		res->generation = 0;
+		route_cache_uncached++;
+		return (NULL);
+	}
+
+	return (res);
+}
+
+void
+router_cache_print(struct evbuffer *buf)
+{
+	evbuffer_add_printf(buf,
+	    "route cache: %d entries, %llu hits, %llu misses, "
+	    "%llu not cacheable\n", ROUTE_CACHE_SIZE,
+	    (unsigned long long)route_cache_hits,
+	    (unsigned long long)route_cache_misses,
+	    (unsigned long long)route_cache_uncached);
+}
+
+/* Compiled configuration */
+
+static void
+router_marshal_route(void *data, void *arg)
+{
+	struct router_entry *rte = data;
+	struct link_entry *link = rte->link;
+	struct evbuffer *evbuf = arg, *tmp;
+
+	if ((tmp = evbuffer_new()) == NULL)
+		err(1, "%s: evbuffer_new", __func__);
+
+	evtag_marshal_int(tmp, RTE_TYPE, rte->type);
+	evtag_marshal(tmp, RTE_NET, &rte->net, sizeof(struct addr));
+	switch (rte->type) {
+	case ROUTE_NET:
+		evtag_marshal(tmp, RTE_GW, &rte->gw->addr, sizeof(struct addr));
+		evtag_marshal_int(tmp, RTE_LATENCY, link->latency);
+		evtag_marshal_int(tmp, RTE_LOSS, link->packetloss);
+		evtag_marshal_int(tmp, RTE_BANDWIDTH, link->bandwidth);
+		evtag_marshal_int(tmp, RTE_DIVIDER, link->divider);
+		evtag_marshal_int(tmp, RTE_RED_LOW, link->red.low);
+		evtag_marshal_int(tmp, RTE_RED_HIGH, link->red.high);
+		break;
+	case ROUTE_TUNNEL:
+		evtag_marshal(tmp, RTE_TUNNEL_SRC, &rte->tunnel_src,
+		    sizeof(struct addr));
+		evtag_marshal(tmp, RTE_TUNNEL_DST, &rte->tunnel_dst,
+		    sizeof(struct addr));
+		break;
+	default:
+		break;
+	}
+
+	evtag_marshal_buffer(evbuf, RTR_ROUTE, tmp);
+	evbuffer_free(tmp);
+}
+
+static void
+router_marshal_one(struct evbuffer *evbuf, struct router *r)
+{
+	struct evbuffer *tmp;
+
+	if ((tmp = evbuffer_new()) == NULL)
+		err(1, "%s: evbuffer_new", __func__);
+
+	evtag_marshal(tmp, RTR_ADDR, &r->addr, sizeof(struct addr));
+	if (r->flags & ROUTER_ISENTRY)
+		evtag_marshal(tmp, RTR_NETWORK, &r->network,
+		    sizeof(struct addr));
+	network_walk(r->routes, router_marshal_route, tmp);
+
+	evtag_marshal_buffer(evbuf, SNAP_ROUTER, tmp);
+	evbuffer_free(tmp);
+}
+
+/*
+ * Entry routers are marshaled first, so that they are started before
+ * any route refers to them.
+ */
+int
+router_marshal(struct evbuffer *evbuf)
+{
+	struct router *r;
+
+	SPLAY_FOREACH(r, routetree, &routers) {
+		if (r->flags & ROUTER_ISENTRY)
+			router_marshal_one(evbuf, r);
+	}
+	SPLAY_FOREACH(r, routetree, &routers) {
+		if (!(r->flags & ROUTER_ISENTRY))
+			router_marshal_one(evbuf, r);
+	}
+
+	return (0);
+}
+
+static struct router *
+router_find_or_new(struct addr *addr)
+{
+	struct router *r;
+
+	if ((r = router_find(addr)) == NULL)
+		r = router_new(addr);
+	return (r);
+}
+
+static int
+router_unmarshal_route(struct router *r, struct evbuffer *evbuf)
+{
+	struct link_drop nodrop = { 0, 0 };
+	struct link_entry *link;
+	struct router *gw;
+	struct addr net, gwaddr, src, dst;
+	uint32_t type, latency, loss, bandwidth, divider, low, high;
+
+	if (evtag_unmarshal_int(evbuf, RTE_TYPE, &type) == -1 ||
+	    evtag_unmarshal_fixed(evbuf, RTE_NET, &net, sizeof(net)) == -1)
+		return (-1);
+
+	switch (type) {
+	case ROUTE_LINK:
+		return (router_add_link(r, &net));
+	case ROUTE_UNREACH:
+		return (router_add_unreach(r, &net));
+	case ROUTE_TUNNEL:
+		if (evtag_unmarshal_fixed(evbuf, RTE_TUNNEL_SRC,
+			&src, sizeof(src)) == -1 ||
+		    evtag_unmarshal_fixed(evbuf, RTE_TUNNEL_DST,
+			&dst, sizeof(dst)) == -1)
+			return (-1);
+		return (router_add_tunnel(r, &net, &src, &dst));
+	case ROUTE_NET:
+		break;
+	default:
+		return (-1);
+	}
+
+	if (evtag_unmarshal_fixed(evbuf, RTE_GW, &gwaddr,
+		sizeof(gwaddr)) == -1 ||
+	    evtag_unmarshal_int(evbuf, RTE_LATENCY, &latency) == -1 ||
+	    evtag_unmarshal_int(evbuf, RTE_LOSS, &loss) == -1 ||
+	    evtag_unmarshal_int(evbuf, RTE_BANDWIDTH, &bandwidth) == -1 ||
+	    evtag_unmarshal_int(evbuf, RTE_DIVIDER, &divider) == -1 ||
+	    evtag_unmarshal_int(evbuf, RTE_RED_LOW, &low) == -1 ||
+	    evtag_unmarshal_int(evbuf, RTE_RED_HIGH, &high) == -1)
+		return (-1);
+
+	if ((gw = router_find_or_new(&gwaddr)) == NULL)
+		return (-1);
+
+	/* The bandwidth has been converted already; set it directly */
+	if (router_add_net(r, &net, gw, latency, loss, 0, &nodrop) == -1)
+		return (-1);
+	link = link_entry_find(&r->links, &gw->addr);
+	link->bandwidth = bandwidth;
+	link->divider = divider;
+	link->red.low = low;
+	link->red.high = high;
+
+	return (0);
+}
+
+/* Loads a single router from a compiled configuration */
+int
+router_unmarshal(struct evbuffer *evbuf)
+{
+	struct evbuffer *tmp;
+	struct router *r;
+	struct addr addr, network;
+	uint32_t tag;
+	int res = -1;
+
+	if (evtag_unmarshal_fixed(evbuf, RTR_ADDR, &addr, sizeof(addr)) == -1)
+		return (-1);
+
+	if (evtag_peek(evbuf, &tag) != -1 && tag == RTR_NETWORK) {
+		if (evtag_unmarshal_fixed(evbuf, RTR_NETWORK,
+			&network, sizeof(network)) == -1 ||
+		    router_start(&addr, &network) == -1)
+			return (-1);
+	}
+
+	if ((r = router_find_or_new(&addr)) == NULL)
+		return (-1);
+
+	if ((tmp = evbuffer_new()) == NULL)
+		err(1, "%s: evbuffer_new", __func__);
+
+	while (evtag_peek(evbuf, &tag) != -1) {
+		evbuffer_drain(tmp, evbuffer_get_length(tmp));
+		if (evtag_unmarshal(evbuf, &tag, tmp) == -1 ||
+		    tag != RTR_ROUTE ||
+		    router_unmarshal_route(r, tmp) == -1)
+			goto out;
+	}
+
+	res = 0;
+ out:
+	evbuffer_free(tmp);
+	return (res);
+}
+
+/* Unittests */
+
+void
+router_test(void)
+{
+	struct router *entry, *r1, *r2;
+	struct route_result *res;
+	struct addr gw, a1, a2, net, dst, link;
+	struct link_drop drop = { 0, 0 };
+	u_int generation;
+
+	router_end();
+
+	addr_pton("10.0.0.1", &gw);
+	addr_pton("10.1.0.1", &a1);
+	addr_pton("10.2.0.1", &a2);
+	addr_pton("10.2.0.0/16", &net);
+	addr_pton("10.2.1.0/24", &link);
+	addr_pton("10.2.1.5", &dst);
+
+	if (router_start(&gw, NULL) == -1)
+		errx(1, "%s: router_start failed", __func__);
+	entry = router_find(&gw);
+	r1 = router_new(&a1);
+	r2 = router_new(&a2);
+
+	/* entry -> r1 -> r2, which has the destination on its link */
+	router_add_net(entry, &net, r1, 10, 100, 0, &drop);
+	router_add_net(r1, &net, r2, 5, 0, 1000, &drop);
+	router_add_link(r2, &link);
+
+	if ((res = router_cache_lookup(&gw, &dst)) == NULL)
+		errx(1, "%s: route not cached", __func__);
+	if (res->hops != 3 || res->latency != 15 || res->nlinks != 1 ||
+	    res->external || res->noroute ||
+	    res->rte == NULL || res->rte->type != ROUTE_LINK ||
+	    addr_cmp(&res->host, &a2) != 0)
+		errx(1, "%s: bad route: %d hops, %d ms, %d links",
+		    __func__, res->hops, res->latency, res->nlinks);
+	if (res->survive < 0.989 || res->survive > 0.991)
+		errx(1, "%s: bad packet loss %f", __func__, res->survive);
+	if (router_cache_lookup(&gw, &dst) != res)
+		errx(1, "%s: second lookup missed", __func__);
+
+	/* Unknown destinations leave through the entry router */
+	addr_pton("192.168.0.1", &dst);
+	if ((res = router_cache_lookup(&gw, &dst)) == NULL ||
+	    !res->external || res->hops != 1)
+		errx(1, "%s: external route not recognized", __func__);
+
+	/* Configuration changes invalidate the cache */
+	generation = router_generation;
+	addr_pton("10.2.2.0/24", &link);
+	router_add_unreach(r2, &link);
+	if (router_generation == generation)
+		errx(1, "%s: generation did not change", __func__);
+	addr_pton("10.2.2.7", &dst);
+	if ((res = router_cache_lookup(&gw, &dst)) == NULL ||
+	    res->rte == NULL || res->rte->type != ROUTE_UNREACH)
+		errx(1, "%s: unreachable route not recognized", __func__);
+
+	router_end();
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
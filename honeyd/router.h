@@ -33,6 +33,7 @@
 #define _ROUTER_H_
 
 struct network;
+struct delayq;
 
 enum route_type {ROUTE_LINK = 0, ROUTE_NET, ROUTE_UNREACH, ROUTE_TUNNEL};
 
@@ -55,6 +56,7 @@ struct link_entry {
 	struct link_drop red;	/* Random Early Drop thresholds */
 
 	struct timeval tv_busy;	/* time that we are busy sending */
+	struct delayq *queue;	/* packets waiting for this link */
 };
 
 struct router_entry {
@@ -87,6 +89,36 @@ struct router {
 
 #define ROUTER_ISENTRY	0x0001
 
+/*
+ * The part of a route from an entry router to a destination that does
+ * not change from packet to packet.  Only the link queues, i.e. the
+ * bandwidth and RED drops, and the random packet loss remain to be
+ * applied for each packet.
+ */
+#define ROUTE_MAXLINKS	16	/* bandwidth limited links on a path */
+
+struct route_result {
+	ip_addr_t gw;
+	ip_addr_t dst;
+	u_int generation;	/* valid if it matches router_generation */
+
+	int hops;		/* routers that decrement the TTL */
+	int latency;		/* in ms */
+	double survive;		/* probability of not losing the packet */
+
+	int external;		/* leaves the topology at the entry router */
+	int noroute;
+	struct addr host;	/* last router on the path */
+	struct router_entry *rte;	/* route taken at the last router */
+
+	int nlinks;
+	struct link_entry *links[ROUTE_MAXLINKS];
+};
+
+#define ROUTE_CACHE_SIZE	1024	/* must be a power of two */
+
+extern u_int router_generation;
+
 extern int router_used;
 extern struct network *entry_routers;
 
@@ -94,6 +126,9 @@ void router_init(void);
 struct router *router_new(struct addr *);
 int router_start(struct addr *, struct addr *);
 void router_end(void);
+void router_stage_begin(void);
+int router_stage_end(void);
+void router_stage_abort(void);
 struct router *router_find(struct addr *);
 int router_add_link(struct router *, struct addr *);
 int router_add_unreach(struct router *, struct addr *);
@@ -107,5 +142,10 @@ struct link_entry *link_entry_new(struct addr *);
 struct router_entry *router_find_tunnel(struct addr *, struct addr *);
 struct router_entry *router_find_nexthop(struct router *, struct addr *);
 
-void *network_lookup(struct network *, struct addr *);
+struct route_result *router_cache_lookup(struct addr *, struct addr *);
+struct evbuffer;
+void router_cache_print(struct evbuffer *);
+
+void router_test(void);
+
 #endif
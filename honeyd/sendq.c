@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2002, 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE		/* for sendmmsg */
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include "config.h"
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <dnet.h>
+#include <pcap.h>
+
+#if defined(HAVE_SENDMMSG) && defined(HAVE_LINUX_IF_PACKET_H)
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#define HAVE_SENDQ
+#endif
+
+#undef timeout_pending
+#undef timeout_initialized
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "honeyd.h"
+#include "interface.h"
+#include "histogram.h"
+#include "sendq.h"
+
+static struct sendq_stats sendq_stats;
+static int sendq_maxbatch;
+
+extern struct event_base *honeyd_base_ev;
+extern struct stats_network stats_network;
+
+#ifdef HAVE_SENDQ
+struct sendq_entry {
+	union {
+		struct sockaddr_in sin;
+		struct sockaddr_ll sll;
+	} addr;
+	u_int len;
+	u_int iplen;		/* accounted as output bytes */
+	u_char data[SENDQ_FRAMESIZE];
+};
+
+struct sendq {
+	int fd;
+	socklen_t addrlen;
+	int count;
+	struct sendq_entry *entries;
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+};
+
+static struct sendq sendq_ipq, sendq_ethq;
+static struct timeval sendq_latency;
+static struct event *sendq_ev;
+
+static void
+sendq_alloc(struct sendq *q, int fd, socklen_t addrlen)
+{
+	q->fd = fd;
+	q->addrlen = addrlen;
+	q->count = 0;
+	q->entries = calloc(sendq_maxbatch, sizeof(struct sendq_entry));
+	q->msgs = calloc(sendq_maxbatch, sizeof(struct mmsghdr));
+	q->iov = calloc(sendq_maxbatch, sizeof(struct iovec));
+	if (q->entries == NULL || q->msgs == NULL || q->iov == NULL)
+		err(1, "%s: calloc", __func__);
+}
+
+/* Sends all queued packets, skipping over packets that fail */
+static void
+sendq_flush_queue(struct sendq *q)
+{
+	struct sendq_entry *entry;
+	int i, res, off = 0;
+
+	if (!q->count)
+		return;
+
+	for (i = 0; i < q->count; i++) {
+		entry = &q->entries[i];
+		q->iov[i].iov_base = entry->data;
+		q->iov[i].iov_len = entry->len;
+		memset(&q->msgs[i], 0, sizeof(struct mmsghdr));
+		q->msgs[i].msg_hdr.msg_name = &entry->addr;
+		q->msgs[i].msg_hdr.msg_namelen = q->addrlen;
+		q->msgs[i].msg_hdr.msg_iov = &q->iov[i];
+		q->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (off < q->count) {
+		sendq_stats.syscalls++;
+		res = sendmmsg(q->fd, &q->msgs[off], q->count - off, 0);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EHOSTDOWN && errno != EHOSTUNREACH &&
+			    errno != ENOBUFS)
+				syslog(LOG_ERR, "couldn't send packet: %m");
+			sendq_stats.errors++;
+			res = 1;	/* drop the failing packet */
+		} else {
+			for (i = off; i < off + res; i++)
+				count_increment(stats_network.output_bytes,
+				    q->entries[i].iplen);
+			sendq_stats.packets += res;
+		}
+		off += res;
+	}
+
+	q->count = 0;
+}
+
+static void
+sendq_cb(evutil_socket_t fd, short what, void *arg)
+{
+	sendq_flush();
+}
+
+static struct sendq_entry *
+sendq_entry_new(struct sendq *q)
+{
+	if (q->count == sendq_maxbatch)
+		sendq_flush_queue(q);
+
+	/* The first packet of a batch schedules the flush */
+	if (!sendq_ipq.count && !sendq_ethq.count) {
+		if (timerisset(&sendq_latency))
+			evtimer_add(sendq_ev, &sendq_latency);
+		else
+			event_active(sendq_ev, EV_TIMEOUT, 1);
+	}
+
+	return (&q->entries[q->count++]);
+}
+#endif /* HAVE_SENDQ */
+
+/*
+ * Sets up the output queue with maxbatch packets per flush and a
+ * latency bound in microseconds.  A batch size of one disables it.
+ */
+void
+sendq_init(int maxbatch, int latency)
+{
+	sendq_maxbatch = maxbatch;
+	if (sendq_maxbatch <= 1)
+		return;
+
+#ifdef HAVE_SENDQ
+	{
+		int fd, on = 1;
+
+		if ((fd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) == -1)
+			err(1, "%s: socket", __func__);
+		if (setsockopt(fd, IPPROTO_IP, IP_HDRINCL,
+			&on, sizeof(on)) == -1)
+			err(1, "%s: IP_HDRINCL", __func__);
+		if (setsockopt(fd, SOL_SOCKET, SO_BROADCAST,
+			&on, sizeof(on)) == -1)
+			err(1, "%s: SO_BROADCAST", __func__);
+		sendq_alloc(&sendq_ipq, fd, sizeof(struct sockaddr_in));
+
+		if ((fd = socket(AF_PACKET, SOCK_RAW, 0)) == -1)
+			err(1, "%s: socket", __func__);
+		sendq_alloc(&sendq_ethq, fd, sizeof(struct sockaddr_ll));
+
+		sendq_latency.tv_sec = latency / 1000000;
+		sendq_latency.tv_usec = latency % 1000000;
+
+		sendq_ev = evtimer_new(honeyd_base_ev, sendq_cb, NULL);
+		if (sendq_ev == NULL)
+			errx(1, "%s: evtimer_new", __func__);
+	}
+#else
+	sendq_maxbatch = 1;
+#endif
+}
+
+/*
+ * Queues a complete IP packet with a valid checksum.  Returns -1 if the
+ * caller needs to send the packet by itself.
+ */
+int
+sendq_ip(const struct ip_hdr *ip, u_int iplen)
+{
+#ifdef HAVE_SENDQ
+	struct sendq_entry *entry;
+
+	if (sendq_maxbatch > 1 && iplen <= SENDQ_FRAMESIZE) {
+		entry = sendq_entry_new(&sendq_ipq);
+		memset(&entry->addr, 0, sizeof(entry->addr));
+		entry->addr.sin.sin_family = AF_INET;
+		entry->addr.sin.sin_addr.s_addr = ip->ip_dst;
+		entry->len = entry->iplen = iplen;
+		memcpy(entry->data, ip, iplen);
+		return (0);
+	}
+#endif
+	sendq_stats.direct++;
+	return (-1);
+}
+
+/* Queues an ethernet frame for the interface */
+int
+sendq_eth(const struct interface *inter, const u_char *frame, u_int len)
+{
+#ifdef HAVE_SENDQ
+	struct sendq_entry *entry;
+
+	if (sendq_maxbatch > 1 && len <= SENDQ_FRAMESIZE &&
+	    len >= ETH_HDR_LEN && inter->if_index != 0) {
+		entry = sendq_entry_new(&sendq_ethq);
+		memset(&entry->addr, 0, sizeof(entry->addr));
+		entry->addr.sll.sll_family = AF_PACKET;
+		entry->addr.sll.sll_ifindex = inter->if_index;
+		entry->addr.sll.sll_halen = ETH_ADDR_LEN;
+		memcpy(entry->addr.sll.sll_addr, frame, ETH_ADDR_LEN);
+		entry->len = len;
+		entry->iplen = len - ETH_HDR_LEN;
+		memcpy(entry->data, frame, len);
+		return (0);
+	}
+#endif
+	sendq_stats.direct++;
+	return (-1);
+}
+
+void
+sendq_flush(void)
+{
+#ifdef HAVE_SENDQ
+	if (!sendq_ipq.count && !sendq_ethq.count)
+		return;
+
+	sendq_stats.flushes++;
+	sendq_flush_queue(&sendq_ipq);
+	sendq_flush_queue(&sendq_ethq);
+#endif
+}
+
+void
+sendq_print(struct evbuffer *buf)
+{
+	struct sendq_stats *s = &sendq_stats;
+
+	evbuffer_add_printf(buf,
+	    "max batch %d: %llu packets in %llu flushes, %llu syscalls, "
+	    "%.1f packets per syscall\n", sendq_maxbatch,
+	    (unsigned long long)s->packets, (unsigned long long)s->flushes,
+	    (unsigned long long)s->syscalls,
+	    s->syscalls ? (double)s->packets / s->syscalls : 0.0);
+	evbuffer_add_printf(buf, "%llu errors, %llu sent directly\n",
+	    (unsigned long long)s->errors, (unsigned long long)s->direct);
+}
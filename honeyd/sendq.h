@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2002, 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef _SENDQ_H_
+#define _SENDQ_H_
+
+/*
+ * Outgoing IP packets and ethernet frames are collected while the
+ * current event loop iteration runs and are then sent with a single
+ * sendmmsg(2) call per socket.  The queue is flushed when it is full,
+ * or once the latency bound has passed; a latency of zero flushes after
+ * all events that are active right now have been processed.
+ */
+
+#define SENDQ_MAXBATCH	32	/* default number of packets per flush */
+#define SENDQ_FRAMESIZE	(HONEYD_MTU + 40)
+
+struct sendq_stats {
+	uint64_t packets;	/* sent via the queue */
+	uint64_t syscalls;
+	uint64_t flushes;
+	uint64_t errors;
+	uint64_t direct;	/* bypassed the queue */
+};
+
+struct interface;
+struct ip_hdr;
+struct evbuffer;
+
+void sendq_init(int, int);
+int sendq_ip(const struct ip_hdr *, u_int);
+int sendq_eth(const struct interface *, const u_char *, u_int);
+void sendq_flush(void);
+void sendq_print(struct evbuffer *);
+
+#endif /* _SENDQ_H_ */
@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2002, 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include "config.h"
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <dnet.h>
+
+#undef timeout_pending
+#undef timeout_initialized
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/tag.h>
+
+#include <sha1.h>
+
+#include "honeyd.h"
+#include "template.h"
+#include "personality.h"
+#include "plugins_config.h"
+#include "network.h"
+#include "router.h"
+#include "snapshot.h"
+
+/*
+ * A compiled configuration is a sequence of tagged records.  It starts
+ * with the version and the digest of every source file, so that a stale
+ * snapshot is rejected before any state is touched.  The records after
+ * that describe the state that parsing the configuration produced:
+ * personality annotations, plugin options, templates and routers.
+ */
+
+static int
+snapshot_digest(const char *path, u_char *digest)
+{
+	SHA1_CTX ctx;
+	u_char buf[8192];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY, 0)) == -1)
+		return (-1);
+
+	SHA1Init(&ctx);
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		SHA1Update(&ctx, buf, n);
+	close(fd);
+	if (n == -1)
+		return (-1);
+	SHA1Final(digest, &ctx);
+
+	return (0);
+}
+
+static int
+snapshot_marshal_template(struct template *tmpl, void *arg)
+{
+	if (template_marshal(arg, tmpl) == -1) {
+		syslog(LOG_WARNING, "%s: template \"%s\" can not be compiled",
+		    __func__, tmpl->name);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+snapshot_marshal_option(const char *plugin, const char *option,
+    const struct honeyd_plugin_cfg *cfg, void *arg)
+{
+	struct evbuffer *evbuf = arg, *tmp;
+
+	if ((tmp = evbuffer_new()) == NULL)
+		err(1, "%s: evbuffer_new", __func__);
+
+	evtag_marshal_string(tmp, OPT_PLUGIN, plugin);
+	evtag_marshal_string(tmp, OPT_NAME, option);
+	switch (cfg->cfg_type) {
+	case HD_CONFIG_INT:
+		evtag_marshal_int(tmp, OPT_INT, cfg->cfg_int);
+		break;
+	case HD_CONFIG_FLT:
+		evtag_marshal(tmp, OPT_FLOAT, &cfg->cfg_flt,
+		    sizeof(cfg->cfg_flt));
+		break;
+	case HD_CONFIG_STR:
+		evtag_marshal_string(tmp, OPT_STRING, cfg->cfg_str);
+		break;
+	}
+
+	evtag_marshal_buffer(evbuf, SNAP_OPTION, tmp);
+	evbuffer_free(tmp);
+}
+
+/*
+ * Writes the current configuration to path.  The digests of the
+ * source files tie the snapshot to the configuration it came from.
+ */
+int
+snapshot_save(const char *path, char * const *sources, int nsources)
+{
+	struct evbuffer *evbuf, *tmp;
+	u_char digest[SHA1_DIGESTSIZE];
+	char tmppath[MAXPATHLEN];
+	FILE *fout;
+	int i, res = -1;
+
+	if ((evbuf = evbuffer_new()) == NULL || (tmp = evbuffer_new()) == NULL)
+		err(1, "%s: evbuffer_new", __func__);
+
+	evtag_marshal_int(evbuf, SNAP_VERSION, SNAPSHOT_VERSION);
+	for (i = 0; i < nsources; i++) {
+		if (sources[i] == NULL)
+			continue;
+		if (snapshot_digest(sources[i], digest) == -1) {
+			warn("%s: %s", __func__, sources[i]);
+			goto out;
+		}
+		evbuffer_drain(tmp, evbuffer_get_length(tmp));
+		evtag_marshal_string(tmp, SRC_PATH, sources[i]);
+		evtag_marshal(tmp, SRC_DIGEST, digest, sizeof(digest));
+		evtag_marshal_buffer(evbuf, SNAP_SOURCE, tmp);
+	}
+
+	/* Annotations change the personalities in the catalog */
+	for (i = 0; i < npersons; i++) {
+		struct personality *person = perslist[i];
+		if (!person->disallow_finscan && !person->fragp)
+			continue;
+		evbuffer_drain(tmp, evbuffer_get_length(tmp));
+		evtag_marshal_string(tmp, ANN_NAME, person->name);
+		evtag_marshal_int(tmp, ANN_FINSCAN, person->disallow_finscan);
+		evtag_marshal_int(tmp, ANN_FRAGMENT, person->fragp);
+		evtag_marshal_buffer(evbuf, SNAP_ANNOTATE, tmp);
+	}
+
+	plugins_config_foreach(snapshot_marshal_option, evbuf);
+
+	template_marshal_start();
+	if (template_iterate(snapshot_marshal_template, evbuf) == -1)
+		goto out;
+	if (router_marshal(evbuf) == -1)
+		goto out;
+
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	if ((fout = fopen(tmppath, "w")) == NULL) {
+		warn("%s: fopen(%s)", __func__, tmppath);
+		goto out;
+	}
+
+	if (fwrite(evbuffer_pullup(evbuf, -1), evbuffer_get_length(evbuf),
+		1, fout) != 1) {
+		warn("%s: fwrite(%s)", __func__, tmppath);
+		fclose(fout);
+		unlink(tmppath);
+		goto out;
+	}
+
+	if (fclose(fout) == EOF || rename(tmppath, path) == -1) {
+		warn("%s: %s", __func__, path);
+		unlink(tmppath);
+		goto out;
+	}
+
+	res = 0;
+ out:
+	evbuffer_free(tmp);
+	evbuffer_free(evbuf);
+	return (res);
+}
+
+/* Checks the version and that no source file has changed */
+static int
+snapshot_verify(struct evbuffer *evbuf, char * const *sources, int nsources)
+{
+	struct evbuffer *tmp;
+	u_char digest[SHA1_DIGESTSIZE], old[SHA1_DIGESTSIZE];
+	uint32_t tag, version;
+	char *path;
+	int i, res = -1;
+
+	if (evtag_unmarshal_int(evbuf, SNAP_VERSION, &version) == -1 ||
+	    version != SNAPSHOT_VERSION)
+		return (-1);
+
+	if ((tmp = evbuffer_new()) == NULL)
+		err(1, "%s: evbuffer_new", __func__);
+
+	for (i = 0; i < nsources; i++) {
+		if (sources[i] == NULL)
+			continue;
+
+		evbuffer_drain(tmp, evbuffer_get_length(tmp));
+		if (evtag_unmarshal(evbuf, &tag, tmp) == -1 ||
+		    tag != SNAP_SOURCE ||
+		    evtag_unmarshal_string(tmp, SRC_PATH, &path) == -1)
+			goto out;
+		free(path);
+		if (evtag_unmarshal_fixed(tmp, SRC_DIGEST,
+			old, sizeof(old)) == -1)
+			goto out;
+
+		if (snapshot_digest(sources[i], digest) == -1 ||
+		    memcmp(digest, old, sizeof(digest))) {
+			syslog(LOG_INFO, "%s: %s has changed",
+			    __func__, sources[i]);
+			goto out;
+		}
+	}
+
+	/* The snapshot might have been compiled from more files */
+	if (evtag_peek(evbuf, &tag) != -1 && tag == SNAP_SOURCE)
+		goto out;
+
+	res = 0;
+ out:
+	evbuffer_free(tmp);
+	return (res);
+}
+
+static int
+snapshot_annotate(struct evbuffer *evbuf)
+{
+	struct personality *person;
+	uint32_t finscan, fragp;
+	char *name;
+
+	if (evtag_unmarshal_string(evbuf, ANN_NAME, &name) == -1)
+		return (-1);
+	person = personality_find(name);
+	free(name);
+	if (person == NULL ||
+	    evtag_unmarshal_int(evbuf, ANN_FINSCAN, &finscan) == -1 ||
+	    evtag_unmarshal_int(evbuf, ANN_FRAGMENT, &fragp) == -1)
+		return (-1);
+
+	person->disallow_finscan = finscan;
+	person->fragp = fragp;
+	personality_compile(person);
+
+	return (0);
+}
+
+static int
+snapshot_option(struct evbuffer *evbuf)
+{
+	struct honeyd_plugin_cfg cfg;
+	char *plugin = NULL, *option = NULL;
+	uint32_t tag, integer;
+	int res = -1;
+
+	memset(&cfg, 0, sizeof(cfg));
+	if (evtag_unmarshal_string(evbuf, OPT_PLUGIN, &plugin) == -1 ||
+	    evtag_unmarshal_string(evbuf, OPT_NAME, &option) == -1 ||
+	    evtag_peek(evbuf, &tag) == -1)
+		goto out;
+
+	switch (tag) {
+	case OPT_INT:
+		if (evtag_unmarshal_int(evbuf, tag, &integer) == -1)
+			goto out;
+		cfg.cfg_type = HD_CONFIG_INT;
+		cfg.cfg_int = integer;
+		break;
+	case OPT_FLOAT:
+		if (evtag_unmarshal_fixed(evbuf, tag,
+			&cfg.cfg_flt, sizeof(cfg.cfg_flt)) == -1)
+			goto out;
+		cfg.cfg_type = HD_CONFIG_FLT;
+		break;
+	case OPT_STRING:
+		if (evtag_unmarshal_string(evbuf, tag, &cfg.cfg_str) == -1)
+			goto out;
+		cfg.cfg_type = HD_CONFIG_STR;
+		break;
+	default:
+		goto out;
+	}
+
+	plugins_config_item_add(plugin, option, &cfg);
+	if (cfg.cfg_type == HD_CONFIG_STR)
+		free(cfg.cfg_str);
+	res = 0;
+
+ out:
+	if (plugin != NULL)
+		free(plugin);
+	if (option != NULL)
+		free(option);
+	return (res);
+}
+
+/*
+ * Replaces parsing the configuration.  Returns -1 if the snapshot does
+ * not exist, is out of date or is damaged; anything that was loaded
+ * before the damage has been removed again.
+ */
+int
+snapshot_load(const char *path, char * const *sources, int nsources)
+{
+	struct evbuffer *evbuf, *tmp;
+	uint32_t tag;
+	int fd, res = -1;
+
+	if ((fd = open(path, O_RDONLY, 0)) == -1)
+		return (-1);
+
+	if ((evbuf = evbuffer_new()) == NULL || (tmp = evbuffer_new()) == NULL)
+		err(1, "%s: evbuffer_new", __func__);
+
+	while (evbuffer_read(evbuf, fd, -1) > 0)
+		;
+	close(fd);
+
+	if (snapshot_verify(evbuf, sources, nsources) == -1)
+		goto out;
+
+	while (evbuffer_get_length(evbuf)) {
+		evbuffer_drain(tmp, evbuffer_get_length(tmp));
+		if (evtag_unmarshal(evbuf, &tag, tmp) == -1)
+			goto error;
+
+		switch (tag) {
+		case SNAP_ANNOTATE:
+			if (snapshot_annotate(tmp) == -1)
+				goto error;
+			break;
+		case SNAP_OPTION:
+			if (snapshot_option(tmp) == -1)
+				goto error;
+			break;
+		case SNAP_TEMPLATE:
+			if (template_unmarshal(tmp) == -1)
+				goto error;
+			break;
+		case SNAP_ROUTER:
+			if (router_unmarshal(tmp) == -1)
+				goto error;
+			break;
+		default:
+			goto error;
+		}
+	}
+
+	res = 0;
+	goto out;
+
+ error:
+	syslog(LOG_WARNING, "%s: %s is damaged", __func__, path);
+	template_free_all(TEMPLATE_FREE_REGULAR);
+	router_end();
+ out:
+	evbuffer_free(tmp);
+	evbuffer_free(evbuf);
+	return (res);
+}
+
+/* Unittests */
+
+static int
+snapshot_test_count(struct template *tmpl, void *arg)
+{
+	(*(int *)arg)++;
+	return (0);
+}
+
+void
+snapshot_test(void)
+{
+	char snap[] = "/tmp/honeyd_snapshot.XXXXXX";
+	char source[] = "/tmp/honeyd_snapsource.XXXXXX";
+	char *sources[1] = { source };
+	struct action action;
+	struct template *tmpl, *clone;
+	struct port *port;
+	struct router *r, *gw;
+	struct link_drop nodrop = { 0, 0 };
+	struct addr addr, rtaddr, net, gwaddr;
+	struct timeval tv_start, tv_end;
+	int fd, i, count = 0;
+
+	if ((fd = mkstemp(snap)) == -1)
+		err(1, "%s: mkstemp", __func__);
+	close(fd);
+	if ((fd = mkstemp(source)) == -1)
+		err(1, "%s: mkstemp", __func__);
+
+	template_free_all(TEMPLATE_FREE_REGULAR);
+	router_end();
+
+	if ((tmpl = template_create("snaptest")) == NULL)
+		errx(1, "%s: template_create", __func__);
+	memset(&action, 0, sizeof(action));
+	action.status = PORT_OPEN;
+	action.action = "sh scripts/web.sh";
+	if (port_insert(tmpl, IP_PROTO_TCP, 80, &action) == NULL)
+		errx(1, "%s: port_insert", __func__);
+	action.action = NULL;
+	action.status = PORT_PROXY;
+	action.aitop = cmd_proxy_getinfo("127.0.0.1", SOCK_STREAM, 8080);
+	if (port_insert(tmpl, IP_PROTO_TCP, 8080, &action) == NULL)
+		errx(1, "%s: port_insert", __func__);
+	freeaddrinfo(action.aitop);
+	tmpl->tcp.status = PORT_RESET;
+	tmpl->drop_inrate = 150;
+	tmpl->timestamp = 1234;
+	if (npersons)
+		tmpl->person = personality_clone(perslist[0]);
+
+	for (i = 0; i < 100; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "10.0.%d.%d", i / 250, i % 250 + 1);
+		if (template_clone(name, tmpl, NULL, 0) == NULL)
+			errx(1, "%s: template_clone", __func__);
+	}
+
+	addr_pton("192.168.0.1", &rtaddr);
+	addr_pton("10.0.0.0/8", &net);
+	addr_pton("192.168.0.2", &gwaddr);
+	if (router_start(&rtaddr, &net) == -1)
+		errx(1, "%s: router_start", __func__);
+	r = router_find(&rtaddr);
+	gw = router_new(&gwaddr);
+	if (router_add_net(r, &net, gw, 10, 100, 0, &nodrop) == -1)
+		errx(1, "%s: router_add_net", __func__);
+	addr_pton("10.0.0.0/24", &net);
+	if (router_add_link(gw, &net) == -1)
+		errx(1, "%s: router_add_link", __func__);
+
+	if (snapshot_save(snap, sources, 1) == -1)
+		errx(1, "%s: could not save snapshot", __func__);
+
+	template_free_all(TEMPLATE_FREE_REGULAR);
+	router_end();
+
+	gettimeofday(&tv_start, NULL);
+	if (snapshot_load(snap, sources, 1) == -1)
+		errx(1, "%s: could not load snapshot", __func__);
+	gettimeofday(&tv_end, NULL);
+	timersub(&tv_end, &tv_start, &tv_end);
+
+	template_iterate(snapshot_test_count, &count);
+	if (count != 101)
+		errx(1, "%s: loaded %d templates instead of 101",
+		    __func__, count);
+
+	if ((clone = template_find("10.0.0.42")) == NULL)
+		errx(1, "%s: lost template", __func__);
+	if (clone->tcp.status != PORT_RESET || clone->drop_inrate != 150 ||
+	    clone->timestamp != 1234)
+		errx(1, "%s: bad template settings", __func__);
+	if (npersons && (clone->person == NULL ||
+		clone->person->name != perslist[0]->name))
+		errx(1, "%s: bad personality", __func__);
+	if (clone->portset->refcnt != 101)
+		errx(1, "%s: templates no longer share their ports", __func__);
+	if ((port = port_find(clone, IP_PROTO_TCP, 80)) == NULL ||
+	    port->action.status != PORT_OPEN ||
+	    strcmp(port->action.action, "sh scripts/web.sh"))
+		errx(1, "%s: bad port 80", __func__);
+	if ((port = port_find(clone, IP_PROTO_TCP, 8080)) == NULL ||
+	    port->action.status != PORT_PROXY || port->action.aitop == NULL)
+		errx(1, "%s: bad port 8080", __func__);
+
+	addr_pton("10.0.0.42", &addr);
+	if ((r = router_find(&rtaddr)) == NULL ||
+	    router_find(&gwaddr) == NULL ||
+	    network_lookup(r->routes, &addr) == NULL)
+		errx(1, "%s: lost routing topology", __func__);
+
+	/* A changed source file invalidates the snapshot */
+	if (write(fd, "#\n", 2) != 2)
+		err(1, "%s: write", __func__);
+	close(fd);
+	if (snapshot_load(snap, sources, 1) != -1)
+		errx(1, "%s: loaded stale snapshot", __func__);
+
+	template_free_all(TEMPLATE_FREE_REGULAR);
+	router_end();
+	unlink(snap);
+	unlink(source);
+
+	fprintf(stderr, "\t%s: loaded %d templates in %.3f ms\n", __func__,
+	    count, tv_end.tv_sec * 1000.0 + tv_end.tv_usec / 1000.0);
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
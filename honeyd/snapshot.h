@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2002, 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+/*
+ * A compiled configuration is a tagged stream of the templates, plugin
+ * options and routing topology that a configuration file creates.  It
+ * records the SHA-1 of the configuration and fingerprint files it was
+ * compiled from and is only loaded if they are unchanged.
+ */
+
+#define SNAPSHOT_VERSION	1
+
+enum {
+	SNAP_VERSION = 0, SNAP_SOURCE, SNAP_ANNOTATE, SNAP_OPTION,
+	SNAP_TEMPLATE, SNAP_ROUTER, SNAP_MAX_TAGS
+};
+
+enum {
+	SRC_PATH = 0, SRC_DIGEST, SRC_MAX_TAGS
+};
+
+enum {
+	ANN_NAME = 0, ANN_FINSCAN, ANN_FRAGMENT, ANN_MAX_TAGS
+};
+
+enum {
+	OPT_PLUGIN = 0, OPT_NAME, OPT_INT, OPT_FLOAT, OPT_STRING, OPT_MAX_TAGS
+};
+
+enum {
+	TMPL_NAME = 0, TMPL_FLAGS, TMPL_INTERFACE, TMPL_PERSONALITY,
+	TMPL_FINSCAN, TMPL_FRAGMENT, TMPL_TCP, TMPL_UDP, TMPL_ICMP, TMPL_PORT,
+	TMPL_TIMESTAMP, TMPL_DRIFT, TMPL_DROP_IN, TMPL_DROP_SYN, TMPL_UID,
+	TMPL_GID, TMPL_MAXFDS, TMPL_ETHERNET, TMPL_SPOOF_SRC, TMPL_SPOOF_DST,
+	TMPL_PORTS_OF, TMPL_MAX_TAGS
+};
+
+enum {
+	TPORT_PROTO = 0, TPORT_NUMBER, TPORT_ACTION, TPORT_MAX_TAGS
+};
+
+enum {
+	TACT_STATUS = 0, TACT_FLAGS, TACT_STRING, TACT_PROXY_HOST,
+	TACT_PROXY_PORT, TACT_PROXY_TYPE, TACT_MAX_TAGS
+};
+
+enum {
+	RTR_ADDR = 0, RTR_NETWORK, RTR_ROUTE, RTR_MAX_TAGS
+};
+
+enum {
+	RTE_TYPE = 0, RTE_NET, RTE_GW, RTE_TUNNEL_SRC, RTE_TUNNEL_DST,
+	RTE_LATENCY, RTE_LOSS, RTE_BANDWIDTH, RTE_DIVIDER, RTE_RED_LOW,
+	RTE_RED_HIGH, RTE_MAX_TAGS
+};
+
+struct evbuffer;
+struct template;
+
+int snapshot_save(const char *, char * const *, int);
+int snapshot_load(const char *, char * const *, int);
+
+void template_marshal_start(void);
+int template_marshal(struct evbuffer *, struct template *);
+int template_unmarshal(struct evbuffer *);
+int router_marshal(struct evbuffer *);
+int router_unmarshal(struct evbuffer *);
+
+void snapshot_test(void);
+
+#endif /* _SNAPSHOT_H_ */
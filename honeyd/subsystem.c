@@ -632,8 +632,7 @@ subsystem_read(int fd, short what, void *arg)
 			tcp_send(con, TH_SYN, NULL, 0);
 			con->snd_una++;
 
-			con->retrans_time = 1;
-			generic_timeout(con->retrans_timeout, con->retrans_time);
+			timer_add(&con->retrans_timeout, con->rto);
 			goto reschedule;
 		} else if (proto == IP_PROTO_UDP) {
 			struct udp_con *con;
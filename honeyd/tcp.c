@@ -39,7 +39,9 @@
 #include <sys/tree.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/resource.h>
+#include <sys/time.h>
 
 #include <err.h>
 #include <errno.h>
@@ -50,40 +52,70 @@
 #include <string.h>
 #include <unistd.h>
 #include <dnet.h>
+#include <sha1.h>
 
 #undef timeout_pending
 #undef timeout_initialized
 
 #include <event2/event.h>
+#include <event2/buffer.h>
 
 #include "honeyd.h"
+#include "template.h"
 #include "tcp.h"
 #include "log.h"
 #include "hooks.h"
+#include "pool.h"
 #include "util.h"
+#include "parser.h"
+#include "network.h"
+#include "router.h"
+
+extern struct pool *pool_tcpbuf;
 
 struct callback cb_tcp = {
 	cmd_tcp_read, cmd_tcp_write, cmd_tcp_eread, cmd_tcp_connect_cb
 };
 
-void
-tcp_increase_buf(u_char **pbuf, u_int *psize, u_int maxsize)
+/*
+ * Describes len bytes of a ring that start at offset start in at most
+ * two pieces, so that data never needs to be moved within the ring.
+ */
+
+int
+tcp_ring_slice(u_char *buf, u_int start, u_int len, struct iovec *iov)
 {
-	u_int size = *psize;
-	u_char *p;
+	start = TCP_RING(start);
+	if (len == 0 || buf == NULL)
+		return (0);
 
-	if (size >= maxsize)
-		return;
-	size *= 2;
-	if (size >= maxsize)
-		size = maxsize;
+	iov[0].iov_base = buf + start;
+	iov[0].iov_len = MIN(len, TCP_MAX_SIZE - start);
+	if (iov[0].iov_len == len)
+		return (1);
 
-	p = realloc(*pbuf, size);
-	if (p == NULL)
-		return;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len - iov[0].iov_len;
+	return (2);
+}
 
-	*psize = size;
-	*pbuf = p;
+static u_char *
+tcp_ring_get(u_char **pbuf)
+{
+	if (*pbuf == NULL)
+		*pbuf = pool_alloc(pool_tcpbuf);
+	return (*pbuf);
+}
+
+/* Empty rings go back to the pool */
+
+void
+tcp_ring_release(u_char **pbuf, u_int *phead)
+{
+	if (*pbuf != NULL)
+		pool_free(pool_tcpbuf, *pbuf);
+	*pbuf = NULL;
+	*phead = 0;
 }
 
 void
@@ -95,20 +127,279 @@ tcp_drain_payload(struct tcp_con *con, u_int len)
 	if (len >= con->plen) {
 		con->plen = 0;
 		con->poff = 0;
+		tcp_ring_release(&con->payload, &con->phead);
 		goto out;
 	}
 
-	memmove(con->payload, con->payload + len, con->plen - len);
+	con->phead = TCP_RING(con->phead + len);
 	con->plen -= len;
-	con->poff -= len;
+	/* After a timeout, the peer may acknowledge beyond what we resent */
+	con->poff = con->poff > len ? con->poff - len : 0;
  out:
-	cmd_trigger_read(&con->cmd, con->psize - con->plen);
+	cmd_trigger_read(&con->cmd, TCP_MAX_SIZE - con->plen);
+}
+
+/*
+ * Updates the retransmission timeout with a new round trip time
+ * measurement as described in RFC 6298.
+ */
+
+void
+tcp_rtt_update(struct tcp_con *con, u_int rtt)
+{
+	u_int delta;
+
+	if (con->srtt == 0) {
+		con->srtt = rtt;
+		con->rttvar = rtt / 2;
+	} else {
+		delta = con->srtt > rtt ? con->srtt - rtt : rtt - con->srtt;
+		con->rttvar = (3 * con->rttvar + delta) / 4;
+		con->srtt = (7 * con->srtt + rtt) / 8;
+	}
+
+	/* The clock granularity is the resolution of our timer wheel */
+	con->rto = con->srtt + MAX(1000 / TIMER_HZ, 4 * con->rttvar);
+	if (con->rto < TCP_RTO_MIN)
+		con->rto = TCP_RTO_MIN;
+	else if (con->rto > TCP_RTO_MAX)
+		con->rto = TCP_RTO_MAX;
+}
+
+/*
+ * Adds a block from a SACK option to the scoreboard.  Overlapping
+ * blocks are merged and the scoreboard is kept sorted.
+ */
+
+void
+tcp_sack_update(struct tcp_con *con, uint32_t start, uint32_t end)
+{
+	struct tcp_sack *sacks = con->sacks;
+	int i;
+
+	/* Ignore blocks for data that we did not send or that is acked */
+	if (!TCP_SEQ_LT(start, end) || TCP_SEQ_GT(end, con->snd_max) ||
+	    TCP_SEQ_LEQ(end, con->snd_una))
+		return;
+	if (TCP_SEQ_LT(start, con->snd_una))
+		start = con->snd_una;
+
+	for (i = 0; i < con->nsacks; ) {
+		if (TCP_SEQ_GT(sacks[i].start, end) ||
+		    TCP_SEQ_LT(sacks[i].end, start)) {
+			i++;
+			continue;
+		}
+		if (TCP_SEQ_LT(sacks[i].start, start))
+			start = sacks[i].start;
+		if (TCP_SEQ_GT(sacks[i].end, end))
+			end = sacks[i].end;
+		con->nsacks--;
+		memmove(&sacks[i], &sacks[i + 1],
+		    (con->nsacks - i) * sizeof(struct tcp_sack));
+	}
+
+	for (i = 0; i < con->nsacks; i++)
+		if (TCP_SEQ_LT(start, sacks[i].start))
+			break;
+
+	/* Without space, forget about the highest block */
+	if (con->nsacks == TCP_MAX_SACKS) {
+		if (i == TCP_MAX_SACKS)
+			return;
+		con->nsacks--;
+	}
+
+	memmove(&sacks[i + 1], &sacks[i],
+	    (con->nsacks - i) * sizeof(struct tcp_sack));
+	sacks[i].start = start;
+	sacks[i].end = end;
+	con->nsacks++;
+}
+
+/* Removes everything below snd_una from the scoreboard */
+
+void
+tcp_sack_trim(struct tcp_con *con)
+{
+	struct tcp_sack *sacks = con->sacks;
+	int i;
+
+	for (i = 0; i < con->nsacks; i++)
+		if (TCP_SEQ_GT(sacks[i].end, con->snd_una))
+			break;
+
+	con->nsacks -= i;
+	memmove(sacks, &sacks[i], con->nsacks * sizeof(struct tcp_sack));
+	if (con->nsacks && TCP_SEQ_LT(sacks[0].start, con->snd_una))
+		sacks[0].start = con->snd_una;
+}
+
+/*
+ * Finds the first hole at or above seq that the peer is missing.  Only
+ * data below a selectively acknowledged block is known to be lost.
+ */
+
+int
+tcp_sack_hole(struct tcp_con *con, uint32_t seq, uint32_t *pstart,
+    uint32_t *pend)
+{
+	uint32_t start = con->snd_una;
+	int i;
+
+	for (i = 0; i < con->nsacks; i++) {
+		if (TCP_SEQ_LT(seq, con->sacks[i].start) &&
+		    TCP_SEQ_LT(start, con->sacks[i].start)) {
+			*pstart = TCP_SEQ_GT(seq, start) ? seq : start;
+			*pend = con->sacks[i].start;
+			return (1);
+		}
+		start = con->sacks[i].end;
+	}
+
+	return (0);
+}
+
+/*
+ * SYN cookies: while a SYN flood is going on, the initial sequence
+ * number of our SYN-ACK carries everything that we need to create the
+ * connection once the peer acknowledges it.
+ *
+ *	isn = H(tuple) + irs + (count << 24) +
+ *	    ((H(tuple, count) + data) & 0xffffff)
+ *
+ * The count advances every TCP_COOKIE_PERIOD seconds.  The data holds
+ * an index into the table of segment sizes and the window scale and
+ * SACK options that the handshake agreed on.
+ */
+
+#define TCP_COOKIE_PERIOD	64	/* seconds for each count */
+#define TCP_COOKIE_MAXAGE	2	/* counts that a cookie is valid */
+#define TCP_COOKIE_SACK		0x04
+#define TCP_COOKIE_WSHIFT	3
+#define TCP_COOKIE_NOWSCALE	0x0f
+#define TCP_COOKIE_DATAMAX	(1 << 7)
+
+static const u_short tcp_cookie_mss[] = {
+	TCP_DEFAULT_MSS, 1200, 1360, TCP_MAX_SEGMENT
+};
+
+static u_char tcp_cookie_secret[SHA1_DIGESTSIZE];
+
+/* Needs to be called before workers are started, so that they agree */
+
+void
+tcp_syncookie_init(void)
+{
+	extern rand_t *honeyd_rand;
+
+	rand_get(honeyd_rand, tcp_cookie_secret, sizeof(tcp_cookie_secret));
+}
+
+static uint32_t
+tcp_syncookie_hash(const struct tuple *hdr, uint32_t count, int usecount)
+{
+	u_char digest[SHA1_DIGESTSIZE];
+	SHA1_CTX ctx;
+	uint32_t hash;
+
+	SHA1Init(&ctx);
+	SHA1Update(&ctx, tcp_cookie_secret, sizeof(tcp_cookie_secret));
+	SHA1Update(&ctx, (u_char *)&hdr->ip_src, sizeof(hdr->ip_src));
+	SHA1Update(&ctx, (u_char *)&hdr->ip_dst, sizeof(hdr->ip_dst));
+	SHA1Update(&ctx, (u_char *)&hdr->sport, sizeof(hdr->sport));
+	SHA1Update(&ctx, (u_char *)&hdr->dport, sizeof(hdr->dport));
+	if (usecount)
+		SHA1Update(&ctx, (u_char *)&count, sizeof(count));
+	SHA1Final(digest, &ctx);
+
+	memcpy(&hash, digest, sizeof(hash));
+	return (hash);
+}
+
+static uint32_t
+tcp_syncookie_count(void)
+{
+	extern struct event_base *honeyd_base_ev;
+	struct timeval tv;
+
+	event_base_gettimeofday_cached(honeyd_base_ev, &tv);
+	return (tv.tv_sec / TCP_COOKIE_PERIOD);
+}
+
+static uint32_t
+tcp_syncookie_encode(const struct tuple *hdr, uint32_t irs, uint32_t count,
+    u_int data)
+{
+	return (tcp_syncookie_hash(hdr, 0, 0) + irs + (count << 24) +
+	    ((tcp_syncookie_hash(hdr, count, 1) + data) & 0xffffff));
+}
+
+/*
+ * Returns the SYN cookie for a connection whose options have been
+ * processed; irs is the initial sequence number of the peer.
+ */
+
+uint32_t
+tcp_syncookie_make(const struct tcp_con *con, uint32_t irs)
+{
+	u_int data, wscale = TCP_COOKIE_NOWSCALE;
+
+	for (data = sizeof(tcp_cookie_mss) / sizeof(u_short) - 1; data > 0;
+	    data--)
+		if (tcp_cookie_mss[data] <= con->smss)
+			break;
+	if (con->flags & TCP_SACKOK)
+		data |= TCP_COOKIE_SACK;
+	if ((con->flags & TCP_WSCALE) && con->sawwscale)
+		wscale = con->snd_wscale;
+	data |= wscale << TCP_COOKIE_WSHIFT;
+
+	return (tcp_syncookie_encode(&con->conhdr, irs, tcp_syncookie_count(),
+		    data));
+}
+
+/*
+ * Checks the SYN cookie that the peer acknowledged and restores the
+ * options of the handshake.  Returns -1 if the cookie is not valid.
+ */
+
+int
+tcp_syncookie_check(struct tcp_con *con, uint32_t irs, uint32_t isn)
+{
+	uint32_t count = tcp_syncookie_count(), diff;
+	u_int age, data, wscale;
+
+	diff = isn - tcp_syncookie_hash(&con->conhdr, 0, 0) - irs;
+	age = (count - (diff >> 24)) & 0xff;
+	if (age >= TCP_COOKIE_MAXAGE)
+		return (-1);
+	count -= age;
+
+	data = (diff - tcp_syncookie_hash(&con->conhdr, count, 1)) & 0xffffff;
+	if (data >= TCP_COOKIE_DATAMAX)
+		return (-1);
+
+	con->smss = tcp_cookie_mss[data & 0x03];
+	if (data & TCP_COOKIE_SACK) {
+		con->sawsackok = 1;
+		con->flags |= TCP_SACKOK;
+	}
+	wscale = data >> TCP_COOKIE_WSHIFT;
+	if (wscale != TCP_COOKIE_NOWSCALE) {
+		con->sawwscale = 1;
+		con->snd_wscale = wscale;
+		con->flags |= TCP_WSCALE;
+	}
+
+	return (0);
 }
 
 int
 tcp_add_readbuf(struct tcp_con *con, u_char *dat, u_int datlen)
 {
-	int space;
+	struct iovec iov[2];
+	int i, iovcnt;
 
 	hooks_dispatch(IP_PROTO_TCP, HD_INCOMING_STREAM, &con->conhdr,
 	    dat, datlen);
@@ -116,15 +407,17 @@ tcp_add_readbuf(struct tcp_con *con, u_char *dat, u_int datlen)
 	if (con->cmd_pfd == -1)
 		return (datlen);
 
-	space = con->rsize - con->rlen;
-	if (space < datlen) {
-		tcp_increase_buf(&con->readbuf, &con->rsize, TCP_MAX_SIZE);
-		space = con->rsize - con->rlen;
-		if (space < datlen)
-			datlen = space;
-	}
+	if (datlen > TCP_MAX_SIZE - con->rlen)
+		datlen = TCP_MAX_SIZE - con->rlen;
+	if (datlen && tcp_ring_get(&con->readbuf) == NULL)
+		datlen = 0;
 
-	memcpy(con->readbuf + con->rlen, dat, datlen);
+	iovcnt = tcp_ring_slice(con->readbuf, con->rhead + con->rlen, datlen,
+	    iov);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(iov[i].iov_base, dat, iov[i].iov_len);
+		dat += iov[i].iov_len;
+	}
 	con->rlen += datlen;
 
 	cmd_trigger_write(&con->cmd, con->rlen);
@@ -169,14 +462,22 @@ void
 cmd_tcp_read(evutil_socket_t fd, short which, void *arg)
 {
 	struct tcp_con *con = arg;
-	int len, space;
+	struct iovec iov[2];
+	int len, iovcnt;
 	struct command *cmd = &con->cmd;
 	
-	space = con->psize - con->plen;
-	if (space <= 0)
+	if (con->plen >= TCP_MAX_SIZE || tcp_ring_get(&con->payload) == NULL)
 		return;
 
-	TRACE(fd, len = read(fd, con->payload + con->plen, space));
+	/* Read into the free space of the ring */
+	iovcnt = tcp_ring_slice(con->payload, con->phead + con->plen,
+	    TCP_MAX_SIZE - con->plen, iov);
+	TRACE(fd, len = readv(fd, iov, iovcnt));
+
+	/* Nothing arrived; do not hold on to an empty ring */
+	if (len <= 0 && con->plen == 0)
+		tcp_ring_release(&con->payload, &con->phead);
+
 	if (len == -1) {
 		if (errno == EINTR || errno == EAGAIN)
 			goto again;
@@ -195,23 +496,23 @@ cmd_tcp_read(evutil_socket_t fd, short which, void *arg)
 	}
 
 	con->plen += len;
-	if (con->plen == con->psize)
-		tcp_increase_buf(&con->payload, &con->psize, TCP_MAX_SIZE);
 
 	/* XXX - Trigger write */
 	tcp_senddata(con, TH_ACK);
 
  again:
-	cmd_trigger_read(&con->cmd, con->psize - con->plen);
+	cmd_trigger_read(&con->cmd, TCP_MAX_SIZE - con->plen);
 }
 
 void
 cmd_tcp_write(evutil_socket_t fd, short which, void *arg)
 {
 	struct tcp_con *con = arg;
-	int len;
+	struct iovec iov[2];
+	int len, iovcnt;
 	
-	TRACE(fd, len = write(fd, con->readbuf, con->rlen));
+	iovcnt = tcp_ring_slice(con->readbuf, con->rhead, con->rlen, iov);
+	TRACE(fd, len = writev(fd, iov, iovcnt));
 	
 	if (len == -1) {
 		if (errno == EINTR || errno == EAGAIN)
@@ -223,8 +524,10 @@ cmd_tcp_write(evutil_socket_t fd, short which, void *arg)
 		return;
 	}
 
-	memmove(con->readbuf, con->readbuf + len, con->rlen - len);
+	con->rhead = TCP_RING(con->rhead + len);
 	con->rlen -= len;
+	if (con->rlen == 0)
+		tcp_ring_release(&con->readbuf, &con->rhead);
 
 	/* Shut down the connection if we received a FIN and sent all data */
 	if (con->rlen == 0 && con->cmd.fdgotfin)
@@ -258,7 +561,7 @@ cmd_tcp_connect_cb(evutil_socket_t fd, short which, void *arg)
 		goto out;
 	}
 
-	cmd_trigger_read(&con->cmd, con->psize - con->plen);
+	cmd_trigger_read(&con->cmd, TCP_MAX_SIZE - con->plen);
 	cmd_trigger_write(&con->cmd, con->rlen);
 	return;
 
@@ -267,3 +570,795 @@ cmd_tcp_connect_cb(evutil_socket_t fd, short which, void *arg)
 	cmd_free(&con->cmd);
 	tcp_sendfin(con);
 }
+
+/*
+ * Streams data from a service script through a connection and checks
+ * that it arrives in order while the rings wrap around in place.
+ */
+
+static u_int tcp_test_offset;		/* stream offset of the next byte */
+static uint32_t tcp_test_seq;
+static int tcp_test_errors;
+
+static void
+tcp_test_delay_cb(evutil_socket_t fd, short which, void *arg)
+{
+	extern struct pool *pool_pkt;
+	extern struct pool *pool_delay;
+	struct delay *delay = arg;
+	struct ip_hdr *ip = delay->ip;
+	struct tcp_hdr *tcp = (struct tcp_hdr *)((u_char *)ip + (ip->ip_hl << 2));
+	u_char *data = (u_char *)tcp + (tcp->th_off << 2);
+	u_int i, dlen;
+
+	dlen = ntohs(ip->ip_len) - (ip->ip_hl << 2) - (tcp->th_off << 2);
+	if (ntohl(tcp->th_seq) != tcp_test_seq)
+		tcp_test_errors++;
+	for (i = 0; i < dlen; i++) {
+		if (data[i] != (u_char)((tcp_test_offset + i) % 251))
+			tcp_test_errors++;
+	}
+	tcp_test_offset += dlen;
+	tcp_test_seq += dlen;
+
+	if (delay->flags & DELAY_FREEPKT)
+		pool_free(pool_pkt, ip);
+	template_free(delay->tmpl);
+	if (delay->flags & DELAY_NEEDFREE)
+		pool_free(pool_delay, delay);
+}
+
+static void
+tcp_test_timeout(void *arg)
+{
+}
+
+void
+tcp_test(void)
+{
+	extern void (*honeyd_delay_callback)(evutil_socket_t, short, void *);
+	void (*old)(evutil_socket_t, short, void *) = honeyd_delay_callback;
+	static u_char buf[8192];
+	struct tcp_con con;
+	struct addr src, dst;
+	u_char *ring = NULL;
+	u_int total = 1024 * 1024, written = 0, acked, wraps = 0, head;
+	int pair[2], i, n;
+
+	honeyd_delay_callback = tcp_test_delay_cb;
+
+	memset(&con, 0, sizeof(con));
+	addr_pton("192.0.2.1", &src);
+	addr_pton("192.0.2.2", &dst);
+	con.conhdr.ip_src = src.addr_ip;
+	con.conhdr.ip_dst = dst.addr_ip;
+	con.conhdr.sport = 4321;
+	con.conhdr.dport = 80;
+	con.conhdr.type = SOCK_STREAM;
+	con.snd_una = con.snd_max = tcp_test_seq = 1000;
+	con.rcv_next = con.last_acked = 1;
+	con.smss = TCP_DEFAULT_MSS;
+	con.rto = TCP_RTO_INIT;
+	con.cwnd = con.snd_wnd = TCP_MAX_SIZE;
+	timer_set(&con.retrans_timeout, tcp_test_timeout, &con);
+	tcp_setupconnect(&con);
+
+	/* The other end of the socket pair plays the script */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		err(1, "%s: socketpair", __func__);
+	if (fcntl(pair[0], F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(pair[1], F_SETFL, O_NONBLOCK) == -1)
+		err(1, "%s: fcntl", __func__);
+	con.cmd.pfd = pair[0];
+	con.cmd.perrfd = -1;
+	cmd_ready_fd(&con.cmd, &cb_tcp, &con);
+
+	while (tcp_test_offset < total) {
+		if (written < total) {
+			n = MIN(sizeof(buf), total - written);
+			for (i = 0; i < n; i++)
+				buf[i] = (written + i) % 251;
+			if ((n = write(pair[1], buf, n)) > 0)
+				written += n;
+		}
+
+		head = con.phead;
+		cmd_tcp_read(pair[0], EV_READ, &con);
+		if (con.plen == 0)
+			errx(1, "%s: no data at %u", __func__, tcp_test_offset);
+
+		/* The data stays where it was read until it is acked */
+		if (ring != NULL && con.payload != ring)
+			errx(1, "%s: payload moved", __func__);
+		ring = con.payload;
+		if (con.phead != head)
+			errx(1, "%s: reading moved the ring", __func__);
+
+		/* Acknowledge two thirds of the data in flight */
+		acked = con.poff - con.poff / 3;
+		con.snd_una += acked;
+		tcp_drain_payload(&con, acked);
+		if (con.plen == 0)
+			ring = NULL;
+		else if (con.phead < head)
+			wraps++;
+	}
+
+	if (tcp_test_errors)
+		errx(1, "%s: %d bad bytes or segments", __func__,
+		    tcp_test_errors);
+	if (wraps < total / TCP_MAX_SIZE / 2)
+		errx(1, "%s: ring wrapped only %u times", __func__, wraps);
+
+	timer_del(&con.retrans_timeout);
+	cmd_free(&con.cmd);
+	TRACE_RESET(pair[1], close(pair[1]));
+	tcp_connectfail(&con);
+
+	honeyd_delay_callback = old;
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
+
+/*
+ * Sends data over a simulated lossy link to a peer that acknowledges
+ * every segment and reports missing data with SACK blocks.  The router
+ * drops packets in both directions.
+ */
+
+#define TCP_BENCH_SIZE		(256 * 1024)
+#define TCP_BENCH_WINDOW	32768
+#define TCP_BENCH_WSCALE	2
+
+static struct {
+	struct addr peer, host;
+	uint32_t irs;			/* first sequence number of Honeyd */
+	uint32_t rcv_nxt;
+	uint32_t high;			/* highest sequence number seen */
+	struct tcp_sack blocks[TCP_MAX_SACKS];
+	int nblocks;
+	int last;			/* block of the last segment */
+	int wscale;			/* our window is scaled by this */
+	int established;
+	u_char data[TCP_BENCH_SIZE];
+	u_int segments, rexmits;
+} tcp_bench_peer;
+
+static void (*tcp_bench_deliver)(evutil_socket_t, short, void *);
+
+static void
+tcp_bench_output(uint8_t flags)
+{
+	static const u_char synopts[] = {
+		TCP_OPT_MSS, 4, 0x05, 0xb4,
+		TCP_OPT_NOP, TCP_OPT_WSCALE, 3, TCP_BENCH_WSCALE,
+		TCP_OPT_NOP, TCP_OPT_NOP, TCP_OPT_SACKOK, 2
+	};
+	extern rand_t *honeyd_rand;
+	u_char pkt[IP_HDR_LEN + TCP_HDR_LEN + TCP_OPT_LEN_MAX], *opt;
+	struct ip_hdr *ip = (struct ip_hdr *)pkt;
+	struct tcp_hdr *tcp = (struct tcp_hdr *)(pkt + IP_HDR_LEN);
+	u_int optlen = 0, window = TCP_BENCH_WINDOW, iplen;
+	uint32_t sack[2];
+	int i, n;
+
+	opt = (u_char *)(tcp + 1);
+	if (flags & TH_SYN) {
+		memcpy(opt, synopts, sizeof(synopts));
+		optlen = sizeof(synopts);
+	} else if (tcp_bench_peer.nblocks) {
+		/* The first block reports the most recent segment */
+		n = MIN(tcp_bench_peer.nblocks, 3);
+		opt[0] = opt[1] = TCP_OPT_NOP;
+		opt[2] = TCP_OPT_SACK;
+		opt[3] = TCP_OPT_LEN + n * sizeof(sack);
+		for (i = 0; i < n; i++) {
+			struct tcp_sack *block = &tcp_bench_peer.blocks[
+			    (tcp_bench_peer.last + i) % tcp_bench_peer.nblocks];
+			sack[0] = htonl(block->start);
+			sack[1] = htonl(block->end);
+			memcpy(opt + 4 + i * sizeof(sack), sack, sizeof(sack));
+		}
+		optlen = 4 + n * sizeof(sack);
+	}
+	if (!(flags & TH_SYN))
+		window >>= tcp_bench_peer.wscale;
+
+	iplen = IP_HDR_LEN + TCP_HDR_LEN + optlen;
+	tcp_pack_hdr(tcp, 40000, 80, 1000 + !(flags & TH_SYN),
+	    tcp_bench_peer.rcv_nxt, flags, window, 0);
+	tcp->th_off += optlen / 4;
+	ip_pack_hdr(ip, 0, iplen, rand_uint16(honeyd_rand), 0, 64,
+	    IP_PROTO_TCP, tcp_bench_peer.peer.addr_ip,
+	    tcp_bench_peer.host.addr_ip);
+	ip_checksum(ip, iplen);
+
+	honeyd_input(NULL, ip, iplen);
+}
+
+/* Remembers data that arrived out of order */
+
+static void
+tcp_bench_block(uint32_t start, uint32_t end)
+{
+	struct tcp_sack *blocks = tcp_bench_peer.blocks;
+	int i;
+
+	for (i = 0; i < tcp_bench_peer.nblocks; i++) {
+		if (TCP_SEQ_GT(blocks[i].start, end) ||
+		    TCP_SEQ_LT(blocks[i].end, start))
+			continue;
+		if (TCP_SEQ_LT(start, blocks[i].start))
+			blocks[i].start = start;
+		if (TCP_SEQ_GT(end, blocks[i].end))
+			blocks[i].end = end;
+		tcp_bench_peer.last = i;
+		return;
+	}
+
+	if (i == TCP_MAX_SACKS)
+		errx(1, "%s: too many holes", __func__);
+	blocks[i].start = start;
+	blocks[i].end = end;
+	tcp_bench_peer.last = i;
+	tcp_bench_peer.nblocks++;
+}
+
+static void
+tcp_bench_input(struct tcp_hdr *tcp, u_int dlen)
+{
+	struct tcp_sack *blocks = tcp_bench_peer.blocks;
+	u_char *data = (u_char *)tcp + (tcp->th_off << 2), *p, *end;
+	uint32_t seq = ntohl(tcp->th_seq);
+	u_int off;
+	int i;
+
+	if (tcp->th_flags & TH_SYN) {
+		/* Our window is only scaled if Honeyd scales its own */
+		tcp_bench_peer.wscale = 0;
+		p = (u_char *)(tcp + 1);
+		end = (u_char *)tcp + (tcp->th_off << 2);
+		while (p < end && *p != TCP_OPT_EOL) {
+			if (*p == TCP_OPT_NOP) {
+				p++;
+				continue;
+			}
+			if (p + 1 >= end || p[1] < 2)
+				break;
+			if (*p == TCP_OPT_WSCALE)
+				tcp_bench_peer.wscale = TCP_BENCH_WSCALE;
+			p += p[1];
+		}
+
+		tcp_bench_peer.irs = tcp_bench_peer.high = seq + 1;
+		tcp_bench_peer.rcv_nxt = seq + 1;
+		tcp_bench_peer.established = 1;
+		tcp_bench_output(TH_ACK);
+		return;
+	}
+
+	if (!tcp_bench_peer.established || dlen == 0)
+		return;
+
+	tcp_bench_peer.segments++;
+	if (TCP_SEQ_LT(seq, tcp_bench_peer.high))
+		tcp_bench_peer.rexmits++;
+	else
+		tcp_bench_peer.high = seq + dlen;
+
+	off = seq - tcp_bench_peer.irs;
+	if (off + dlen > TCP_BENCH_SIZE)
+		errx(1, "%s: data beyond the end of the stream", __func__);
+	memcpy(tcp_bench_peer.data + off, data, dlen);
+
+	if (TCP_SEQ_GT(seq, tcp_bench_peer.rcv_nxt)) {
+		tcp_bench_block(seq, seq + dlen);
+	} else if (TCP_SEQ_GT(seq + dlen, tcp_bench_peer.rcv_nxt)) {
+		tcp_bench_peer.rcv_nxt = seq + dlen;
+
+		/* Filling a hole might make blocks contiguous */
+		for (i = 0; i < tcp_bench_peer.nblocks; ) {
+			if (TCP_SEQ_GT(blocks[i].start,
+				tcp_bench_peer.rcv_nxt)) {
+				i++;
+				continue;
+			}
+			if (TCP_SEQ_GT(blocks[i].end, tcp_bench_peer.rcv_nxt))
+				tcp_bench_peer.rcv_nxt = blocks[i].end;
+			blocks[i] = blocks[--tcp_bench_peer.nblocks];
+			i = 0;
+		}
+		tcp_bench_peer.last = 0;
+	}
+
+	tcp_bench_output(TH_ACK);
+}
+
+static void
+tcp_bench_delay_cb(evutil_socket_t fd, short which, void *arg)
+{
+	extern struct pool *pool_pkt;
+	extern struct pool *pool_delay;
+	struct delay *delay = arg;
+	struct ip_hdr *ip = delay->ip;
+	struct tcp_hdr *tcp;
+
+	/* Packets to Honeyd are delivered as usual */
+	if (!(delay->flags & DELAY_EXTERNAL)) {
+		(*tcp_bench_deliver)(fd, which, arg);
+		return;
+	}
+
+	tcp = (struct tcp_hdr *)((u_char *)ip + (ip->ip_hl << 2));
+	if (ip->ip_p == IP_PROTO_TCP &&
+	    ip->ip_dst == tcp_bench_peer.peer.addr_ip)
+		tcp_bench_input(tcp, ntohs(ip->ip_len) - (ip->ip_hl << 2) -
+		    (tcp->th_off << 2));
+
+	if (delay->flags & DELAY_FREEPKT)
+		pool_free(pool_pkt, ip);
+	template_free(delay->tmpl);
+	if (delay->flags & DELAY_NEEDFREE)
+		pool_free(pool_delay, delay);
+}
+
+static void
+tcp_bench_config(struct evbuffer *evbuf, const char *config)
+{
+	char line[256];
+
+	strlcpy(line, config, sizeof(line));
+	if (parse_line(evbuf, line) == -1)
+		errx(1, "%s: parse_line \"%s\" failed", __func__, config);
+}
+
+static void
+tcp_bench_run(int loss)
+{
+	extern struct event_base *honeyd_base_ev;
+	extern struct flowtable tcpcons;
+	static u_char buf[8192];
+	struct evbuffer *evbuf = evbuffer_new();
+	struct tcp_con *con = NULL;
+	struct tuple key;
+	struct timeval tv_start, tv_end, tv_syn, tv;
+	char line[256];
+	u_int written = 0, maxflight = 0, i;
+	double secs;
+	int pair[2], n;
+
+	/* The reverse route has the same packet loss */
+	router_end();
+	snprintf(line, sizeof(line), "route 172.16.0.1 add net 172.16.3.0/24 "
+	    "172.16.3.1 latency 5ms loss %d", loss);
+	tcp_bench_config(evbuf, "route entry 172.16.0.1 network 172.16.0.0/12");
+	tcp_bench_config(evbuf, line);
+	tcp_bench_config(evbuf, "route 172.16.3.1 link 172.16.3.0/24");
+
+	memset(&tcp_bench_peer, 0, sizeof(tcp_bench_peer));
+	addr_pton("192.0.2.1", &tcp_bench_peer.peer);
+	addr_pton("172.16.3.5", &tcp_bench_peer.host);
+
+	memset(&key, 0, sizeof(key));
+	key.ip_src = tcp_bench_peer.peer.addr_ip;
+	key.ip_dst = tcp_bench_peer.host.addr_ip;
+	key.sport = 40000;
+	key.dport = 80;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		err(1, "%s: socketpair", __func__);
+	if (fcntl(pair[1], F_SETFL, O_NONBLOCK) == -1)
+		err(1, "%s: fcntl", __func__);
+
+	gettimeofday(&tv_start, NULL);
+	timerclear(&tv_syn);
+	while (tcp_bench_peer.rcv_nxt - tcp_bench_peer.irs < TCP_BENCH_SIZE ||
+	    !tcp_bench_peer.established) {
+		gettimeofday(&tv_end, NULL);
+		timersub(&tv_end, &tv_start, &tv);
+		if (tv.tv_sec >= 60)
+			errx(1, "%s: transfer stalled at %u bytes", __func__,
+			    tcp_bench_peer.rcv_nxt - tcp_bench_peer.irs);
+
+		/* The SYN might get lost, too */
+		if (!tcp_bench_peer.established) {
+			timersub(&tv_end, &tv_syn, &tv);
+			if (tv.tv_sec >= 1) {
+				tcp_bench_output(TH_SYN);
+				tv_syn = tv_end;
+			}
+		}
+
+		/* The service starts once the handshake completes */
+		if (con == NULL && (con = (struct tcp_con *)
+			tuple_find(&tcpcons, &key)) != NULL) {
+			if (con->state != TCP_STATE_ESTABLISHED) {
+				con = NULL;
+			} else {
+				con->cmd.pfd = pair[0];
+				con->cmd.perrfd = -1;
+				cmd_ready_fd(&con->cmd, &cb_tcp, con);
+				TRACE(event_get_fd(con->cmd.pread),
+				    event_add(con->cmd.pread, NULL));
+			}
+		}
+
+		while (con != NULL && written < TCP_BENCH_SIZE) {
+			n = MIN(sizeof(buf), TCP_BENCH_SIZE - written);
+			for (i = 0; i < n; i++)
+				buf[i] = (written + i) % 251;
+			if ((n = write(pair[1], buf, n)) <= 0)
+				break;
+			written += n;
+		}
+		if (con != NULL && con->poff > maxflight)
+			maxflight = con->poff;
+
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000;
+		event_base_loopexit(honeyd_base_ev, &tv);
+		event_base_dispatch(honeyd_base_ev);
+	}
+	gettimeofday(&tv_end, NULL);
+
+	for (i = 0; i < TCP_BENCH_SIZE; i++) {
+		if (tcp_bench_peer.data[i] != (u_char)(i % 251))
+			errx(1, "%s: bad data at %u", __func__, i);
+	}
+	if (!loss && (tcp_bench_peer.rexmits || maxflight <= 4380))
+		errx(1, "%s: %u retransmissions, %u bytes in flight without "
+		    "loss", __func__, tcp_bench_peer.rexmits, maxflight);
+
+	timersub(&tv_end, &tv_start, &tv);
+	secs = tv.tv_sec + tv.tv_usec / 1000000.0;
+	fprintf(stderr, "\t\t%2d%% loss: %4.0f KB/s, %u of %u segments "
+	    "resent, srtt %u ms\n", loss, TCP_BENCH_SIZE / 1024 / secs,
+	    tcp_bench_peer.rexmits, tcp_bench_peer.segments, con->srtt);
+
+	tcp_free(con);
+	TRACE_RESET(pair[1], close(pair[1]));
+
+	/* Packets in flight are dropped by the peer */
+	tcp_bench_peer.established = 0;
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+	event_base_loopexit(honeyd_base_ev, &tv);
+	event_base_dispatch(honeyd_base_ev);
+
+	router_end();
+	evbuffer_free(evbuf);
+}
+
+void
+tcp_bench(void)
+{
+	extern void (*honeyd_delay_callback)(evutil_socket_t, short, void *);
+	struct evbuffer *evbuf = evbuffer_new();
+
+	tcp_bench_config(evbuf, "create tcpbench");
+	tcp_bench_config(evbuf, "add tcpbench tcp port 80 open");
+	tcp_bench_config(evbuf, "bind 172.16.3.5 tcpbench");
+
+	tcp_bench_deliver = honeyd_delay_callback;
+	honeyd_delay_callback = tcp_bench_delay_cb;
+
+	tcp_bench_run(0);
+	tcp_bench_run(1);
+	tcp_bench_run(3);
+
+	honeyd_delay_callback = tcp_bench_deliver;
+
+	tcp_bench_config(evbuf, "delete 172.16.3.5");
+	tcp_bench_config(evbuf, "delete tcpbench");
+	evbuffer_free(evbuf);
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
+
+/*
+ * Floods a template with connection requests.  Connections that carry
+ * data have to survive, SYN cookies may only create connections for
+ * valid acknowledgments and sources have to stay within their quota.
+ */
+
+#define TCP_FLOOD_HOST		"172.16.4.5"
+
+static struct {
+	struct addr host;
+	uint32_t seq;			/* of the last reply */
+	uint8_t flags;
+} tcp_flood_peer;
+
+static void
+tcp_flood_delay_cb(evutil_socket_t fd, short which, void *arg)
+{
+	extern struct pool *pool_pkt;
+	extern struct pool *pool_delay;
+	struct delay *delay = arg;
+	struct ip_hdr *ip = delay->ip;
+	struct tcp_hdr *tcp;
+
+	if (!(delay->flags & DELAY_EXTERNAL)) {
+		(*tcp_bench_deliver)(fd, which, arg);
+		return;
+	}
+
+	tcp = (struct tcp_hdr *)((u_char *)ip + (ip->ip_hl << 2));
+	if (ip->ip_p == IP_PROTO_TCP &&
+	    ip->ip_src == tcp_flood_peer.host.addr_ip) {
+		tcp_flood_peer.seq = ntohl(tcp->th_seq);
+		tcp_flood_peer.flags = tcp->th_flags;
+	}
+
+	if (delay->flags & DELAY_FREEPKT)
+		pool_free(pool_pkt, ip);
+	template_free(delay->tmpl);
+	if (delay->flags & DELAY_NEEDFREE)
+		pool_free(pool_delay, delay);
+}
+
+static void
+tcp_flood_output(ip_addr_t src, uint16_t sport, uint32_t seq, uint32_t ack,
+    uint8_t flags, u_int dlen)
+{
+	static const u_char synopts[] = {
+		TCP_OPT_MSS, 4, 0x05, 0xb4,
+		TCP_OPT_NOP, TCP_OPT_WSCALE, 3, 2,
+		TCP_OPT_NOP, TCP_OPT_NOP, TCP_OPT_SACKOK, 2
+	};
+	extern rand_t *honeyd_rand;
+	u_char pkt[IP_HDR_LEN + TCP_HDR_LEN + sizeof(synopts) + 16];
+	struct ip_hdr *ip = (struct ip_hdr *)pkt;
+	struct tcp_hdr *tcp = (struct tcp_hdr *)(pkt + IP_HDR_LEN);
+	u_int optlen = 0, iplen;
+
+	if (flags & TH_SYN) {
+		memcpy(tcp + 1, synopts, sizeof(synopts));
+		optlen = sizeof(synopts);
+	}
+	memset((u_char *)(tcp + 1) + optlen, 'x', MIN(dlen, 16));
+
+	iplen = IP_HDR_LEN + TCP_HDR_LEN + optlen + MIN(dlen, 16);
+	tcp_pack_hdr(tcp, sport, 80, seq, ack, flags, 32768, 0);
+	tcp->th_off += optlen / 4;
+	ip_pack_hdr(ip, 0, iplen, rand_uint16(honeyd_rand), 0, 64,
+	    IP_PROTO_TCP, src, tcp_flood_peer.host.addr_ip);
+	ip_checksum(ip, iplen);
+
+	tcp_flood_peer.flags = 0;
+	honeyd_input(NULL, ip, iplen);
+}
+
+static struct tcp_con *
+tcp_flood_find(ip_addr_t src, uint16_t sport)
+{
+	extern struct flowtable tcpcons;
+	struct tuple key;
+
+	memset(&key, 0, sizeof(key));
+	key.ip_src = src;
+	key.ip_dst = tcp_flood_peer.host.addr_ip;
+	key.sport = sport;
+	key.dport = 80;
+	return ((struct tcp_con *)tuple_find(&tcpcons, &key));
+}
+
+/* Completes the handshake of a half-open connection and sends data */
+
+static struct tcp_con *
+tcp_flood_establish(ip_addr_t src, uint16_t sport, uint32_t ack)
+{
+	struct tcp_con *con;
+
+	tcp_flood_output(src, sport, 1001, ack, TH_ACK, 0);
+	tcp_flood_output(src, sport, 1001, ack, TH_ACK|TH_PUSH, 8);
+
+	con = tcp_flood_find(src, sport);
+	if (con == NULL || con->state != TCP_STATE_ESTABLISHED ||
+	    (con->flags & TCP_QUIET))
+		errx(1, "%s: no connection with data from port %d",
+		    __func__, sport);
+	return (con);
+}
+
+static struct tcp_con *
+tcp_flood_connect(ip_addr_t src, uint16_t sport)
+{
+	tcp_flood_output(src, sport, 1000, 0, TH_SYN, 0);
+	if (tcp_flood_peer.flags != (TH_SYN|TH_ACK))
+		errx(1, "%s: no SYN-ACK for port %d", __func__, sport);
+	return (tcp_flood_establish(src, sport, tcp_flood_peer.seq + 1));
+}
+
+static void
+tcp_flood_free(void)
+{
+	extern struct conlru tcplru;
+	struct tuple *hdr, *next;
+
+	for (hdr = TAILQ_FIRST(&tcplru); hdr != NULL; hdr = next) {
+		next = TAILQ_NEXT(hdr, next);
+		if (hdr->ip_dst == tcp_flood_peer.host.addr_ip)
+			tcp_free((struct tcp_con *)hdr);
+	}
+}
+
+static int
+tcp_flood_cookie(const struct tuple *hdr, uint32_t irs, uint32_t isn,
+    struct tcp_con *con)
+{
+	memset(con, 0, sizeof(*con));
+	con->conhdr = *hdr;
+	return (tcp_syncookie_check(con, irs, isn));
+}
+
+void
+tcp_flood_test(void)
+{
+	extern void (*honeyd_delay_callback)(evutil_socket_t, short, void *);
+	extern rand_t *honeyd_rand;
+	extern int honeyd_nhalfopen, honeyd_syncookies;
+	extern int honeyd_max_source_connections;
+	extern int honeyd_max_template_connections;
+	struct evbuffer *evbuf = evbuffer_new();
+	struct stats_admit before;
+	struct template *tmpl;
+	struct tcp_con *con, tmp;
+	struct tuple hdr;
+	struct addr addr;
+	ip_addr_t src, other;
+	uint32_t cookie, count;
+	u_int smss, options;
+	int i, accepted = 0;
+
+	tcp_bench_config(evbuf, "create tcpflood");
+	tcp_bench_config(evbuf, "add tcpflood tcp port 80 open");
+	tcp_bench_config(evbuf, "bind " TCP_FLOOD_HOST " tcpflood");
+	if ((tmpl = template_find(TCP_FLOOD_HOST)) == NULL)
+		errx(1, "%s: template missing", __func__);
+	addr_pton(TCP_FLOOD_HOST, &tcp_flood_peer.host);
+	addr_pton("192.0.2.2", &addr);
+	src = addr.addr_ip;
+	addr_pton("192.0.2.3", &addr);
+	other = addr.addr_ip;
+
+	/* The cookie restores the options and only fits its connection */
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.conhdr.ip_src = src;
+	tmp.conhdr.ip_dst = tcp_flood_peer.host.addr_ip;
+	tmp.conhdr.sport = 40000;
+	tmp.conhdr.dport = 80;
+	tmp.smss = 1300;
+	tmp.flags = TCP_SACKOK|TCP_WSCALE;
+	tmp.sawwscale = 1;
+	tmp.snd_wscale = 7;
+	cookie = tcp_syncookie_make(&tmp, 1000);
+	hdr = tmp.conhdr;
+
+	if (tcp_flood_cookie(&hdr, 1000, cookie, &tmp) == -1 ||
+	    tmp.smss != 1200 || !(tmp.flags & TCP_SACKOK) ||
+	    !tmp.sawwscale || tmp.snd_wscale != 7)
+		errx(1, "%s: cookie did not restore the options", __func__);
+	hdr.sport++;
+	if (tcp_flood_cookie(&hdr, 1000, cookie, &tmp) != -1)
+		errx(1, "%s: cookie accepted for another port", __func__);
+	hdr.sport--;
+
+	count = tcp_syncookie_count();
+	cookie = tcp_syncookie_encode(&hdr, 1000, count - 1, 0);
+	if (tcp_flood_cookie(&hdr, 1000, cookie, &tmp) == -1)
+		errx(1, "%s: recent cookie rejected", __func__);
+	cookie = tcp_syncookie_encode(&hdr, 1000, count - 2, 0);
+	if (tcp_flood_cookie(&hdr, 1000, cookie, &tmp) != -1)
+		errx(1, "%s: expired cookie accepted", __func__);
+	cookie = tcp_syncookie_encode(&hdr, 1000, count + 1, 0);
+	if (tcp_flood_cookie(&hdr, 1000, cookie, &tmp) != -1)
+		errx(1, "%s: cookie from the future accepted", __func__);
+
+	for (i = 0; i < 10000; i++)
+		if (tcp_flood_cookie(&hdr, 1000, rand_uint32(honeyd_rand),
+			&tmp) == 0)
+			accepted++;
+	if (accepted > 1)
+		errx(1, "%s: %d of 10000 guessed cookies accepted",
+		    __func__, accepted);
+
+	tcp_bench_deliver = honeyd_delay_callback;
+	honeyd_delay_callback = tcp_flood_delay_cb;
+
+	/* An interactive session survives a flood of SYNs */
+	before = stats_admit;
+	con = tcp_flood_connect(src, 40000);
+	smss = con->smss;
+	options = con->flags & (TCP_SACKOK|TCP_WSCALE);
+	for (i = 0; i < HONEYD_MAX_CONNECTS + 1000; i++)
+		tcp_flood_output(htonl(0xc6120000 + i), 1024 + i % 60000,
+		    1000, 0, TH_SYN, 0);
+	if (tcp_flood_find(src, 40000) != con)
+		errx(1, "%s: interactive connection evicted", __func__);
+	if (stats_admit.evicted_quiet - before.evicted_quiet < 1000 ||
+	    stats_admit.evicted_oldest != before.evicted_oldest)
+		errx(1, "%s: evicted %llu quiet and %llu other connections",
+		    __func__, (unsigned long long)
+		    (stats_admit.evicted_quiet - before.evicted_quiet),
+		    (unsigned long long)
+		    (stats_admit.evicted_oldest - before.evicted_oldest));
+	tcp_flood_free();
+	if (honeyd_nhalfopen != 0 || tmpl->nconnects != 0)
+		errx(1, "%s: %d half-open and %d connections left", __func__,
+		    honeyd_nhalfopen, tmpl->nconnects);
+
+	/* With SYN cookies, only the final ACK creates the connection */
+	honeyd_syncookies = 0;
+	before = stats_admit;
+	tcp_flood_output(src, 40001, 1000, 0, TH_SYN, 0);
+	if (tcp_flood_peer.flags != (TH_SYN|TH_ACK) ||
+	    tcp_flood_find(src, 40001) != NULL ||
+	    stats_admit.cookies_sent != before.cookies_sent + 1)
+		errx(1, "%s: SYN created state", __func__);
+	cookie = tcp_flood_peer.seq;
+	tcp_flood_output(src, 40001, 1001, cookie + 0x5a5a5a, TH_ACK, 0);
+	if (tcp_flood_find(src, 40001) != NULL ||
+	    stats_admit.cookies_rejected != before.cookies_rejected + 1)
+		errx(1, "%s: forged cookie accepted", __func__);
+	con = tcp_flood_establish(src, 40001, cookie + 1);
+	if (con->smss != smss ||
+	    (con->flags & (TCP_SACKOK|TCP_WSCALE)) != options ||
+	    stats_admit.cookies_accepted != before.cookies_accepted + 1)
+		errx(1, "%s: cookie lost the options", __func__);
+	honeyd_syncookies = -1;
+	tcp_flood_free();
+
+	/* A source at its quota gives up connections without data */
+	honeyd_max_source_connections = 4;
+	before = stats_admit;
+	for (i = 0; i < 5; i++)
+		tcp_flood_output(other, 41000 + i, 1000, 0, TH_SYN, 0);
+	if (tcp_flood_find(other, 41000) != NULL ||
+	    tcp_flood_find(other, 41004) == NULL ||
+	    stats_admit.evicted_quiet != before.evicted_quiet + 1)
+		errx(1, "%s: source exceeded its quota", __func__);
+	for (i = 1; i < 5; i++) {
+		con = tcp_flood_find(other, 41000 + i);
+		tcp_flood_establish(other, 41000 + i, con->snd_una);
+	}
+	tcp_flood_output(other, 41005, 1000, 0, TH_SYN, 0);
+	if (tcp_flood_find(other, 41005) != NULL ||
+	    stats_admit.refused_source != before.refused_source + 1)
+		errx(1, "%s: busy source exceeded its quota", __func__);
+
+	/* Other sources are not affected, until the template is full */
+	tcp_flood_connect(src, 41005);
+	honeyd_max_template_connections = tmpl->nconnects;
+	tcp_flood_output(src, 41006, 1000, 0, TH_SYN, 0);
+	if (tcp_flood_find(src, 41006) != NULL ||
+	    stats_admit.refused_template != before.refused_template + 1)
+		errx(1, "%s: template exceeded its quota", __func__);
+	honeyd_max_template_connections = 0;
+	tcp_flood_free();
+
+	/* Also behind the connections of many other sources */
+	before = stats_admit;
+	for (i = 0; i < 1000; i++)
+		tcp_flood_output(htonl(0xc6130000 + i), 1024, 1000, 0,
+		    TH_SYN, 0);
+	for (i = 0; i < 5; i++)
+		tcp_flood_output(other, 42000 + i, 1000, 0, TH_SYN, 0);
+	if (tcp_flood_find(other, 42000) != NULL ||
+	    tcp_flood_find(other, 42004) == NULL ||
+	    stats_admit.evicted_quiet != before.evicted_quiet + 1)
+		errx(1, "%s: source lost its quota in a flood", __func__);
+	honeyd_max_source_connections = 0;
+	tcp_flood_free();
+	if (honeyd_nhalfopen != 0 || tmpl->nconnects != 0)
+		errx(1, "%s: %d half-open and %d connections left", __func__,
+		    honeyd_nhalfopen, tmpl->nconnects);
+
+	honeyd_delay_callback = tcp_bench_deliver;
+
+	tcp_bench_config(evbuf, "delete " TCP_FLOOD_HOST);
+	tcp_bench_config(evbuf, "delete tcpflood");
+	evbuffer_free(evbuf);
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
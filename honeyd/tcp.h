@@ -32,13 +32,32 @@
 #ifndef _TCP_H_
 #define _TCP_H_
 
+#define TCP_RING(x)	((x) & (TCP_MAX_SIZE - 1))
+
+struct iovec;
+
+int tcp_ring_slice(u_char *, u_int, u_int, struct iovec *);
+void tcp_ring_release(u_char **, u_int *);
+
 int tcp_add_readbuf(struct tcp_con *, u_char *, u_int);
 void tcp_drain_payload(struct tcp_con *, u_int);
-void tcp_increase_buf(u_char **, u_int *, u_int);
+
+void tcp_rtt_update(struct tcp_con *, u_int);
+void tcp_sack_update(struct tcp_con *, uint32_t, uint32_t);
+void tcp_sack_trim(struct tcp_con *);
+int tcp_sack_hole(struct tcp_con *, uint32_t, uint32_t *, uint32_t *);
+
+void tcp_syncookie_init(void);
+uint32_t tcp_syncookie_make(const struct tcp_con *, uint32_t);
+int tcp_syncookie_check(struct tcp_con *, uint32_t, uint32_t);
 
 void cmd_tcp_eread(evutil_socket_t, short, void *);
 void cmd_tcp_read(evutil_socket_t, short, void *);
 void cmd_tcp_write(evutil_socket_t, short, void *);
 void cmd_tcp_connect_cb(evutil_socket_t, short, void *);
 
+void tcp_test(void);
+void tcp_bench(void);
+void tcp_flood_test(void);
+
 #endif
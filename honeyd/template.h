@@ -41,6 +41,7 @@ struct personality;
 struct subsystem;
 struct ip_hdr;
 struct condition;
+struct condition_cache;
 
 struct subsystem_container {
 	TAILQ_ENTRY(subsystem_container) next;
@@ -50,12 +51,30 @@ struct subsystem_container {
 
 TAILQ_HEAD(subsystemqueue, subsystem);
 
+/*
+ * Cloned templates share the ports of their template.  A template gets
+ * its own copy of the ports before it changes any of them.
+ */
+struct portset {
+	struct porttree ports;
+	int nports;
+	u_int refcnt;
+
+	u_int mark;			/* for visiting each set only once */
+	struct template *marktmpl;
+};
+
 struct template {
 	SPLAY_ENTRY(template) node;
 
 	char *name;
 
-	struct porttree ports;
+	/* Templates bound to an IP address are also hashed by address */
+	LIST_ENTRY(template) addr_next;
+	ip_addr_t addr;
+	int addr_indexed;
+
+	struct portset *portset;
 
 	struct action icmp;
 	struct action tcp;
@@ -81,11 +100,19 @@ struct template {
 	/* Maximum number of file descriptors for spawned process */
 	int max_nofiles;
 
+	/* Incoming TCP connections, see --max-template-connections */
+	int nconnects;
+	struct tcpquietq tcpquiet;	/* of them, never received data */
+
+	/* Datagrams that scripts did not get, see "stats udp" */
+	uint64_t udp_drops;
+
 	TAILQ_HEAD(subsyscontainerqueue, subsystem_container) subsystems;
 
 	/* Condition on which this template is activated */
 	TAILQ_HEAD(conditionqueue, condition) dynamic;
 	int dynamic_rulenr;
+	struct condition_cache *dyncache;	/* decisions per source */
 	
 	/* Special handling for templates */
 	int flags;
@@ -102,8 +129,15 @@ struct template {
 
 	/* Reference counter */
 	uint16_t refcnt;
+
+	/* Used while the configuration is reloaded */
+	int reload;
+	int deferred;
 };
 
+#define TEMPLATE_DEFER_ARP	0x0001	/* post ARP entry once installed */
+#define TEMPLATE_DEFER_START	0x0002	/* start subsystems once installed */
+
 #define TEMPLATE_EXTERNAL	0x0001	/* Real machine on external network */
 #define TEMPLATE_DYNAMIC	0x0002	/* Pointer to templates */
 #define TEMPLATE_DYNAMIC_CHILD	0x0004  /* Is dynamic child */
@@ -123,6 +157,9 @@ struct template	*template_clone(const char *, const struct template *,
 struct template *template_find(const char *);
 struct template *template_find_best(const char *, const struct ip_hdr *,
 		    u_short);
+struct template *template_find_addr(ip_addr_t);
+struct template *template_find_best_addr(ip_addr_t, const struct ip_hdr *,
+		    u_short);
 void		template_list_glob(struct evbuffer *buffer,
 		    const char *pattern);
 
@@ -135,6 +172,10 @@ int		template_insert_dynamic(struct template *, struct template *,
 #define TEMPLATE_FREE_REGULAR		0x00
 #define TEMPLATE_FREE_DEALLOCATE	0x01
 void		template_free_all(int how);
+
+/* Set while a reload parses the new configuration */
+extern int template_staging;
+extern int template_staging_dhcp;
 void		template_subsystem_free(struct subsystem *);
 void		template_subsystem_free_ports(struct subsystem *);
 void		template_subsystem_list_glob(struct evbuffer *buffer,
@@ -150,6 +191,7 @@ int		template_insert(struct template *);
 void		template_deallocate(struct template *);
 
 void		template_print(struct evbuffer*, struct template *);
+void		template_print_memory(struct evbuffer *);
 
 /* Iterate across all templates and call the callback function for each */
 int		template_iterate(int (*f)(struct template *, void *),
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2002, 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include "config.h"
+
+#include <sys/queue.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#undef timeout_pending
+#undef timeout_initialized
+
+#include <event2/event.h>
+
+#include "timer.h"
+
+/*
+ * The first level has one slot per tick.  Each of the remaining levels
+ * covers 64 slots of the level below; together they span more than a
+ * week at TIMER_HZ.  Longer timeouts are clamped and re-queued.
+ */
+#define WHEEL_BITS0	8
+#define WHEEL_BITSN	6
+#define WHEEL_SIZE0	(1 << WHEEL_BITS0)
+#define WHEEL_SIZEN	(1 << WHEEL_BITSN)
+#define WHEEL_MASK0	(WHEEL_SIZE0 - 1)
+#define WHEEL_MASKN	(WHEEL_SIZEN - 1)
+#define WHEEL_LEVELS	3	/* in addition to the first level */
+#define WHEEL_SHIFT(l)	(WHEEL_BITS0 + (l) * WHEEL_BITSN)
+#define WHEEL_INDEX(t, l) (((t) >> WHEEL_SHIFT(l)) & WHEEL_MASKN)
+#define WHEEL_SPAN	(1 << WHEEL_SHIFT(WHEEL_LEVELS))
+
+LIST_HEAD(timerq, timer);
+
+static struct timerq wheel0[WHEEL_SIZE0];
+static struct timerq wheeln[WHEEL_LEVELS][WHEEL_SIZEN];
+
+static uint32_t wheel_tick;	/* next tick to be processed */
+static struct timeval wheel_start;
+static struct event *wheel_ev;
+
+extern struct event_base *honeyd_base_ev;
+
+static void
+timer_queue(struct timer *t)
+{
+	uint32_t expire = t->expire;
+	int32_t delta = expire - wheel_tick;
+	struct timerq *head;
+	int level;
+
+	if (delta < WHEEL_SIZE0) {
+		if (delta < 0)
+			expire = wheel_tick;
+		head = &wheel0[expire & WHEEL_MASK0];
+	} else {
+		if (delta >= WHEEL_SPAN)
+			expire = wheel_tick + WHEEL_SPAN - 1;
+		for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+			if (delta < (1 << WHEEL_SHIFT(level + 1)))
+				break;
+		}
+		head = &wheeln[level][WHEEL_INDEX(expire, level)];
+	}
+
+	LIST_INSERT_HEAD(head, t, next);
+}
+
+/* Moves all timeouts from a higher level slot to where they belong now */
+static int
+timer_cascade(int level, int index)
+{
+	struct timerq *head = &wheeln[level][index];
+	struct timer *t;
+
+	while ((t = LIST_FIRST(head)) != NULL) {
+		LIST_REMOVE(t, next);
+		timer_queue(t);
+	}
+
+	return (index);
+}
+
+static void
+timer_run(uint32_t target)
+{
+	struct timerq work;
+	struct timer *t;
+	uint32_t now;
+	int index;
+
+	while ((int32_t)(target - wheel_tick) >= 0) {
+		index = wheel_tick & WHEEL_MASK0;
+		if (!index &&
+		    !timer_cascade(0, WHEEL_INDEX(wheel_tick, 0)) &&
+		    !timer_cascade(1, WHEEL_INDEX(wheel_tick, 1)))
+			timer_cascade(2, WHEEL_INDEX(wheel_tick, 2));
+
+		/* Callbacks may add and remove timeouts while we run */
+		LIST_INIT(&work);
+		while ((t = LIST_FIRST(&wheel0[index])) != NULL) {
+			LIST_REMOVE(t, next);
+			LIST_INSERT_HEAD(&work, t, next);
+		}
+
+		now = wheel_tick++;
+
+		while ((t = LIST_FIRST(&work)) != NULL) {
+			LIST_REMOVE(t, next);
+
+			/* The timeout has been extended since it was queued */
+			if ((int32_t)(t->expire - now) > 0) {
+				timer_queue(t);
+				continue;
+			}
+
+			t->pending = 0;
+			(*t->cb)(t->arg);
+		}
+	}
+}
+
+static void
+timer_tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct timeval tv;
+
+	event_base_gettimeofday_cached(honeyd_base_ev, &tv);
+	timersub(&tv, &wheel_start, &tv);
+
+	timer_run(tv.tv_sec * TIMER_HZ + tv.tv_usec / (1000000 / TIMER_HZ));
+}
+
+/* The wheel runs at the given event priority */
+
+void
+timer_init(int priority)
+{
+	struct timeval tv;
+	int i, j;
+
+	for (i = 0; i < WHEEL_SIZE0; i++)
+		LIST_INIT(&wheel0[i]);
+	for (i = 0; i < WHEEL_LEVELS; i++)
+		for (j = 0; j < WHEEL_SIZEN; j++)
+			LIST_INIT(&wheeln[i][j]);
+
+	wheel_tick = 0;
+	gettimeofday(&wheel_start, NULL);
+
+	wheel_ev = event_new(honeyd_base_ev, -1, EV_PERSIST,
+	    timer_tick_cb, NULL);
+	if (wheel_ev == NULL)
+		errx(1, "%s: event_new", __func__);
+	if (event_priority_set(wheel_ev, priority) == -1)
+		errx(1, "%s: event_priority_set", __func__);
+
+	timerclear(&tv);
+	tv.tv_usec = 1000000 / TIMER_HZ;
+	event_add(wheel_ev, &tv);
+}
+
+void
+timer_set(struct timer *t, void (*cb)(void *), void *arg)
+{
+	memset(t, 0, sizeof(struct timer));
+	t->cb = cb;
+	t->arg = arg;
+}
+
+/*
+ * Schedules the timeout in msec milliseconds.  Extending a pending
+ * timeout just records the new expiration; the timeout gets re-queued
+ * when its old slot comes up.
+ */
+void
+timer_add(struct timer *t, int msec)
+{
+	uint32_t ticks = ((uint64_t)msec * TIMER_HZ + 999) / 1000;
+	uint32_t expire = wheel_tick + (ticks ? ticks : 1);
+
+	if (t->pending) {
+		if ((int32_t)(expire - t->expire) >= 0) {
+			t->expire = expire;
+			return;
+		}
+		LIST_REMOVE(t, next);
+	}
+
+	t->expire = expire;
+	t->pending = 1;
+	timer_queue(t);
+}
+
+void
+timer_del(struct timer *t)
+{
+	if (!t->pending)
+		return;
+
+	LIST_REMOVE(t, next);
+	t->pending = 0;
+}
+
+/* Unittests */
+
+static uint32_t timer_test_fired[4];
+
+static void
+timer_test_cb(void *arg)
+{
+	int i = (int)(long)arg;
+
+	timer_test_fired[i] = wheel_tick - 1;
+}
+
+void
+timer_test(void)
+{
+	struct timer t[4];
+	struct timeval tv;
+	uint32_t first, start;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		timer_set(&t[i], timer_test_cb, (void *)(long)i);
+		timer_test_fired[i] = 0;
+	}
+
+	first = start = wheel_tick;
+
+	timer_add(&t[0], 1000);			/* first level */
+	timer_add(&t[1], 300 * 1000);		/* idle timeout */
+	timer_add(&t[2], 60 * 1000);
+	timer_add(&t[3], 2000 * 1000);
+
+	/* Shortening needs to re-queue */
+	timer_add(&t[3], 30 * 1000);
+	/* Extending is lazy */
+	timer_add(&t[2], 120 * 1000);
+
+	timer_run(start + 9);
+	if (timer_test_fired[0] || !timer_pending(&t[0]))
+		errx(1, "%s: timeout fired early", __func__);
+	timer_run(start + 10);
+	if (timer_test_fired[0] != start + 10 || timer_pending(&t[0]))
+		errx(1, "%s: timeout did not fire", __func__);
+
+	timer_run(start + 60 * TIMER_HZ);
+	if (timer_test_fired[2])
+		errx(1, "%s: extended timeout fired early", __func__);
+	if (timer_test_fired[3] != start + 30 * TIMER_HZ)
+		errx(1, "%s: shortened timeout fired at %u", __func__,
+		    timer_test_fired[3] - start);
+
+	/* Deleted timeouts never fire */
+	timer_del(&t[1]);
+
+	timer_run(start + 400 * TIMER_HZ);
+	if (timer_test_fired[2] != start + 120 * TIMER_HZ)
+		errx(1, "%s: extended timeout fired at %u", __func__,
+		    timer_test_fired[2] - start);
+	if (timer_test_fired[1])
+		errx(1, "%s: deleted timeout fired", __func__);
+
+	/* A timeout that needs to cascade down from the last level */
+	start = wheel_tick;
+	timer_add(&t[1], 2 * 86400 * 1000);
+	timer_run(start + 2 * 86400 * TIMER_HZ - 1);
+	if (timer_test_fired[1] || !timer_pending(&t[1]))
+		errx(1, "%s: long timeout fired early", __func__);
+	timer_run(start + 2 * 86400 * TIMER_HZ);
+	if (timer_test_fired[1] != start + 2 * 86400 * TIMER_HZ)
+		errx(1, "%s: long timeout did not fire", __func__);
+
+	/* Later tests need the wheel to follow the real clock again */
+	tv.tv_sec = (wheel_tick - first) / TIMER_HZ;
+	tv.tv_usec = (wheel_tick - first) % TIMER_HZ * (1000000 / TIMER_HZ);
+	timersub(&wheel_start, &tv, &wheel_start);
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
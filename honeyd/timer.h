@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2002, 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+/*
+ * Hierarchical timing wheel for the many long running timeouts of
+ * connections, fragments and fingerprints.  A single periodic libevent
+ * timer advances the wheel, so that adding and removing a timeout never
+ * touches the libevent heap.  Timeouts fire within one tick of their
+ * scheduled time.
+ */
+
+struct timer {
+	LIST_ENTRY(timer) next;
+
+	uint32_t expire;	/* absolute tick */
+	int pending;
+
+	void (*cb)(void *);
+	void *arg;
+};
+
+#define TIMER_HZ	10	/* ticks per second */
+
+void timer_init(int);
+void timer_set(struct timer *, void (*)(void *), void *);
+void timer_add(struct timer *, int);
+void timer_del(struct timer *);
+
+#define timer_pending(t)	((t)->pending)
+
+void timer_test(void);
+
+#endif /* _TIMER_H_ */
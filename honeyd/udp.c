@@ -30,6 +30,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define _GNU_SOURCE		/* for sendmmsg and recvmmsg */
+
 #include <sys/types.h>
 #include <sys/param.h>
 
@@ -55,12 +57,31 @@
 #undef timeout_initialized
 
 #include <event2/event.h>
+#include <event2/buffer.h>
 
 #include "honeyd.h"
+#include "template.h"
 #include "udp.h"
 #include "log.h"
 #include "hooks.h"
 #include "util.h"
+#include "pool.h"
+#include "parser.h"
+
+extern struct pool *pool_conbuffer;
+extern size_t honeyd_udp_maxmem;
+
+/* Datagrams queued for scripts and subsystems by all flows */
+static struct {
+	size_t queued;			/* bytes */
+	size_t peak;
+	uint64_t datagrams;
+	uint64_t writes;		/* system calls to deliver them */
+	uint64_t replies;
+	uint64_t reads;
+	uint64_t flowdrops;		/* MAX_UDP_BUFFERS or MAX_UDP_QUEUED */
+	uint64_t memdrops;		/* --udp-memory */
+} udp_stats;
 
 struct callback cb_udp = {
 	cmd_udp_read, cmd_udp_write, cmd_udp_eread, cmd_udp_connect_cb
@@ -91,10 +112,17 @@ cmd_udp_eread(int fd, short which, void *arg)
 	event_add(cmd->peread, NULL);
 }
 
+/*
+ * Queues a datagram for the script or subsystem of a flow.  Datagrams
+ * beyond the limits of the flow or the memory budget of all flows are
+ * dropped and counted against the template.
+ */
+
 void
 udp_add_readbuf(struct udp_con *con, u_char *dat, u_int datlen)
 {
 	struct conbuffer *buf;
+	size_t size = sizeof(struct conbuffer) + datlen;
 
 	hooks_dispatch(IP_PROTO_UDP, HD_INCOMING_STREAM, &con->conhdr,
 	    dat, datlen);
@@ -102,70 +130,160 @@ udp_add_readbuf(struct udp_con *con, u_char *dat, u_int datlen)
 	if (con->cmd_pfd == -1)
 		return;
 
-	if (con->nincoming >= MAX_UDP_BUFFERS)
-		return;
-
-	buf = malloc(sizeof(struct conbuffer));
-	if (buf == NULL)
-		return;
-	buf->buf = malloc(datlen);
-	if (buf->buf == NULL) {
-		free(buf);
-		return;
+	if (con->nincoming >= MAX_UDP_BUFFERS ||
+	    con->queued + size > MAX_UDP_QUEUED) {
+		udp_stats.flowdrops++;
+		goto drop;
+	}
+	if (udp_stats.queued + size > honeyd_udp_maxmem) {
+		udp_stats.memdrops++;
+		goto drop;
 	}
 
+	/* Header and data share one buffer */
+	if (size > pool_conbuffer->size)
+		buf = pool_alloc_size(pool_conbuffer, size);
+	else
+		buf = pool_alloc(pool_conbuffer);
+	buf->buf = (u_char *)(buf + 1);
 	memcpy(buf->buf, dat, datlen);
 	buf->len = datlen;
 
 	TAILQ_INSERT_TAIL(&con->incoming, buf, next);
 	con->nincoming++;
+	con->queued += size;
+
+	udp_stats.queued += size;
+	if (udp_stats.queued > udp_stats.peak)
+		udp_stats.peak = udp_stats.queued;
 
 	cmd_trigger_write(&con->cmd, 1);
+	return;
+
+ drop:
+	if (con->tmpl != NULL)
+		con->tmpl->udp_drops++;
+}
+
+/* Removes the first datagram from the queue of a flow */
+
+void
+udp_free_readbuf(struct udp_con *con)
+{
+	struct conbuffer *buf = TAILQ_FIRST(&con->incoming);
+	size_t size = sizeof(struct conbuffer) + buf->len;
+
+	TAILQ_REMOVE(&con->incoming, buf, next);
+	con->nincoming--;
+	con->queued -= size;
+	udp_stats.queued -= size;
+
+	pool_free(pool_conbuffer, buf);
 }
 
+/*
+ * Replies of a script are read UDP_BATCH datagrams at a time when the
+ * socket keeps datagram boundaries.
+ */
+
 void
 cmd_udp_read(int fd, short which, void *arg)
 {
 	static u_char *buf = NULL;
-	static int bufsz = 1<<16;
-
 	struct udp_con *con = arg;
-	ssize_t len;
+	struct iovec iov[UDP_BATCH];
+	ssize_t len[UDP_BATCH];
+	int i, n = 1;
 
 	if (!buf) {
-		buf = malloc(bufsz); /* largest possible UDP packet */
+		/* largest possible UDP packets */
+		buf = malloc(UDP_BATCH * UDP_MAXDATAGRAM);
 		if (!buf)
 			return;
 	}
-	memset(buf, 0, bufsz);
+	for (i = 0; i < UDP_BATCH; i++) {
+		iov[i].iov_base = buf + i * UDP_MAXDATAGRAM;
+		iov[i].iov_len = UDP_MAXDATAGRAM;
+	}
 
-	TRACE(fd, len = recv(fd, buf, bufsz, 0));
-	if (len == -1) {
+#ifdef HAVE_RECVMMSG
+	if (con->conhdr.type == SOCK_DGRAM) {
+		struct mmsghdr msgs[UDP_BATCH];
+
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < UDP_BATCH; i++) {
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		TRACE(fd, n = recvmmsg(fd, msgs, UDP_BATCH, MSG_DONTWAIT,
+			NULL));
+		if (n == -1) {
+			len[0] = -1;
+			n = 1;
+		} else {
+			for (i = 0; i < n; i++)
+				len[i] = msgs[i].msg_len;
+		}
+	} else
+#endif
+	TRACE(fd, len[0] = recv(fd, iov[0].iov_base, iov[0].iov_len, 0));
+
+	if (len[0] == -1) {
 		if (errno == EINTR || errno == EAGAIN)
 			goto again;
 	}
-	if (len <= 0) {
-		udp_free(con);
-		return;
-	}
+	udp_stats.reads++;
 
-	udp_send(con, buf, len);
+	for (i = 0; i < n; i++) {
+		/* The script went away */
+		if (len[i] <= 0) {
+			udp_free(con);
+			return;
+		}
+		udp_send(con, iov[i].iov_base, len[i]);
+		udp_stats.replies++;
+	}
 
  again:
 	cmd_trigger_read(&con->cmd, 1);
 }
 
+/*
+ * Hands queued datagrams to the script, UDP_BATCH at a time if the
+ * socket keeps datagram boundaries.
+ */
+
 void
 cmd_udp_write(int fd, short which, void *arg)
 {
 	struct udp_con *con = arg;
 	struct conbuffer *buf;
 	ssize_t len;
+	int n = 1;
 	
 	buf = TAILQ_FIRST(&con->incoming);
 	if (buf == NULL)
 		return;
+
+#ifdef HAVE_SENDMMSG
+	if (con->conhdr.type == SOCK_DGRAM && con->nincoming > 1) {
+		struct mmsghdr msgs[UDP_BATCH];
+		struct iovec iov[UDP_BATCH];
+
+		memset(msgs, 0, sizeof(msgs));
+		for (n = 0; buf != NULL && n < UDP_BATCH;
+		    buf = TAILQ_NEXT(buf, next), n++) {
+			iov[n].iov_base = buf->buf;
+			iov[n].iov_len = buf->len;
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+		}
+		TRACE(fd, len = sendmmsg(fd, msgs, n, 0));
+		n = len;
+	} else
+#endif
 	TRACE(fd, len = send(fd, buf->buf, buf->len, 0));
+
 	if (len == -1) {
 		if (errno == EINTR || errno == EAGAIN)
 			goto again;
@@ -175,12 +293,11 @@ cmd_udp_write(int fd, short which, void *arg)
 		cmd_free(&con->cmd);
 		return;
 	}
+	udp_stats.writes++;
+	udp_stats.datagrams += n;
 
-	TAILQ_REMOVE(&con->incoming, buf, next);
-	con->nincoming--;
-
-	free(buf->buf);
-	free(buf);
+	while (n--)
+		udp_free_readbuf(con);
 
  again:
 	cmd_trigger_write(&con->cmd, TAILQ_FIRST(&con->incoming) != NULL);
@@ -198,3 +315,202 @@ cmd_udp_connect_cb(int fd, short which, void *arg)
 	cmd_trigger_write(&con->cmd, TAILQ_FIRST(&con->incoming) != NULL);
 	return;
 }
+
+void
+udp_print(struct evbuffer *buf)
+{
+	extern struct templtree templates;
+	struct template *tmpl;
+
+	evbuffer_add_printf(buf, "Queued: %lu KB of %lu KB, at most %lu KB\n",
+	    (u_long)(udp_stats.queued / 1024),
+	    (u_long)(honeyd_udp_maxmem / 1024),
+	    (u_long)(udp_stats.peak / 1024));
+	evbuffer_add_printf(buf,
+	    "Delivered: %llu datagrams in %llu system calls\n",
+	    (unsigned long long)udp_stats.datagrams,
+	    (unsigned long long)udp_stats.writes);
+	evbuffer_add_printf(buf, "Replies: %llu datagrams in %llu system calls\n",
+	    (unsigned long long)udp_stats.replies,
+	    (unsigned long long)udp_stats.reads);
+	evbuffer_add_printf(buf,
+	    "Dropped: %llu over the flow limit, %llu over the memory limit\n",
+	    (unsigned long long)udp_stats.flowdrops,
+	    (unsigned long long)udp_stats.memdrops);
+
+	SPLAY_FOREACH(tmpl, templtree, &templates) {
+		if (!tmpl->udp_drops)
+			continue;
+		evbuffer_add_printf(buf, "  %s: %llu dropped\n", tmpl->name,
+		    (unsigned long long)tmpl->udp_drops);
+	}
+}
+
+/*
+ * Queues datagrams for a script on a socket pair and checks that they
+ * are delivered in batches, that the limits drop datagrams and count
+ * them against the template, and that replies are read in batches.
+ */
+
+static int udp_test_replies;
+
+static void
+udp_test_delay_cb(evutil_socket_t fd, short which, void *arg)
+{
+	extern struct pool *pool_pkt;
+	extern struct pool *pool_delay;
+	struct delay *delay = arg;
+	struct ip_hdr *ip = delay->ip;
+
+	if (ip->ip_p == IP_PROTO_UDP)
+		udp_test_replies++;
+
+	if (delay->flags & DELAY_FREEPKT)
+		pool_free(pool_pkt, ip);
+	template_free(delay->tmpl);
+	if (delay->flags & DELAY_NEEDFREE)
+		pool_free(pool_delay, delay);
+}
+
+static void
+udp_test_config(struct evbuffer *evbuf, const char *config)
+{
+	char line[256];
+
+	strlcpy(line, config, sizeof(line));
+	if (parse_line(evbuf, line) == -1)
+		errx(1, "%s: parse_line \"%s\" failed", __func__, config);
+}
+
+/* Lets the script receive everything that has been queued */
+
+static int
+udp_test_drain(struct udp_con *con, int fd)
+{
+	u_char dat[2048];
+	ssize_t len;
+	int n = 0;
+
+	do {
+		if (TAILQ_FIRST(&con->incoming) != NULL)
+			cmd_udp_write(con->cmd_pfd, EV_WRITE, con);
+		while ((len = recv(fd, dat, sizeof(dat), 0)) != -1) {
+			if (len != 100 + n || dat[0] != n)
+				errx(1, "%s: datagram %d is wrong", __func__, n);
+			n++;
+		}
+	} while (TAILQ_FIRST(&con->incoming) != NULL);
+
+	return (n);
+}
+
+void
+udp_test(void)
+{
+	extern void (*honeyd_delay_callback)(evutil_socket_t, short, void *);
+	void (*deliver)(evutil_socket_t, short, void *);
+	struct evbuffer *evbuf = evbuffer_new();
+	u_char pkt[IP_HDR_LEN + UDP_HDR_LEN], dat[1024];
+	struct ip_hdr *ip = (struct ip_hdr *)pkt;
+	struct udp_hdr *udp = (struct udp_hdr *)(pkt + IP_HDR_LEN);
+	struct template *tmpl;
+	struct udp_con *con;
+	struct addr src, dst;
+	uint64_t writes;
+	size_t maxmem = honeyd_udp_maxmem;
+	int pair[2], i, n;
+
+	udp_test_config(evbuf, "create udptest");
+	udp_test_config(evbuf, "add udptest udp port 53 open");
+	udp_test_config(evbuf, "bind 172.16.5.5 udptest");
+	tmpl = template_find("172.16.5.5");
+
+	addr_pton("192.0.2.7", &src);
+	addr_pton("172.16.5.5", &dst);
+	udp_pack_hdr(udp, 5353, 53, UDP_HDR_LEN);
+	ip_pack_hdr(ip, 0, sizeof(pkt), 1, 0, 64, IP_PROTO_UDP,
+	    src.addr_ip, dst.addr_ip);
+
+	if ((con = udp_new(ip, udp, 0)) == NULL)
+		errx(1, "%s: udp_new failed", __func__);
+	con->tmpl = template_ref(tmpl);
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, pair) == -1)
+		err(1, "%s: socketpair", __func__);
+	if (fcntl(pair[0], F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(pair[1], F_SETFL, O_NONBLOCK) == -1)
+		err(1, "%s: fcntl", __func__);
+	con->cmd.pfd = pair[0];
+	cmd_ready_fd(&con->cmd, &cb_udp, con);
+
+	/* Queued datagrams are delivered UDP_BATCH at a time */
+	for (i = 0; i < 2 * UDP_BATCH + 3; i++) {
+		dat[0] = i;
+		udp_add_readbuf(con, dat, 100 + i);
+	}
+	if (udp_stats.queued != con->queued || con->nincoming != i)
+		errx(1, "%s: %d datagrams with %lu bytes queued", __func__,
+		    con->nincoming, (u_long)con->queued);
+	writes = udp_stats.writes;
+	if ((n = udp_test_drain(con, pair[1])) != i)
+		errx(1, "%s: received %d of %d datagrams", __func__, n, i);
+#ifdef HAVE_SENDMMSG
+	if (udp_stats.writes - writes > 3)
+		errx(1, "%s: %d datagrams took %d writes", __func__, n,
+		    (int)(udp_stats.writes - writes));
+#endif
+	if (udp_stats.queued != 0 || con->queued != 0)
+		errx(1, "%s: %lu bytes still accounted", __func__,
+		    (u_long)udp_stats.queued);
+
+	/* Beyond the limits of the flow, datagrams are dropped */
+	for (i = 0; i < MAX_UDP_BUFFERS + 5; i++) {
+		dat[0] = i;
+		udp_add_readbuf(con, dat, 100 + i);
+	}
+	if (con->nincoming != MAX_UDP_BUFFERS || tmpl->udp_drops != 5)
+		errx(1, "%s: flow limit: %d queued, %llu dropped", __func__,
+		    con->nincoming, (unsigned long long)tmpl->udp_drops);
+	if ((n = udp_test_drain(con, pair[1])) != MAX_UDP_BUFFERS)
+		errx(1, "%s: received %d of %d datagrams", __func__, n,
+		    MAX_UDP_BUFFERS);
+
+	/* Or beyond the memory budget of all flows */
+	honeyd_udp_maxmem = 3 * (sizeof(struct conbuffer) + sizeof(dat));
+	for (i = 0; i < 5; i++)
+		udp_add_readbuf(con, dat, sizeof(dat));
+	if (con->nincoming != 3 || tmpl->udp_drops != 7)
+		errx(1, "%s: memory limit: %d queued, %llu dropped", __func__,
+		    con->nincoming, (unsigned long long)tmpl->udp_drops);
+	honeyd_udp_maxmem = maxmem;
+
+	/* Replies of the script are read in batches */
+	deliver = honeyd_delay_callback;
+	honeyd_delay_callback = udp_test_delay_cb;
+	for (i = 0; i < 3; i++)
+		if (send(pair[1], dat, 10 + i, 0) == -1)
+			err(1, "%s: send", __func__);
+	for (i = 0; i < 3 && udp_test_replies < 3; i++)
+		cmd_udp_read(con->cmd_pfd, EV_READ, con);
+	honeyd_delay_callback = deliver;
+#ifdef HAVE_RECVMMSG
+	if (i != 1)
+		errx(1, "%s: %d reads for 3 replies", __func__, i);
+#endif
+	if (udp_test_replies != 3)
+		errx(1, "%s: %d of 3 replies sent", __func__,
+		    udp_test_replies);
+
+	/* Freeing the flow gives the queued datagrams back */
+	udp_free(con);
+	TRACE_RESET(pair[1], close(pair[1]));
+	if (udp_stats.queued != 0)
+		errx(1, "%s: %lu bytes still accounted", __func__,
+		    (u_long)udp_stats.queued);
+
+	udp_test_config(evbuf, "delete 172.16.5.5");
+	udp_test_config(evbuf, "delete udptest");
+	evbuffer_free(evbuf);
+
+	fprintf(stderr, "\t%s: OK\n", __func__);
+}
@@ -32,7 +32,15 @@
 #ifndef _UDP_H_
 #define _UDP_H_
 
+#define UDP_BATCH	8		/* datagrams per system call */
+#define UDP_MAXDATAGRAM	(1 << 16)
+
+struct evbuffer;
+
 void udp_add_readbuf(struct udp_con *, u_char *, u_int);
+void udp_free_readbuf(struct udp_con *);
+void udp_print(struct evbuffer *);
+void udp_test(void);
 
 void cmd_udp_eread(int, short, void *);
 void cmd_udp_read(int, short, void *);
@@ -37,6 +37,7 @@
 #endif
 
 #include <sys/queue.h>
+#include <sys/tree.h>
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
@@ -60,6 +61,9 @@
 
 #include "ui.h"
 #include "parser.h"
+#include "pool.h"
+#include "sendq.h"
+#include "cmdpool.h"
 #ifdef HAVE_PYTHON
 #include "pyextend.h"
 #endif
@@ -75,6 +79,7 @@ char *strnsep(char **, char *);
 
 static int ui_command_help(struct evbuffer *, char *);
 static int ui_command_python(struct evbuffer *, char *);
+static int ui_command_stats(struct evbuffer *, char *);
 
 struct command {
 	char *cmd;
@@ -106,6 +111,13 @@ struct command commands[] = {
 		"list\t\t lists configured templates or subsystems\n",
 		"list <template [pattern]|subsystem [pattern]>\n",
 	},
+	{
+		"stats",
+		"stats\t\t shows internal statistics\n",
+		"stats <pools|packets|lookups|send|routes|scripts|templates|\n"
+		"       connections|udp>\n",
+		ui_command_stats
+	},
 	{
 		NULL, NULL, NULL, NULL
 	}
@@ -165,6 +177,47 @@ ui_command_python(struct evbuffer *buf, char *line)
 	return (0);
 }
 
+static int
+ui_command_stats(struct evbuffer *buf, char *line)
+{
+	char *what;
+
+	what = strnsep(&line, WHITESPACE);
+	if (what == NULL || !strlen(what))
+		return (-1);
+
+	if (strcasecmp(what, "pools") == 0) {
+		pool_print(buf);
+	} else if (strcasecmp(what, "packets") == 0) {
+		extern void honeyd_print_packet_stats(struct evbuffer *);
+		honeyd_print_packet_stats(buf);
+	} else if (strcasecmp(what, "lookups") == 0) {
+		extern void honeyd_print_lookup_stats(struct evbuffer *);
+		honeyd_print_lookup_stats(buf);
+	} else if (strcasecmp(what, "send") == 0) {
+		sendq_print(buf);
+	} else if (strcasecmp(what, "routes") == 0) {
+		extern void router_cache_print(struct evbuffer *);
+		router_cache_print(buf);
+	} else if (strcasecmp(what, "scripts") == 0) {
+		cmd_pool_print(buf);
+	} else if (strcasecmp(what, "templates") == 0) {
+		extern void template_print_memory(struct evbuffer *);
+		template_print_memory(buf);
+	} else if (strcasecmp(what, "connections") == 0) {
+		extern void honeyd_print_connection_stats(struct evbuffer *);
+		honeyd_print_connection_stats(buf);
+	} else if (strcasecmp(what, "udp") == 0) {
+		extern void udp_print(struct evbuffer *);
+		udp_print(buf);
+	} else {
+		evbuffer_add_printf(buf,
+		    "Error: unknown statistics \"%s\"\n", what);
+	}
+
+	return (0);
+}
+
 static int
 ui_command_help(struct evbuffer *buf, char *line)
 {
@@ -381,3 +434,15 @@ ui_init(void)
 	event_priority_set(ev_accept, 0);
 	event_add(ev_accept, NULL);
 }
+
+/* Stops accepting connections without removing the socket file */
+void
+ui_close(void)
+{
+	if (ev_accept == NULL)
+		return;
+
+	close(event_get_fd(ev_accept));
+	event_free(ev_accept);
+	ev_accept = NULL;
+}
@@ -89,50 +89,100 @@
 #include "personality.h"
 #include "xprobe_assoc.h"
 
-static int
-assoc_compare(assoc_item *a, assoc_item *b)
+struct assoc_item **assoclist;
+int nassocs;
+static int assoclistsize;
+static LIST_HEAD(assochash, assoc_item) assoctable[ASSOC_HASHSIZE];
+
+void
+associations_init(void)
 {
-  return strcmp(a->nmap_name, b->nmap_name);
+	int i;
+
+	for (i = 0; i < ASSOC_HASHSIZE; i++)
+		LIST_INIT(&assoctable[i]);
+	nassocs = 0;
 }
 
-SPLAY_HEAD(assoc_tree, assoc_item) associations;
-SPLAY_PROTOTYPE(assoc_tree, assoc_item, node, assoc_compare);
+/* Both names are interned, so that comparing pointers is enough */
+static struct assoc_item *
+association_find(const char *nmap_name)
+{
+	struct assoc_item *assoc;
+
+	LIST_FOREACH(assoc, &assoctable[personality_hash(nmap_name) &
+		(ASSOC_HASHSIZE - 1)], next) {
+		if (assoc->nmap_name == nmap_name)
+			return (assoc);
+	}
 
-SPLAY_GENERATE(assoc_tree, assoc_item, node, assoc_compare);
+	return (NULL);
+}
 
-void
-associations_init(void)
+/**
+ * Associates an nmap fingerprint with an xprobe fingerprint.  The first
+ * association of an nmap name wins.
+ *
+ * @param nmap_name the name of the nmap fingerprint
+ * @param xp_fprint the xprobe fingerprint
+ * @return -1 if the name has been associated already, 0 on success
+ */
+
+int
+association_insert(const char *nmap_name, struct xp_fingerprint *xp_fprint)
 {
-	SPLAY_INIT(&associations);
+	struct assoc_item *assoc;
+	char *name = personality_intern(nmap_name, 1);
+
+	if (association_find(name) != NULL)
+		return (-1);
+
+	if ((assoc = calloc(1, sizeof(struct assoc_item))) == NULL)
+		err(1, "%s: calloc", __func__);
+	assoc->nmap_name = name;
+	assoc->xp_fprint = xp_fprint;
+	LIST_INSERT_HEAD(&assoctable[personality_hash(name) &
+		(ASSOC_HASHSIZE - 1)], assoc, next);
+
+	if (nassocs >= assoclistsize) {
+		struct assoc_item **list;
+		int size = assoclistsize ? assoclistsize * 2 : 1024;
+
+		if ((list = realloc(assoclist, size * sizeof(*list))) == NULL)
+			err(1, "%s: realloc", __func__);
+		assoclist = list;
+		assoclistsize = size;
+	}
+	assoclist[nassocs++] = assoc;
+
+	return (0);
 }
 
 /**
- * Retrieves a single line from the associations files and parses it.
+ * Retrieves a single line from the associations files and adds the
+ * association if both fingerprints are known.
  *
  * @param fp the FILE stream pointer
- * @return NULL if the line did not parse to an association, or a new
- *         assoc_item if it did.
  */
 
-static assoc_item *
+static void
 get_assoc(FILE *fp)
 {
 	char line[1024];
 	char *p, *q;
-	assoc_item *assoc = NULL;
-	struct xp_fingerprint fprint;
+	struct xp_fingerprint *xp_fprint;
 
 	/* Get one line */
 	p = fgets(line, sizeof(line), fp);
 	if (p == NULL)
-		return (NULL);
+		return;
 
 	/* Remove leading whitespace */
 	p += strspn(p, WHITESPACE);
 
 	/* Remove comments and blank lines */
 	if (*p == '\0' || *p == '#')
-		return (NULL);
+		return;
 
 	/* Remove trailing comments */
 	q = p;
@@ -142,35 +192,21 @@ get_assoc(FILE *fp)
 	q = p;
 	p = strsep(&q, ";");
 	if (p == NULL || q == NULL)
-		return (NULL);
-
-	/* Make a new association */
-	assoc = (assoc_item *)calloc(1, sizeof(struct assoc_item));
-	if (assoc == NULL)
-		return (NULL);
+		return;
 
 	/* The value in p is the nmap name.  The value in q is the xprobe
 	 * name.
 	 */
-	fprint.os_id = q;
-	assoc->nmap_name = strdup(p);
-	assoc->xp_fprint = SPLAY_FIND(xp_fprint_tree, &xp_fprints, &fprint);
-
-	/* Make sure the strdup and SPLAY_FIND succeeded, otherwise clean up */
-	if (assoc->nmap_name == NULL || assoc->xp_fprint == NULL) {
-		if (assoc->nmap_name)
-			free (assoc->nmap_name);
-		free (assoc);
-		return (NULL);
-	}
+	if ((xp_fprint = xprobe_personality_find(q)) == NULL)
+		return;
 
 	/* fprintf(stderr, "%s <-> %s\n",p,q); */
-	return (assoc);
+	association_insert(p, xp_fprint);
 }
 
 /**
- * Loads associations by getting one association at a time, then adding it
- * to the associations splay tree.
+ * Loads associations one line at a time and adds them to the
+ * associations hash table.
  *
  * @param fp the FILE stream pointer
  * @return -1 on error, 0 on success
@@ -179,18 +215,13 @@ get_assoc(FILE *fp)
 int
 parse_associations(FILE *fp)
 {
-	assoc_item *assoc = NULL;
-
 	if (fp == NULL) {
 		fprintf(stderr, "Could not open associations file!\n");
 		return (-1);
 	}
 
-	while (!feof(fp)) {
-		assoc = get_assoc(fp);
-		if (assoc != NULL)
-			SPLAY_INSERT(assoc_tree, &associations, assoc);
-	}
+	while (!feof(fp))
+		get_assoc(fp);
 
 	return (0);
 }
@@ -198,9 +229,9 @@ parse_associations(FILE *fp)
 /**
  * Takes a personality that is filled with NMAP personality information and
  * adds the corresponding Xprobe OS (if possible) to the personality by looking
- * up the NMAP OS name in the associations splay tree.
+ * up the NMAP OS name in the associations hash table.
  *
- * @param pers The pre-filled NMAP personality to look up in the association tree
+ * @param pers The pre-filled NMAP personality to look up in the association table
  * @return 0 if no matching association was found, or 1 if one was
  */
 
@@ -208,14 +239,12 @@ int
 correlate_nmap_with_xprobe(struct personality *pers)
 {
 	struct assoc_item *assoc;
-	struct assoc_item lookup;
 
 	if (pers == NULL)
 		return 0;
 
 	/* Lookup the association */
-	lookup.nmap_name = pers->name;
-	if ((assoc = SPLAY_FIND(assoc_tree, &associations, &lookup)) == NULL)
+	if ((assoc = association_find(pers->name)) == NULL)
 		return (0);
 
 	/* 
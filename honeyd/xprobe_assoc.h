@@ -58,17 +58,23 @@
 #define _XPROBE_ASSOC_H_
 
 struct assoc_item {
-	SPLAY_ENTRY(assoc_item) node;
-	char                    *nmap_name;
+	LIST_ENTRY(assoc_item)  next;
+	char                    *nmap_name;	/* interned */
 	struct xp_fingerprint   *xp_fprint;
 };
 
 typedef struct assoc_item     assoc_item;
 
+#define ASSOC_HASHSIZE	2048
+
+extern struct assoc_item **assoclist;
+extern int nassocs;
+
 /* prototypes */
 
 int parse_associations(FILE *fp);
 int correlate_nmap_with_xprobe(struct personality * pers);
 void associations_init(void);
+int association_insert(const char *, struct xp_fingerprint *);
 
 #endif /* _XPROBE_ASSOC_H */